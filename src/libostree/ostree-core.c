@@ -1291,18 +1291,19 @@ _ostree_loose_path_with_suffix (char              *buf,
             suffix);
 }
 
-/*
- * _ostree_get_relative_object_path:
+/**
+ * ostree_get_relative_object_path:
  * @checksum: ASCII checksum string
  * @type: Object type
  * @compressed: Whether or not the repository object is compressed
  *
- * Returns: (transfer full): Relative path for a loose object
+ * Returns: (transfer full): Path of the loose object, relative to the
+ * repository, such as objects/ab/cdef...commit
  */
 char *
-_ostree_get_relative_object_path (const char         *checksum,
-                                  OstreeObjectType    type,
-                                  gboolean            compressed)
+ostree_get_relative_object_path (const char         *checksum,
+                                 OstreeObjectType    type,
+                                 gboolean            compressed)
 {
   GString *path;
 
@@ -1321,10 +1322,16 @@ _ostree_get_relative_object_path (const char         *checksum,
   return g_string_free (path, FALSE);
 }
 
+/*
+ * Deltas from scratch, which have a %NULL @from, are stored under
+ * just the target checksum.
+ */
 char *
 _ostree_get_relative_static_delta_path (const char        *from,
                                         const char        *to)
 {
+  if (from == NULL)
+    return g_strdup_printf ("deltas/%s/meta", to);
   return g_strdup_printf ("deltas/%s-%s/meta", from, to);
 }
 
@@ -1333,6 +1340,8 @@ _ostree_get_relative_static_delta_part_path (const char        *from,
                                              const char        *to,
                                              guint              i)
 {
+  if (from == NULL)
+    return g_strdup_printf ("deltas/%s/%u", to, i);
   return g_strdup_printf ("deltas/%s-%s/%u", from, to, i);
 }
 
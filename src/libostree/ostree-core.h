@@ -104,6 +104,23 @@ typedef enum {
  */
 #define OSTREE_COMMIT_GVARIANT_FORMAT G_VARIANT_TYPE ("(a{sv}aya(say)sstayay)")
 
+/**
+ * OSTREE_SUMMARY_GVARIANT_FORMAT:
+ *
+ * a(s(taya{sv})) - Array of (ref name, (commit size, commit checksum, metadata)), sorted by ref name
+ * a{sv} - Additional metadata; "ostree.static-deltas" is an a{sat} mapping
+ *         each delta name ("FROM-TO", or "TO" for a delta from scratch)
+ *         to the compressed sizes of its parts
+ */
+#define OSTREE_SUMMARY_GVARIANT_FORMAT G_VARIANT_TYPE ("(a(s(taya{sv}))a{sv})")
+
+/**
+ * OSTREE_SUMMARY_SIG_GVARIANT_FORMAT:
+ *
+ * a{sv} - Signatures; "ostree.gpgsigs" is an aay of detached GPG signatures of the summary
+ */
+#define OSTREE_SUMMARY_SIG_GVARIANT_FORMAT G_VARIANT_TYPE ("a{sv}")
+
 /**
  * OstreeRepoMode:
  * @OSTREE_REPO_MODE_BARE: Files are stored as themselves; can only be written as root
@@ -169,6 +186,10 @@ void ostree_object_from_string (const char *str,
                                 gchar     **out_checksum,
                                 OstreeObjectType *out_objtype);
 
+char *ostree_get_relative_object_path (const char         *checksum,
+                                       OstreeObjectType    type,
+                                       gboolean            compressed);
+
 gboolean
 ostree_content_stream_parse (gboolean                compressed,
                              GInputStream           *input,
@@ -0,0 +1,49 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2014 Colin Walters <walters@verbum.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#pragma once
+
+#include <sys/stat.h>
+
+#include "ostree-diff.h"
+
+G_BEGIN_DECLS
+
+char *_ostree_diff_checksum_cache_key (struct stat *stbuf);
+
+gboolean _ostree_diff_get_file_checksum (OstreeDiffFlags  flags,
+                                         GFile           *f,
+                                         GFileInfo       *f_info,
+                                         GHashTable      *checksum_cache,
+                                         char           **out_checksum,
+                                         GCancellable    *cancellable,
+                                         GError         **error);
+
+gboolean _ostree_diff_dirs_with_cache (OstreeDiffFlags flags,
+                                       GFile          *a,
+                                       GFile          *b,
+                                       GPtrArray      *modified,
+                                       GPtrArray      *removed,
+                                       GPtrArray      *added,
+                                       GHashTable     *checksum_cache,
+                                       GCancellable   *cancellable,
+                                       GError        **error);
+
+G_END_DECLS
@@ -22,21 +22,59 @@
 
 #include "config.h"
 
+#include <errno.h>
+
 #include "ostree.h"
+#include "ostree-diff-private.h"
 #include "otutil.h"
 #include "libgsystem.h"
 
-static gboolean
-get_file_checksum (OstreeDiffFlags  flags,
-                   GFile *f,
-                   GFileInfo *f_info,
-                   char  **out_checksum,
-                   GCancellable *cancellable,
-                   GError   **error)
+/*
+ * _ostree_diff_checksum_cache_key:
+ * @stbuf: Result of lstat()
+ *
+ * Returns a key for @stbuf in a checksum cache.  Any write to a file
+ * changes its mtime; the mode and ownership are included too since
+ * they are part of the checksum, but changing them does not.
+ */
+char *
+_ostree_diff_checksum_cache_key (struct stat *stbuf)
+{
+  return g_strdup_printf ("%" G_GUINT64_FORMAT ":%" G_GUINT64_FORMAT
+                          ":%" G_GUINT64_FORMAT ":%" G_GINT64_FORMAT
+                          ".%09ld:%u:%u:%u",
+                          (guint64) stbuf->st_dev,
+                          (guint64) stbuf->st_ino,
+                          (guint64) stbuf->st_size,
+                          (gint64) stbuf->st_mtim.tv_sec,
+                          (long) stbuf->st_mtim.tv_nsec,
+                          (guint) stbuf->st_mode,
+                          (guint) stbuf->st_uid,
+                          (guint) stbuf->st_gid);
+}
+
+/*
+ * _ostree_diff_get_file_checksum:
+ * @checksum_cache: (allow-none): Map from _ostree_diff_checksum_cache_key() to checksum
+ *
+ * Like computing the checksum of @f directly, but a file whose stat
+ * data is found in @checksum_cache is not read again.  Checksums
+ * which are computed are added to @checksum_cache, which therefore
+ * must always be used with the same @flags.
+ */
+gboolean
+_ostree_diff_get_file_checksum (OstreeDiffFlags  flags,
+                                GFile           *f,
+                                GFileInfo       *f_info,
+                                GHashTable      *checksum_cache,
+                                char           **out_checksum,
+                                GCancellable    *cancellable,
+                                GError         **error)
 {
   gboolean ret = FALSE;
   gs_free char *ret_checksum = NULL;
   gs_free guchar *csum = NULL;
+  gs_free char *cache_key = NULL;
 
   if (OSTREE_IS_REPO_FILE (f))
     {
@@ -47,6 +85,26 @@ get_file_checksum (OstreeDiffFlags  flags,
       gs_unref_variant GVariant *xattrs = NULL;
       gs_unref_object GInputStream *in = NULL;
 
+      if (checksum_cache)
+        {
+          struct stat stbuf;
+          const char *cached;
+
+          if (lstat (gs_file_get_path_cached (f), &stbuf) != 0)
+            {
+              ot_util_set_error_from_errno (error, errno);
+              goto out;
+            }
+
+          cache_key = _ostree_diff_checksum_cache_key (&stbuf);
+          cached = g_hash_table_lookup (checksum_cache, cache_key);
+          if (cached)
+            {
+              ret_checksum = g_strdup (cached);
+              goto done;
+            }
+        }
+
       if (!(flags & OSTREE_DIFF_FLAGS_IGNORE_XATTRS))
         {
           if (!gs_file_get_all_xattrs (f, &xattrs, cancellable, error))
@@ -65,8 +123,15 @@ get_file_checksum (OstreeDiffFlags  flags,
                                             &csum, cancellable, error))
         goto out;
       ret_checksum = ostree_checksum_from_bytes (csum);
+
+      if (cache_key)
+        {
+          g_hash_table_replace (checksum_cache, cache_key, g_strdup (ret_checksum));
+          cache_key = NULL;
+        }
     }
 
+ done:
   ret = TRUE;
   ot_transfer_out_value(out_checksum, &ret_checksum);
  out:
@@ -124,6 +189,7 @@ diff_files (OstreeDiffFlags  flags,
             GFileInfo       *a_info,
             GFile           *b,
             GFileInfo       *b_info,
+            GHashTable      *checksum_cache,
             OstreeDiffItem **out_item,
             GCancellable    *cancellable,
             GError         **error)
@@ -133,9 +199,11 @@ diff_files (OstreeDiffFlags  flags,
   gs_free char *checksum_b = NULL;
   OstreeDiffItem *ret_item = NULL;
 
-  if (!get_file_checksum (flags, a, a_info, &checksum_a, cancellable, error))
+  if (!_ostree_diff_get_file_checksum (flags, a, a_info, checksum_cache,
+                                       &checksum_a, cancellable, error))
     goto out;
-  if (!get_file_checksum (flags, b, b_info, &checksum_b, cancellable, error))
+  if (!_ostree_diff_get_file_checksum (flags, b, b_info, checksum_cache,
+                                       &checksum_b, cancellable, error))
     goto out;
 
   if (strcmp (checksum_a, checksum_b) != 0)
@@ -201,6 +269,510 @@ diff_add_dir_recurse (GFile          *d,
   return ret;
 }
 
+typedef struct {
+  OstreeRepo          *repo;
+  OstreeDiffTreeFunc   func;
+  gpointer             user_data;
+  GString             *path; /* Of the current directory, with a trailing '/' */
+} DiffTreesData;
+
+static gboolean
+peek_checksum (GVariant      *csum_v,
+               const guchar **out_csum,
+               GError       **error)
+{
+  if (!ostree_validate_structureof_csum_v (csum_v, error))
+    return FALSE;
+  *out_csum = ostree_checksum_bytes_peek (csum_v);
+  return TRUE;
+}
+
+/* Like bsearch_in_file_variant() in ostree-repo-file.c */
+static gboolean
+tree_entries_find (GVariant    *entries,
+                   const char  *name,
+                   gsize       *out_pos)
+{
+  gsize imin = 0;
+  gsize imax = g_variant_n_children (entries);
+
+  while (imin < imax)
+    {
+      gsize imid = imin + (imax - imin) / 2;
+      gs_unref_variant GVariant *child = g_variant_get_child_value (entries, imid);
+      const char *cur;
+      int cmp;
+
+      g_variant_get_child (child, 0, "&s", &cur);
+      cmp = strcmp (cur, name);
+      if (cmp < 0)
+        imin = imid + 1;
+      else if (cmp > 0)
+        imax = imid;
+      else
+        {
+          *out_pos = imid;
+          return TRUE;
+        }
+    }
+
+  return FALSE;
+}
+
+static gboolean
+emit_change (DiffTreesData     *data,
+             OstreeDiffChange   change,
+             const char        *name,
+             gboolean           is_dir_a,
+             const guchar      *csum_a,
+             gboolean           is_dir_b,
+             const guchar      *csum_b,
+             GError           **error)
+{
+  gboolean ret;
+  gsize len = data->path->len;
+  char checksum_a[65];
+  char checksum_b[65];
+
+  if (csum_a)
+    ostree_checksum_inplace_from_bytes (csum_a, checksum_a);
+  if (csum_b)
+    ostree_checksum_inplace_from_bytes (csum_b, checksum_b);
+
+  g_string_append (data->path, name);
+  ret = data->func (change, data->path->str,
+                    is_dir_a, csum_a ? checksum_a : NULL,
+                    is_dir_b, csum_b ? checksum_b : NULL,
+                    data->user_data, error);
+  g_string_truncate (data->path, len);
+
+  return ret;
+}
+
+static gboolean
+load_tree_entries (OstreeRepo    *repo,
+                   const char    *contents_checksum,
+                   GVariant     **out_files,
+                   GVariant     **out_dirs,
+                   GError       **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_variant GVariant *tree = NULL;
+
+  if (!ostree_repo_load_variant (repo, OSTREE_OBJECT_TYPE_DIR_TREE, contents_checksum,
+                                 &tree, error))
+    goto out;
+
+  *out_files = g_variant_get_child_value (tree, 0);
+  *out_dirs = g_variant_get_child_value (tree, 1);
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+static gboolean
+diff_trees_add_recurse (DiffTreesData  *data,
+                        const char     *contents_checksum,
+                        GCancellable   *cancellable,
+                        GError        **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_variant GVariant *files = NULL;
+  gs_unref_variant GVariant *dirs = NULL;
+  gsize i, n;
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    goto out;
+
+  if (!load_tree_entries (data->repo, contents_checksum, &files, &dirs, error))
+    goto out;
+
+  n = g_variant_n_children (files);
+  for (i = 0; i < n; i++)
+    {
+      const char *name;
+      const guchar *csum;
+      gs_unref_variant GVariant *csum_v = NULL;
+
+      g_variant_get_child (files, i, "(&s@ay)", &name, &csum_v);
+      if (!peek_checksum (csum_v, &csum, error))
+        goto out;
+      if (!emit_change (data, OSTREE_DIFF_CHANGE_ADDED, name,
+                        FALSE, NULL, FALSE, csum, error))
+        goto out;
+    }
+
+  n = g_variant_n_children (dirs);
+  for (i = 0; i < n; i++)
+    {
+      const char *name;
+      const guchar *meta_csum;
+      char subtree_checksum[65];
+      gs_unref_variant GVariant *contents_csum_v = NULL;
+      gs_unref_variant GVariant *meta_csum_v = NULL;
+      gsize len = data->path->len;
+      gboolean recursed;
+
+      g_variant_get_child (dirs, i, "(&s@ay@ay)", &name, &contents_csum_v, &meta_csum_v);
+      if (!peek_checksum (meta_csum_v, &meta_csum, error))
+        goto out;
+      if (!ostree_validate_structureof_csum_v (contents_csum_v, error))
+        goto out;
+      if (!emit_change (data, OSTREE_DIFF_CHANGE_ADDED, name,
+                        FALSE, NULL, TRUE, meta_csum, error))
+        goto out;
+
+      ostree_checksum_inplace_from_bytes (ostree_checksum_bytes_peek (contents_csum_v),
+                                          subtree_checksum);
+      g_string_append (data->path, name);
+      g_string_append_c (data->path, '/');
+      recursed = diff_trees_add_recurse (data, subtree_checksum, cancellable, error);
+      g_string_truncate (data->path, len);
+      if (!recursed)
+        goto out;
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+static gboolean
+diff_trees_recurse (DiffTreesData  *data,
+                    const char     *contents_checksum_a,
+                    const char     *contents_checksum_b,
+                    GCancellable   *cancellable,
+                    GError        **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_variant GVariant *files_a = NULL;
+  gs_unref_variant GVariant *files_b = NULL;
+  gs_unref_variant GVariant *dirs_a = NULL;
+  gs_unref_variant GVariant *dirs_b = NULL;
+  gsize i_a, i_b, n_a, n_b;
+
+  if (strcmp (contents_checksum_a, contents_checksum_b) == 0)
+    return TRUE;
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    goto out;
+
+  if (!load_tree_entries (data->repo, contents_checksum_a, &files_a, &dirs_a, error))
+    goto out;
+  if (!load_tree_entries (data->repo, contents_checksum_b, &files_b, &dirs_b, error))
+    goto out;
+
+  /* Both arrays of files are sorted by name, so we walk them in step.
+   * An entry which turned from a file into a directory (or back) is
+   * reported as modified here, and skipped for the directories.
+   */
+  i_a = i_b = 0;
+  n_a = g_variant_n_children (files_a);
+  n_b = g_variant_n_children (files_b);
+  while (i_a < n_a || i_b < n_b)
+    {
+      const char *name_a = NULL;
+      const char *name_b = NULL;
+      const guchar *csum_a = NULL;
+      const guchar *csum_b = NULL;
+      gs_unref_variant GVariant *csum_a_v = NULL;
+      gs_unref_variant GVariant *csum_b_v = NULL;
+      gsize pos;
+      int cmp;
+
+      if (i_a < n_a)
+        {
+          g_variant_get_child (files_a, i_a, "(&s@ay)", &name_a, &csum_a_v);
+          if (!peek_checksum (csum_a_v, &csum_a, error))
+            goto out;
+        }
+      if (i_b < n_b)
+        {
+          g_variant_get_child (files_b, i_b, "(&s@ay)", &name_b, &csum_b_v);
+          if (!peek_checksum (csum_b_v, &csum_b, error))
+            goto out;
+        }
+
+      if (name_a == NULL)
+        cmp = 1;
+      else if (name_b == NULL)
+        cmp = -1;
+      else
+        cmp = strcmp (name_a, name_b);
+
+      if (cmp == 0)
+        {
+          if (memcmp (csum_a, csum_b, 32) != 0)
+            {
+              if (!emit_change (data, OSTREE_DIFF_CHANGE_MODIFIED, name_a,
+                                FALSE, csum_a, FALSE, csum_b, error))
+                goto out;
+            }
+          i_a++;
+          i_b++;
+        }
+      else if (cmp < 0)
+        {
+          if (tree_entries_find (dirs_b, name_a, &pos))
+            {
+              gs_unref_variant GVariant *meta_csum_v = NULL;
+              const guchar *meta_csum;
+
+              g_variant_get_child (dirs_b, pos, "(&s@ay@ay)", NULL, NULL, &meta_csum_v);
+              if (!peek_checksum (meta_csum_v, &meta_csum, error))
+                goto out;
+              if (!emit_change (data, OSTREE_DIFF_CHANGE_MODIFIED, name_a,
+                                FALSE, csum_a, TRUE, meta_csum, error))
+                goto out;
+            }
+          else
+            {
+              if (!emit_change (data, OSTREE_DIFF_CHANGE_REMOVED, name_a,
+                                FALSE, csum_a, FALSE, NULL, error))
+                goto out;
+            }
+          i_a++;
+        }
+      else
+        {
+          if (tree_entries_find (dirs_a, name_b, &pos))
+            {
+              gs_unref_variant GVariant *meta_csum_v = NULL;
+              const guchar *meta_csum;
+
+              g_variant_get_child (dirs_a, pos, "(&s@ay@ay)", NULL, NULL, &meta_csum_v);
+              if (!peek_checksum (meta_csum_v, &meta_csum, error))
+                goto out;
+              if (!emit_change (data, OSTREE_DIFF_CHANGE_MODIFIED, name_b,
+                                TRUE, meta_csum, FALSE, csum_b, error))
+                goto out;
+            }
+          else
+            {
+              if (!emit_change (data, OSTREE_DIFF_CHANGE_ADDED, name_b,
+                                FALSE, NULL, FALSE, csum_b, error))
+                goto out;
+            }
+          i_b++;
+        }
+    }
+
+  i_a = i_b = 0;
+  n_a = g_variant_n_children (dirs_a);
+  n_b = g_variant_n_children (dirs_b);
+  while (i_a < n_a || i_b < n_b)
+    {
+      const char *name_a = NULL;
+      const char *name_b = NULL;
+      const guchar *meta_csum_a = NULL;
+      const guchar *meta_csum_b = NULL;
+      gs_unref_variant GVariant *contents_csum_a_v = NULL;
+      gs_unref_variant GVariant *contents_csum_b_v = NULL;
+      gs_unref_variant GVariant *meta_csum_a_v = NULL;
+      gs_unref_variant GVariant *meta_csum_b_v = NULL;
+      gsize pos;
+      int cmp;
+
+      if (i_a < n_a)
+        {
+          g_variant_get_child (dirs_a, i_a, "(&s@ay@ay)", &name_a,
+                               &contents_csum_a_v, &meta_csum_a_v);
+          if (!peek_checksum (meta_csum_a_v, &meta_csum_a, error))
+            goto out;
+          if (!ostree_validate_structureof_csum_v (contents_csum_a_v, error))
+            goto out;
+        }
+      if (i_b < n_b)
+        {
+          g_variant_get_child (dirs_b, i_b, "(&s@ay@ay)", &name_b,
+                               &contents_csum_b_v, &meta_csum_b_v);
+          if (!peek_checksum (meta_csum_b_v, &meta_csum_b, error))
+            goto out;
+          if (!ostree_validate_structureof_csum_v (contents_csum_b_v, error))
+            goto out;
+        }
+
+      if (name_a == NULL)
+        cmp = 1;
+      else if (name_b == NULL)
+        cmp = -1;
+      else
+        cmp = strcmp (name_a, name_b);
+
+      if (cmp == 0)
+        {
+          char subtree_a[65];
+          char subtree_b[65];
+          gsize len = data->path->len;
+          gboolean recursed;
+
+          if (memcmp (meta_csum_a, meta_csum_b, 32) != 0)
+            {
+              if (!emit_change (data, OSTREE_DIFF_CHANGE_MODIFIED, name_a,
+                                TRUE, meta_csum_a, TRUE, meta_csum_b, error))
+                goto out;
+            }
+
+          ostree_checksum_inplace_from_bytes (ostree_checksum_bytes_peek (contents_csum_a_v), subtree_a);
+          ostree_checksum_inplace_from_bytes (ostree_checksum_bytes_peek (contents_csum_b_v), subtree_b);
+          g_string_append (data->path, name_a);
+          g_string_append_c (data->path, '/');
+          recursed = diff_trees_recurse (data, subtree_a, subtree_b, cancellable, error);
+          g_string_truncate (data->path, len);
+          if (!recursed)
+            goto out;
+
+          i_a++;
+          i_b++;
+        }
+      else if (cmp < 0)
+        {
+          if (!tree_entries_find (files_b, name_a, &pos))
+            {
+              if (!emit_change (data, OSTREE_DIFF_CHANGE_REMOVED, name_a,
+                                TRUE, meta_csum_a, FALSE, NULL, error))
+                goto out;
+            }
+          i_a++;
+        }
+      else
+        {
+          if (!tree_entries_find (files_a, name_b, &pos))
+            {
+              char subtree_b[65];
+              gsize len = data->path->len;
+              gboolean recursed;
+
+              if (!emit_change (data, OSTREE_DIFF_CHANGE_ADDED, name_b,
+                                FALSE, NULL, TRUE, meta_csum_b, error))
+                goto out;
+
+              ostree_checksum_inplace_from_bytes (ostree_checksum_bytes_peek (contents_csum_b_v), subtree_b);
+              g_string_append (data->path, name_b);
+              g_string_append_c (data->path, '/');
+              recursed = diff_trees_add_recurse (data, subtree_b, cancellable, error);
+              g_string_truncate (data->path, len);
+              if (!recursed)
+                goto out;
+            }
+          i_b++;
+        }
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/**
+ * ostree_diff_trees:
+ * @repo: Repository
+ * @contents_checksum_a: Checksum of the first dirtree
+ * @contents_checksum_b: Checksum of the second dirtree
+ * @func: (scope call): Called for each change
+ * @user_data: User data for @func
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Compute the difference between two trees stored in @repo, calling
+ * @func for each added, removed and modified entry as it is found.
+ * This works directly on the dirtree objects: both sides are walked
+ * in name order, subtrees with equal checksums are skipped, and files
+ * are compared by content checksum.  The semantics are those of
+ * ostree_diff_dirs(): an added directory is followed by all of its
+ * contents, but only the toplevel of a removed one is reported.
+ */
+gboolean
+ostree_diff_trees (OstreeRepo          *repo,
+                   const char          *contents_checksum_a,
+                   const char          *contents_checksum_b,
+                   OstreeDiffTreeFunc   func,
+                   gpointer             user_data,
+                   GCancellable        *cancellable,
+                   GError             **error)
+{
+  gboolean ret;
+  DiffTreesData data = { 0, };
+
+  data.repo = repo;
+  data.func = func;
+  data.user_data = user_data;
+  data.path = g_string_new ("/");
+
+  ret = diff_trees_recurse (&data, contents_checksum_a, contents_checksum_b,
+                            cancellable, error);
+
+  g_string_free (data.path, TRUE);
+  return ret;
+}
+
+typedef struct {
+  GFile      *a;
+  GFile      *b;
+  GPtrArray  *modified;
+  GPtrArray  *removed;
+  GPtrArray  *added;
+  GCancellable *cancellable;
+} DiffDirsData;
+
+static gboolean
+diff_dirs_collect_change (OstreeDiffChange   change,
+                          const char        *path,
+                          gboolean           is_dir_a,
+                          const char        *checksum_a,
+                          gboolean           is_dir_b,
+                          const char        *checksum_b,
+                          gpointer           user_data,
+                          GError           **error)
+{
+  gboolean ret = FALSE;
+  DiffDirsData *data = user_data;
+  const char *relpath = path + 1;
+  gs_unref_object GFile *child_a = NULL;
+  gs_unref_object GFile *child_b = NULL;
+  gs_unref_object GFileInfo *child_a_info = NULL;
+  gs_unref_object GFileInfo *child_b_info = NULL;
+
+  switch (change)
+    {
+    case OSTREE_DIFF_CHANGE_ADDED:
+      g_ptr_array_add (data->added, g_file_resolve_relative_path (data->b, relpath));
+      break;
+    case OSTREE_DIFF_CHANGE_REMOVED:
+      g_ptr_array_add (data->removed, g_file_resolve_relative_path (data->a, relpath));
+      break;
+    case OSTREE_DIFF_CHANGE_MODIFIED:
+      /* Only modified entries pay for a GFileInfo */
+      child_a = g_file_resolve_relative_path (data->a, relpath);
+      child_b = g_file_resolve_relative_path (data->b, relpath);
+      child_a_info = g_file_query_info (child_a, OSTREE_GIO_FAST_QUERYINFO,
+                                        G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                        data->cancellable, error);
+      if (!child_a_info)
+        goto out;
+      child_b_info = g_file_query_info (child_b, OSTREE_GIO_FAST_QUERYINFO,
+                                        G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                        data->cancellable, error);
+      if (!child_b_info)
+        goto out;
+
+      if (g_file_info_get_file_type (child_a_info) != g_file_info_get_file_type (child_b_info))
+        {
+          checksum_a = NULL;
+          checksum_b = NULL;
+        }
+      g_ptr_array_add (data->modified, diff_item_new (child_a, child_a_info,
+                                                      child_b, child_b_info,
+                                                      (char*)checksum_a, (char*)checksum_b));
+      break;
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
 /**
  * ostree_diff_dirs:
  * @flags: Flags
@@ -222,6 +794,28 @@ ostree_diff_dirs (OstreeDiffFlags flags,
                   GPtrArray      *added,
                   GCancellable   *cancellable,
                   GError        **error)
+{
+  return _ostree_diff_dirs_with_cache (flags, a, b, modified, removed, added,
+                                       NULL, cancellable, error);
+}
+
+/*
+ * _ostree_diff_dirs_with_cache:
+ * @checksum_cache: (allow-none): See _ostree_diff_get_file_checksum()
+ *
+ * Like ostree_diff_dirs(), but files outside of a repository are only
+ * read if their stat data is not in @checksum_cache.
+ */
+gboolean
+_ostree_diff_dirs_with_cache (OstreeDiffFlags flags,
+                              GFile          *a,
+                              GFile          *b,
+                              GPtrArray      *modified,
+                              GPtrArray      *removed,
+                              GPtrArray      *added,
+                              GHashTable     *checksum_cache,
+                              GCancellable   *cancellable,
+                              GError        **error)
 {
   gboolean ret = FALSE;
   GError *temp_error = NULL;
@@ -243,21 +837,28 @@ ostree_diff_dirs (OstreeDiffFlags flags,
   if (!child_b_info)
     goto out;
 
-  /* Fast path test for unmodified directories */
+  /* Two trees in the same repository can be compared without going
+   * through the GFile API for every entry.
+   */
   if (g_file_info_get_file_type (child_a_info) == G_FILE_TYPE_DIRECTORY
       && g_file_info_get_file_type (child_b_info) == G_FILE_TYPE_DIRECTORY
       && OSTREE_IS_REPO_FILE (a)
-      && OSTREE_IS_REPO_FILE (b))
+      && OSTREE_IS_REPO_FILE (b)
+      && ostree_repo_file_get_repo ((OstreeRepoFile*)a) == ostree_repo_file_get_repo ((OstreeRepoFile*)b))
     {
       OstreeRepoFile *a_repof = (OstreeRepoFile*) a;
       OstreeRepoFile *b_repof = (OstreeRepoFile*) b;
-      
-      if (strcmp (ostree_repo_file_tree_get_contents_checksum (a_repof),
-                  ostree_repo_file_tree_get_contents_checksum (b_repof)) == 0)
-        {
-          ret = TRUE;
-          goto out;
-        }
+      DiffDirsData data = { a, b, modified, removed, added, cancellable };
+
+      if (!ostree_diff_trees (ostree_repo_file_get_repo (a_repof),
+                              ostree_repo_file_tree_get_contents_checksum (a_repof),
+                              ostree_repo_file_tree_get_contents_checksum (b_repof),
+                              diff_dirs_collect_change, &data,
+                              cancellable, error))
+        goto out;
+
+      ret = TRUE;
+      goto out;
     }
 
   g_clear_object (&child_a_info);
@@ -316,8 +917,8 @@ ostree_diff_dirs (OstreeDiffFlags flags,
             {
               OstreeDiffItem *diff_item = NULL;
 
-              if (!diff_files (flags, child_a, child_a_info, child_b, child_b_info, &diff_item,
-                               cancellable, error))
+              if (!diff_files (flags, child_a, child_a_info, child_b, child_b_info,
+                               checksum_cache, &diff_item, cancellable, error))
                 goto out;
               
               if (diff_item)
@@ -325,8 +926,9 @@ ostree_diff_dirs (OstreeDiffFlags flags,
 
               if (child_a_type == G_FILE_TYPE_DIRECTORY)
                 {
-                  if (!ostree_diff_dirs (flags, child_a, child_b, modified,
-                                         removed, added, cancellable, error))
+                  if (!_ostree_diff_dirs_with_cache (flags, child_a, child_b, modified,
+                                                     removed, added, checksum_cache,
+                                                     cancellable, error))
                     goto out;
                 }
             }
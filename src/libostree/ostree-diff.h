@@ -61,6 +61,51 @@ gboolean ostree_diff_dirs (OstreeDiffFlags flags,
                            GCancellable   *cancellable,
                            GError        **error);
 
+/**
+ * OstreeDiffChange:
+ * @OSTREE_DIFF_CHANGE_ADDED: Entry only exists in the second tree
+ * @OSTREE_DIFF_CHANGE_REMOVED: Entry only exists in the first tree
+ * @OSTREE_DIFF_CHANGE_MODIFIED: Entry exists in both trees, but differs
+ */
+typedef enum {
+  OSTREE_DIFF_CHANGE_ADDED,
+  OSTREE_DIFF_CHANGE_REMOVED,
+  OSTREE_DIFF_CHANGE_MODIFIED
+} OstreeDiffChange;
+
+/**
+ * OstreeDiffTreeFunc:
+ * @change: Kind of change
+ * @path: Path of the entry relative to the tree root, starting with "/"
+ * @is_dir_a: Whether the entry is a directory in the first tree
+ * @checksum_a: (allow-none): Checksum in the first tree, or %NULL if added
+ * @is_dir_b: Whether the entry is a directory in the second tree
+ * @checksum_b: (allow-none): Checksum in the second tree, or %NULL if removed
+ * @user_data: User data
+ * @error: Error
+ *
+ * Called by ostree_diff_trees() for each change.  Checksums are of the
+ * content object for files, and of the dirmeta object for directories.
+ *
+ * Returns: %FALSE (with @error set) to stop the diff
+ */
+typedef gboolean (*OstreeDiffTreeFunc) (OstreeDiffChange   change,
+                                        const char        *path,
+                                        gboolean           is_dir_a,
+                                        const char        *checksum_a,
+                                        gboolean           is_dir_b,
+                                        const char        *checksum_b,
+                                        gpointer           user_data,
+                                        GError           **error);
+
+gboolean ostree_diff_trees (OstreeRepo          *repo,
+                            const char          *contents_checksum_a,
+                            const char          *contents_checksum_b,
+                            OstreeDiffTreeFunc   func,
+                            gpointer             user_data,
+                            GCancellable        *cancellable,
+                            GError             **error);
+
 void ostree_diff_print (GFile          *a,
                         GFile          *b,
                         GPtrArray      *modified,
@@ -33,16 +33,64 @@ typedef enum {
   OSTREE_FETCHER_STATE_COMPLETE
 } OstreeFetcherState;
 
+/* How often the outstanding request limit is reconsidered */
+#define ADAPT_INTERVAL_USEC (G_USEC_PER_SEC)
+/* Queueing delay beyond this multiple of the best observed latency
+ * means we're only adding to a queue on the server side.
+ */
+#define ADAPT_LATENCY_FACTOR 2
+
+/* A mirror that failed, or answered "not found", this many requests
+ * in a row is only used when no other is left, until
+ * MIRROR_PROBE_USEC has passed.
+ */
+#define MIRROR_MAX_CONSECUTIVE_FAILURES 3
+#define MIRROR_PROBE_USEC (30 * G_USEC_PER_SEC)
+#define MIRROR_MAX 32
+
+typedef struct {
+  SoupURI *uri;
+  char *path_prefix; /* Path of uri, with trailing '/' */
+  guint n_outstanding;
+  guint n_completed;
+  guint n_failed;
+  guint consecutive_failures;
+  guint64 last_failure_time;
+  guint consecutive_not_found;
+  guint64 last_not_found_time;
+  double latency; /* Moving average time to first byte, in microseconds */
+} OstreeFetcherMirror;
+
+typedef enum {
+  OSTREE_FETCHER_OUTCOME_OK,
+  OSTREE_FETCHER_OUTCOME_NOT_FOUND,
+  OSTREE_FETCHER_OUTCOME_FAILED
+} OstreeFetcherOutcome;
+
 typedef struct {
   guint refcount;
   OstreeFetcher *self;
   SoupURI *uri;
+  int priority;
+  guint64 serial;
+  guint64 send_time;
+  guint64 latency;
+
+  /* Set if uri lies below the mirrored base; resolved against the
+   * chosen mirror each time the request is sent.
+   */
+  char *relpath;
+  OstreeFetcherMirror *mirror;
+  guint32 tried_mirrors;
 
   OstreeFetcherState state;
 
   SoupRequest *request;
 
   gboolean is_stream;
+  /* If range_length is non-zero, only that range of uri is fetched */
+  guint64 range_start;
+  guint64 range_length;
   GInputStream *request_body;
   GFile *out_tmpfile;
   GOutputStream *out_stream;
@@ -62,6 +110,7 @@ pending_uri_free (OstreeFetcherPendingURI *pending)
     return;
 
   soup_uri_free (pending->uri);
+  g_free (pending->relpath);
   g_clear_object (&pending->self);
   g_clear_object (&pending->out_tmpfile);
   g_clear_object (&pending->request);
@@ -88,12 +137,36 @@ struct OstreeFetcher
   guint64 total_downloaded;
   guint total_requests;
 
-  /* Queue for libsoup, see bgo#708591 */
+  /* Queue for libsoup, see bgo#708591; ordered by priority, then
+   * by submission.
+   */
   gint outstanding;
-  GQueue pending_queue;
+  GSequence *pending_queue;
+  guint64 pending_serial;
   gint max_outstanding;
+  gint limit_outstanding;
+  gboolean adaptive;
+
+  /* Throughput and latency over the current adaptation window */
+  guint64 window_start;
+  guint64 window_bytes;
+  guint64 window_latency;
+  guint window_completed;
+  guint64 min_latency;
+  double last_throughput;
+  gint direction;
+
+  GPtrArray *mirrors; /* OstreeFetcherMirror, the primary first */
 };
 
+static void
+mirror_free (OstreeFetcherMirror *mirror)
+{
+  soup_uri_free (mirror->uri);
+  g_free (mirror->path_prefix);
+  g_free (mirror);
+}
+
 G_DEFINE_TYPE (OstreeFetcher, ostree_fetcher, G_TYPE_OBJECT)
 
 static void
@@ -110,7 +183,8 @@ ostree_fetcher_finalize (GObject *object)
   g_hash_table_destroy (self->message_to_request);
   g_hash_table_destroy (self->output_stream_set);
 
-  g_queue_clear (&self->pending_queue);
+  g_sequence_free (self->pending_queue);
+  g_clear_pointer (&self->mirrors, (GDestroyNotify) g_ptr_array_unref);
 
   G_OBJECT_CLASS (ostree_fetcher_parent_class)->finalize (object);
 }
@@ -148,7 +222,7 @@ ostree_fetcher_init (OstreeFetcher *self)
 {
   gint max_conns;
 
-  g_queue_init (&self->pending_queue);
+  self->pending_queue = g_sequence_new (NULL);
   self->session = soup_session_async_new_with_options (SOUP_SESSION_USER_AGENT, "ostree ",
                                                        SOUP_SESSION_SSL_USE_SYSTEM_CA_FILE, TRUE,
                                                        SOUP_SESSION_USE_THREAD_CONTEXT, TRUE,
@@ -159,6 +233,9 @@ ostree_fetcher_init (OstreeFetcher *self)
   self->requester = (SoupRequester *)soup_session_get_feature (self->session, SOUP_TYPE_REQUESTER);
   g_object_get (self->session, "max-conns-per-host", &max_conns, NULL);
   self->max_outstanding = 3 * max_conns;
+  self->limit_outstanding = 8 * max_conns;
+  self->adaptive = TRUE;
+  self->direction = 1;
 
   g_signal_connect (self->session, "request-started",
                     G_CALLBACK (on_request_started), self);
@@ -185,20 +262,324 @@ ostree_fetcher_new (GFile                    *tmpdir,
   return self;
 }
 
+/*
+ * ostree_fetcher_set_max_connections:
+ * @self: Fetcher
+ * @max_conns: Maximum number of connections per host
+ *
+ * Set the number of connections opened to a single host; the
+ * outstanding request limits are scaled to match.
+ */
+void
+ostree_fetcher_set_max_connections (OstreeFetcher *self,
+                                    guint          max_conns)
+{
+  g_return_if_fail (max_conns > 0);
+
+  g_object_set (self->session,
+                "max-conns-per-host", max_conns,
+                "max-conns", MAX (max_conns, 10),
+                NULL);
+  self->max_outstanding = 3 * max_conns;
+  self->limit_outstanding = 8 * max_conns;
+}
+
+/*
+ * ostree_fetcher_set_concurrency:
+ * @self: Fetcher
+ * @max_outstanding: Maximum number of requests handed to libsoup, or 0 for the default
+ * @adaptive: Whether to tune the limit from observed throughput
+ *
+ * If @adaptive is %TRUE, the number of outstanding requests is grown
+ * while doing so increases throughput, and shrunk when it only adds
+ * latency, up to @max_outstanding.  Otherwise up to @max_outstanding
+ * requests are kept in flight, or the fixed default if it is 0.
+ */
+void
+ostree_fetcher_set_concurrency (OstreeFetcher *self,
+                                guint          max_outstanding,
+                                gboolean       adaptive)
+{
+  if (max_outstanding > 0)
+    self->limit_outstanding = max_outstanding;
+  self->adaptive = adaptive;
+  if (!adaptive && max_outstanding > 0)
+    self->max_outstanding = max_outstanding;
+  else
+    self->max_outstanding = MIN (self->max_outstanding, self->limit_outstanding);
+}
+
+/*
+ * ostree_fetcher_set_timeout:
+ * @self: Fetcher
+ * @timeout_secs: Seconds to wait on an unresponsive connection
+ */
+void
+ostree_fetcher_set_timeout (OstreeFetcher *self,
+                            guint          timeout_secs)
+{
+  g_object_set (self->session,
+                "timeout", timeout_secs,
+                "idle-timeout", timeout_secs,
+                NULL);
+}
+
+static char *
+uri_path_prefix (SoupURI *uri)
+{
+  const char *path = soup_uri_get_path (uri);
+  if (g_str_has_suffix (path, "/"))
+    return g_strdup (path);
+  return g_strconcat (path, "/", NULL);
+}
+
+/*
+ * ostree_fetcher_set_mirrors:
+ * @self: Fetcher
+ * @base_uri: Primary location
+ * @mirror_uris: (element-type SoupURI): Equivalent locations
+ *
+ * Requests made with ostree_fetcher_request_uri_with_partial_async()
+ * for a URI below @base_uri may then be served by any of @base_uri
+ * or @mirror_uris.  Each request goes to the mirror with the lowest
+ * expected completion time, judged from its observed latency, error
+ * rate and requests in flight; a failed request is retried on the
+ * mirrors not yet tried for it.
+ */
+void
+ostree_fetcher_set_mirrors (OstreeFetcher *self,
+                            SoupURI       *base_uri,
+                            GPtrArray     *mirror_uris)
+{
+  guint i;
+
+  g_return_if_fail (mirror_uris->len < MIRROR_MAX);
+
+  g_clear_pointer (&self->mirrors, (GDestroyNotify) g_ptr_array_unref);
+  self->mirrors = g_ptr_array_new_with_free_func ((GDestroyNotify) mirror_free);
+
+  for (i = 0; i <= mirror_uris->len; i++)
+    {
+      SoupURI *uri = i == 0 ? base_uri : mirror_uris->pdata[i-1];
+      OstreeFetcherMirror *mirror = g_new0 (OstreeFetcherMirror, 1);
+
+      mirror->uri = soup_uri_copy (uri);
+      mirror->path_prefix = uri_path_prefix (uri);
+      g_ptr_array_add (self->mirrors, mirror);
+    }
+}
+
+static double
+mirror_expected_cost (OstreeFetcher       *self,
+                      OstreeFetcherMirror *mirror,
+                      double               default_latency,
+                      guint64              now)
+{
+  double latency = mirror->latency > 0 ? mirror->latency : default_latency;
+  double error_rate = (double) mirror->n_failed / (mirror->n_failed + mirror->n_completed + 1);
+  double cost = latency * (1 + 10 * error_rate) * (1 + mirror->n_outstanding);
+
+  if ((mirror->consecutive_failures >= MIRROR_MAX_CONSECUTIVE_FAILURES &&
+       now - mirror->last_failure_time < MIRROR_PROBE_USEC) ||
+      (mirror->consecutive_not_found >= MIRROR_MAX_CONSECUTIVE_FAILURES &&
+       now - mirror->last_not_found_time < MIRROR_PROBE_USEC))
+    cost *= 1000;
+
+  return cost;
+}
+
+static OstreeFetcherMirror *
+choose_mirror (OstreeFetcher           *self,
+               OstreeFetcherPendingURI *pending)
+{
+  guint i;
+  guint n_known = 0;
+  double total_latency = 0;
+  double default_latency;
+  double best_cost = 0;
+  gint best = -1;
+  guint64 now = g_get_monotonic_time ();
+
+  /* Mirrors without samples yet are assumed to be average */
+  for (i = 0; i < self->mirrors->len; i++)
+    {
+      OstreeFetcherMirror *mirror = self->mirrors->pdata[i];
+      if (mirror->latency > 0)
+        {
+          total_latency += mirror->latency;
+          n_known++;
+        }
+    }
+  default_latency = n_known > 0 ? total_latency / n_known : 1;
+
+  for (i = 0; i < self->mirrors->len; i++)
+    {
+      OstreeFetcherMirror *mirror = self->mirrors->pdata[i];
+      double cost;
+
+      if (pending->tried_mirrors & (1U << i))
+        continue;
+
+      cost = mirror_expected_cost (self, mirror, default_latency, now);
+      if (best == -1 || cost < best_cost)
+        {
+          best = i;
+          best_cost = cost;
+        }
+    }
+
+  if (best == -1)
+    return NULL;
+
+  pending->tried_mirrors |= (1U << best);
+  return self->mirrors->pdata[best];
+}
+
+static void
+mirror_record_result (OstreeFetcherMirror     *mirror,
+                      OstreeFetcherPendingURI *pending,
+                      OstreeFetcherOutcome     outcome)
+{
+  g_assert (mirror->n_outstanding > 0);
+  mirror->n_outstanding--;
+
+  switch (outcome)
+    {
+    case OSTREE_FETCHER_OUTCOME_FAILED:
+      mirror->n_failed++;
+      mirror->consecutive_failures++;
+      mirror->last_failure_time = g_get_monotonic_time ();
+      break;
+    case OSTREE_FETCHER_OUTCOME_NOT_FOUND:
+      /* Not a latency sample, since a wrong path answers fastest; a
+       * run of them does mean this mirror is missing what the others
+       * serve, though.
+       */
+      mirror->consecutive_not_found++;
+      mirror->last_not_found_time = g_get_monotonic_time ();
+      break;
+    case OSTREE_FETCHER_OUTCOME_OK:
+      mirror->n_completed++;
+      mirror->consecutive_failures = 0;
+      mirror->consecutive_not_found = 0;
+      if (mirror->latency > 0)
+        mirror->latency = 0.8 * mirror->latency + 0.2 * pending->latency;
+      else
+        mirror->latency = MAX (pending->latency, 1);
+      break;
+    }
+}
+
 static void
 on_request_sent (GObject        *object, GAsyncResult   *result, gpointer        user_data);
 
+static gint
+compare_pending (gconstpointer a,
+                 gconstpointer b,
+                 gpointer      user_data)
+{
+  const OstreeFetcherPendingURI *pending_a = a;
+  const OstreeFetcherPendingURI *pending_b = b;
+
+  if (pending_a->priority != pending_b->priority)
+    return pending_a->priority < pending_b->priority ? -1 : 1;
+  if (pending_a->serial != pending_b->serial)
+    return pending_a->serial < pending_b->serial ? -1 : 1;
+  return 0;
+}
+
+static void
+track_pending_message (OstreeFetcher           *self,
+                       OstreeFetcherPendingURI *pending)
+{
+  if (!SOUP_IS_REQUEST_HTTP (pending->request))
+    return;
+
+  pending->refcount++;
+  g_hash_table_insert (self->message_to_request,
+                       soup_request_http_get_message ((SoupRequestHTTP*)pending->request),
+                       pending);
+}
+
+static void
+ostree_fetcher_send_pending (OstreeFetcher           *self,
+                             OstreeFetcherPendingURI *pending)
+{
+  gs_unref_object GFileInfo *file_info = NULL;
+  GError *local_error = NULL;
+  guint64 have = 0;
+
+  /* Resume from whatever a previous attempt left behind */
+  if (!ot_gfile_query_info_allow_noent (pending->out_tmpfile, OSTREE_GIO_FAST_QUERYINFO,
+                                        G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                        &file_info, pending->cancellable, &local_error))
+    {
+      g_simple_async_result_take_error (pending->result, local_error);
+      g_simple_async_result_complete_in_idle (pending->result);
+      g_object_unref (pending->result);
+      return;
+    }
+  if (file_info)
+    have = g_file_info_get_size (file_info);
+
+  if (pending->range_length > 0 && have >= pending->range_length)
+    {
+      g_simple_async_result_complete_in_idle (pending->result);
+      g_object_unref (pending->result);
+      return;
+    }
+
+  if (pending->relpath)
+    {
+      SoupURI *mirror_uri;
+      gs_free char *path = NULL;
+
+      pending->mirror = choose_mirror (self, pending);
+      g_assert (pending->mirror != NULL);
+      pending->mirror->n_outstanding++;
+
+      mirror_uri = soup_uri_copy (pending->mirror->uri);
+      path = g_strconcat (pending->mirror->path_prefix, pending->relpath, NULL);
+      soup_uri_set_path (mirror_uri, path);
+      g_clear_object (&pending->request);
+      pending->request = soup_requester_request_uri (self->requester, mirror_uri, &local_error);
+      soup_uri_free (mirror_uri);
+      g_assert_no_error (local_error);
+    }
+
+  if (SOUP_IS_REQUEST_HTTP (pending->request))
+    {
+      SoupMessage *msg;
+
+      msg = soup_request_http_get_message ((SoupRequestHTTP*) pending->request);
+      if (pending->range_length > 0)
+        soup_message_headers_set_range (msg->request_headers, pending->range_start + have,
+                                        pending->range_start + pending->range_length - 1);
+      else if (have > 0)
+        soup_message_headers_set_range (msg->request_headers, have, -1);
+      g_object_unref (msg);
+    }
+  track_pending_message (self, pending);
+
+  self->outstanding++;
+  pending->state = OSTREE_FETCHER_STATE_PENDING;
+  pending->send_time = g_get_monotonic_time ();
+  soup_request_send_async (pending->request, pending->cancellable,
+                           on_request_sent, pending);
+}
+
 static void
 ostree_fetcher_process_pending_queue (OstreeFetcher *self)
 {
 
-  while (g_queue_peek_head (&self->pending_queue) != NULL &&
+  while (!g_sequence_iter_is_end (g_sequence_get_begin_iter (self->pending_queue)) &&
          self->outstanding < self->max_outstanding)
     {
-      OstreeFetcherPendingURI *next = g_queue_pop_head (&self->pending_queue);
-      self->outstanding++;
-      soup_request_send_async (next->request, next->cancellable,
-                               on_request_sent, next);
+      GSequenceIter *iter = g_sequence_get_begin_iter (self->pending_queue);
+      OstreeFetcherPendingURI *next = g_sequence_get (iter);
+
+      g_sequence_remove (iter);
+      ostree_fetcher_send_pending (self, next);
     }
 }
 
@@ -208,17 +589,139 @@ ostree_fetcher_queue_pending_uri (OstreeFetcher *self,
 {
   g_assert (!pending->is_stream);
 
-  g_queue_push_tail (&self->pending_queue, pending);
+  /* Retries keep their original place in line */
+  if (pending->serial == 0)
+    pending->serial = ++self->pending_serial;
+  g_sequence_insert_sorted (self->pending_queue, pending, compare_pending, NULL);
 
   ostree_fetcher_process_pending_queue (self);
 }
 
+/* A hill climb on throughput: keep moving the outstanding request
+ * limit in the same direction while throughput improves, and turn
+ * around when it drops.  On high latency links this grows the limit
+ * until round trips on small objects no longer dominate.
+ */
 static void
-on_splice_complete (GObject        *object,
-                    GAsyncResult   *result,
-                    gpointer        user_data) 
+adapt_concurrency (OstreeFetcher           *self,
+                   OstreeFetcherPendingURI *pending,
+                   guint64                  bytes)
+{
+  guint64 now = g_get_monotonic_time ();
+  guint64 elapsed;
+  guint64 latency;
+  double throughput;
+  gint step;
+
+  if (!self->adaptive)
+    return;
+
+  if (self->window_start == 0)
+    self->window_start = pending->send_time;
+
+  self->window_bytes += bytes;
+  self->window_latency += pending->latency;
+  self->window_completed++;
+
+  elapsed = now - self->window_start;
+  if (elapsed < ADAPT_INTERVAL_USEC ||
+      self->window_completed < (guint) self->max_outstanding)
+    return;
+
+  throughput = (double) self->window_bytes * G_USEC_PER_SEC / elapsed;
+  latency = self->window_latency / self->window_completed;
+  if (self->min_latency == 0 || latency < self->min_latency)
+    self->min_latency = latency;
+
+  if (self->last_throughput > 0 && throughput < self->last_throughput * 0.95)
+    self->direction = self->direction < 0 ? 1 : -1;
+  else if (self->last_throughput > 0 && throughput < self->last_throughput * 1.05)
+    {
+      /* No measurable change; hold for a window, then probe upwards */
+      if (latency > ADAPT_LATENCY_FACTOR * self->min_latency)
+        self->direction = -1;
+      else
+        self->direction = self->direction == 0 ? 1 : 0;
+    }
+  else if (self->direction == 0)
+    self->direction = 1;
+
+  step = MAX (1, self->max_outstanding / 4);
+  self->max_outstanding = CLAMP (self->max_outstanding + self->direction * step,
+                                 1, self->limit_outstanding);
+
+  self->last_throughput = throughput;
+  self->window_start = now;
+  self->window_bytes = 0;
+  self->window_latency = 0;
+  self->window_completed = 0;
+}
+
+/* Called once per sent request, however it completed. */
+static void
+ostree_fetcher_request_done (OstreeFetcher           *self,
+                             OstreeFetcherPendingURI *pending,
+                             guint64                  bytes,
+                             OstreeFetcherOutcome     outcome)
+{
+  if (pending->is_stream)
+    return;
+
+  if (pending->mirror)
+    {
+      mirror_record_result (pending->mirror, pending, outcome);
+      pending->mirror = NULL;
+    }
+
+  g_assert (self->outstanding > 0);
+  self->outstanding--;
+  if (outcome == OSTREE_FETCHER_OUTCOME_OK)
+    adapt_concurrency (self, pending, bytes);
+  ostree_fetcher_process_pending_queue (self);
+}
+
+/* If @pending may be served by a mirror that hasn't failed it yet,
+ * queue it again and return %TRUE.
+ */
+static gboolean
+ostree_fetcher_retry_on_mirror (OstreeFetcher           *self,
+                                OstreeFetcherPendingURI *pending,
+                                const GError            *error)
+{
+  guint i;
+  gboolean have_untried = FALSE;
+
+  if (!pending->relpath ||
+      g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    return FALSE;
+
+  for (i = 0; i < self->mirrors->len; i++)
+    {
+      if (!(pending->tried_mirrors & (1U << i)))
+        {
+          have_untried = TRUE;
+          break;
+        }
+    }
+  if (!have_untried)
+    return FALSE;
+
+  g_debug ("Retrying %s on another mirror: %s", pending->relpath, error->message);
+
+  if (pending->request_body)
+    (void) g_input_stream_close (pending->request_body, NULL, NULL);
+  g_clear_object (&pending->request_body);
+  g_clear_object (&pending->out_stream);
+  pending->content_length = 0;
+
+  ostree_fetcher_queue_pending_uri (self, pending);
+  return TRUE;
+}
+
+/* Called once the body of a request has been written out */
+static void
+finish_download (OstreeFetcherPendingURI *pending)
 {
-  OstreeFetcherPendingURI *pending = user_data;
   gs_unref_object GFileInfo *file_info = NULL;
   goffset filesize;
   GError *local_error = NULL;
@@ -231,23 +734,33 @@ on_splice_complete (GObject        *object,
                                  G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
                                  pending->cancellable, &local_error);
   if (!file_info)
-    goto out;
+    {
+      ostree_fetcher_request_done (pending->self, pending, 0, OSTREE_FETCHER_OUTCOME_FAILED);
+      goto out;
+    }
+
+  filesize = g_file_info_get_size (file_info);
+  if (filesize < pending->content_length)
+    g_set_error (&local_error, G_IO_ERROR, G_IO_ERROR_FAILED, "Download incomplete");
 
   /* Now that we've finished downloading, continue with other queued
    * requests.
    */
-  pending->self->outstanding--;
-  ostree_fetcher_process_pending_queue (pending->self);
+  ostree_fetcher_request_done (pending->self, pending, filesize,
+                               local_error ? OSTREE_FETCHER_OUTCOME_FAILED : OSTREE_FETCHER_OUTCOME_OK);
 
-  filesize = g_file_info_get_size (file_info);
-  if (filesize < pending->content_length)
+  if (local_error)
     {
-      g_set_error (&local_error, G_IO_ERROR, G_IO_ERROR_FAILED, "Download incomplete");
+      if (ostree_fetcher_retry_on_mirror (pending->self, pending, local_error))
+        {
+          g_clear_error (&local_error);
+          return;
+        }
       goto out;
     }
   else
     {
-      pending->self->total_downloaded += g_file_info_get_size (file_info);
+      pending->self->total_downloaded += filesize;
     }
 
  out:
@@ -258,6 +771,62 @@ on_splice_complete (GObject        *object,
   g_object_unref (pending->result);
 }
 
+static void
+on_splice_complete (GObject        *object,
+                    GAsyncResult   *result,
+                    gpointer        user_data) 
+{
+  finish_download (user_data);
+}
+
+/* Without HTTP, e.g. for file: URIs, there are no range requests;
+ * read the range out of the full body instead.
+ */
+static gboolean
+copy_range_sync (OstreeFetcherPendingURI *pending,
+                 guint64                  offset,
+                 guint64                  length,
+                 GError                 **error)
+{
+  guint8 buf[8192];
+
+  while (offset > 0)
+    {
+      gssize n = g_input_stream_skip (pending->request_body, MIN (offset, G_MAXSSIZE),
+                                      pending->cancellable, error);
+      if (n < 0)
+        return FALSE;
+      if (n == 0)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Unexpected end of file");
+          return FALSE;
+        }
+      offset -= n;
+    }
+
+  while (length > 0)
+    {
+      gsize bytes_written;
+      gssize n = g_input_stream_read (pending->request_body, buf, MIN (length, sizeof (buf)),
+                                      pending->cancellable, error);
+      if (n < 0)
+        return FALSE;
+      if (n == 0)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Unexpected end of file");
+          return FALSE;
+        }
+      if (!g_output_stream_write_all (pending->out_stream, buf, n, &bytes_written,
+                                      pending->cancellable, error))
+        return FALSE;
+      length -= n;
+    }
+
+  return g_output_stream_close (pending->out_stream, pending->cancellable, error);
+}
+
 static void
 on_request_sent (GObject        *object,
                  GAsyncResult   *result,
@@ -271,6 +840,8 @@ on_request_sent (GObject        *object,
   pending->state = OSTREE_FETCHER_STATE_COMPLETE;
   pending->request_body = soup_request_send_finish ((SoupRequest*) object,
                                                    result, &local_error);
+  if (pending->send_time > 0)
+    pending->latency = g_get_monotonic_time () - pending->send_time;
 
   if (!pending->request_body)
     goto out;
@@ -278,11 +849,13 @@ on_request_sent (GObject        *object,
   if (SOUP_IS_REQUEST_HTTP (object))
     {
       msg = soup_request_http_get_message ((SoupRequestHTTP*) object);
-      if (msg->status_code == SOUP_STATUS_REQUESTED_RANGE_NOT_SATISFIABLE)
+      if (msg->status_code == SOUP_STATUS_REQUESTED_RANGE_NOT_SATISFIABLE &&
+          pending->range_length == 0)
         {
           // We already have the whole file, so just use it.
           pending->state = OSTREE_FETCHER_STATE_COMPLETE;
           (void) g_input_stream_close (pending->request_body, NULL, NULL);
+          ostree_fetcher_request_done (pending->self, pending, 0, OSTREE_FETCHER_OUTCOME_OK);
           g_simple_async_result_complete (pending->result);
           g_object_unref (pending->result);
           return;
@@ -304,11 +877,21 @@ on_request_sent (GObject        *object,
                        msg->status_code, soup_status_get_phrase (msg->status_code));
           goto out;
         }
+      else if (pending->range_length > 0 &&
+               msg->status_code != SOUP_STATUS_PARTIAL_CONTENT)
+        {
+          g_set_error (&local_error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Server does not support range requests");
+          goto out;
+        }
     }
 
   pending->state = OSTREE_FETCHER_STATE_DOWNLOADING;
   
-  pending->content_length = soup_request_get_content_length (pending->request);
+  if (pending->range_length > 0)
+    pending->content_length = pending->range_length;
+  else
+    pending->content_length = soup_request_get_content_length (pending->request);
 
   if (!pending->is_stream)
     {
@@ -317,9 +900,29 @@ on_request_sent (GObject        *object,
       if (!pending->out_stream)
         goto out;
       g_hash_table_add (pending->self->output_stream_set, g_object_ref (pending->out_stream));
-      g_output_stream_splice_async (pending->out_stream, pending->request_body, flags, G_PRIORITY_DEFAULT,
-                                    pending->cancellable, on_splice_complete, pending);
-      
+
+      if (pending->range_length > 0 && !msg)
+        {
+          GError *temp_error = NULL;
+          gs_unref_object GFileInfo *out_info =
+            g_file_output_stream_query_info ((GFileOutputStream*)pending->out_stream,
+                                             G_FILE_ATTRIBUTE_STANDARD_SIZE,
+                                             pending->cancellable, &temp_error);
+
+          if (!out_info ||
+              !copy_range_sync (pending, pending->range_start + g_file_info_get_size (out_info),
+                                pending->range_length - g_file_info_get_size (out_info),
+                                &temp_error))
+            {
+              /* The incomplete download is noticed when finishing */
+              g_debug ("Reading %s: %s", soup_uri_get_path (pending->uri), temp_error->message);
+              g_clear_error (&temp_error);
+            }
+          finish_download (pending);
+        }
+      else
+        g_output_stream_splice_async (pending->out_stream, pending->request_body, flags, G_PRIORITY_DEFAULT,
+                                      pending->cancellable, on_splice_complete, pending);
     }
   else
     {
@@ -329,8 +932,22 @@ on_request_sent (GObject        *object,
  out:
   if (local_error)
     {
+      /* A missing object is a normal answer, not a sign of an unhealthy
+       * mirror; it's still worth asking the others, in case this one
+       * is lagging behind.
+       */
+      ostree_fetcher_request_done (pending->self, pending, 0,
+                                   g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND) ?
+                                   OSTREE_FETCHER_OUTCOME_NOT_FOUND : OSTREE_FETCHER_OUTCOME_FAILED);
+      if (ostree_fetcher_retry_on_mirror (pending->self, pending, local_error))
+        {
+          g_clear_error (&local_error);
+          return;
+        }
       g_simple_async_result_take_error (pending->result, local_error);
       g_simple_async_result_complete (pending->result);
+      if (!pending->is_stream)
+        g_object_unref (pending->result);
     }
 }
 
@@ -338,6 +955,9 @@ static OstreeFetcherPendingURI *
 ostree_fetcher_request_uri_internal (OstreeFetcher         *self,
                                      SoupURI               *uri,
                                      gboolean               is_stream,
+                                     guint64                range_start,
+                                     guint64                range_length,
+                                     int                    priority,
                                      GCancellable          *cancellable,
                                      GAsyncReadyCallback    callback,
                                      gpointer               user_data,
@@ -350,13 +970,35 @@ ostree_fetcher_request_uri_internal (OstreeFetcher         *self,
   pending->refcount = 1;
   pending->self = g_object_ref (self);
   pending->uri = soup_uri_copy (uri);
+  pending->priority = priority;
   pending->is_stream = is_stream;
+  pending->range_start = range_start;
+  pending->range_length = range_length;
   if (!is_stream)
     {
       gs_free char *uristring = soup_uri_to_string (uri, FALSE);
-      gs_free char *hash = g_compute_checksum_for_string (G_CHECKSUM_SHA256, uristring, strlen (uristring));
+      gs_free char *hash = NULL;
+
+      /* Ranges of the same file each get their own download */
+      if (range_length > 0)
+        {
+          char *with_range = g_strdup_printf ("%s#%" G_GUINT64_FORMAT "+%" G_GUINT64_FORMAT,
+                                              uristring, range_start, range_length);
+          g_free (uristring);
+          uristring = with_range;
+        }
+      hash = g_compute_checksum_for_string (G_CHECKSUM_SHA256, uristring, strlen (uristring));
       pending->out_tmpfile = g_file_get_child (self->tmpdir, hash);
     }
+  if (!is_stream && self->mirrors)
+    {
+      OstreeFetcherMirror *primary = self->mirrors->pdata[0];
+      const char *path = soup_uri_get_path (uri);
+
+      if (soup_uri_host_equal (uri, primary->uri) &&
+          g_str_has_prefix (path, primary->path_prefix))
+        pending->relpath = g_strdup (path + strlen (primary->path_prefix));
+    }
   pending->cancellable = cancellable ? g_object_ref (cancellable) : NULL;
   pending->request = soup_requester_request_uri (self->requester, uri, &local_error);
   pending->result = g_simple_async_result_new ((GObject*) self,
@@ -368,54 +1010,67 @@ ostree_fetcher_request_uri_internal (OstreeFetcher         *self,
                                              (GDestroyNotify) pending_uri_free);
   
   g_assert_no_error (local_error);
-  
-  pending->refcount++;
 
   return pending;
 }
 
+/*
+ * ostree_fetcher_request_uri_with_partial_async:
+ * @priority: Scheduling priority; lower values are sent first, see %G_PRIORITY_DEFAULT
+ *
+ * Download @uri into the fetcher's temporary directory, resuming
+ * a previous partial download if one exists.
+ */
 void
 ostree_fetcher_request_uri_with_partial_async (OstreeFetcher         *self,
                                                SoupURI               *uri,
+                                               int                    priority,
                                                GCancellable          *cancellable,
                                                GAsyncReadyCallback    callback,
                                                gpointer               user_data)
 {
   OstreeFetcherPendingURI *pending;
-  gs_unref_object GFileInfo *file_info = NULL;
-  GError *local_error = NULL;
 
   self->total_requests++;
 
-  pending = ostree_fetcher_request_uri_internal (self, uri, FALSE, cancellable,
+  pending = ostree_fetcher_request_uri_internal (self, uri, FALSE, 0, 0, priority, cancellable,
                                                  callback, user_data,
                                                  ostree_fetcher_request_uri_with_partial_async);
 
-  if (!ot_gfile_query_info_allow_noent (pending->out_tmpfile, OSTREE_GIO_FAST_QUERYINFO,
-                                        G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
-                                        &file_info, cancellable, &local_error))
-    goto out;
+  ostree_fetcher_queue_pending_uri (self, pending);
+}
 
-  if (SOUP_IS_REQUEST_HTTP (pending->request))
-    {
-      SoupMessage *msg;
+/*
+ * ostree_fetcher_request_uri_range_async:
+ * @offset: Start of the range
+ * @length: Length of the range, greater than zero
+ * @priority: Scheduling priority, see ostree_fetcher_request_uri_with_partial_async()
+ *
+ * Like ostree_fetcher_request_uri_with_partial_async(), but download
+ * only the given byte range of @uri.  Complete the request with
+ * ostree_fetcher_request_uri_with_partial_finish().
+ */
+void
+ostree_fetcher_request_uri_range_async (OstreeFetcher         *self,
+                                        SoupURI               *uri,
+                                        guint64                offset,
+                                        guint64                length,
+                                        int                    priority,
+                                        GCancellable          *cancellable,
+                                        GAsyncReadyCallback    callback,
+                                        gpointer               user_data)
+{
+  OstreeFetcherPendingURI *pending;
 
-      msg = soup_request_http_get_message ((SoupRequestHTTP*) pending->request);
-      if (file_info && g_file_info_get_size (file_info) > 0)
-        soup_message_headers_set_range (msg->request_headers, g_file_info_get_size (file_info), -1);
-      g_hash_table_insert (self->message_to_request,
-                           soup_request_http_get_message ((SoupRequestHTTP*)pending->request),
-                           pending);
-    }
+  g_return_if_fail (length > 0);
 
-  ostree_fetcher_queue_pending_uri (self, pending);
+  self->total_requests++;
 
- out:
-  if (local_error != NULL)
-    {
-      g_simple_async_result_take_error (pending->result, local_error);
-      g_simple_async_result_complete (pending->result);
-    }
+  pending = ostree_fetcher_request_uri_internal (self, uri, FALSE, offset, length, priority,
+                                                 cancellable, callback, user_data,
+                                                 ostree_fetcher_request_uri_with_partial_async);
+
+  ostree_fetcher_queue_pending_uri (self, pending);
 }
 
 GFile *
@@ -447,17 +1102,12 @@ ostree_fetcher_stream_uri_async (OstreeFetcher         *self,
 
   self->total_requests++;
 
-  pending = ostree_fetcher_request_uri_internal (self, uri, TRUE, cancellable,
+  pending = ostree_fetcher_request_uri_internal (self, uri, TRUE, 0, 0, G_PRIORITY_DEFAULT, cancellable,
                                                  callback, user_data,
                                                  ostree_fetcher_stream_uri_async);
 
-  if (SOUP_IS_REQUEST_HTTP (pending->request))
-    {
-      g_hash_table_insert (self->message_to_request,
-                           soup_request_http_get_message ((SoupRequestHTTP*)pending->request),
-                           pending);
-    }
-  
+  track_pending_message (self, pending);
+
   soup_request_send_async (pending->request, cancellable,
                            on_request_sent, pending);
 }
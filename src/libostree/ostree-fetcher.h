@@ -60,12 +60,36 @@ guint64 ostree_fetcher_bytes_transferred (OstreeFetcher       *self);
 
 guint ostree_fetcher_get_n_requests (OstreeFetcher       *self);
 
+void ostree_fetcher_set_max_connections (OstreeFetcher *self,
+                                         guint          max_conns);
+
+void ostree_fetcher_set_concurrency (OstreeFetcher *self,
+                                     guint          max_outstanding,
+                                     gboolean       adaptive);
+
+void ostree_fetcher_set_timeout (OstreeFetcher *self,
+                                 guint          timeout_secs);
+
+void ostree_fetcher_set_mirrors (OstreeFetcher *self,
+                                 SoupURI       *base_uri,
+                                 GPtrArray     *mirror_uris);
+
 void ostree_fetcher_request_uri_with_partial_async (OstreeFetcher         *self,
                                                     SoupURI               *uri,
+                                                    int                    priority,
                                                     GCancellable          *cancellable,
                                                     GAsyncReadyCallback    callback,
                                                     gpointer               user_data);
 
+void ostree_fetcher_request_uri_range_async (OstreeFetcher         *self,
+                                             SoupURI               *uri,
+                                             guint64                offset,
+                                             guint64                length,
+                                             int                    priority,
+                                             GCancellable          *cancellable,
+                                             GAsyncReadyCallback    callback,
+                                             gpointer               user_data);
+
 GFile *ostree_fetcher_request_uri_with_partial_finish (OstreeFetcher *self,
                                                        GAsyncResult  *result,
                                                        GError       **error);
@@ -0,0 +1,178 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2014 Colin Walters <walters@verbum.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+#include "config.h"
+
+#include "ostree-lzma-compressor.h"
+#include "ostree-lzma-common.h"
+
+#include <lzma.h>
+
+/*
+ * OstreeLzmaCompressor:
+ *
+ * A #GConverter producing an xz stream, with the same semantics as
+ * #GZlibCompressor.
+ */
+
+struct _OstreeLzmaCompressor
+{
+  GObject parent_instance;
+
+  lzma_stream lstream;
+  gboolean initialized;
+  guint32 preset;
+};
+
+static void _ostree_lzma_compressor_iface_init (GConverterIface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (OstreeLzmaCompressor, _ostree_lzma_compressor,
+                         G_TYPE_OBJECT,
+                         G_IMPLEMENT_INTERFACE (G_TYPE_CONVERTER,
+                                                _ostree_lzma_compressor_iface_init))
+
+static void
+_ostree_lzma_compressor_finalize (GObject *object)
+{
+  OstreeLzmaCompressor *self = OSTREE_LZMA_COMPRESSOR (object);
+
+  lzma_end (&self->lstream);
+
+  G_OBJECT_CLASS (_ostree_lzma_compressor_parent_class)->finalize (object);
+}
+
+static void
+_ostree_lzma_compressor_init (OstreeLzmaCompressor *self)
+{
+  lzma_stream tmp = LZMA_STREAM_INIT;
+  self->lstream = tmp;
+}
+
+static void
+_ostree_lzma_compressor_class_init (OstreeLzmaCompressorClass *klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+
+  gobject_class->finalize = _ostree_lzma_compressor_finalize;
+}
+
+/*
+ * _ostree_lzma_compressor_new:
+ * @preset: Compression level, as for xz; between 0 and 9
+ */
+OstreeLzmaCompressor *
+_ostree_lzma_compressor_new (guint32 preset)
+{
+  OstreeLzmaCompressor *self = g_object_new (OSTREE_TYPE_LZMA_COMPRESSOR, NULL);
+
+  self->preset = preset;
+  return self;
+}
+
+/*
+ * _ostree_lzma_compressor_get_memusage:
+ * @preset: Compression level, as for xz; between 0 and 9
+ *
+ * Returns: Memory in bytes used by one encoder at @preset
+ */
+guint64
+_ostree_lzma_compressor_get_memusage (guint32 preset)
+{
+  return lzma_easy_encoder_memusage (preset);
+}
+
+static void
+_ostree_lzma_compressor_reset (GConverter *converter)
+{
+  OstreeLzmaCompressor *self = OSTREE_LZMA_COMPRESSOR (converter);
+
+  if (self->initialized)
+    {
+      lzma_stream tmp = LZMA_STREAM_INIT;
+      lzma_end (&self->lstream);
+      self->lstream = tmp;
+      self->initialized = FALSE;
+    }
+}
+
+static GConverterResult
+_ostree_lzma_compressor_convert (GConverter *converter,
+                                 const void *inbuf,
+                                 gsize       inbuf_size,
+                                 void       *outbuf,
+                                 gsize       outbuf_size,
+                                 GConverterFlags flags,
+                                 gsize      *bytes_read,
+                                 gsize      *bytes_written,
+                                 GError    **error)
+{
+  OstreeLzmaCompressor *self = OSTREE_LZMA_COMPRESSOR (converter);
+  lzma_action action;
+  lzma_ret res;
+
+  if (inbuf_size != 0 && outbuf_size == 0)
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NO_SPACE,
+                           "Buffer is too small");
+      return G_CONVERTER_ERROR;
+    }
+
+  if (!self->initialized)
+    {
+      res = lzma_easy_encoder (&self->lstream, self->preset, LZMA_CHECK_CRC64);
+      if (res != LZMA_OK)
+        goto out;
+      self->initialized = TRUE;
+    }
+
+  self->lstream.next_in = (void *)inbuf;
+  self->lstream.avail_in = inbuf_size;
+
+  self->lstream.next_out = outbuf;
+  self->lstream.avail_out = outbuf_size;
+
+  action = LZMA_RUN;
+  if (flags & G_CONVERTER_INPUT_AT_END)
+    action = LZMA_FINISH;
+  else if (flags & G_CONVERTER_FLUSH)
+    action = LZMA_SYNC_FLUSH;
+
+  res = lzma_code (&self->lstream, action);
+  if (res != LZMA_OK && res != LZMA_STREAM_END)
+    goto out;
+
+  *bytes_read = inbuf_size - self->lstream.avail_in;
+  *bytes_written = outbuf_size - self->lstream.avail_out;
+
+  /* A finished sync flush also reports LZMA_STREAM_END */
+  if (action == LZMA_SYNC_FLUSH && res == LZMA_STREAM_END)
+    return G_CONVERTER_FLUSHED;
+
+ out:
+  return _ostree_lzma_return (res, error);
+}
+
+static void
+_ostree_lzma_compressor_iface_init (GConverterIface *iface)
+{
+  iface->convert = _ostree_lzma_compressor_convert;
+  iface->reset = _ostree_lzma_compressor_reset;
+}
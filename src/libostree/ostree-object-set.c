@@ -0,0 +1,257 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2014 Colin Walters <walters@verbum.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "ostree-object-set.h"
+
+/**
+ * SECTION:libostree-object-set
+ * @title: Compact set of object names
+ * @short_description: Set of objects keyed by binary checksum
+ *
+ * An #OstreeObjectSet holds object names as a binary checksum plus
+ * object type.  It is filled by ostree_repo_traverse_commit_set(), and
+ * is much more compact than a #GHashTable of serialized names when
+ * traversing millions of objects.
+ *
+ * Lookups may be performed from multiple threads, as long as no
+ * thread is modifying the set.
+ */
+
+/*
+ * Entries are packed 33 bytes each into fixed size chunks, and the
+ * hash table is an open addressing array of 32 bit indexes into them.
+ * Since checksums are already uniformly distributed, their leading
+ * bytes are used directly as the hash.
+ */
+
+/**
+ * OstreeObjectSet:
+ *
+ * Private instance structure.
+ */
+
+#define ENTRY_SIZE 33
+#define CHUNK_SHIFT 16
+#define CHUNK_N_ENTRIES (1 << CHUNK_SHIFT)
+#define INITIAL_N_BUCKETS 1024
+
+struct OstreeObjectSet {
+  GPtrArray *chunks;
+  guint n_entries;
+
+  /* Entry index plus one; 0 means empty */
+  guint32 *buckets;
+  guint n_buckets;
+};
+
+static inline guchar *
+entry_at (OstreeObjectSet *set,
+          guint            i)
+{
+  guchar *chunk = set->chunks->pdata[i >> CHUNK_SHIFT];
+  return chunk + (i & (CHUNK_N_ENTRIES - 1)) * ENTRY_SIZE;
+}
+
+static inline guint32
+hash_name (const guchar      *csum,
+           OstreeObjectType   objtype)
+{
+  guint32 h;
+  memcpy (&h, csum, sizeof (h));
+  return h ^ ((guint32)objtype * 0x9E3779B9U);
+}
+
+/* Returns the bucket holding the name, or the empty one where it
+ * should be inserted.
+ */
+static guint
+find_bucket (OstreeObjectSet   *set,
+             const guchar      *csum,
+             OstreeObjectType   objtype)
+{
+  guint mask = set->n_buckets - 1;
+  guint b = hash_name (csum, objtype) & mask;
+
+  while (TRUE)
+    {
+      guint32 v = set->buckets[b];
+      const guchar *entry;
+
+      if (v == 0)
+        break;
+
+      entry = entry_at (set, v - 1);
+      if (entry[32] == (guchar)objtype && memcmp (entry, csum, 32) == 0)
+        break;
+
+      b = (b + 1) & mask;
+    }
+
+  return b;
+}
+
+static void
+grow_buckets (OstreeObjectSet *set)
+{
+  guint i;
+
+  g_free (set->buckets);
+  set->n_buckets *= 2;
+  set->buckets = g_new0 (guint32, set->n_buckets);
+
+  for (i = 0; i < set->n_entries; i++)
+    {
+      const guchar *entry = entry_at (set, i);
+      guint b = find_bucket (set, entry, entry[32]);
+      set->buckets[b] = i + 1;
+    }
+}
+
+/**
+ * ostree_object_set_new: (skip)
+ *
+ * Returns: (transfer full): A new empty set of object names
+ */
+OstreeObjectSet *
+ostree_object_set_new (void)
+{
+  OstreeObjectSet *set = g_new0 (OstreeObjectSet, 1);
+
+  set->chunks = g_ptr_array_new_with_free_func (g_free);
+  set->n_buckets = INITIAL_N_BUCKETS;
+  set->buckets = g_new0 (guint32, set->n_buckets);
+
+  return set;
+}
+
+/**
+ * ostree_object_set_free: (skip)
+ * @set: (allow-none): A set
+ *
+ * Free @set and all of its entries.
+ */
+void
+ostree_object_set_free (OstreeObjectSet *set)
+{
+  if (!set)
+    return;
+
+  g_ptr_array_unref (set->chunks);
+  g_free (set->buckets);
+  g_free (set);
+}
+
+/**
+ * ostree_object_set_add: (skip)
+ * @set: A set
+ * @csum: Binary SHA256 checksum, 32 bytes
+ * @objtype: Object type
+ *
+ * Add the object named by @csum and @objtype to @set.
+ *
+ * Returns: %TRUE if it was not already present
+ */
+gboolean
+ostree_object_set_add (OstreeObjectSet   *set,
+                       const guchar      *csum,
+                       OstreeObjectType   objtype)
+{
+  guint b;
+  guchar *entry;
+
+  b = find_bucket (set, csum, objtype);
+  if (set->buckets[b] != 0)
+    return FALSE;
+
+  g_assert (set->n_entries < G_MAXUINT32);
+
+  if ((set->n_entries & (CHUNK_N_ENTRIES - 1)) == 0)
+    g_ptr_array_add (set->chunks, g_malloc (CHUNK_N_ENTRIES * ENTRY_SIZE));
+
+  entry = entry_at (set, set->n_entries);
+  memcpy (entry, csum, 32);
+  entry[32] = (guchar)objtype;
+  set->n_entries++;
+  set->buckets[b] = set->n_entries;
+
+  /* Keep the load factor under one half */
+  if (set->n_entries * 2 > set->n_buckets)
+    grow_buckets (set);
+
+  return TRUE;
+}
+
+/**
+ * ostree_object_set_contains: (skip)
+ * @set: A set
+ * @csum: Binary SHA256 checksum, 32 bytes
+ * @objtype: Object type
+ *
+ * Returns: %TRUE if the object named by @csum and @objtype is in @set
+ */
+gboolean
+ostree_object_set_contains (OstreeObjectSet   *set,
+                            const guchar      *csum,
+                            OstreeObjectType   objtype)
+{
+  return set->buckets[find_bucket (set, csum, objtype)] != 0;
+}
+
+/**
+ * ostree_object_set_get_size: (skip)
+ * @set: A set
+ *
+ * Returns: Number of objects in @set
+ */
+guint
+ostree_object_set_get_size (OstreeObjectSet *set)
+{
+  return set->n_entries;
+}
+
+/**
+ * ostree_object_set_get: (skip)
+ * @set: A set
+ * @i: Index, less than ostree_object_set_get_size()
+ * @out_csum: (out): Binary checksum of the object
+ * @out_objtype: (out): Object type
+ *
+ * Retrieve the @i'th entry of @set; entries are kept in the order
+ * they were added.  @out_csum points into @set, and is valid until
+ * it is freed.
+ */
+void
+ostree_object_set_get (OstreeObjectSet    *set,
+                       guint               i,
+                       const guchar      **out_csum,
+                       OstreeObjectType   *out_objtype)
+{
+  const guchar *entry;
+
+  g_return_if_fail (i < set->n_entries);
+
+  entry = entry_at (set, i);
+  *out_csum = entry;
+  *out_objtype = entry[32];
+}
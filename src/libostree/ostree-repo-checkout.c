@@ -34,6 +34,7 @@
 
 static gboolean
 checkout_object_for_uncompressed_cache (OstreeRepo      *self,
+                                        const char      *checksum,
                                         const char      *loose_path,
                                         GFileInfo       *src_info,
                                         GInputStream    *content,
@@ -46,6 +47,7 @@ checkout_object_for_uncompressed_cache (OstreeRepo      *self,
   int fd;
   int res;
   guint32 file_mode;
+  struct stat stbuf;
 
   /* Don't make setuid files in uncompressed cache */
   file_mode = g_file_info_get_attribute_uint32 (src_info, "unix::mode");
@@ -73,6 +75,12 @@ checkout_object_for_uncompressed_cache (OstreeRepo      *self,
       goto out;
     }
 
+  if (fstat (fd, &stbuf) != 0)
+    {
+      ot_util_set_error_from_errno (error, errno);
+      goto out;
+    }
+
   if (!g_output_stream_close (temp_out, cancellable, error))
     goto out;
 
@@ -93,6 +101,12 @@ checkout_object_for_uncompressed_cache (OstreeRepo      *self,
       else
         (void) unlinkat (self->tmp_dir_fd, temp_filename, 0);
     }
+  else
+    {
+      if (!_ostree_repo_devino_cache_insert (self, checksum, stbuf.st_dev, stbuf.st_ino,
+                                             cancellable, error))
+        goto out;
+    }
 
   ret = TRUE;
  out:
@@ -429,7 +443,7 @@ checkout_one_file_at (OstreeRepo                        *repo,
       /* Overwrite any parent repo from earlier */
       _ostree_loose_path (loose_path_buf, checksum, OSTREE_OBJECT_TYPE_FILE, OSTREE_REPO_MODE_BARE);
 
-      if (!checkout_object_for_uncompressed_cache (repo, loose_path_buf,
+      if (!checkout_object_for_uncompressed_cache (repo, checksum, loose_path_buf,
                                                    source_info, input,
                                                    cancellable, error))
         {
@@ -516,39 +530,22 @@ checkout_one_file_at (OstreeRepo                        *repo,
   return ret;
 }
 
-/*
- * checkout_tree_at:
- * @self: Repo
- * @mode: Options controlling all files
- * @overwrite_mode: Whether or not to overwrite files
- * @destination_parent_fd: Place tree here
- * @destination_name: Use this name for tree
- * @source: Source tree
- * @source_info: Source info
- * @cancellable: Cancellable
- * @error: Error
- *
- * Like ostree_repo_checkout_tree(), but check out @source into the
- * relative @destination_name, located by @destination_parent_fd.
- */
 static gboolean
-checkout_tree_at (OstreeRepo                        *self,
-                  OstreeRepoCheckoutMode             mode,
-                  OstreeRepoCheckoutOverwriteMode    overwrite_mode,
-                  int                                destination_parent_fd,
-                  const char                        *destination_name,
-                  GFile                             *destination,
-                  OstreeRepoFile                    *source,
-                  GFileInfo                         *source_info,
-                  GCancellable                      *cancellable,
-                  GError                           **error)
+checkout_dir_begin (OstreeRepoCheckoutMode             mode,
+                    OstreeRepoCheckoutOverwriteMode    overwrite_mode,
+                    int                                destination_parent_fd,
+                    const char                        *destination_name,
+                    OstreeRepoFile                    *source,
+                    gboolean                          *out_did_exist,
+                    int                               *out_dfd,
+                    GCancellable                      *cancellable,
+                    GError                           **error)
 {
   gboolean ret = FALSE;
   gboolean did_exist = FALSE;
   int destination_dfd = -1;
   int res;
   gs_unref_variant GVariant *xattrs = NULL;
-  gs_unref_object GFileEnumerator *dir_enum = NULL;
 
   /* Create initially with mode 0700, then chown/chmod only when we're
    * done.  This avoids anyone else being able to operate on partially
@@ -586,6 +583,93 @@ checkout_tree_at (OstreeRepo                        *self,
         }
     }
 
+  ret = TRUE;
+  *out_did_exist = did_exist;
+  *out_dfd = destination_dfd;
+  destination_dfd = -1;
+ out:
+  if (destination_dfd != -1)
+    (void) close (destination_dfd);
+  return ret;
+}
+
+/* We do fchmod/fchown last so that no one else could access the
+ * partially created directory and change content we're laying out.
+ */
+static gboolean
+checkout_dir_finish (OstreeRepoCheckoutMode             mode,
+                     gboolean                           did_exist,
+                     int                                destination_dfd,
+                     GFileInfo                         *source_info,
+                     GError                           **error)
+{
+  int res;
+
+  if (did_exist || mode == OSTREE_REPO_CHECKOUT_MODE_USER)
+    return TRUE;
+
+  do
+    res = fchmod (destination_dfd,
+                  g_file_info_get_attribute_uint32 (source_info, "unix::mode"));
+  while (G_UNLIKELY (res == -1 && errno == EINTR));
+  if (G_UNLIKELY (res == -1))
+    {
+      ot_util_set_error_from_errno (error, errno);
+      return FALSE;
+    }
+
+  do
+    res = fchown (destination_dfd,
+                  g_file_info_get_attribute_uint32 (source_info, "unix::uid"),
+                  g_file_info_get_attribute_uint32 (source_info, "unix::gid"));
+  while (G_UNLIKELY (res == -1 && errno == EINTR));
+  if (G_UNLIKELY (res == -1))
+    {
+      ot_util_set_error_from_errno (error, errno);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/*
+ * checkout_tree_at:
+ * @self: Repo
+ * @mode: Options controlling all files
+ * @overwrite_mode: Whether or not to overwrite files
+ * @destination_parent_fd: Place tree here
+ * @destination_name: Use this name for tree
+ * @source: Source tree
+ * @source_info: Source info
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Like ostree_repo_checkout_tree(), but check out @source into the
+ * relative @destination_name, located by @destination_parent_fd.
+ */
+static gboolean
+checkout_tree_at (OstreeRepo                        *self,
+                  OstreeRepoCheckoutMode             mode,
+                  OstreeRepoCheckoutOverwriteMode    overwrite_mode,
+                  int                                destination_parent_fd,
+                  const char                        *destination_name,
+                  GFile                             *destination,
+                  OstreeRepoFile                    *source,
+                  GFileInfo                         *source_info,
+                  GCancellable                      *cancellable,
+                  GError                           **error)
+{
+  gboolean ret = FALSE;
+  gboolean did_exist = FALSE;
+  int destination_dfd = -1;
+  gs_unref_object GFileEnumerator *dir_enum = NULL;
+
+  if (!checkout_dir_begin (mode, overwrite_mode,
+                           destination_parent_fd, destination_name, source,
+                           &did_exist, &destination_dfd,
+                           cancellable, error))
+    goto out;
+
   dir_enum = g_file_enumerate_children ((GFile*)source,
                                         OSTREE_GIO_FAST_QUERYINFO, 
                                         G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
@@ -627,40 +711,330 @@ checkout_tree_at (OstreeRepo                        *self,
         }
     }
 
-  /* We do fchmod/fchown last so that no one else could access the
-   * partially created directory and change content we're laying out.
-   */
-  if (!did_exist && mode != OSTREE_REPO_CHECKOUT_MODE_USER)
+  if (!checkout_dir_finish (mode, did_exist, destination_dfd, source_info, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  if (destination_dfd != -1)
+    (void) close (destination_dfd);
+  return ret;
+}
+
+/* Large directories are split into jobs of this many files */
+#define CHECKOUT_FILE_BATCH_SIZE 64
+
+/* State for checking out from a worker pool.  Every directory is a
+ * job; its files are checked out by that job, except that for large
+ * directories, batches of files are queued as jobs of their own.  A
+ * directory keeps a count of its unfinished jobs and subdirectories,
+ * and its mode and ownership are only applied once that drops to zero,
+ * just like the serial path does once everything below it is done.
+ *
+ * Directories are addressed by path relative to the root of the
+ * checkout rather than holding a descriptor for each, since an
+ * arbitrary number of them may be in progress at once.
+ */
+typedef struct {
+  OstreeRepo *repo;
+  OstreeRepoCheckoutMode mode;
+  OstreeRepoCheckoutOverwriteMode overwrite_mode;
+  int root_dfd;
+  GThreadPool *pool;
+  GCancellable *cancellable;
+
+  volatile gint failed;
+  GMutex lock;
+  GCond cond;
+  gboolean done;
+  GError *error;
+} CheckoutParallelData;
+
+typedef struct CheckoutDirTask CheckoutDirTask;
+
+struct CheckoutDirTask {
+  CheckoutDirTask *parent;
+  volatile gint pending;
+  char *relpath;
+  GFile *destination;
+  OstreeRepoFile *source;
+  GFileInfo *source_info;
+  gboolean did_exist;
+};
+
+typedef struct {
+  CheckoutDirTask *dir;
+  /* Both NULL for the directory job itself */
+  GPtrArray *files;
+  GPtrArray *infos;
+} CheckoutJob;
+
+static CheckoutDirTask *
+checkout_dir_task_new (CheckoutDirTask   *parent,
+                       const char        *name,
+                       GFile             *destination,
+                       OstreeRepoFile    *source,
+                       GFileInfo         *source_info)
+{
+  CheckoutDirTask *task = g_new0 (CheckoutDirTask, 1);
+
+  task->parent = parent;
+  task->pending = 1;
+  if (parent == NULL)
+    task->relpath = g_strdup (".");
+  else if (strcmp (parent->relpath, ".") == 0)
+    task->relpath = g_strdup (name);
+  else
+    task->relpath = g_build_filename (parent->relpath, name, NULL);
+  task->destination = g_object_ref (destination);
+  task->source = g_object_ref (source);
+  task->source_info = g_object_ref (source_info);
+
+  return task;
+}
+
+static void
+checkout_dir_task_free (CheckoutDirTask *task)
+{
+  g_free (task->relpath);
+  g_object_unref (task->destination);
+  g_object_unref (task->source);
+  g_object_unref (task->source_info);
+  g_free (task);
+}
+
+static void
+checkout_job_free (CheckoutJob *job)
+{
+  if (job->files)
+    g_ptr_array_unref (job->files);
+  if (job->infos)
+    g_ptr_array_unref (job->infos);
+  g_free (job);
+}
+
+static void
+checkout_parallel_take_error (CheckoutParallelData *pdata,
+                              GError               *local_error)
+{
+  g_mutex_lock (&pdata->lock);
+  if (pdata->error == NULL)
+    pdata->error = local_error;
+  else
+    g_error_free (local_error);
+  g_atomic_int_set (&pdata->failed, 1);
+  g_mutex_unlock (&pdata->lock);
+}
+
+static void
+checkout_push_job (CheckoutParallelData *pdata,
+                   CheckoutDirTask      *dir,
+                   GPtrArray            *files,
+                   GPtrArray            *infos)
+{
+  CheckoutJob *job = g_new0 (CheckoutJob, 1);
+
+  job->dir = dir;
+  job->files = files;
+  job->infos = infos;
+  g_thread_pool_push (pdata->pool, job, NULL);
+}
+
+/* Drop one pending reference on @task; the last one finishes the
+ * directory and releases its parent in turn.
+ */
+static void
+checkout_dir_task_release (CheckoutParallelData *pdata,
+                           CheckoutDirTask      *task)
+{
+  CheckoutDirTask *parent;
+
+  if (!g_atomic_int_dec_and_test (&task->pending))
+    return;
+
+  if (!g_atomic_int_get (&pdata->failed))
     {
-      do
-        res = fchmod (destination_dfd,
-                      g_file_info_get_attribute_uint32 (source_info, "unix::mode"));
-      while (G_UNLIKELY (res == -1 && errno == EINTR));
-      if (G_UNLIKELY (res == -1))
+      GError *local_error = NULL;
+      int dfd = -1;
+
+      if (task->parent == NULL)
         {
-          ot_util_set_error_from_errno (error, errno);
-          goto out;
+          if (!checkout_dir_finish (pdata->mode, task->did_exist, pdata->root_dfd,
+                                    task->source_info, &local_error))
+            checkout_parallel_take_error (pdata, local_error);
         }
+      else if (!gs_file_open_dir_fd_at (pdata->root_dfd, task->relpath, &dfd,
+                                        pdata->cancellable, &local_error)
+               || !checkout_dir_finish (pdata->mode, task->did_exist, dfd,
+                                        task->source_info, &local_error))
+        checkout_parallel_take_error (pdata, local_error);
+
+      if (dfd != -1)
+        (void) close (dfd);
+    }
 
-      do
-        res = fchown (destination_dfd,
-                      g_file_info_get_attribute_uint32 (source_info, "unix::uid"),
-                      g_file_info_get_attribute_uint32 (source_info, "unix::gid"));
-      while (G_UNLIKELY (res == -1 && errno == EINTR));
-      if (G_UNLIKELY (res == -1))
+  parent = task->parent;
+  checkout_dir_task_free (task);
+
+  if (parent)
+    checkout_dir_task_release (pdata, parent);
+  else
+    {
+      g_mutex_lock (&pdata->lock);
+      pdata->done = TRUE;
+      g_cond_signal (&pdata->cond);
+      g_mutex_unlock (&pdata->lock);
+    }
+}
+
+static gboolean
+checkout_file_batch_at (CheckoutParallelData  *pdata,
+                        CheckoutDirTask       *dir,
+                        int                    dfd,
+                        GPtrArray             *files,
+                        GPtrArray             *infos,
+                        GError               **error)
+{
+  guint i;
+
+  for (i = 0; i < files->len; i++)
+    {
+      GFileInfo *file_info = infos->pdata[i];
+
+      if (!checkout_one_file_at (pdata->repo, files->pdata[i], file_info,
+                                 dfd, dir->destination,
+                                 g_file_info_get_name (file_info),
+                                 pdata->mode, pdata->overwrite_mode,
+                                 pdata->cancellable, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+checkout_dir_contents (CheckoutParallelData  *pdata,
+                       CheckoutDirTask       *dir,
+                       GError               **error)
+{
+  gboolean ret = FALSE;
+  int dfd = -1;
+  gs_unref_object GFileEnumerator *dir_enum = NULL;
+  gs_unref_ptrarray GPtrArray *files = NULL;
+  gs_unref_ptrarray GPtrArray *infos = NULL;
+
+  if (dir->parent == NULL)
+    dfd = pdata->root_dfd;
+  else if (!checkout_dir_begin (pdata->mode, pdata->overwrite_mode,
+                                pdata->root_dfd, dir->relpath, dir->source,
+                                &dir->did_exist, &dfd,
+                                pdata->cancellable, error))
+    goto out;
+
+  dir_enum = g_file_enumerate_children ((GFile*)dir->source,
+                                        OSTREE_GIO_FAST_QUERYINFO, 
+                                        G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                        pdata->cancellable, 
+                                        error);
+  if (!dir_enum)
+    goto out;
+
+  while (TRUE)
+    {
+      GFileInfo *file_info;
+      GFile *src_child;
+      const char *name;
+
+      if (!gs_file_enumerator_iterate (dir_enum, &file_info, &src_child,
+                                       pdata->cancellable, error))
+        goto out;
+      if (file_info == NULL)
+        break;
+
+      name = g_file_info_get_name (file_info);
+
+      if (g_file_info_get_file_type (file_info) == G_FILE_TYPE_DIRECTORY)
         {
-          ot_util_set_error_from_errno (error, errno);
-          goto out;
+          gs_unref_object GFile *child_destination = g_file_get_child (dir->destination, name);
+          CheckoutDirTask *child = checkout_dir_task_new (dir, name, child_destination,
+                                                          (OstreeRepoFile*)src_child, file_info);
+
+          g_atomic_int_inc (&dir->pending);
+          checkout_push_job (pdata, child, NULL, NULL);
         }
+      else
+        {
+          if (!files)
+            {
+              files = g_ptr_array_new_with_free_func (g_object_unref);
+              infos = g_ptr_array_new_with_free_func (g_object_unref);
+            }
+          g_ptr_array_add (files, g_object_ref (src_child));
+          g_ptr_array_add (infos, g_object_ref (file_info));
+
+          if (files->len == CHECKOUT_FILE_BATCH_SIZE)
+            {
+              g_atomic_int_inc (&dir->pending);
+              checkout_push_job (pdata, dir, files, infos);
+              files = NULL;
+              infos = NULL;
+            }
+        }
+    }
+
+  /* Do the remainder ourself */
+  if (files)
+    {
+      if (!checkout_file_batch_at (pdata, dir, dfd, files, infos, error))
+        goto out;
     }
 
   ret = TRUE;
  out:
-  if (destination_dfd != -1)
-    (void) close (destination_dfd);
+  if (dfd != -1 && dfd != pdata->root_dfd)
+    (void) close (dfd);
   return ret;
 }
 
+static void
+checkout_job_thread (gpointer   data,
+                     gpointer   user_data)
+{
+  CheckoutJob *job = data;
+  CheckoutParallelData *pdata = user_data;
+  CheckoutDirTask *dir = job->dir;
+  GError *local_error = NULL;
+  int dfd = -1;
+
+  /* Once one job failed, don't bother with the rest */
+  if (g_atomic_int_get (&pdata->failed))
+    goto out;
+
+  if (job->files)
+    {
+      if (!gs_file_open_dir_fd_at (pdata->root_dfd, dir->relpath, &dfd,
+                                   pdata->cancellable, &local_error))
+        goto out;
+      if (!checkout_file_batch_at (pdata, dir, dfd, job->files, job->infos,
+                                   &local_error))
+        goto out;
+    }
+  else
+    {
+      if (!checkout_dir_contents (pdata, dir, &local_error))
+        goto out;
+    }
+
+ out:
+  if (dfd != -1)
+    (void) close (dfd);
+  if (local_error)
+    checkout_parallel_take_error (pdata, local_error);
+  checkout_job_free (job);
+  /* May free @dir */
+  checkout_dir_task_release (pdata, dir);
+}
+
 /**
  * ostree_repo_checkout_tree:
  * @self: Repo
@@ -695,6 +1069,99 @@ ostree_repo_checkout_tree (OstreeRepo               *self,
                            cancellable, error);
 }
 
+/**
+ * ostree_repo_checkout_tree_parallel:
+ * @self: Repo
+ * @mode: Options controlling all files
+ * @overwrite_mode: Whether or not to overwrite files
+ * @n_jobs: Number of worker threads, or 0 for one per online processor
+ * @destination: Place tree here
+ * @source: Source tree
+ * @source_info: Source info
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Like ostree_repo_checkout_tree(), but directories (and batches of
+ * files within large directories) are checked out concurrently by a
+ * pool of @n_jobs worker threads.  As with the serial version, the
+ * final mode and ownership of each directory are only applied once
+ * everything below it has been checked out.  If @n_jobs is 1, this
+ * is equivalent to ostree_repo_checkout_tree().
+ */
+gboolean
+ostree_repo_checkout_tree_parallel (OstreeRepo               *self,
+                                    OstreeRepoCheckoutMode    mode,
+                                    OstreeRepoCheckoutOverwriteMode    overwrite_mode,
+                                    guint                     n_jobs,
+                                    GFile                    *destination,
+                                    OstreeRepoFile           *source,
+                                    GFileInfo                *source_info,
+                                    GCancellable             *cancellable,
+                                    GError                  **error)
+{
+  gboolean ret = FALSE;
+  CheckoutParallelData pdata = { 0, };
+  CheckoutDirTask *root;
+
+  if (n_jobs == 1)
+    return ostree_repo_checkout_tree (self, mode, overwrite_mode, destination,
+                                      source, source_info, cancellable, error);
+
+  pdata.repo = self;
+  pdata.mode = mode;
+  pdata.overwrite_mode = overwrite_mode;
+  pdata.cancellable = cancellable;
+  pdata.root_dfd = -1;
+  g_mutex_init (&pdata.lock);
+  g_cond_init (&pdata.cond);
+
+  root = checkout_dir_task_new (NULL, NULL, destination, source, source_info);
+
+  if (!checkout_dir_begin (mode, overwrite_mode,
+                           AT_FDCWD, gs_file_get_path_cached (destination), source,
+                           &root->did_exist, &pdata.root_dfd,
+                           cancellable, error))
+    {
+      checkout_dir_task_free (root);
+      goto out;
+    }
+
+  if (n_jobs == 0)
+    pdata.pool = ot_thread_pool_new_nproc (checkout_job_thread, &pdata);
+  else
+    {
+      GError *local_error = NULL;
+      pdata.pool = g_thread_pool_new (checkout_job_thread, &pdata,
+                                      (int)n_jobs, FALSE, &local_error);
+      g_assert_no_error (local_error);
+    }
+
+  checkout_push_job (&pdata, root, NULL, NULL);
+
+  g_mutex_lock (&pdata.lock);
+  while (!pdata.done)
+    g_cond_wait (&pdata.cond, &pdata.lock);
+  g_mutex_unlock (&pdata.lock);
+
+  /* Wait for the workers to return */
+  g_thread_pool_free (pdata.pool, FALSE, TRUE);
+
+  if (pdata.error)
+    {
+      g_propagate_error (error, pdata.error);
+      pdata.error = NULL;
+      goto out;
+    }
+
+  ret = TRUE;
+ out:
+  if (pdata.root_dfd != -1)
+    (void) close (pdata.root_dfd);
+  g_mutex_clear (&pdata.lock);
+  g_cond_clear (&pdata.cond);
+  return ret;
+}
+
 /**
  * ostree_repo_checkout_gc:
  * @self: Repo
@@ -22,8 +22,10 @@
 
 #include "config.h"
 
+#include <sys/file.h>
 #include <glib-unix.h>
 #include <gio/gfiledescriptorbased.h>
+#include <gio/gunixoutputstream.h>
 #include "otutil.h"
 #include "libgsystem.h"
 
@@ -59,6 +61,7 @@ _ostree_repo_ensure_loose_objdir_at (int             dfd,
 
 static gboolean
 commit_loose_object_trusted (OstreeRepo        *self,
+                             const char        *checksum,
                              OstreeObjectType   objtype,
                              const char        *loose_path,
                              GFile             *temp_file,
@@ -154,8 +157,11 @@ commit_loose_object_trusted (OstreeRepo        *self,
 
       /* Ensure that in case of a power cut, these files have the data we
        * want.   See http://lwn.net/Articles/322823/
+       *
+       * With batch fsync, this is instead done for the whole transaction
+       * by ostree_repo_commit_transaction().
        */
-      if (!self->disable_fsync)
+      if (!self->disable_fsync && !self->batch_fsync)
         {
           if (fsync (fd) == -1)
             {
@@ -184,6 +190,22 @@ commit_loose_object_trusted (OstreeRepo        *self,
       else
         (void) unlinkat (self->tmp_dir_fd, temp_filename, 0);
     }
+  else if (self->devino_cache
+           && objtype == OSTREE_OBJECT_TYPE_FILE
+           && self->mode == OSTREE_REPO_MODE_BARE)
+    {
+      struct stat stbuf;
+
+      if (fstatat (self->objects_dir_fd, loose_path, &stbuf, AT_SYMLINK_NOFOLLOW) != 0)
+        {
+          ot_util_set_error_from_errno (error, errno);
+          goto out;
+        }
+
+      if (!_ostree_repo_devino_cache_insert (self, checksum, stbuf.st_dev, stbuf.st_ino,
+                                             cancellable, error))
+        goto out;
+    }
 
   ret = TRUE;
  out:
@@ -221,6 +243,10 @@ repo_store_size_entry (OstreeRepo       *self,
                        gsize             unpacked,
                        gsize             archived)
 {
+  /* Content may be written from multiple threads; see
+   * ostree_repo_commit_modifier_set_n_jobs().
+   */
+  g_mutex_lock (&self->txn_stats_lock);
   if (G_UNLIKELY (self->object_sizes == NULL))
     self->object_sizes = g_hash_table_new_full (g_str_hash, g_str_equal,
                                                 g_free, content_size_cache_entry_free);
@@ -228,6 +254,7 @@ repo_store_size_entry (OstreeRepo       *self,
   g_hash_table_replace (self->object_sizes,
                         g_strdup (checksum),
                         content_size_cache_entry_new (unpacked, archived));
+  g_mutex_unlock (&self->txn_stats_lock);
 }
 
 static int
@@ -313,6 +340,35 @@ add_size_index_to_metadata (OstreeRepo        *self,
   return ret;
 }
 
+/* Like _ostree_repo_has_loose_object(), but look in the packs first;
+ * a packed object is not written loose again.
+ */
+static gboolean
+has_stored_object (OstreeRepo           *self,
+                   const char           *checksum,
+                   OstreeObjectType      objtype,
+                   gboolean             *out_is_stored,
+                   char                 *loose_path_buf,
+                   GCancellable         *cancellable,
+                   GError              **error)
+{
+  gs_unref_bytes GBytes *packed_data = NULL;
+
+  if (!_ostree_repo_find_packed_object (self, objtype, checksum, &packed_data,
+                                        cancellable, error))
+    return FALSE;
+
+  if (packed_data)
+    {
+      _ostree_loose_path (loose_path_buf, checksum, objtype, self->mode);
+      *out_is_stored = TRUE;
+      return TRUE;
+    }
+
+  return _ostree_repo_has_loose_object (self, checksum, objtype, out_is_stored,
+                                        loose_path_buf, cancellable, error);
+}
+
 static gboolean
 write_object (OstreeRepo         *self,
               OstreeObjectType    objtype,
@@ -353,9 +409,9 @@ write_object (OstreeRepo         *self,
 
   if (expected_checksum)
     {
-      if (!_ostree_repo_has_loose_object (self, expected_checksum, objtype,
-                                          &have_obj, loose_objpath,
-                                          cancellable, error))
+      if (!has_stored_object (self, expected_checksum, objtype,
+                              &have_obj, loose_objpath,
+                              cancellable, error))
         goto out;
       if (have_obj)
         {
@@ -501,16 +557,16 @@ write_object (OstreeRepo         *self,
       repo_store_size_entry (self, actual_checksum, unpacked_size, archived_size);
     }
 
-  if (!_ostree_repo_has_loose_object (self, actual_checksum, objtype,
-                                      &have_obj, loose_objpath,
-                                      cancellable, error))
+  if (!has_stored_object (self, actual_checksum, objtype,
+                          &have_obj, loose_objpath,
+                          cancellable, error))
     goto out;
           
   do_commit = !have_obj;
 
   if (do_commit)
     {
-      if (!commit_loose_object_trusted (self, objtype, loose_objpath,
+      if (!commit_loose_object_trusted (self, actual_checksum, objtype, loose_objpath,
                                         temp_file, temp_filename,
                                         is_symlink, file_info,
                                         xattrs, temp_out,
@@ -552,135 +608,177 @@ write_object (OstreeRepo         *self,
   return ret;
 }
 
-typedef struct {
-  dev_t dev;
-  ino_t ino;
-} OstreeDevIno;
-
-static guint
-devino_hash (gconstpointer a)
+/*
+ * _ostree_repo_write_archived_content:
+ * @self: An archive-z2 repository
+ * @expected_checksum: Checksum of the content object
+ * @archived_path: Content object in archive-z2 format
+ * @out_csum: (out): Binary checksum
+ *
+ * Store @archived_path, a content object as found in another
+ * archive-z2 repository.  The content is decompressed to validate it
+ * against @expected_checksum, but the compressed data is then stored
+ * as is, rather than being compressed again as write_object() does.
+ *
+ * If @archived_path is a file in the repository's tmp directory, such
+ * as a download from a pull, it is moved into place instead of being
+ * copied, so the object is written to disk only once.
+ */
+gboolean
+_ostree_repo_write_archived_content (OstreeRepo        *self,
+                                     const char        *expected_checksum,
+                                     GFile             *archived_path,
+                                     guchar           **out_csum,
+                                     GCancellable      *cancellable,
+                                     GError           **error)
 {
-  OstreeDevIno *a_i = (gpointer)a;
-  return (guint) (a_i->dev + a_i->ino);
-}
+  gboolean ret = FALSE;
+  gboolean have_obj;
+  gboolean do_commit;
+  char loose_objpath[_OSTREE_LOOSE_PATH_MAX];
+  gssize archived_size = 0;
+  gs_free char *actual_checksum = NULL;
+  gs_free char *temp_filename = NULL;
+  gs_free guchar *ret_csum = NULL;
+  gs_unref_object GFile *temp_file = NULL;
+  gs_unref_object GInputStream *file_input = NULL;
+  gs_unref_object GInputStream *archived_input = NULL;
+  gs_unref_object GFileInfo *file_info = NULL;
+  gs_unref_variant GVariant *xattrs = NULL;
+  gs_unref_object GOutputStream *temp_out = NULL;
 
-static int
-devino_equal (gconstpointer   a,
-              gconstpointer   b)
-{
-  OstreeDevIno *a_i = (gpointer)a;
-  OstreeDevIno *b_i = (gpointer)b;
-  return a_i->dev == b_i->dev
-    && a_i->ino == b_i->ino;
-}
+  g_return_val_if_fail (self->in_transaction, FALSE);
+  g_return_val_if_fail (self->mode == OSTREE_REPO_MODE_ARCHIVE_Z2, FALSE);
 
-static gboolean
-scan_loose_devino (OstreeRepo                     *self,
-                   GHashTable                     *devino_cache,
-                   GCancellable                   *cancellable,
-                   GError                        **error)
-{
-  gboolean ret = FALSE;
-  guint i;
-  OstreeRepoMode repo_mode;
-  gs_unref_ptrarray GPtrArray *object_dirs = NULL;
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    return FALSE;
 
-  if (self->parent_repo)
+  if (!ostree_repo_has_object (self, OSTREE_OBJECT_TYPE_FILE, expected_checksum,
+                               &have_obj, cancellable, error))
+    goto out;
+  if (have_obj)
     {
-      if (!scan_loose_devino (self->parent_repo, devino_cache, cancellable, error))
-        goto out;
+      ret_csum = ostree_checksum_to_bytes (expected_checksum);
+      ret = TRUE;
+      ot_transfer_out_value (out_csum, &ret_csum);
+      goto out;
     }
 
-  repo_mode = ostree_repo_get_mode (self);
+  if (!ostree_content_file_parse (TRUE, archived_path, FALSE,
+                                  &file_input, &file_info, &xattrs,
+                                  cancellable, error))
+    goto out;
+
+  if (!(g_file_info_get_file_type (file_info) == G_FILE_TYPE_REGULAR ||
+        g_file_info_get_file_type (file_info) == G_FILE_TYPE_SYMBOLIC_LINK))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Unsupported file type %u", g_file_info_get_file_type (file_info));
+      goto out;
+    }
 
-  if (!_ostree_repo_get_loose_object_dirs (self, &object_dirs, cancellable, error))
+  if (!ostree_checksum_file_from_input (file_info, xattrs, file_input,
+                                        OSTREE_OBJECT_TYPE_FILE, &ret_csum,
+                                        cancellable, error))
     goto out;
 
-  for (i = 0; i < object_dirs->len; i++)
+  actual_checksum = ostree_checksum_from_bytes (ret_csum);
+  if (strcmp (actual_checksum, expected_checksum) != 0)
     {
-      GFile *objdir = object_dirs->pdata[i];
-      gs_unref_object GFileEnumerator *enumerator = NULL;
-      gs_unref_object GFileInfo *file_info = NULL;
-      const char *dirname;
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Corrupted %s object %s (actual checksum is %s)",
+                   ostree_object_type_to_string (OSTREE_OBJECT_TYPE_FILE),
+                   expected_checksum, actual_checksum);
+      goto out;
+    }
 
-      enumerator = g_file_enumerate_children (objdir, OSTREE_GIO_FAST_QUERYINFO,
-                                              G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
-                                              cancellable,
-                                              error);
-      if (!enumerator)
-        goto out;
+  if (!has_stored_object (self, actual_checksum, OSTREE_OBJECT_TYPE_FILE,
+                          &have_obj, loose_objpath,
+                          cancellable, error))
+    goto out;
 
-      dirname = gs_file_get_basename_cached (objdir);
+  do_commit = !have_obj;
 
-      while (TRUE)
+  if (do_commit && g_file_has_parent (archived_path, self->tmp_dir))
+    {
+      int fd;
+      struct stat stbuf;
+
+      temp_filename = g_file_get_basename (archived_path);
+      temp_file = g_object_ref (archived_path);
+
+      fd = openat (self->tmp_dir_fd, temp_filename, O_RDWR | O_NOFOLLOW | O_CLOEXEC);
+      if (fd == -1)
         {
-          const char *name;
-          const char *dot;
-          guint32 type;
-          OstreeDevIno *key;
-          GString *checksum;
-          gboolean skip;
-
-          if (!gs_file_enumerator_iterate (enumerator, &file_info, NULL,
-                                           NULL, error))
-            goto out;
-          if (file_info == NULL)
-            break;
+          ot_util_set_error_from_errno (error, errno);
+          goto out;
+        }
+      temp_out = g_unix_output_stream_new (fd, TRUE);
 
-          name = g_file_info_get_attribute_byte_string (file_info, "standard::name");
-          type = g_file_info_get_attribute_uint32 (file_info, "standard::type");
+      if (fstat (fd, &stbuf) != 0 || fchmod (fd, 0644) != 0)
+        {
+          ot_util_set_error_from_errno (error, errno);
+          goto out;
+        }
+      archived_size = stbuf.st_size;
+    }
+  else if (do_commit)
+    {
+      archived_input = (GInputStream*)gs_file_read_noatime (archived_path, cancellable, error);
+      if (!archived_input)
+        goto out;
 
-          if (type == G_FILE_TYPE_DIRECTORY)
-            continue;
+      if (!gs_file_open_in_tmpdir_at (self->tmp_dir_fd, 0644,
+                                      &temp_filename, &temp_out,
+                                      cancellable, error))
+        goto out;
+      temp_file = g_file_get_child (self->tmp_dir, temp_filename);
 
-          switch (repo_mode)
-            {
-            case OSTREE_REPO_MODE_ARCHIVE_Z2:
-            case OSTREE_REPO_MODE_BARE:
-              skip = !g_str_has_suffix (name, ".file");
-              break;
-            default:
-              g_assert_not_reached ();
-            }
-          if (skip)
-            continue;
+      archived_size = g_output_stream_splice (temp_out, archived_input, 0,
+                                              cancellable, error);
+      if (archived_size < 0)
+        goto out;
 
-          dot = strrchr (name, '.');
-          g_assert (dot);
+      if (!g_output_stream_flush (temp_out, cancellable, error))
+        goto out;
+    }
 
-          if ((dot - name) != 62)
-            continue;
+  if (do_commit)
+    {
+      if (self->generate_sizes)
+        {
+          gsize unpacked_size = 0;
+          if (g_file_info_get_file_type (file_info) == G_FILE_TYPE_REGULAR)
+            unpacked_size = g_file_info_get_size (file_info);
+          repo_store_size_entry (self, actual_checksum, unpacked_size, archived_size);
+        }
 
-          checksum = g_string_new (dirname);
-          g_string_append_len (checksum, name, 62);
+      if (!commit_loose_object_trusted (self, actual_checksum, OSTREE_OBJECT_TYPE_FILE,
+                                        loose_objpath, temp_file, temp_filename,
+                                        FALSE, file_info, xattrs, temp_out,
+                                        cancellable, error))
+        goto out;
 
-          key = g_new (OstreeDevIno, 1);
-          key->dev = g_file_info_get_attribute_uint32 (file_info, "unix::device");
-          key->ino = g_file_info_get_attribute_uint64 (file_info, "unix::inode");
+      g_clear_pointer (&temp_filename, g_free);
+    }
 
-          g_hash_table_replace (devino_cache, key, g_string_free (checksum, FALSE));
-        }
+  g_mutex_lock (&self->txn_stats_lock);
+  if (do_commit)
+    {
+      self->txn_stats.content_objects_written++;
+      self->txn_stats.content_bytes_written += archived_size;
     }
+  self->txn_stats.content_objects_total++;
+  g_mutex_unlock (&self->txn_stats_lock);
 
   ret = TRUE;
+  ot_transfer_out_value (out_csum, &ret_csum);
  out:
+  if (temp_filename)
+    (void) unlinkat (self->tmp_dir_fd, temp_filename, 0);
   return ret;
 }
 
-static const char *
-devino_cache_lookup (OstreeRepo           *self,
-                     GFileInfo            *finfo)
-{
-  OstreeDevIno dev_ino;
-
-  if (!self->loose_object_devino_hash)
-    return NULL;
-
-  dev_ino.dev = g_file_info_get_attribute_uint32 (finfo, "unix::device");
-  dev_ino.ino = g_file_info_get_attribute_uint64 (finfo, "unix::inode");
-  return g_hash_table_lookup (self->loose_object_devino_hash, &dev_ino);
-}
-
 /**
  * ostree_repo_scan_hardlinks:
  * @self: An #OstreeRepo
@@ -693,10 +791,12 @@ devino_cache_lookup (OstreeRepo           *self,
  * ostree's existing repo, ostree can build a mapping of device numbers and
  * inodes to their checksum.
  *
- * There is an upfront cost to creating this mapping, as this will scan the
- * entire objects directory. If your commit is composed of mostly hardlinks to
- * existing ostree objects, then this will speed up considerably, so call it
- * before you call ostree_write_directory_to_mtree() or similar.
+ * The mapping is stored persistently in the repository and kept up
+ * to date as objects are written, so only the first call has the
+ * upfront cost of scanning the entire objects directory. If your commit
+ * is composed of mostly hardlinks to existing ostree objects, then this
+ * will speed up considerably, so call it before you call
+ * ostree_write_directory_to_mtree() or similar.
  */
 gboolean
 ostree_repo_scan_hardlinks (OstreeRepo    *self,
@@ -707,17 +807,442 @@ ostree_repo_scan_hardlinks (OstreeRepo    *self,
 
   g_return_val_if_fail (self->in_transaction == TRUE, FALSE);
 
-  if (!self->loose_object_devino_hash)
-    self->loose_object_devino_hash = g_hash_table_new_full (devino_hash, devino_equal, g_free, g_free);
-  g_hash_table_remove_all (self->loose_object_devino_hash);
-  if (!scan_loose_devino (self, self->loose_object_devino_hash, cancellable, error))
+  if (!_ostree_repo_devino_cache_ensure (self, TRUE, cancellable, error))
+    goto out;
+
+  self->use_devino_cache = TRUE;
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+#define UNSYNCED_TRANSACTION_MARKER_PREFIX "transaction-unsynced"
+
+/*
+ * With batch fsync, a crash before a transaction is committed may
+ * leave loose objects with incomplete contents.  To be able to detect
+ * this, each writer syncs a marker file to disk before any object is
+ * written, and removes it once the objects have been synced.  The
+ * writer holds an exclusive flock() on its marker for as long as it
+ * exists, so a marker we can lock belongs to a writer that died.  In
+ * that case, every loose object changed since the marker was created
+ * is verified, and deleted if its contents do not match its checksum;
+ * nothing can refer to them yet, since the refs are only updated
+ * after the sync.
+ */
+
+/* Verify the loose object @name in @dfd.  *out_valid is only set to
+ * %FALSE once the contents have been read in full and do not hash to
+ * @checksum; failing to read them is an error.
+ */
+static gboolean
+verify_loose_object (OstreeRepo        *self,
+                     int                dfd,
+                     const char        *name,
+                     const char        *checksum,
+                     OstreeObjectType   objtype,
+                     gboolean          *out_valid,
+                     GCancellable      *cancellable,
+                     GError           **error)
+{
+  gboolean ret = FALSE;
+  int fd = -1;
+  GMappedFile *mfile = NULL;
+  gs_free char *actual_checksum = NULL;
+
+  if (objtype == OSTREE_OBJECT_TYPE_FILE && self->mode == OSTREE_REPO_MODE_BARE)
+    {
+      gs_unref_object GInputStream *input = NULL;
+      gs_unref_object GFileInfo *file_info = NULL;
+      gs_unref_variant GVariant *xattrs = NULL;
+      gs_free guchar *csum = NULL;
+
+      /* Bare objects are stored as is, so there is nothing to decode;
+       * any failure here comes from reading them.
+       */
+      if (!ostree_repo_load_file (self, checksum, &input, &file_info, &xattrs,
+                                  cancellable, error))
+        goto out;
+      if (!ostree_checksum_file_from_input (file_info, xattrs, input,
+                                            OSTREE_OBJECT_TYPE_FILE, &csum,
+                                            cancellable, error))
+        goto out;
+      actual_checksum = ostree_checksum_from_bytes (csum);
+    }
+  else
+    {
+      if (!gs_file_openat_noatime (dfd, name, &fd, cancellable, error))
+        goto out;
+      mfile = g_mapped_file_new_from_fd (fd, FALSE, error);
+      if (!mfile)
+        goto out;
+
+      if (OSTREE_OBJECT_TYPE_IS_META (objtype))
+        actual_checksum = g_compute_checksum_for_data (G_CHECKSUM_SHA256,
+                                                       (guint8*)g_mapped_file_get_contents (mfile),
+                                                       g_mapped_file_get_length (mfile));
+      else
+        {
+          GError *temp_error = NULL;
+          gs_unref_bytes GBytes *bytes = g_mapped_file_get_bytes (mfile);
+          gs_unref_object GInputStream *mem_input = g_memory_input_stream_new_from_bytes (bytes);
+          gs_unref_object GInputStream *input = NULL;
+          gs_unref_object GFileInfo *file_info = NULL;
+          gs_unref_variant GVariant *xattrs = NULL;
+          gs_free guchar *csum = NULL;
+
+          /* The whole object is in memory at this point, so failing to
+           * decode it means that it is truncated or corrupt, and it
+           * cannot hash to its checksum.
+           */
+          if (ostree_content_stream_parse (TRUE, mem_input, g_bytes_get_size (bytes), FALSE,
+                                           &input, &file_info, &xattrs,
+                                           cancellable, &temp_error)
+              && ostree_checksum_file_from_input (file_info, xattrs, input,
+                                                  OSTREE_OBJECT_TYPE_FILE, &csum,
+                                                  cancellable, &temp_error))
+            actual_checksum = ostree_checksum_from_bytes (csum);
+          else if (g_error_matches (temp_error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+            {
+              g_propagate_error (error, temp_error);
+              goto out;
+            }
+          else
+            {
+              g_debug ("Decoding %s.filez: %s", checksum, temp_error->message);
+              g_clear_error (&temp_error);
+            }
+        }
+    }
+
+  ret = TRUE;
+  *out_valid = actual_checksum != NULL && strcmp (actual_checksum, checksum) == 0;
+ out:
+  if (mfile)
+    g_mapped_file_unref (mfile);
+  if (fd != -1)
+    (void) close (fd);
+  return ret;
+}
+
+static gboolean
+recover_unsynced_objects_at (OstreeRepo        *self,
+                             const char        *prefix,
+                             int                dfd,
+                             struct timespec   *since,
+                             GCancellable      *cancellable,
+                             GError           **error)
+{
+  gboolean ret = FALSE;
+  DIR *d = NULL;
+  struct dirent *dent;
+
+  d = fdopendir (dfd);
+  if (!d)
+    {
+      (void) close (dfd);
+      ot_util_set_error_from_errno (error, errno);
+      goto out;
+    }
+
+  while ((dent = readdir (d)) != NULL)
+    {
+      const char *name = dent->d_name;
+      const char *dot;
+      OstreeObjectType objtype;
+      char checksum[65];
+      struct stat stbuf;
+      gboolean valid;
+
+      dot = strrchr (name, '.');
+      if (!dot || (dot - name) != 62)
+        continue;
+
+      if ((self->mode == OSTREE_REPO_MODE_ARCHIVE_Z2 && strcmp (dot, ".filez") == 0) ||
+          (self->mode == OSTREE_REPO_MODE_BARE && strcmp (dot, ".file") == 0))
+        objtype = OSTREE_OBJECT_TYPE_FILE;
+      else if (strcmp (dot, ".dirtree") == 0)
+        objtype = OSTREE_OBJECT_TYPE_DIR_TREE;
+      else if (strcmp (dot, ".dirmeta") == 0)
+        objtype = OSTREE_OBJECT_TYPE_DIR_META;
+      else if (strcmp (dot, ".commit") == 0)
+        objtype = OSTREE_OBJECT_TYPE_COMMIT;
+      else
+        continue;
+
+      if (fstatat (dirfd (d), name, &stbuf, AT_SYMLINK_NOFOLLOW) != 0)
+        {
+          if (errno == ENOENT)
+            continue;
+          ot_util_set_error_from_errno (error, errno);
+          goto out;
+        }
+
+      /* Bare objects have their mtime reset, but the ctime is always
+       * updated when the object is put in place.  It also changes when
+       * e.g. a checkout hardlinks the object; such objects are simply
+       * verified and kept.
+       */
+      if (stbuf.st_ctim.tv_sec < since->tv_sec ||
+          (stbuf.st_ctim.tv_sec == since->tv_sec &&
+           stbuf.st_ctim.tv_nsec < since->tv_nsec))
+        continue;
+
+      memcpy (checksum, prefix, 2);
+      memcpy (checksum + 2, name, 62);
+      checksum[64] = '\0';
+
+      if (!verify_loose_object (self, dirfd (d), name, checksum, objtype, &valid,
+                                cancellable, error))
+        goto out;
+
+      if (!valid)
+        {
+          g_debug ("Deleting incomplete object %s.%s from interrupted transaction",
+                   checksum, ostree_object_type_to_string (objtype));
+          if (unlinkat (dirfd (d), name, 0) != 0 && errno != ENOENT)
+            {
+              ot_util_set_error_from_errno (error, errno);
+              goto out;
+            }
+        }
+    }
+
+  ret = TRUE;
+ out:
+  if (d)
+    (void) closedir (d);
+  return ret;
+}
+
+static gboolean
+recover_unsynced_transaction (OstreeRepo        *self,
+                              GCancellable      *cancellable,
+                              GError           **error)
+{
+  gboolean ret = FALSE;
+  guint c;
+  int repo_dfd = -1;
+  int dir_fd;
+  DIR *d = NULL;
+  struct dirent *dent;
+  struct timespec since = { 0, };
+  static const gchar hexchars[] = "0123456789abcdef";
+  GArray *dead_marker_fds = g_array_new (FALSE, FALSE, sizeof (int));
+  gs_unref_ptrarray GPtrArray *dead_markers = g_ptr_array_new_with_free_func (g_free);
+
+  if (!gs_file_open_dir_fd (self->repodir, &repo_dfd, cancellable, error))
+    goto out;
+
+  dir_fd = dup (repo_dfd);
+  if (dir_fd == -1)
+    {
+      ot_util_set_error_from_errno (error, errno);
+      goto out;
+    }
+  d = fdopendir (dir_fd);
+  if (!d)
+    {
+      int errsv = errno;
+      (void) close (dir_fd);
+      ot_util_set_error_from_errno (error, errsv);
+      goto out;
+    }
+
+  /* Lock every marker we find; the ones still locked by their
+   * writer are in use, and must be left alone.
+   */
+  while ((dent = readdir (d)) != NULL)
+    {
+      int fd;
+      struct stat stbuf;
+
+      if (!g_str_has_prefix (dent->d_name, UNSYNCED_TRANSACTION_MARKER_PREFIX))
+        continue;
+
+      fd = openat (repo_dfd, dent->d_name, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+      if (fd == -1)
+        {
+          if (errno == ENOENT)
+            continue;
+          ot_util_set_error_from_errno (error, errno);
+          goto out;
+        }
+
+      if (flock (fd, LOCK_EX | LOCK_NB) != 0)
+        {
+          int errsv = errno;
+          (void) close (fd);
+          if (errsv == EWOULDBLOCK)
+            continue;
+          ot_util_set_error_from_errno (error, errsv);
+          goto out;
+        }
+      g_array_append_val (dead_marker_fds, fd);
+      g_ptr_array_add (dead_markers, g_strdup (dent->d_name));
+
+      if (fstat (fd, &stbuf) != 0)
+        {
+          ot_util_set_error_from_errno (error, errno);
+          goto out;
+        }
+      if (dead_markers->len == 1 ||
+          stbuf.st_ctim.tv_sec < since.tv_sec ||
+          (stbuf.st_ctim.tv_sec == since.tv_sec &&
+           stbuf.st_ctim.tv_nsec < since.tv_nsec))
+        since = stbuf.st_ctim;
+    }
+
+  if (dead_markers->len == 0)
+    {
+      ret = TRUE;
+      goto out;
+    }
+
+  for (c = 0; c < 256; c++)
+    {
+      char buf[3];
+      int dfd;
+
+      buf[0] = hexchars[c >> 4];
+      buf[1] = hexchars[c & 0xF];
+      buf[2] = '\0';
+      dfd = openat (self->objects_dir_fd, buf, O_RDONLY | O_NONBLOCK | O_DIRECTORY | O_CLOEXEC);
+      if (dfd == -1)
+        {
+          if (errno == ENOENT)
+            continue;
+          ot_util_set_error_from_errno (error, errno);
+          goto out;
+        }
+      /* Takes ownership of dfd */
+      if (!recover_unsynced_objects_at (self, buf, dfd, &since,
+                                        cancellable, error))
+        goto out;
+    }
+
+  if (syncfs (self->objects_dir_fd) != 0)
+    {
+      ot_util_set_error_from_errno (error, errno);
+      goto out;
+    }
+
+  for (c = 0; c < dead_markers->len; c++)
+    {
+      const char *name = dead_markers->pdata[c];
+
+      if (unlinkat (repo_dfd, name, 0) != 0 && errno != ENOENT)
+        {
+          ot_util_set_error_from_errno (error, errno);
+          goto out;
+        }
+    }
+
+  ret = TRUE;
+ out:
+  for (c = 0; c < dead_marker_fds->len; c++)
+    (void) close (g_array_index (dead_marker_fds, int, c));
+  g_array_unref (dead_marker_fds);
+  if (d)
+    (void) closedir (d);
+  if (repo_dfd != -1)
+    (void) close (repo_dfd);
+  return ret;
+}
+
+static gboolean
+write_unsynced_transaction_marker (OstreeRepo        *self,
+                                   GCancellable      *cancellable,
+                                   GError           **error)
+{
+  gboolean ret = FALSE;
+  int fd = -1;
+  int dfd = -1;
+  gs_free char *name = gs_fileutil_gen_tmp_name (UNSYNCED_TRANSACTION_MARKER_PREFIX "-", NULL);
+
+  /* The marker is locked before it becomes visible in the repo, so
+   * that nobody can mistake it for a stale one.
+   */
+  do
+    fd = openat (self->tmp_dir_fd, name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+  while (G_UNLIKELY (fd == -1 && errno == EINTR));
+  if (fd == -1)
+    {
+      ot_util_set_error_from_errno (error, errno);
+      goto out;
+    }
+
+  if (flock (fd, LOCK_EX) != 0)
+    {
+      ot_util_set_error_from_errno (error, errno);
+      goto out;
+    }
+
+  /* The marker must be on disk before any object is */
+  if (fsync (fd) != 0)
+    {
+      ot_util_set_error_from_errno (error, errno);
+      goto out;
+    }
+
+  if (!gs_file_open_dir_fd (self->repodir, &dfd, cancellable, error))
     goto out;
+  if (renameat (self->tmp_dir_fd, name, dfd, name) != 0)
+    {
+      ot_util_set_error_from_errno (error, errno);
+      (void) unlinkat (self->tmp_dir_fd, name, 0);
+      goto out;
+    }
+  if (fsync (dfd) != 0)
+    {
+      ot_util_set_error_from_errno (error, errno);
+      (void) unlinkat (dfd, name, 0);
+      goto out;
+    }
+
+  /* Keep the lock until the objects are synced */
+  self->txn_marker_fd = fd;
+  fd = -1;
+  self->txn_marker_name = name;
+  name = NULL;
 
   ret = TRUE;
  out:
+  if (fd != -1)
+    (void) close (fd);
+  if (dfd != -1)
+    (void) close (dfd);
   return ret;
 }
 
+/* Sync all objects written by this transaction, then drop the marker */
+static gboolean
+sync_transaction_objects (OstreeRepo        *self,
+                          GCancellable      *cancellable,
+                          GError           **error)
+{
+  gs_unref_object GFile *marker = NULL;
+
+  if (self->txn_marker_fd == -1)
+    return TRUE;
+
+  if (syncfs (self->objects_dir_fd) != 0)
+    {
+      ot_util_set_error_from_errno (error, errno);
+      return FALSE;
+    }
+
+  marker = g_file_get_child (self->repodir, self->txn_marker_name);
+  if (!ot_gfile_ensure_unlinked (marker, cancellable, error))
+    return FALSE;
+
+  (void) close (self->txn_marker_fd);
+  self->txn_marker_fd = -1;
+  g_clear_pointer (&self->txn_marker_name, g_free);
+  return TRUE;
+}
+
 /**
  * ostree_repo_prepare_transaction:
  * @self: An #OstreeRepo
@@ -756,6 +1281,19 @@ ostree_repo_prepare_transaction (OstreeRepo     *self,
 
   memset (&self->txn_stats, 0, sizeof (OstreeRepoTransactionStats));
 
+  /* Keep the devino cache up to date if it exists */
+  if (!_ostree_repo_devino_cache_ensure (self, FALSE, cancellable, error))
+    goto out;
+
+  if (!recover_unsynced_transaction (self, cancellable, error))
+    goto out;
+
+  if (self->batch_fsync && !self->disable_fsync)
+    {
+      if (!write_unsynced_transaction_marker (self, cancellable, error))
+        goto out;
+    }
+
   self->in_transaction = TRUE;
   if (ret_transaction_resume)
     {
@@ -919,8 +1457,13 @@ ostree_repo_commit_transaction (OstreeRepo                  *self,
   if (!cleanup_tmpdir (self, cancellable, error))
     goto out;
 
-  if (self->loose_object_devino_hash)
-    g_hash_table_remove_all (self->loose_object_devino_hash);
+  self->use_devino_cache = FALSE;
+
+  /* With batch fsync, this is the point where the objects become
+   * durable; it must happen before any ref can point to them.
+   */
+  if (!sync_transaction_objects (self, cancellable, error))
+    goto out;
 
   if (self->txn_refs)
     if (!_ostree_repo_update_refs (self, self->txn_refs, cancellable, error))
@@ -953,8 +1496,11 @@ ostree_repo_abort_transaction (OstreeRepo     *self,
   if (!cleanup_tmpdir (self, cancellable, error))
     goto out;
 
-  if (self->loose_object_devino_hash)
-    g_hash_table_remove_all (self->loose_object_devino_hash);
+  self->use_devino_cache = FALSE;
+
+  /* The objects are still valid, so avoid having to verify them later */
+  if (!sync_transaction_objects (self, cancellable, error))
+    goto out;
 
   g_clear_pointer (&self->txn_refs, g_hash_table_destroy);
 
@@ -1189,7 +1735,7 @@ _ostree_repo_get_object_path (OstreeRepo       *self,
 
   compressed = (type == OSTREE_OBJECT_TYPE_FILE
                 && ostree_repo_get_mode (self) == OSTREE_REPO_MODE_ARCHIVE_Z2);
-  relpath = _ostree_get_relative_object_path (checksum, type, compressed);
+  relpath = ostree_get_relative_object_path (checksum, type, compressed);
   ret = g_file_resolve_relative_path (self->repodir, relpath);
   g_free (relpath);
 
@@ -1256,6 +1802,7 @@ typedef struct {
   OstreeRepo *repo;
   char *expected_checksum;
   GInputStream *object;
+  GFile *archived_path;
   guint64 file_object_length;
   GCancellable *cancellable;
   GSimpleAsyncResult *result;
@@ -1271,6 +1818,7 @@ write_content_async_data_free (gpointer user_data)
   g_clear_object (&data->repo);
   g_clear_object (&data->cancellable);
   g_clear_object (&data->object);
+  g_clear_object (&data->archived_path);
   g_free (data->result_csum);
   g_free (data->expected_checksum);
   g_free (data);
@@ -1285,10 +1833,17 @@ write_content_thread (GSimpleAsyncResult  *res,
   WriteContentAsyncData *data;
 
   data = g_simple_async_result_get_op_res_gpointer (res);
-  if (!ostree_repo_write_content (data->repo, data->expected_checksum,
-                                  data->object, data->file_object_length,
-                                  &data->result_csum,
-                                  cancellable, &error))
+  if (data->archived_path)
+    {
+      if (!_ostree_repo_write_archived_content (data->repo, data->expected_checksum,
+                                                data->archived_path, &data->result_csum,
+                                                cancellable, &error))
+        g_simple_async_result_take_error (res, error);
+    }
+  else if (!ostree_repo_write_content (data->repo, data->expected_checksum,
+                                       data->object, data->file_object_length,
+                                       &data->result_csum,
+                                       cancellable, &error))
     g_simple_async_result_take_error (res, error);
 }
 
@@ -1333,6 +1888,38 @@ ostree_repo_write_content_async (OstreeRepo               *self,
   g_object_unref (asyncdata->result);
 }
 
+/*
+ * _ostree_repo_write_archived_content_async:
+ *
+ * Asynchronous version of _ostree_repo_write_archived_content();
+ * complete it with ostree_repo_write_content_finish().
+ */
+void
+_ostree_repo_write_archived_content_async (OstreeRepo               *self,
+                                           const char               *expected_checksum,
+                                           GFile                    *archived_path,
+                                           GCancellable             *cancellable,
+                                           GAsyncReadyCallback       callback,
+                                           gpointer                  user_data)
+{
+  WriteContentAsyncData *asyncdata;
+
+  asyncdata = g_new0 (WriteContentAsyncData, 1);
+  asyncdata->repo = g_object_ref (self);
+  asyncdata->expected_checksum = g_strdup (expected_checksum);
+  asyncdata->archived_path = g_object_ref (archived_path);
+  asyncdata->cancellable = cancellable ? g_object_ref (cancellable) : NULL;
+
+  asyncdata->result = g_simple_async_result_new ((GObject*) self,
+                                                 callback, user_data,
+                                                 ostree_repo_write_content_async);
+
+  g_simple_async_result_set_op_res_gpointer (asyncdata->result, asyncdata,
+                                             write_content_async_data_free);
+  g_simple_async_result_run_in_thread (asyncdata->result, write_content_thread, G_PRIORITY_DEFAULT, cancellable);
+  g_object_unref (asyncdata->result);
+}
+
 /**
  * ostree_repo_write_content_finish:
  * @self: a #OstreeRepo
@@ -1618,6 +2205,8 @@ struct OstreeRepoCommitModifier {
   gpointer xattr_user_data;
 
   OstreeSePolicy *sepolicy;
+
+  guint n_jobs;
 };
 
 OstreeRepoCommitFilterResult
@@ -1744,12 +2333,208 @@ get_modified_xattrs (OstreeRepo                       *self,
   return ret;
 }
 
+static gboolean
+write_content_for_file (OstreeRepo        *self,
+                        GFile             *path,
+                        GFileInfo         *file_info,
+                        GVariant          *xattrs,
+                        char              *out_checksum_buf,
+                        GCancellable      *cancellable,
+                        GError           **error)
+{
+  gboolean ret = FALSE;
+  guint64 file_obj_length;
+  gs_unref_object GInputStream *file_input = NULL;
+  gs_unref_object GInputStream *file_object_input = NULL;
+  gs_free guchar *child_file_csum = NULL;
+
+  if (g_file_info_get_file_type (file_info) == G_FILE_TYPE_REGULAR)
+    {
+      file_input = (GInputStream*)g_file_read (path, cancellable, error);
+      if (!file_input)
+        goto out;
+    }
+
+  if (!ostree_raw_file_to_content_stream (file_input,
+                                          file_info, xattrs,
+                                          &file_object_input, &file_obj_length,
+                                          cancellable, error))
+    goto out;
+  if (!ostree_repo_write_content (self, NULL, file_object_input, file_obj_length,
+                                  &child_file_csum, cancellable, error))
+    goto out;
+
+  ostree_checksum_inplace_from_bytes (child_file_csum, out_checksum_buf);
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/* State for committing content objects from a worker pool; directory
+ * traversal and metadata writes stay on the calling thread, and the
+ * resulting checksums are only added to the mutable trees once all
+ * workers are done, in traversal order, so the generated tree is
+ * identical to the serial path.
+ */
+typedef struct {
+  OstreeRepo *repo;
+  GThreadPool *pool;
+  GPtrArray *jobs;
+  GCancellable *cancellable;
+
+  volatile gint failed;
+  GMutex error_lock;
+  GError *error;
+} CommitParallelData;
+
+typedef struct {
+  OstreeMutableTree *mtree;
+  char *name;
+  GFile *path;
+  GFileInfo *file_info;
+  GVariant *xattrs;
+  char checksum[65];
+} CommitContentJob;
+
+static void
+commit_content_job_free (CommitContentJob *job)
+{
+  g_object_unref (job->mtree);
+  g_free (job->name);
+  g_object_unref (job->path);
+  g_object_unref (job->file_info);
+  if (job->xattrs)
+    g_variant_unref (job->xattrs);
+  g_free (job);
+}
+
+static void
+commit_content_job_thread (gpointer   data,
+                           gpointer   user_data)
+{
+  CommitContentJob *job = data;
+  CommitParallelData *pdata = user_data;
+  GError *local_error = NULL;
+
+  /* Once one object failed, don't bother with the rest */
+  if (g_atomic_int_get (&pdata->failed))
+    return;
+
+  if (!write_content_for_file (pdata->repo, job->path, job->file_info, job->xattrs,
+                               job->checksum, pdata->cancellable, &local_error))
+    {
+      g_mutex_lock (&pdata->error_lock);
+      g_prefix_error (&local_error, "Writing content for '%s': ",
+                      gs_file_get_path_cached (job->path));
+      if (pdata->error == NULL)
+        pdata->error = local_error;
+      else
+        g_error_free (local_error);
+      g_atomic_int_set (&pdata->failed, 1);
+      g_mutex_unlock (&pdata->error_lock);
+    }
+}
+
+static CommitParallelData *
+commit_parallel_data_new (OstreeRepo    *repo,
+                          guint          n_jobs,
+                          GCancellable  *cancellable)
+{
+  CommitParallelData *pdata = g_new0 (CommitParallelData, 1);
+
+  pdata->repo = g_object_ref (repo);
+  pdata->jobs = g_ptr_array_new_with_free_func ((GDestroyNotify)commit_content_job_free);
+  pdata->cancellable = cancellable ? g_object_ref (cancellable) : NULL;
+  g_mutex_init (&pdata->error_lock);
+
+  if (n_jobs == 0)
+    pdata->pool = ot_thread_pool_new_nproc (commit_content_job_thread, pdata);
+  else
+    {
+      GError *local_error = NULL;
+      pdata->pool = g_thread_pool_new (commit_content_job_thread, pdata,
+                                       (int)n_jobs, FALSE, &local_error);
+      g_assert_no_error (local_error);
+    }
+
+  return pdata;
+}
+
+static void
+commit_parallel_data_push (CommitParallelData *pdata,
+                           OstreeMutableTree  *mtree,
+                           const char         *name,
+                           GFile              *path,
+                           GFileInfo          *file_info,
+                           GVariant           *xattrs)
+{
+  CommitContentJob *job = g_new0 (CommitContentJob, 1);
+
+  job->mtree = g_object_ref (mtree);
+  job->name = g_strdup (name);
+  job->path = g_object_ref (path);
+  job->file_info = g_object_ref (file_info);
+  job->xattrs = xattrs ? g_variant_ref (xattrs) : NULL;
+
+  /* The array owns the job; workers only fill in the checksum */
+  g_ptr_array_add (pdata->jobs, job);
+  g_thread_pool_push (pdata->pool, job, NULL);
+}
+
+/* Wait for all workers, then record their checksums in traversal order */
+static gboolean
+commit_parallel_data_finish (CommitParallelData *pdata,
+                             GError            **error)
+{
+  gboolean ret = FALSE;
+  guint i;
+
+  g_thread_pool_free (pdata->pool, FALSE, TRUE);
+  pdata->pool = NULL;
+
+  if (pdata->error)
+    {
+      g_propagate_error (error, pdata->error);
+      pdata->error = NULL;
+      goto out;
+    }
+
+  for (i = 0; i < pdata->jobs->len; i++)
+    {
+      CommitContentJob *job = pdata->jobs->pdata[i];
+
+      if (!ostree_mutable_tree_replace_file (job->mtree, job->name, job->checksum,
+                                             error))
+        goto out;
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+static void
+commit_parallel_data_free (CommitParallelData *pdata)
+{
+  /* On error paths, drop whatever is still queued */
+  if (pdata->pool)
+    g_thread_pool_free (pdata->pool, TRUE, TRUE);
+  g_ptr_array_unref (pdata->jobs);
+  g_clear_object (&pdata->cancellable);
+  g_clear_object (&pdata->repo);
+  g_clear_error (&pdata->error);
+  g_mutex_clear (&pdata->error_lock);
+  g_free (pdata);
+}
+
 static gboolean
 write_directory_to_mtree_internal (OstreeRepo                  *self,
                                    GFile                       *dir,
                                    OstreeMutableTree           *mtree,
                                    OstreeRepoCommitModifier    *modifier,
                                    GPtrArray                   *path,
+                                   CommitParallelData          *pdata,
                                    GCancellable                *cancellable,
                                    GError                     **error)
 {
@@ -1887,7 +2672,7 @@ write_directory_to_mtree_internal (OstreeRepo                  *self,
                     goto out;
 
                   if (!write_directory_to_mtree_internal (self, child, child_mtree,
-                                                          modifier, path,
+                                                          modifier, path, pdata,
                                                           cancellable, error))
                     goto out;
                 }
@@ -1901,18 +2686,20 @@ write_directory_to_mtree_internal (OstreeRepo                  *self,
                 }
               else
                 {
-                  guint64 file_obj_length;
-                  const char *loose_checksum;
-                  gs_unref_object GInputStream *file_input = NULL;
+                  gboolean have_loose_checksum = FALSE;
+                  char loose_checksum[65];
                   gs_unref_variant GVariant *xattrs = NULL;
-                  gs_unref_object GInputStream *file_object_input = NULL;
-                  gs_free guchar *child_file_csum = NULL;
-                  gs_free char *tmp_checksum = NULL;
+                  char tmp_checksum[65];
 
                   g_debug ("Adding: %s", gs_file_get_path_cached (child));
-                  loose_checksum = devino_cache_lookup (self, child_info);
-
-                  if (loose_checksum)
+                  if (self->use_devino_cache)
+                    have_loose_checksum =
+                      _ostree_repo_devino_cache_lookup (self,
+                                                        g_file_info_get_attribute_uint32 (child_info, "unix::device"),
+                                                        g_file_info_get_attribute_uint64 (child_info, "unix::inode"),
+                                                        loose_checksum);
+
+                  if (have_loose_checksum)
                     {
                       if (!ostree_mutable_tree_replace_file (mtree, name, loose_checksum,
                                                              error))
@@ -1920,33 +2707,31 @@ write_directory_to_mtree_internal (OstreeRepo                  *self,
                     }
                   else
                     {
-                      if (g_file_info_get_file_type (modified_info) == G_FILE_TYPE_REGULAR)
-                        {
-                          file_input = (GInputStream*)g_file_read (child, cancellable, error);
-                          if (!file_input)
-                            goto out;
-                        }
-
+                      /* Extended attributes are computed here rather
+                       * than in a worker, since the xattr callback and
+                       * SELinux policy aren't required to be threadsafe.
+                       */
                       if (!get_modified_xattrs (self, modifier,
                                                 child_relpath, child_info, child,
                                                 &xattrs,
                                                 cancellable, error))
                         goto out;
 
-                      if (!ostree_raw_file_to_content_stream (file_input,
-                                                              modified_info, xattrs,
-                                                              &file_object_input, &file_obj_length,
-                                                              cancellable, error))
-                        goto out;
-                      if (!ostree_repo_write_content (self, NULL, file_object_input, file_obj_length,
-                                                      &child_file_csum, cancellable, error))
-                        goto out;
+                      if (pdata)
+                        {
+                          commit_parallel_data_push (pdata, mtree, name, child,
+                                                     modified_info, xattrs);
+                        }
+                      else
+                        {
+                          if (!write_content_for_file (self, child, modified_info, xattrs,
+                                                       tmp_checksum, cancellable, error))
+                            goto out;
 
-                      g_free (tmp_checksum);
-                      tmp_checksum = ostree_checksum_from_bytes (child_file_csum);
-                      if (!ostree_mutable_tree_replace_file (mtree, name, tmp_checksum,
-                                                             error))
-                        goto out;
+                          if (!ostree_mutable_tree_replace_file (mtree, name, tmp_checksum,
+                                                                 error))
+                            goto out;
+                        }
                     }
                 }
 
@@ -1982,14 +2767,26 @@ ostree_repo_write_directory_to_mtree (OstreeRepo                *self,
 {
   gboolean ret = FALSE;
   GPtrArray *path = NULL;
+  CommitParallelData *pdata = NULL;
+
+  if (modifier && modifier->n_jobs != 1)
+    pdata = commit_parallel_data_new (self, modifier->n_jobs, cancellable);
 
   path = g_ptr_array_new ();
-  if (!write_directory_to_mtree_internal (self, dir, mtree, modifier, path,
+  if (!write_directory_to_mtree_internal (self, dir, mtree, modifier, path, pdata,
                                           cancellable, error))
     goto out;
 
+  if (pdata)
+    {
+      if (!commit_parallel_data_finish (pdata, error))
+        goto out;
+    }
+
   ret = TRUE;
  out:
+  if (pdata)
+    commit_parallel_data_free (pdata);
   if (path)
     g_ptr_array_free (path, TRUE);
   return ret;
@@ -2106,6 +2903,7 @@ ostree_repo_commit_modifier_new (OstreeRepoCommitModifierFlags  flags,
   modifier->filter = commit_filter;
   modifier->user_data = user_data;
   modifier->destroy_notify = destroy_notify;
+  modifier->n_jobs = 1;
 
   return modifier;
 }
@@ -2182,6 +2980,26 @@ ostree_repo_commit_modifier_set_sepolicy (OstreeRepoCommitModifier
   modifier->sepolicy = sepolicy ? g_object_ref (sepolicy) : NULL;
 }
 
+/**
+ * ostree_repo_commit_modifier_set_n_jobs:
+ * @modifier: An #OstreeRepoCommitModifier
+ * @n_jobs: Number of worker threads, or 0 for one per online processor
+ *
+ * By default, ostree_repo_write_directory_to_mtree() checksums and
+ * stores content objects one at a time.  If @n_jobs is not 1, content
+ * objects are instead written by a pool of @n_jobs worker threads.
+ * The resulting tree is identical to the one produced serially.
+ *
+ * The commit filter and xattr callbacks are still invoked from the
+ * calling thread.
+ */
+void
+ostree_repo_commit_modifier_set_n_jobs (OstreeRepoCommitModifier  *modifier,
+                                        guint                      n_jobs)
+{
+  modifier->n_jobs = n_jobs;
+}
+
 G_DEFINE_BOXED_TYPE(OstreeRepoCommitModifier, ostree_repo_commit_modifier,
                     ostree_repo_commit_modifier_ref,
                     ostree_repo_commit_modifier_unref);
@@ -0,0 +1,680 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2014 Colin Walters <walters@verbum.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "config.h"
+
+#include <sys/mman.h>
+#include "otutil.h"
+#include "libgsystem.h"
+
+#include "ostree-core-private.h"
+#include "ostree-repo-private.h"
+
+/*
+ * The devino cache maps the (st_dev, st_ino) of hardlinkable loose
+ * objects to their checksum; it allows committing a tree checked out
+ * via hardlinks without checksumming every file.  The objects are the
+ * loose content objects for bare repositories, and the uncompressed
+ * object cache for archive-z2.
+ *
+ * It is stored in the "devino-cache" file at the toplevel of the
+ * repository as an open addressing hash table, used via a shared
+ * writable mmap():
+ *
+ *   header:  "OSTDINO\0", guint32 version, guint32 n_buckets,
+ *            guint32 n_entries
+ *   buckets: OstreeDevinoCacheEntry[n_buckets]
+ *
+ * Integers are in host byte order, since st_dev and st_ino are only
+ * meaningful on this machine anyways.  Each entry carries a check
+ * value computed over its contents, so entries torn by a crash are
+ * ignored.  More importantly, every hit is verified by a stat() of
+ * the loose object, so stale entries (e.g. from prune, or objects
+ * written by older versions of ostree) are harmless; the cache only
+ * ever trades checksumming for a stat.
+ */
+
+#define OSTREE_DEVINO_CACHE_MAGIC "OSTDINO"
+#define OSTREE_DEVINO_CACHE_VERSION 1
+#define OSTREE_DEVINO_CACHE_MIN_BUCKETS 4096
+
+typedef struct {
+  char     magic[8];
+  guint32  version;
+  guint32  n_buckets;
+  guint32  n_entries;  /* Only a hint, used to decide when to grow */
+  guint32  reserved[11];
+} OstreeDevinoCacheHeader;
+
+typedef struct {
+  guint64  dev;
+  guint64  ino;
+  guint8   csum[32];
+  guint32  check;  /* 0 for an empty bucket */
+  guint32  reserved[3];
+} OstreeDevinoCacheEntry;
+
+G_STATIC_ASSERT (sizeof (OstreeDevinoCacheHeader) == 64);
+G_STATIC_ASSERT (sizeof (OstreeDevinoCacheEntry) == 64);
+
+struct OstreeRepoDevinoCache {
+  GMutex                    lock;
+  int                       fd;
+  gboolean                  writable;
+  guint8                   *data;
+  gsize                     len;
+  OstreeDevinoCacheHeader  *header;
+  OstreeDevinoCacheEntry   *entries;
+};
+
+static guint32
+devino_bucket (guint64 dev,
+               guint64 ino)
+{
+  guint64 h = (ino * G_GUINT64_CONSTANT (0x9E3779B97F4A7C15)) ^ dev;
+  return (guint32) (h ^ (h >> 32));
+}
+
+static guint32
+devino_entry_check (const OstreeDevinoCacheEntry *entry)
+{
+  const guint8 *p = (const guint8*) entry;
+  const guint8 *end = (const guint8*) &entry->check;
+  guint32 h = 2166136261U;
+
+  /* FNV-1a */
+  for (; p < end; p++)
+    h = (h ^ *p) * 16777619U;
+
+  return h | 1;
+}
+
+static gboolean
+devino_entry_is_valid (const OstreeDevinoCacheEntry *entry)
+{
+  return entry->check != 0 && entry->check == devino_entry_check (entry);
+}
+
+/* Returns %TRUE if a previously unused bucket was filled */
+static gboolean
+devino_table_insert (OstreeDevinoCacheEntry  *entries,
+                     guint32                  n_buckets,
+                     guint64                  dev,
+                     guint64                  ino,
+                     const guint8            *csum)
+{
+  guint32 i = devino_bucket (dev, ino) & (n_buckets - 1);
+  guint32 n;
+
+  for (n = 0; n < n_buckets; n++)
+    {
+      OstreeDevinoCacheEntry *entry = &entries[i];
+      gboolean is_free = !devino_entry_is_valid (entry);
+
+      if (is_free || (entry->dev == dev && entry->ino == ino))
+        {
+          entry->check = 0;
+          entry->dev = dev;
+          entry->ino = ino;
+          memcpy (entry->csum, csum, 32);
+          entry->check = devino_entry_check (entry);
+          return is_free;
+        }
+
+      i = (i + 1) & (n_buckets - 1);
+    }
+
+  /* We always keep the table at most half full */
+  g_assert_not_reached ();
+  return FALSE;
+}
+
+static gboolean
+devino_table_lookup (const OstreeDevinoCacheEntry  *entries,
+                     guint32                        n_buckets,
+                     guint64                        dev,
+                     guint64                        ino,
+                     guint8                        *out_csum)
+{
+  guint32 i = devino_bucket (dev, ino) & (n_buckets - 1);
+  guint32 n;
+
+  for (n = 0; n < n_buckets; n++)
+    {
+      const OstreeDevinoCacheEntry *entry = &entries[i];
+
+      if (entry->check == 0)
+        break;
+
+      if (entry->dev == dev && entry->ino == ino
+          && devino_entry_is_valid (entry))
+        {
+          memcpy (out_csum, entry->csum, 32);
+          return TRUE;
+        }
+
+      i = (i + 1) & (n_buckets - 1);
+    }
+
+  return FALSE;
+}
+
+static GFile *
+devino_cache_path (OstreeRepo *self)
+{
+  return g_file_get_child (ostree_repo_get_path (self), "devino-cache");
+}
+
+static void
+devino_cache_unmap (OstreeRepoDevinoCache *cache)
+{
+  if (cache->data)
+    (void) munmap (cache->data, cache->len);
+  cache->data = NULL;
+  cache->header = NULL;
+  cache->entries = NULL;
+  if (cache->fd != -1)
+    (void) close (cache->fd);
+  cache->fd = -1;
+}
+
+void
+_ostree_repo_devino_cache_free (OstreeRepoDevinoCache *cache)
+{
+  devino_cache_unmap (cache);
+  g_mutex_clear (&cache->lock);
+  g_free (cache);
+}
+
+/*
+ * Map the cache file into @cache; if it doesn't exist or is invalid,
+ * @out_mapped is set to %FALSE.
+ */
+static gboolean
+devino_cache_map (OstreeRepo             *self,
+                  OstreeRepoDevinoCache  *cache,
+                  gboolean               *out_mapped,
+                  GError                **error)
+{
+  gboolean ret = FALSE;
+  int fd;
+  struct stat stbuf;
+  void *data;
+  guint32 n_buckets;
+  gs_unref_object GFile *path = devino_cache_path (self);
+
+  g_assert (cache->data == NULL);
+
+  *out_mapped = FALSE;
+  cache->writable = TRUE;
+
+  do
+    fd = open (gs_file_get_path_cached (path), O_RDWR | O_CLOEXEC);
+  while (G_UNLIKELY (fd == -1 && errno == EINTR));
+  if (fd == -1 && (errno == EACCES || errno == EROFS))
+    {
+      cache->writable = FALSE;
+      do
+        fd = open (gs_file_get_path_cached (path), O_RDONLY | O_CLOEXEC);
+      while (G_UNLIKELY (fd == -1 && errno == EINTR));
+    }
+  if (fd == -1)
+    {
+      if (errno == ENOENT)
+        ret = TRUE;
+      else
+        ot_util_set_error_from_errno (error, errno);
+      goto out;
+    }
+  cache->fd = fd;
+
+  if (fstat (fd, &stbuf) != 0)
+    {
+      ot_util_set_error_from_errno (error, errno);
+      goto out;
+    }
+
+  if ((gsize) stbuf.st_size < sizeof (OstreeDevinoCacheHeader))
+    {
+      g_debug ("Ignoring truncated devino cache");
+      ret = TRUE;
+      goto out;
+    }
+
+  data = mmap (NULL, stbuf.st_size,
+               PROT_READ | (cache->writable ? PROT_WRITE : 0),
+               MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED)
+    {
+      ot_util_set_error_from_errno (error, errno);
+      goto out;
+    }
+  cache->data = data;
+  cache->len = stbuf.st_size;
+  cache->header = (OstreeDevinoCacheHeader*) cache->data;
+  cache->entries = (OstreeDevinoCacheEntry*) (cache->data + sizeof (OstreeDevinoCacheHeader));
+
+  n_buckets = cache->header->n_buckets;
+  if (memcmp (cache->header->magic, OSTREE_DEVINO_CACHE_MAGIC, sizeof (cache->header->magic)) != 0
+      || cache->header->version != OSTREE_DEVINO_CACHE_VERSION
+      || n_buckets == 0 || (n_buckets & (n_buckets - 1)) != 0
+      || cache->len != sizeof (OstreeDevinoCacheHeader) + (gsize)n_buckets * sizeof (OstreeDevinoCacheEntry))
+    {
+      g_debug ("Ignoring invalid devino cache");
+      ret = TRUE;
+      goto out;
+    }
+
+  ret = TRUE;
+  *out_mapped = TRUE;
+ out:
+  if (!*out_mapped)
+    devino_cache_unmap (cache);
+  return ret;
+}
+
+/*
+ * Atomically replace the cache file with a new table of @n_buckets
+ * holding @records.
+ */
+static gboolean
+devino_cache_write (OstreeRepo     *self,
+                    guint32         n_buckets,
+                    GArray         *records,
+                    GCancellable   *cancellable,
+                    GError        **error)
+{
+  gboolean ret = FALSE;
+  guint i;
+  gsize len = sizeof (OstreeDevinoCacheHeader) + (gsize)n_buckets * sizeof (OstreeDevinoCacheEntry);
+  gsize bytes_written;
+  OstreeDevinoCacheHeader *header;
+  OstreeDevinoCacheEntry *entries;
+  gs_free guint8 *buf = g_malloc0 (len);
+  gs_unref_object GFile *tmppath = NULL;
+  gs_unref_object GFile *path = devino_cache_path (self);
+  gs_unref_object GOutputStream *out = NULL;
+
+  header = (OstreeDevinoCacheHeader*) buf;
+  entries = (OstreeDevinoCacheEntry*) (buf + sizeof (OstreeDevinoCacheHeader));
+
+  memcpy (header->magic, OSTREE_DEVINO_CACHE_MAGIC, sizeof (OSTREE_DEVINO_CACHE_MAGIC));
+  header->version = OSTREE_DEVINO_CACHE_VERSION;
+  header->n_buckets = n_buckets;
+
+  for (i = 0; i < records->len; i++)
+    {
+      OstreeDevinoCacheEntry *record = &g_array_index (records, OstreeDevinoCacheEntry, i);
+      if (devino_table_insert (entries, n_buckets, record->dev, record->ino, record->csum))
+        header->n_entries++;
+    }
+
+  /* This is only a cache; if we crash before the data hits disk, the
+   * header validation or the entry checks will catch it.
+   */
+  if (!gs_file_open_in_tmpdir (self->tmp_dir, 0644, &tmppath, &out,
+                               cancellable, error))
+    goto out;
+  if (!g_output_stream_write_all (out, buf, len, &bytes_written,
+                                  cancellable, error))
+    goto out;
+  if (!g_output_stream_close (out, cancellable, error))
+    goto out;
+  if (!gs_file_rename (tmppath, path, cancellable, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  if (!ret && tmppath)
+    (void) gs_file_unlink (tmppath, NULL, NULL);
+  return ret;
+}
+
+static guint32
+devino_cache_n_buckets_for (guint n_entries)
+{
+  guint32 n_buckets = OSTREE_DEVINO_CACHE_MIN_BUCKETS;
+
+  /* Start out at most a quarter full; we grow at half */
+  while (n_buckets < n_entries * 4)
+    n_buckets *= 2;
+
+  return n_buckets;
+}
+
+static gboolean
+scan_loose_devino (OstreeRepo     *self,
+                   GArray         *records,
+                   GCancellable   *cancellable,
+                   GError        **error)
+{
+  gboolean ret = FALSE;
+  guint i;
+  gs_unref_ptrarray GPtrArray *object_dirs = NULL;
+
+  if (!_ostree_repo_get_loose_object_dirs (self, &object_dirs, cancellable, error))
+    goto out;
+
+  for (i = 0; i < object_dirs->len; i++)
+    {
+      GFile *objdir = object_dirs->pdata[i];
+      gs_unref_object GFileEnumerator *enumerator = NULL;
+      const char *dirname;
+
+      enumerator = g_file_enumerate_children (objdir, OSTREE_GIO_FAST_QUERYINFO,
+                                              G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                              cancellable,
+                                              error);
+      if (!enumerator)
+        goto out;
+
+      dirname = gs_file_get_basename_cached (objdir);
+
+      while (TRUE)
+        {
+          GFileInfo *file_info;
+          const char *name;
+          const char *dot;
+          guint32 type;
+          char checksum[65];
+          OstreeDevinoCacheEntry record = { 0, };
+
+          if (!gs_file_enumerator_iterate (enumerator, &file_info, NULL,
+                                           cancellable, error))
+            goto out;
+          if (file_info == NULL)
+            break;
+
+          name = g_file_info_get_attribute_byte_string (file_info, "standard::name");
+          type = g_file_info_get_attribute_uint32 (file_info, "standard::type");
+
+          if (type == G_FILE_TYPE_DIRECTORY)
+            continue;
+
+          /* Both bare objects and the archive-z2 uncompressed
+           * object cache use this suffix.
+           */
+          if (!g_str_has_suffix (name, ".file"))
+            continue;
+
+          dot = strrchr (name, '.');
+          g_assert (dot);
+
+          if ((dot - name) != 62 || strlen (dirname) != 2)
+            continue;
+
+          memcpy (checksum, dirname, 2);
+          memcpy (checksum + 2, name, 62);
+          checksum[64] = '\0';
+          if (!ostree_validate_checksum_string (checksum, NULL))
+            continue;
+
+          record.dev = g_file_info_get_attribute_uint32 (file_info, "unix::device");
+          record.ino = g_file_info_get_attribute_uint64 (file_info, "unix::inode");
+          ostree_checksum_inplace_to_bytes (checksum, record.csum);
+          g_array_append_val (records, record);
+        }
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/*
+ * _ostree_repo_devino_cache_ensure:
+ * @create: If %TRUE, build the cache from the loose objects if it doesn't exist
+ *
+ * Load the devino cache for @self (and if @create is given, its
+ * parents).  Without @create, a missing cache is not an error, but
+ * then no cache will be maintained.
+ */
+gboolean
+_ostree_repo_devino_cache_ensure (OstreeRepo     *self,
+                                  gboolean        create,
+                                  GCancellable   *cancellable,
+                                  GError        **error)
+{
+  gboolean ret = FALSE;
+  gboolean mapped;
+  OstreeRepoDevinoCache *cache = NULL;
+
+  if (create && self->parent_repo)
+    {
+      GError *temp_error = NULL;
+
+      if (!_ostree_repo_devino_cache_ensure (self->parent_repo, TRUE, cancellable, &temp_error))
+        {
+          /* We commonly can't write to a system parent repository;
+           * just go without its cache.
+           */
+          if (g_error_matches (temp_error, G_IO_ERROR, G_IO_ERROR_PERMISSION_DENIED)
+              || g_error_matches (temp_error, G_IO_ERROR, G_IO_ERROR_READ_ONLY))
+            g_clear_error (&temp_error);
+          else
+            {
+              g_propagate_error (error, temp_error);
+              goto out;
+            }
+        }
+    }
+
+  g_mutex_lock (&self->cache_lock);
+
+  if (self->devino_cache || (self->devino_cache_checked && !create))
+    {
+      ret = TRUE;
+      goto out_unlock;
+    }
+
+  cache = g_new0 (OstreeRepoDevinoCache, 1);
+  g_mutex_init (&cache->lock);
+  cache->fd = -1;
+
+  if (!devino_cache_map (self, cache, &mapped, error))
+    goto out_unlock;
+
+  if (!mapped && create)
+    {
+      GArray *records = g_array_new (FALSE, FALSE, sizeof (OstreeDevinoCacheEntry));
+      gboolean scanned;
+
+      scanned = scan_loose_devino (self, records, cancellable, error)
+        && devino_cache_write (self, devino_cache_n_buckets_for (records->len), records,
+                               cancellable, error);
+      g_array_unref (records);
+      if (!scanned)
+        goto out_unlock;
+
+      if (!devino_cache_map (self, cache, &mapped, error))
+        goto out_unlock;
+    }
+
+  self->devino_cache_checked = TRUE;
+  if (mapped)
+    {
+      self->devino_cache = cache;
+      cache = NULL;
+    }
+
+  ret = TRUE;
+ out_unlock:
+  g_mutex_unlock (&self->cache_lock);
+ out:
+  if (cache)
+    _ostree_repo_devino_cache_free (cache);
+  return ret;
+}
+
+/* Called with the cache lock held */
+static gboolean
+devino_cache_grow (OstreeRepo             *self,
+                   OstreeRepoDevinoCache  *cache,
+                   GCancellable           *cancellable,
+                   GError                **error)
+{
+  gboolean ret = FALSE;
+  guint32 i;
+  guint32 n_buckets = cache->header->n_buckets;
+  gboolean mapped;
+  GArray *records = g_array_new (FALSE, FALSE, sizeof (OstreeDevinoCacheEntry));
+
+  for (i = 0; i < n_buckets; i++)
+    {
+      if (devino_entry_is_valid (&cache->entries[i]))
+        g_array_append_val (records, cache->entries[i]);
+    }
+
+  if (!devino_cache_write (self, n_buckets * 2, records, cancellable, error))
+    goto out;
+
+  devino_cache_unmap (cache);
+  if (!devino_cache_map (self, cache, &mapped, error))
+    goto out;
+  if (!mapped)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Failed to reload devino cache");
+      goto out;
+    }
+
+  ret = TRUE;
+ out:
+  g_array_unref (records);
+  return ret;
+}
+
+/*
+ * _ostree_repo_devino_cache_insert:
+ *
+ * Record that the loose object @checksum has the given device and
+ * inode; does nothing if @self has no devino cache.
+ */
+gboolean
+_ostree_repo_devino_cache_insert (OstreeRepo     *self,
+                                  const char     *checksum,
+                                  guint64         dev,
+                                  guint64         ino,
+                                  GCancellable   *cancellable,
+                                  GError        **error)
+{
+  gboolean ret = FALSE;
+  OstreeRepoDevinoCache *cache;
+  guint8 csum[32];
+
+  if (!_ostree_repo_devino_cache_ensure (self, FALSE, cancellable, error))
+    return FALSE;
+
+  cache = self->devino_cache;
+  if (!cache || !cache->writable)
+    return TRUE;
+
+  ostree_checksum_inplace_to_bytes (checksum, csum);
+
+  g_mutex_lock (&cache->lock);
+
+  if (cache->data == NULL)
+    {
+      /* A previous grow failed */
+      ret = TRUE;
+      goto out;
+    }
+
+  if (devino_table_insert (cache->entries, cache->header->n_buckets, dev, ino, csum))
+    cache->header->n_entries++;
+
+  if (cache->header->n_entries * 2 > cache->header->n_buckets)
+    {
+      if (!devino_cache_grow (self, cache, cancellable, error))
+        goto out;
+    }
+
+  ret = TRUE;
+ out:
+  g_mutex_unlock (&cache->lock);
+  return ret;
+}
+
+static gboolean
+devino_cache_verify (OstreeRepo  *self,
+                     const char  *checksum,
+                     guint64      dev,
+                     guint64      ino)
+{
+  char loose_path[_OSTREE_LOOSE_PATH_MAX];
+  struct stat stbuf;
+  int dfd = self->mode == OSTREE_REPO_MODE_ARCHIVE_Z2 ?
+    self->uncompressed_objects_dir_fd : self->objects_dir_fd;
+  int res;
+
+  if (dfd == -1)
+    return FALSE;
+
+  _ostree_loose_path (loose_path, checksum, OSTREE_OBJECT_TYPE_FILE, OSTREE_REPO_MODE_BARE);
+
+  do
+    res = fstatat (dfd, loose_path, &stbuf, AT_SYMLINK_NOFOLLOW);
+  while (G_UNLIKELY (res == -1 && errno == EINTR));
+  if (res == -1)
+    return FALSE;
+
+  return stbuf.st_dev == dev && stbuf.st_ino == ino;
+}
+
+/*
+ * _ostree_repo_devino_cache_lookup:
+ * @out_checksum: Buffer of 65 bytes
+ *
+ * Look up a file with the given device and inode in the devino cache
+ * of @self and its parents.  Returns %TRUE and sets @out_checksum
+ * only if the file is verified to be a hardlink to that object.
+ */
+gboolean
+_ostree_repo_devino_cache_lookup (OstreeRepo     *self,
+                                  guint64         dev,
+                                  guint64         ino,
+                                  char           *out_checksum)
+{
+  OstreeRepoDevinoCache *cache = self->devino_cache;
+
+  if (cache)
+    {
+      guint8 csum[32];
+      gboolean found = FALSE;
+
+      g_mutex_lock (&cache->lock);
+      if (cache->data)
+        found = devino_table_lookup (cache->entries, cache->header->n_buckets,
+                                     dev, ino, csum);
+      g_mutex_unlock (&cache->lock);
+
+      if (found)
+        {
+          ostree_checksum_inplace_from_bytes (csum, out_checksum);
+          if (devino_cache_verify (self, out_checksum, dev, ino))
+            return TRUE;
+        }
+    }
+
+  if (self->parent_repo)
+    return _ostree_repo_devino_cache_lookup (self->parent_repo, dev, ino, out_checksum);
+
+  return FALSE;
+}
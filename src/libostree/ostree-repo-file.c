@@ -28,6 +28,18 @@
 
 static void ostree_repo_file_file_iface_init (GFileIface *iface);
 
+typedef struct {
+  const char *name;  /* Points into the tree_contents */
+  guint32 index;     /* Position in the files or dirs array */
+  guint32 is_dir;
+} OstreeRepoFileChild;
+
+/* Every entry of a resolved directory, sorted by name */
+typedef struct {
+  guint n_children;
+  OstreeRepoFileChild children[];
+} OstreeRepoFileChildIndex;
+
 struct OstreeRepoFile
 {
   GObject parent_instance;
@@ -43,6 +55,9 @@ struct OstreeRepoFile
   GVariant *tree_contents;
   char *tree_metadata_checksum;
   GVariant *tree_metadata;
+
+  volatile gint n_child_lookups;
+  OstreeRepoFileChildIndex *child_index;
 };
 
 G_DEFINE_TYPE_WITH_CODE (OstreeRepoFile, ostree_repo_file, G_TYPE_OBJECT,
@@ -58,6 +73,7 @@ ostree_repo_file_finalize (GObject *object)
 
   g_clear_pointer (&self->tree_contents, (GDestroyNotify) g_variant_unref);
   g_clear_pointer (&self->tree_metadata, (GDestroyNotify) g_variant_unref);
+  g_free (self->child_index);
   g_free (self->cached_file_checksum);
   g_free (self->tree_contents_checksum);
   g_free (self->tree_metadata_checksum);
@@ -218,7 +234,6 @@ do_resolve_nonroot (OstreeRepoFile     *self,
   gs_unref_variant GVariant *tree_metadata = NULL;
   gs_unref_variant GVariant *contents_csum_v = NULL;
   gs_unref_variant GVariant *metadata_csum_v = NULL;
-  gs_free char *tmp_checksum = NULL;
 
   if (!ostree_repo_file_ensure_resolved (self->parent, error))
     goto out;
@@ -243,18 +258,14 @@ do_resolve_nonroot (OstreeRepoFile     *self,
       g_variant_get_child (container, i, "(&s@ay@ay)",
                            &name, &contents_csum_v, &metadata_csum_v);
 
-      g_free (tmp_checksum);
-      tmp_checksum = ostree_checksum_from_bytes_v (contents_csum_v);
-      if (!ostree_repo_load_variant (self->repo, OSTREE_OBJECT_TYPE_DIR_TREE,
-                                     tmp_checksum, &tree_contents,
-                                     error))
+      if (!_ostree_repo_load_variant_csum (self->repo, OSTREE_OBJECT_TYPE_DIR_TREE,
+                                           ostree_checksum_bytes_peek (contents_csum_v),
+                                           &tree_contents, error))
         goto out;
 
-      g_free (tmp_checksum);
-      tmp_checksum = ostree_checksum_from_bytes_v (metadata_csum_v);
-      if (!ostree_repo_load_variant (self->repo, OSTREE_OBJECT_TYPE_DIR_META,
-                                     tmp_checksum, &tree_metadata,
-                                     error))
+      if (!_ostree_repo_load_variant_csum (self->repo, OSTREE_OBJECT_TYPE_DIR_META,
+                                           ostree_checksum_bytes_peek (metadata_csum_v),
+                                           &tree_metadata, error))
         goto out;
 
       self->tree_contents = tree_contents;
@@ -783,6 +794,67 @@ bsearch_in_file_variant (GVariant  *variant,
   return FALSE;
 }
 
+static OstreeRepoFileChildIndex *
+child_index_new (GVariant *tree_contents)
+{
+  gs_unref_variant GVariant *files_variant = g_variant_get_child_value (tree_contents, 0);
+  gs_unref_variant GVariant *dirs_variant = g_variant_get_child_value (tree_contents, 1);
+  guint n_files = g_variant_n_children (files_variant);
+  guint n_dirs = g_variant_n_children (dirs_variant);
+  OstreeRepoFileChildIndex *ret;
+  const char *file_name = NULL;
+  const char *dir_name = NULL;
+  guint i, j, k;
+
+  ret = g_malloc (sizeof (OstreeRepoFileChildIndex)
+                  + (n_files + n_dirs) * sizeof (OstreeRepoFileChild));
+  ret->n_children = n_files + n_dirs;
+
+  /* Merge the two sorted arrays; the names are borrowed from
+   * @tree_contents, which lives as long as the index.
+   */
+  i = j = k = 0;
+  if (n_files > 0)
+    g_variant_get_child (files_variant, 0, "(&s@ay)", &file_name, NULL);
+  if (n_dirs > 0)
+    g_variant_get_child (dirs_variant, 0, "(&s@ay@ay)", &dir_name, NULL, NULL);
+  while (file_name || dir_name)
+    {
+      OstreeRepoFileChild *child = &ret->children[k++];
+
+      if (dir_name == NULL || (file_name != NULL && strcmp (file_name, dir_name) < 0))
+        {
+          child->name = file_name;
+          child->index = i++;
+          child->is_dir = FALSE;
+          file_name = NULL;
+          if (i < n_files)
+            g_variant_get_child (files_variant, i, "(&s@ay)", &file_name, NULL);
+        }
+      else
+        {
+          child->name = dir_name;
+          child->index = j++;
+          child->is_dir = TRUE;
+          dir_name = NULL;
+          if (j < n_dirs)
+            g_variant_get_child (dirs_variant, j, "(&s@ay@ay)", &dir_name, NULL, NULL);
+        }
+    }
+
+  return ret;
+}
+
+static int
+compare_child_name (const void *a,
+                    const void *b)
+{
+  const char *name = a;
+  const OstreeRepoFileChild *child = b;
+
+  return strcmp (name, child->name);
+}
+
 int
 ostree_repo_file_tree_find_child  (OstreeRepoFile  *self,
                                     const char      *name,
@@ -794,6 +866,29 @@ ostree_repo_file_tree_find_child  (OstreeRepoFile  *self,
   GVariant *dirs_variant = NULL;
   GVariant *ret_container = NULL;
 
+  /* A single lookup (e.g. resolving a path) is cheapest as a binary
+   * search of the variants; once a directory is searched again (e.g.
+   * for each of its children in turn), index it so that each further
+   * lookup is a binary search without any allocation.
+   */
+  if (g_atomic_int_add (&self->n_child_lookups, 1) > 0)
+    {
+      const OstreeRepoFileChild *child;
+
+      if (g_once_init_enter (&self->child_index))
+        g_once_init_leave (&self->child_index, child_index_new (self->tree_contents));
+
+      child = bsearch (name, self->child_index->children, self->child_index->n_children,
+                       sizeof (OstreeRepoFileChild), compare_child_name);
+      if (child == NULL)
+        return -1;
+
+      *is_dir = child->is_dir;
+      if (out_container)
+        *out_container = g_variant_get_child_value (self->tree_contents, child->is_dir ? 1 : 0);
+      return child->index;
+    }
+
   files_variant = g_variant_get_child_value (self->tree_contents, 0);
   dirs_variant = g_variant_get_child_value (self->tree_contents, 1);
 
@@ -0,0 +1,232 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2014 Colin Walters <walters@verbum.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include "otutil.h"
+#include "libgsystem.h"
+
+#include "ostree-repo-private.h"
+
+/*
+ * The metadata cache keeps the most recently loaded DIR_TREE and
+ * DIR_META variants of a repository in memory, so that walking the
+ * same trees again (e.g. resolving #OstreeRepoFile paths, or diffing
+ * two commits which share most directories) does not open and map
+ * the objects each time.  Objects are immutable, so entries only
+ * need to be dropped when objects are deleted.
+ *
+ * It is a plain LRU: a hash table from the binary checksum and type
+ * to a link in a queue ordered from most to least recently used.
+ * All operations take a lock, since a repository may be used from
+ * several threads at once (e.g. by a parallel checkout).
+ */
+
+#define OSTREE_METADATA_CACHE_KEY_SIZE 33
+
+typedef struct {
+  guint8    key[OSTREE_METADATA_CACHE_KEY_SIZE];  /* csum + objtype */
+  GVariant *variant;
+} OstreeMetadataCacheEntry;
+
+struct OstreeRepoMetadataCache {
+  GMutex      lock;
+  guint       max_entries;
+  GHashTable *entries;  /* key -> GList* in lru */
+  GQueue      lru;      /* OstreeMetadataCacheEntry*, head is most recent */
+  guint64     hits;
+  guint64     misses;
+};
+
+static guint
+metadata_cache_key_hash (gconstpointer v)
+{
+  guint32 h;
+
+  /* Checksums are uniformly distributed already */
+  memcpy (&h, v, sizeof (h));
+  return h;
+}
+
+static gboolean
+metadata_cache_key_equal (gconstpointer v1,
+                          gconstpointer v2)
+{
+  return memcmp (v1, v2, OSTREE_METADATA_CACHE_KEY_SIZE) == 0;
+}
+
+static void
+metadata_cache_make_key (OstreeObjectType  objtype,
+                         const guchar     *csum,
+                         guint8           *key)
+{
+  memcpy (key, csum, 32);
+  key[32] = (guint8) objtype;
+}
+
+static void
+metadata_cache_entry_free (OstreeMetadataCacheEntry *entry)
+{
+  g_variant_unref (entry->variant);
+  g_free (entry);
+}
+
+gboolean
+_ostree_repo_metadata_cache_is_cacheable (OstreeObjectType objtype)
+{
+  return objtype == OSTREE_OBJECT_TYPE_DIR_TREE
+    || objtype == OSTREE_OBJECT_TYPE_DIR_META;
+}
+
+OstreeRepoMetadataCache *
+_ostree_repo_metadata_cache_new (guint max_entries)
+{
+  OstreeRepoMetadataCache *cache = g_new0 (OstreeRepoMetadataCache, 1);
+
+  g_mutex_init (&cache->lock);
+  cache->max_entries = max_entries;
+  cache->entries = g_hash_table_new (metadata_cache_key_hash,
+                                     metadata_cache_key_equal);
+  g_queue_init (&cache->lru);
+
+  return cache;
+}
+
+static void
+metadata_cache_clear_unlocked (OstreeRepoMetadataCache *cache)
+{
+  g_hash_table_remove_all (cache->entries);
+  g_queue_foreach (&cache->lru, (GFunc) metadata_cache_entry_free, NULL);
+  g_queue_clear (&cache->lru);
+}
+
+void
+_ostree_repo_metadata_cache_free (OstreeRepoMetadataCache *cache)
+{
+  metadata_cache_clear_unlocked (cache);
+  g_hash_table_destroy (cache->entries);
+  g_mutex_clear (&cache->lock);
+  g_free (cache);
+}
+
+/*
+ * _ostree_repo_metadata_cache_lookup:
+ *
+ * Returns: (transfer full): The cached variant for @csum, or %NULL
+ */
+GVariant *
+_ostree_repo_metadata_cache_lookup (OstreeRepoMetadataCache *cache,
+                                    OstreeObjectType         objtype,
+                                    const guchar            *csum)
+{
+  guint8 key[OSTREE_METADATA_CACHE_KEY_SIZE];
+  GList *link;
+  GVariant *ret = NULL;
+
+  metadata_cache_make_key (objtype, csum, key);
+
+  g_mutex_lock (&cache->lock);
+  link = g_hash_table_lookup (cache->entries, key);
+  if (link)
+    {
+      OstreeMetadataCacheEntry *entry = link->data;
+
+      g_queue_unlink (&cache->lru, link);
+      g_queue_push_head_link (&cache->lru, link);
+      ret = g_variant_ref (entry->variant);
+      cache->hits++;
+    }
+  else
+    cache->misses++;
+  g_mutex_unlock (&cache->lock);
+
+  return ret;
+}
+
+void
+_ostree_repo_metadata_cache_insert (OstreeRepoMetadataCache *cache,
+                                    OstreeObjectType         objtype,
+                                    const guchar            *csum,
+                                    GVariant                *variant)
+{
+  OstreeMetadataCacheEntry *entry;
+
+  if (cache->max_entries == 0)
+    return;
+
+  entry = g_new0 (OstreeMetadataCacheEntry, 1);
+  metadata_cache_make_key (objtype, csum, entry->key);
+  entry->variant = g_variant_ref (variant);
+
+  g_mutex_lock (&cache->lock);
+  if (g_hash_table_lookup (cache->entries, entry->key))
+    {
+      /* Another thread loaded it at the same time */
+      metadata_cache_entry_free (entry);
+    }
+  else
+    {
+      g_queue_push_head (&cache->lru, entry);
+      g_hash_table_insert (cache->entries, entry->key, cache->lru.head);
+
+      while (cache->lru.length > cache->max_entries)
+        {
+          OstreeMetadataCacheEntry *oldest = g_queue_pop_tail (&cache->lru);
+          g_hash_table_remove (cache->entries, oldest->key);
+          metadata_cache_entry_free (oldest);
+        }
+    }
+  g_mutex_unlock (&cache->lock);
+}
+
+void
+_ostree_repo_metadata_cache_clear (OstreeRepoMetadataCache *cache)
+{
+  g_mutex_lock (&cache->lock);
+  metadata_cache_clear_unlocked (cache);
+  g_mutex_unlock (&cache->lock);
+}
+
+/**
+ * ostree_repo_get_metadata_cache_stats:
+ * @self: Repo
+ * @out_hits: (out) (allow-none): Number of metadata loads answered from memory
+ * @out_misses: (out) (allow-none): Number of metadata loads which read the object
+ *
+ * Directory tree and directory metadata objects which were loaded
+ * recently are kept in memory.  Return how often loading one of them
+ * was served from there, and how often it was not, since @self was
+ * created.
+ */
+void
+ostree_repo_get_metadata_cache_stats (OstreeRepo   *self,
+                                      guint64      *out_hits,
+                                      guint64      *out_misses)
+{
+  OstreeRepoMetadataCache *cache = self->metadata_cache;
+
+  g_mutex_lock (&cache->lock);
+  if (out_hits)
+    *out_hits = cache->hits;
+  if (out_misses)
+    *out_misses = cache->misses;
+  g_mutex_unlock (&cache->lock);
+}
@@ -0,0 +1,1384 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2014 Colin Walters <walters@verbum.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <fcntl.h>
+#include <gio/gunixinputstream.h>
+#include <gio/gfiledescriptorbased.h>
+#include "otutil.h"
+#include "libgsystem.h"
+
+#include "ostree-core-private.h"
+#include "ostree-repo-private.h"
+
+/*
+ * Loose objects can be folded into pack files, stored in
+ * objects/pack/.  A pack is made of a data file, which is simply the
+ * concatenation of the objects exactly as they would be stored loose,
+ * and an index file mapping object names to ranges of the data file.
+ *
+ * The index is designed to be used directly via mmap():
+ *
+ *   header:  "OSTPACK\0", guint32 version, guint32 n_entries
+ *   fanout:  guint32[256]; fanout[b] is the number of entries whose
+ *            checksum starts with a byte <= b
+ *   entries: OstreePackIndexEntry[n_entries], sorted by checksum
+ *
+ * All integers are big endian.  Metadata and content objects are kept
+ * in separate packs, named ostmeta-$checksum.{index,data} and
+ * ostcontent-$checksum.{index,data} respectively, where $checksum is
+ * the SHA256 of the index file.  Content objects are only packed in
+ * archive-z2 repositories.
+ *
+ * objects/pack/packs lists the names of all packs.  Pulls read it to
+ * fetch the remote indexes, and then request packed objects as byte
+ * ranges of the data files.  Once an object is packed, the packs are
+ * where it is looked up first.
+ *
+ * Deleting a packed object doesn't rewrite its pack; instead, a
+ * tombstone (the 32 byte checksum followed by the object type) is
+ * appended to $name.deleted, and lookups skip the entry.  Pruning
+ * and repacking drop the tombstoned entries when they rewrite the
+ * pack.
+ */
+
+#define OSTREE_PACK_INDEX_MAGIC "OSTPACK"
+#define OSTREE_PACK_INDEX_VERSION 1
+#define OSTREE_PACK_META_PREFIX "ostmeta-"
+#define OSTREE_PACK_CONTENT_PREFIX "ostcontent-"
+
+typedef struct {
+  char     magic[8];
+  guint32  version;
+  guint32  n_entries;
+  guint32  fanout[256];
+} OstreePackIndexHeader;
+
+typedef struct {
+  guint8   csum[32];
+  guint8   objtype;
+  guint8   reserved[7];
+  guint64  offset;
+  guint64  size;
+} OstreePackIndexEntry;
+
+typedef struct {
+  guint8   csum[32];
+  guint8   objtype;
+} OstreePackTombstone;
+
+G_STATIC_ASSERT (sizeof (OstreePackIndexHeader) == 1040);
+G_STATIC_ASSERT (sizeof (OstreePackIndexEntry) == 56);
+G_STATIC_ASSERT (sizeof (OstreePackTombstone) == 33);
+
+struct OstreeRepoPackIndex {
+  char                         *name;
+  GMappedFile                  *index_mfile;
+  GMappedFile                  *data_mfile;
+  const OstreePackIndexHeader  *header;
+  const OstreePackIndexEntry   *entries;
+  guint                         n_entries;
+  OstreeObjectSet              *deleted; /* Tombstones; NULL for remote packs */
+};
+
+void
+_ostree_repo_pack_index_free (OstreeRepoPackIndex *index)
+{
+  g_free (index->name);
+  if (index->index_mfile)
+    g_mapped_file_unref (index->index_mfile);
+  if (index->data_mfile)
+    g_mapped_file_unref (index->data_mfile);
+  if (index->deleted)
+    ostree_object_set_free (index->deleted);
+  g_free (index);
+}
+
+const char *
+_ostree_repo_pack_index_get_name (OstreeRepoPackIndex *index)
+{
+  return index->name;
+}
+
+/*
+ * _ostree_repo_validate_pack_name:
+ *
+ * Check that @name is of the form ostmeta-$checksum or
+ * ostcontent-$checksum.
+ */
+gboolean
+_ostree_repo_validate_pack_name (const char  *name,
+                                 GError     **error)
+{
+  const char *checksum;
+
+  if (g_str_has_prefix (name, OSTREE_PACK_META_PREFIX))
+    checksum = name + strlen (OSTREE_PACK_META_PREFIX);
+  else if (g_str_has_prefix (name, OSTREE_PACK_CONTENT_PREFIX))
+    checksum = name + strlen (OSTREE_PACK_CONTENT_PREFIX);
+  else
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Invalid pack name '%s'", name);
+      return FALSE;
+    }
+
+  return ostree_validate_checksum_string (checksum, error);
+}
+
+/*
+ * _ostree_repo_open_pack_index:
+ * @index_path: Path to the index file
+ * @name: Name of the pack
+ * @verify: Whether to check the index against the checksum in @name
+ *
+ * Map and validate the index of a pack, without its data; this is
+ * also used for the indexes of remote packs.
+ */
+gboolean
+_ostree_repo_open_pack_index (GFile                 *index_path,
+                              const char            *name,
+                              gboolean               verify,
+                              OstreeRepoPackIndex  **out_index,
+                              GCancellable          *cancellable,
+                              GError               **error)
+{
+  gboolean ret = FALSE;
+  OstreeRepoPackIndex *ret_index = NULL;
+  gsize index_len;
+  guint i;
+  guint32 prev;
+  const char *index_data;
+
+  if (!_ostree_repo_validate_pack_name (name, error))
+    goto out;
+
+  ret_index = g_new0 (OstreeRepoPackIndex, 1);
+  ret_index->name = g_strdup (name);
+
+  ret_index->index_mfile = gs_file_map_noatime (index_path, cancellable, error);
+  if (!ret_index->index_mfile)
+    goto out;
+
+  index_data = g_mapped_file_get_contents (ret_index->index_mfile);
+  index_len = g_mapped_file_get_length (ret_index->index_mfile);
+
+  if (verify)
+    {
+      gs_free char *index_checksum =
+        g_compute_checksum_for_data (G_CHECKSUM_SHA256, (const guint8*)index_data, index_len);
+
+      if (!g_str_has_suffix (name, index_checksum))
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Corrupted pack index %s; actual checksum is %s",
+                       name, index_checksum);
+          goto out;
+        }
+    }
+
+  if (index_len < sizeof (OstreePackIndexHeader))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Truncated pack index %s", name);
+      goto out;
+    }
+
+  ret_index->header = (const OstreePackIndexHeader*) index_data;
+  if (memcmp (ret_index->header->magic, OSTREE_PACK_INDEX_MAGIC, sizeof (ret_index->header->magic)) != 0 ||
+      GUINT32_FROM_BE (ret_index->header->version) != OSTREE_PACK_INDEX_VERSION)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Invalid header in pack index %s", name);
+      goto out;
+    }
+
+  ret_index->n_entries = GUINT32_FROM_BE (ret_index->header->n_entries);
+  if ((index_len - sizeof (OstreePackIndexHeader)) / sizeof (OstreePackIndexEntry) != ret_index->n_entries ||
+      (index_len - sizeof (OstreePackIndexHeader)) % sizeof (OstreePackIndexEntry) != 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Invalid length for pack index %s", name);
+      goto out;
+    }
+
+  /* The lookup code relies on the fanout being sane */
+  prev = 0;
+  for (i = 0; i < 256; i++)
+    {
+      guint32 v = GUINT32_FROM_BE (ret_index->header->fanout[i]);
+      if (v < prev || v > ret_index->n_entries)
+        break;
+      prev = v;
+    }
+  if (i < 256 || prev != ret_index->n_entries)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Invalid fanout table in pack index %s", name);
+      goto out;
+    }
+
+  ret_index->entries = (const OstreePackIndexEntry*) (index_data + sizeof (OstreePackIndexHeader));
+
+  ret = TRUE;
+  gs_transfer_out_value (out_index, &ret_index);
+ out:
+  if (ret_index)
+    _ostree_repo_pack_index_free (ret_index);
+  return ret;
+}
+
+static gboolean
+pack_index_open (GFile                 *pack_dir,
+                 const char            *name,
+                 OstreeRepoPackIndex  **out_index,
+                 GCancellable          *cancellable,
+                 GError               **error)
+{
+  gboolean ret = FALSE;
+  GError *temp_error = NULL;
+  OstreeRepoPackIndex *ret_index = NULL;
+  gsize i, len;
+  const OstreePackTombstone *tombstones;
+  gs_free char *index_name = g_strconcat (name, ".index", NULL);
+  gs_free char *data_name = g_strconcat (name, ".data", NULL);
+  gs_free char *deleted_name = g_strconcat (name, ".deleted", NULL);
+  gs_free char *deleted_data = NULL;
+  gs_unref_object GFile *index_path = g_file_get_child (pack_dir, index_name);
+  gs_unref_object GFile *data_path = g_file_get_child (pack_dir, data_name);
+  gs_unref_object GFile *deleted_path = g_file_get_child (pack_dir, deleted_name);
+
+  if (!_ostree_repo_open_pack_index (index_path, name, FALSE, &ret_index,
+                                     cancellable, error))
+    goto out;
+
+  ret_index->data_mfile = gs_file_map_noatime (data_path, cancellable, error);
+  if (!ret_index->data_mfile)
+    goto out;
+
+  ret_index->deleted = ostree_object_set_new ();
+  if (!g_file_load_contents (deleted_path, cancellable, &deleted_data, &len,
+                             NULL, &temp_error))
+    {
+      if (!g_error_matches (temp_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        {
+          g_propagate_error (error, temp_error);
+          goto out;
+        }
+      g_clear_error (&temp_error);
+      len = 0;
+    }
+
+  /* A trailing partial record is from an interrupted append */
+  tombstones = (const OstreePackTombstone*) deleted_data;
+  for (i = 0; i < len / sizeof (OstreePackTombstone); i++)
+    ostree_object_set_add (ret_index->deleted, tombstones[i].csum, tombstones[i].objtype);
+
+  ret = TRUE;
+  gs_transfer_out_value (out_index, &ret_index);
+ out:
+  if (ret_index)
+    _ostree_repo_pack_index_free (ret_index);
+  return ret;
+}
+
+static gboolean
+pack_entry_is_deleted (OstreeRepoPackIndex         *index,
+                       const OstreePackIndexEntry  *entry)
+{
+  return index->deleted &&
+    ostree_object_set_contains (index->deleted, entry->csum, entry->objtype);
+}
+
+static const OstreePackIndexEntry *
+pack_index_lookup (OstreeRepoPackIndex  *index,
+                   OstreeObjectType      objtype,
+                   const guint8         *csum)
+{
+  guint lo, hi;
+
+  lo = csum[0] == 0 ? 0 : GUINT32_FROM_BE (index->header->fanout[csum[0] - 1]);
+  hi = GUINT32_FROM_BE (index->header->fanout[csum[0]]);
+
+  while (lo < hi)
+    {
+      guint mid = lo + (hi - lo) / 2;
+      if (memcmp (index->entries[mid].csum, csum, 32) < 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+
+  for (; lo < index->n_entries && memcmp (index->entries[lo].csum, csum, 32) == 0; lo++)
+    {
+      if (index->entries[lo].objtype == (guint8) objtype)
+        {
+          if (pack_entry_is_deleted (index, &index->entries[lo]))
+            return NULL;
+          return &index->entries[lo];
+        }
+    }
+
+  return NULL;
+}
+
+/*
+ * _ostree_repo_pack_index_lookup:
+ *
+ * Find the range of the pack data holding the object, if @index
+ * has it.
+ */
+gboolean
+_ostree_repo_pack_index_lookup (OstreeRepoPackIndex  *index,
+                                OstreeObjectType      objtype,
+                                const char           *checksum,
+                                guint64              *out_offset,
+                                guint64              *out_size)
+{
+  guint8 csum[32];
+  const OstreePackIndexEntry *entry;
+
+  ostree_checksum_inplace_to_bytes (checksum, csum);
+  entry = pack_index_lookup (index, objtype, csum);
+  if (!entry)
+    return FALSE;
+
+  *out_offset = GUINT64_FROM_BE (entry->offset);
+  *out_size = GUINT64_FROM_BE (entry->size);
+  return TRUE;
+}
+
+/* Must be called with cache_lock held */
+static gboolean
+ensure_pack_indexes_locked (OstreeRepo    *self,
+                            GCancellable  *cancellable,
+                            GError       **error)
+{
+  gboolean ret = FALSE;
+  GError *temp_error = NULL;
+  gs_unref_object GFile *pack_dir = NULL;
+  gs_unref_object GFileEnumerator *dir_enum = NULL;
+  gs_unref_ptrarray GPtrArray *meta_indexes = NULL;
+  gs_unref_ptrarray GPtrArray *content_indexes = NULL;
+
+  if (self->cached_meta_indexes)
+    return TRUE;
+
+  meta_indexes = g_ptr_array_new_with_free_func ((GDestroyNotify) _ostree_repo_pack_index_free);
+  content_indexes = g_ptr_array_new_with_free_func ((GDestroyNotify) _ostree_repo_pack_index_free);
+
+  pack_dir = g_file_get_child (self->objects_dir, "pack");
+  dir_enum = g_file_enumerate_children (pack_dir, OSTREE_GIO_FAST_QUERYINFO,
+                                        G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                        cancellable, &temp_error);
+  if (!dir_enum)
+    {
+      if (!g_error_matches (temp_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        {
+          g_propagate_error (error, temp_error);
+          goto out;
+        }
+      g_clear_error (&temp_error);
+    }
+  else
+    {
+      while (TRUE)
+        {
+          GFileInfo *file_info;
+          const char *name;
+          gs_free char *pack_name = NULL;
+          OstreeRepoPackIndex *index;
+
+          if (!gs_file_enumerator_iterate (dir_enum, &file_info, NULL,
+                                           cancellable, error))
+            goto out;
+          if (file_info == NULL)
+            break;
+
+          name = g_file_info_get_name (file_info);
+          if (!g_str_has_suffix (name, ".index"))
+            continue;
+
+          pack_name = g_strndup (name, strlen (name) - strlen (".index"));
+          if (!_ostree_repo_validate_pack_name (pack_name, NULL))
+            continue;
+
+          if (!pack_index_open (pack_dir, pack_name, &index, cancellable, error))
+            goto out;
+
+          if (g_str_has_prefix (name, OSTREE_PACK_META_PREFIX))
+            g_ptr_array_add (meta_indexes, index);
+          else
+            g_ptr_array_add (content_indexes, index);
+        }
+    }
+
+  ret = TRUE;
+  self->cached_meta_indexes = meta_indexes;
+  meta_indexes = NULL;
+  self->cached_content_indexes = content_indexes;
+  content_indexes = NULL;
+ out:
+  return ret;
+}
+
+/*
+ * _ostree_repo_find_packed_object:
+ * @out_data: (out) (allow-none): Object data, or %NULL if not packed
+ *
+ * Look up an object in the pack files of @self (not its parent).
+ * The returned data is in the same format as the loose object would
+ * be, and refers directly to the mapped pack data.
+ */
+gboolean
+_ostree_repo_find_packed_object (OstreeRepo           *self,
+                                 OstreeObjectType      objtype,
+                                 const char           *checksum,
+                                 GBytes              **out_data,
+                                 GCancellable         *cancellable,
+                                 GError              **error)
+{
+  gboolean ret = FALSE;
+  guint i;
+  guint8 csum[32];
+  GPtrArray *indexes;
+  gs_unref_bytes GBytes *ret_data = NULL;
+
+  ostree_checksum_inplace_to_bytes (checksum, csum);
+
+  g_mutex_lock (&self->cache_lock);
+
+  if (!ensure_pack_indexes_locked (self, cancellable, error))
+    goto out;
+
+  indexes = OSTREE_OBJECT_TYPE_IS_META (objtype) ?
+    self->cached_meta_indexes : self->cached_content_indexes;
+
+  for (i = 0; i < indexes->len; i++)
+    {
+      OstreeRepoPackIndex *index = indexes->pdata[i];
+      const OstreePackIndexEntry *entry = pack_index_lookup (index, objtype, csum);
+      guint64 offset, size;
+
+      if (!entry)
+        continue;
+
+      offset = GUINT64_FROM_BE (entry->offset);
+      size = GUINT64_FROM_BE (entry->size);
+      if (offset + size < offset ||
+          offset + size > g_mapped_file_get_length (index->data_mfile))
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Invalid range for object %s in pack %s",
+                       checksum, index->name);
+          goto out;
+        }
+
+      ret_data = g_bytes_new_with_free_func (g_mapped_file_get_contents (index->data_mfile) + offset,
+                                             size,
+                                             (GDestroyNotify) g_mapped_file_unref,
+                                             g_mapped_file_ref (index->data_mfile));
+      break;
+    }
+
+  ret = TRUE;
+  ot_transfer_out_value (out_data, &ret_data);
+ out:
+  g_mutex_unlock (&self->cache_lock);
+  return ret;
+}
+
+/*
+ * _ostree_repo_list_packed_objects:
+ *
+ * Add all packed objects to @inout_objects, in the format of
+ * ostree_repo_list_objects().
+ */
+gboolean
+_ostree_repo_list_packed_objects (OstreeRepo     *self,
+                                  GHashTable     *inout_objects,
+                                  GCancellable   *cancellable,
+                                  GError        **error)
+{
+  gboolean ret = FALSE;
+  guint i, j;
+  GPtrArray *all_indexes[2];
+
+  g_mutex_lock (&self->cache_lock);
+
+  if (!ensure_pack_indexes_locked (self, cancellable, error))
+    goto out;
+
+  all_indexes[0] = self->cached_meta_indexes;
+  all_indexes[1] = self->cached_content_indexes;
+
+  for (i = 0; i < G_N_ELEMENTS (all_indexes); i++)
+    {
+      for (j = 0; j < all_indexes[i]->len; j++)
+        {
+          OstreeRepoPackIndex *index = all_indexes[i]->pdata[j];
+          guint k;
+
+          for (k = 0; k < index->n_entries; k++)
+            {
+              const OstreePackIndexEntry *entry = &index->entries[k];
+              char checksum[65];
+              GVariant *key;
+              GVariant *existing;
+              gboolean is_loose = FALSE;
+              gs_free const char **packs = NULL;
+              gs_unref_ptrarray GPtrArray *new_packs = g_ptr_array_new ();
+
+              if (pack_entry_is_deleted (index, entry))
+                continue;
+
+              if (!ostree_validate_structureof_objtype (entry->objtype, error))
+                goto out;
+
+              ostree_checksum_inplace_from_bytes (entry->csum, checksum);
+              key = ostree_object_name_serialize (checksum, entry->objtype);
+              g_variant_ref_sink (key);
+
+              existing = g_hash_table_lookup (inout_objects, key);
+              if (existing)
+                {
+                  const char **iter;
+
+                  g_variant_get (existing, "(b^a&s)", &is_loose, &packs);
+                  for (iter = packs; iter && *iter; iter++)
+                    g_ptr_array_add (new_packs, (char*)*iter);
+                }
+              g_ptr_array_add (new_packs, index->name);
+
+              /* transfer ownership */
+              g_hash_table_replace (inout_objects, key,
+                                    g_variant_ref_sink (g_variant_new ("(b@as)", is_loose,
+                                                                       g_variant_new_strv ((const char *const*)new_packs->pdata,
+                                                                                           new_packs->len))));
+            }
+        }
+    }
+
+  ret = TRUE;
+ out:
+  g_mutex_unlock (&self->cache_lock);
+  return ret;
+}
+
+/*
+ * _ostree_repo_list_packed_commits:
+ *
+ * Add the checksums of all packed commit objects to the string set
+ * @inout_commits.  Commits are always in metadata packs.
+ */
+gboolean
+_ostree_repo_list_packed_commits (OstreeRepo     *self,
+                                  GHashTable     *inout_commits,
+                                  GCancellable   *cancellable,
+                                  GError        **error)
+{
+  gboolean ret = FALSE;
+  guint i;
+
+  g_mutex_lock (&self->cache_lock);
+
+  if (!ensure_pack_indexes_locked (self, cancellable, error))
+    goto out;
+
+  for (i = 0; i < self->cached_meta_indexes->len; i++)
+    {
+      OstreeRepoPackIndex *index = self->cached_meta_indexes->pdata[i];
+      guint k;
+
+      for (k = 0; k < index->n_entries; k++)
+        {
+          const OstreePackIndexEntry *entry = &index->entries[k];
+
+          if (entry->objtype != OSTREE_OBJECT_TYPE_COMMIT ||
+              pack_entry_is_deleted (index, entry))
+            continue;
+
+          g_hash_table_add (inout_commits, ostree_checksum_from_bytes (entry->csum));
+        }
+    }
+
+  ret = TRUE;
+ out:
+  g_mutex_unlock (&self->cache_lock);
+  return ret;
+}
+
+static int
+compare_object_names (gconstpointer  a,
+                      gconstpointer  b)
+{
+  GVariant *name_a = *((GVariant**)a);
+  GVariant *name_b = *((GVariant**)b);
+  const char *checksum_a, *checksum_b;
+  OstreeObjectType objtype_a, objtype_b;
+  int c;
+
+  ostree_object_name_deserialize (name_a, &checksum_a, &objtype_a);
+  ostree_object_name_deserialize (name_b, &checksum_b, &objtype_b);
+
+  c = strcmp (checksum_a, checksum_b);
+  if (c != 0)
+    return c;
+  return (int)objtype_a - (int)objtype_b;
+}
+
+static gboolean
+sync_and_close (OstreeRepo     *self,
+                GOutputStream  *out,
+                GCancellable   *cancellable,
+                GError        **error)
+{
+  if (!self->disable_fsync)
+    {
+      int fd = g_file_descriptor_based_get_fd ((GFileDescriptorBased*)out);
+      if (fsync (fd) == -1)
+        {
+          ot_util_set_error_from_errno (error, errno);
+          return FALSE;
+        }
+    }
+  return g_output_stream_close (out, cancellable, error);
+}
+
+static gboolean
+write_one_pack (OstreeRepo     *self,
+                const char     *prefix,
+                GPtrArray      *objects,
+                char          **out_name,
+                GCancellable   *cancellable,
+                GError        **error)
+{
+  gboolean ret = FALSE;
+  guint i;
+  guint64 offset = 0;
+  OstreePackIndexHeader header;
+  guint32 fanout[256] = { 0, };
+  gs_free char *index_checksum = NULL;
+  gs_free char *index_name = NULL;
+  gs_free char *data_name = NULL;
+  gs_free char *deleted_name = NULL;
+  gs_unref_object GFile *pack_dir = NULL;
+  gs_unref_object GFile *deleted_path = NULL;
+  gs_unref_object GFile *index_tmppath = NULL;
+  gs_unref_object GFile *data_tmppath = NULL;
+  gs_unref_object GFile *index_path = NULL;
+  gs_unref_object GFile *data_path = NULL;
+  gs_unref_object GOutputStream *index_out = NULL;
+  gs_unref_object GOutputStream *data_out = NULL;
+  GByteArray *entries = g_byte_array_new ();
+  gsize bytes_written;
+
+  g_ptr_array_sort (objects, compare_object_names);
+
+  if (!gs_file_open_in_tmpdir (self->tmp_dir, 0644, &data_tmppath, &data_out,
+                               cancellable, error))
+    goto out;
+
+  for (i = 0; i < objects->len; i++)
+    {
+      GVariant *serialized_key = objects->pdata[i];
+      const char *checksum;
+      OstreeObjectType objtype;
+      gssize size;
+      OstreePackIndexEntry entry = { { 0, }, };
+      gs_unref_bytes GBytes *packed_data = NULL;
+      gs_unref_object GInputStream *in = NULL;
+
+      ostree_object_name_deserialize (serialized_key, &checksum, &objtype);
+
+      /* When repacking, objects are copied out of the existing packs */
+      if (!_ostree_repo_find_packed_object (self, objtype, checksum, &packed_data,
+                                            cancellable, error))
+        goto out;
+
+      if (packed_data)
+        in = g_memory_input_stream_new_from_bytes (packed_data);
+      else
+        {
+          char loose_path[_OSTREE_LOOSE_PATH_MAX];
+          int fd = -1;
+
+          _ostree_loose_path (loose_path, checksum, objtype, self->mode);
+          if (!gs_file_openat_noatime (self->objects_dir_fd, loose_path, &fd,
+                                       cancellable, error))
+            goto out;
+          in = g_unix_input_stream_new (fd, TRUE);
+        }
+
+      size = g_output_stream_splice (data_out, in, G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE,
+                                     cancellable, error);
+      if (size < 0)
+        goto out;
+
+      ostree_checksum_inplace_to_bytes (checksum, entry.csum);
+      entry.objtype = (guint8) objtype;
+      entry.offset = GUINT64_TO_BE (offset);
+      entry.size = GUINT64_TO_BE ((guint64) size);
+      g_byte_array_append (entries, (guint8*)&entry, sizeof (entry));
+
+      fanout[entry.csum[0]]++;
+      offset += size;
+    }
+
+  if (!sync_and_close (self, data_out, cancellable, error))
+    goto out;
+
+  memset (&header, 0, sizeof (header));
+  memcpy (header.magic, OSTREE_PACK_INDEX_MAGIC, sizeof (OSTREE_PACK_INDEX_MAGIC));
+  header.version = GUINT32_TO_BE (OSTREE_PACK_INDEX_VERSION);
+  header.n_entries = GUINT32_TO_BE (objects->len);
+  for (i = 0; i < 256; i++)
+    {
+      if (i > 0)
+        fanout[i] += fanout[i-1];
+      header.fanout[i] = GUINT32_TO_BE (fanout[i]);
+    }
+  g_byte_array_prepend (entries, (guint8*)&header, sizeof (header));
+
+  index_checksum = g_compute_checksum_for_data (G_CHECKSUM_SHA256, entries->data, entries->len);
+
+  if (!gs_file_open_in_tmpdir (self->tmp_dir, 0644, &index_tmppath, &index_out,
+                               cancellable, error))
+    goto out;
+  if (!g_output_stream_write_all (index_out, entries->data, entries->len,
+                                  &bytes_written, cancellable, error))
+    goto out;
+  if (!sync_and_close (self, index_out, cancellable, error))
+    goto out;
+
+  pack_dir = g_file_get_child (self->objects_dir, "pack");
+  if (!gs_file_ensure_directory (pack_dir, FALSE, cancellable, error))
+    goto out;
+
+  data_name = g_strconcat (prefix, index_checksum, ".data", NULL);
+  index_name = g_strconcat (prefix, index_checksum, ".index", NULL);
+  data_path = g_file_get_child (pack_dir, data_name);
+  index_path = g_file_get_child (pack_dir, index_name);
+
+  /* A tombstone file left over from a removed pack of the same name
+   * would apply to this one.
+   */
+  deleted_name = g_strconcat (prefix, index_checksum, ".deleted", NULL);
+  deleted_path = g_file_get_child (pack_dir, deleted_name);
+  if (!ot_gfile_ensure_unlinked (deleted_path, cancellable, error))
+    goto out;
+
+  /* Readers only look at index files, so rename it last */
+  if (!gs_file_rename (data_tmppath, data_path, cancellable, error))
+    goto out;
+  if (!gs_file_rename (index_tmppath, index_path, cancellable, error))
+    goto out;
+
+  ret = TRUE;
+  if (out_name)
+    *out_name = g_strconcat (prefix, index_checksum, NULL);
+ out:
+  g_byte_array_unref (entries);
+  return ret;
+}
+
+static gboolean
+remove_pack (OstreeRepo     *self,
+             const char     *name,
+             GCancellable   *cancellable,
+             GError        **error)
+{
+  gboolean ret = FALSE;
+  gs_free char *index_name = g_strconcat (name, ".index", NULL);
+  gs_free char *data_name = g_strconcat (name, ".data", NULL);
+  gs_free char *deleted_name = g_strconcat (name, ".deleted", NULL);
+  gs_unref_object GFile *pack_dir = g_file_get_child (self->objects_dir, "pack");
+  gs_unref_object GFile *index_path = g_file_get_child (pack_dir, index_name);
+  gs_unref_object GFile *data_path = g_file_get_child (pack_dir, data_name);
+  gs_unref_object GFile *deleted_path = g_file_get_child (pack_dir, deleted_name);
+
+  /* Index first, so that readers never see a pack without its data */
+  if (!ot_gfile_ensure_unlinked (index_path, cancellable, error))
+    goto out;
+  if (!ot_gfile_ensure_unlinked (data_path, cancellable, error))
+    goto out;
+  if (!ot_gfile_ensure_unlinked (deleted_path, cancellable, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+static void
+invalidate_pack_indexes (OstreeRepo *self)
+{
+  g_mutex_lock (&self->cache_lock);
+  g_clear_pointer (&self->cached_meta_indexes, (GDestroyNotify) g_ptr_array_unref);
+  g_clear_pointer (&self->cached_content_indexes, (GDestroyNotify) g_ptr_array_unref);
+  g_mutex_unlock (&self->cache_lock);
+}
+
+static int
+compare_strings (gconstpointer  a,
+                 gconstpointer  b)
+{
+  return strcmp (*((const char**)a), *((const char**)b));
+}
+
+/*
+ * Update objects/pack/packs, the list of the current packs, one name
+ * per line.  There is no directory listing over HTTP, so this is how
+ * pulls find them.
+ */
+static gboolean
+write_pack_list (OstreeRepo     *self,
+                 GCancellable   *cancellable,
+                 GError        **error)
+{
+  gboolean ret = FALSE;
+  guint i;
+  gs_unref_object GFile *pack_dir = g_file_get_child (self->objects_dir, "pack");
+  gs_unref_object GFile *list_path = g_file_get_child (pack_dir, "packs");
+  gs_unref_object GFileEnumerator *dir_enum = NULL;
+  gs_unref_ptrarray GPtrArray *names = g_ptr_array_new_with_free_func (g_free);
+  GString *buf = g_string_new ("");
+
+  dir_enum = g_file_enumerate_children (pack_dir, OSTREE_GIO_FAST_QUERYINFO,
+                                        G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                        cancellable, error);
+  if (!dir_enum)
+    goto out;
+
+  while (TRUE)
+    {
+      GFileInfo *file_info;
+      const char *name;
+      char *pack_name;
+
+      if (!gs_file_enumerator_iterate (dir_enum, &file_info, NULL,
+                                       cancellable, error))
+        goto out;
+      if (file_info == NULL)
+        break;
+
+      name = g_file_info_get_name (file_info);
+      if (!g_str_has_suffix (name, ".index"))
+        continue;
+
+      pack_name = g_strndup (name, strlen (name) - strlen (".index"));
+      if (!_ostree_repo_validate_pack_name (pack_name, NULL))
+        {
+          g_free (pack_name);
+          continue;
+        }
+      g_ptr_array_add (names, pack_name);
+    }
+
+  g_ptr_array_sort (names, compare_strings);
+  for (i = 0; i < names->len; i++)
+    {
+      g_string_append (buf, names->pdata[i]);
+      g_string_append_c (buf, '\n');
+    }
+
+  if (!g_file_replace_contents (list_path, buf->str, buf->len, NULL, FALSE, 0, NULL,
+                                cancellable, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  g_string_free (buf, TRUE);
+  return ret;
+}
+
+typedef gboolean (*PackEntryKeepFunc) (const OstreePackIndexEntry  *entry,
+                                       gpointer                     user_data);
+
+/*
+ * Rewrite every pack holding an entry for which @keep_func returns
+ * %FALSE, without those entries.  Tombstoned entries are dropped
+ * too, but not counted.
+ */
+static gboolean
+filter_packs (OstreeRepo          *self,
+              PackEntryKeepFunc    keep_func,
+              gpointer             user_data,
+              gboolean             dry_run,
+              guint               *out_n_kept,
+              guint               *out_n_dropped,
+              guint64             *out_dropped_size,
+              GCancellable        *cancellable,
+              GError             **error)
+{
+  gboolean ret = FALSE;
+  guint i, j, k;
+  gboolean changed = FALSE;
+  guint n_kept = 0;
+  guint n_dropped = 0;
+  guint64 dropped_size = 0;
+  GPtrArray *all_indexes[2] = { NULL, NULL };
+  static const char *prefixes[2] = { OSTREE_PACK_META_PREFIX, OSTREE_PACK_CONTENT_PREFIX };
+
+  g_mutex_lock (&self->cache_lock);
+  if (!ensure_pack_indexes_locked (self, cancellable, error))
+    {
+      g_mutex_unlock (&self->cache_lock);
+      goto out;
+    }
+  /* The indexes stay mapped while we hold a reference */
+  all_indexes[0] = g_ptr_array_ref (self->cached_meta_indexes);
+  all_indexes[1] = g_ptr_array_ref (self->cached_content_indexes);
+  g_mutex_unlock (&self->cache_lock);
+
+  for (i = 0; i < G_N_ELEMENTS (all_indexes); i++)
+    {
+      for (j = 0; j < all_indexes[i]->len; j++)
+        {
+          OstreeRepoPackIndex *index = all_indexes[i]->pdata[j];
+          guint n_dropped_here = 0;
+          gs_unref_ptrarray GPtrArray *kept =
+            g_ptr_array_new_with_free_func ((GDestroyNotify) g_variant_unref);
+
+          for (k = 0; k < index->n_entries; k++)
+            {
+              const OstreePackIndexEntry *entry = &index->entries[k];
+
+              if (pack_entry_is_deleted (index, entry))
+                n_dropped_here++;
+              else if (keep_func (entry, user_data))
+                {
+                  char checksum[65];
+
+                  ostree_checksum_inplace_from_bytes (entry->csum, checksum);
+                  g_ptr_array_add (kept, g_variant_ref_sink (ostree_object_name_serialize (checksum, entry->objtype)));
+                  n_kept++;
+                }
+              else
+                {
+                  n_dropped_here++;
+                  n_dropped++;
+                  dropped_size += GUINT64_FROM_BE (entry->size);
+                }
+            }
+
+          if (n_dropped_here == 0 || dry_run)
+            continue;
+
+          if (kept->len > 0)
+            {
+              if (!write_one_pack (self, prefixes[i], kept, NULL, cancellable, error))
+                goto out;
+            }
+          if (!remove_pack (self, index->name, cancellable, error))
+            goto out;
+          changed = TRUE;
+        }
+    }
+
+  if (changed)
+    {
+      if (!write_pack_list (self, cancellable, error))
+        goto out;
+    }
+
+  ret = TRUE;
+  if (out_n_kept)
+    *out_n_kept = n_kept;
+  if (out_n_dropped)
+    *out_n_dropped = n_dropped;
+  if (out_dropped_size)
+    *out_dropped_size = dropped_size;
+ out:
+  if (changed)
+    invalidate_pack_indexes (self);
+  for (i = 0; i < G_N_ELEMENTS (all_indexes); i++)
+    {
+      if (all_indexes[i])
+        g_ptr_array_unref (all_indexes[i]);
+    }
+  return ret;
+}
+
+static gboolean
+keep_reachable (const OstreePackIndexEntry  *entry,
+                gpointer                     user_data)
+{
+  OstreeObjectSet *reachable = user_data;
+  return ostree_object_set_contains (reachable, entry->csum, entry->objtype);
+}
+
+/*
+ * _ostree_repo_prune_packed_objects:
+ * @reachable: Objects to keep
+ * @dry_run: If %TRUE, only count the unreachable objects
+ *
+ * Drop all packed objects not in @reachable, rewriting the packs
+ * which contained them.
+ */
+gboolean
+_ostree_repo_prune_packed_objects (OstreeRepo       *self,
+                                   OstreeObjectSet  *reachable,
+                                   gboolean          dry_run,
+                                   guint            *out_n_reachable,
+                                   guint            *out_n_unreachable,
+                                   guint64          *out_freed_bytes,
+                                   GCancellable     *cancellable,
+                                   GError          **error)
+{
+  return filter_packs (self, keep_reachable, reachable, dry_run,
+                       out_n_reachable, out_n_unreachable, out_freed_bytes,
+                       cancellable, error);
+}
+
+static gboolean
+append_tombstone (OstreeRepo                 *self,
+                  OstreeRepoPackIndex        *index,
+                  const OstreePackTombstone  *tombstone,
+                  GCancellable               *cancellable,
+                  GError                    **error)
+{
+  gboolean ret = FALSE;
+  int fd = -1;
+  gssize bytes_written;
+  gs_free char *deleted_path = g_strconcat ("pack/", index->name, ".deleted", NULL);
+
+  fd = openat (self->objects_dir_fd, deleted_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+  if (fd == -1)
+    {
+      ot_util_set_error_from_errno (error, errno);
+      goto out;
+    }
+
+  /* A single write, so that a record is either there or truncated */
+  do
+    bytes_written = write (fd, tombstone, sizeof (*tombstone));
+  while (G_UNLIKELY (bytes_written == -1 && errno == EINTR));
+  if (bytes_written == -1)
+    {
+      ot_util_set_error_from_errno (error, errno);
+      goto out;
+    }
+  if (bytes_written != sizeof (*tombstone))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Short write to %s", deleted_path);
+      goto out;
+    }
+
+  if (!self->disable_fsync && fsync (fd) == -1)
+    {
+      ot_util_set_error_from_errno (error, errno);
+      goto out;
+    }
+
+  ret = TRUE;
+ out:
+  if (fd != -1)
+    (void) close (fd);
+  return ret;
+}
+
+/*
+ * _ostree_repo_delete_packed_object:
+ * @out_deleted: (out): Whether the object was found in a pack
+ *
+ * Remove an object from all the packs of @self, by recording a
+ * tombstone for each pack holding it.  The space is reclaimed when
+ * the pack is next rewritten by a prune or repack.
+ */
+gboolean
+_ostree_repo_delete_packed_object (OstreeRepo         *self,
+                                   OstreeObjectType    objtype,
+                                   const char         *checksum,
+                                   gboolean           *out_deleted,
+                                   GCancellable       *cancellable,
+                                   GError            **error)
+{
+  gboolean ret = FALSE;
+  guint i;
+  gboolean deleted = FALSE;
+  GPtrArray *indexes;
+  OstreePackTombstone tombstone;
+
+  ostree_checksum_inplace_to_bytes (checksum, tombstone.csum);
+  tombstone.objtype = (guint8) objtype;
+
+  g_mutex_lock (&self->cache_lock);
+
+  if (!ensure_pack_indexes_locked (self, cancellable, error))
+    goto out;
+
+  indexes = OSTREE_OBJECT_TYPE_IS_META (objtype) ?
+    self->cached_meta_indexes : self->cached_content_indexes;
+
+  for (i = 0; i < indexes->len; i++)
+    {
+      OstreeRepoPackIndex *index = indexes->pdata[i];
+
+      if (!pack_index_lookup (index, objtype, tombstone.csum))
+        continue;
+
+      if (!append_tombstone (self, index, &tombstone, cancellable, error))
+        goto out;
+      ostree_object_set_add (index->deleted, tombstone.csum, objtype);
+      deleted = TRUE;
+    }
+
+  ret = TRUE;
+  *out_deleted = deleted;
+ out:
+  g_mutex_unlock (&self->cache_lock);
+  return ret;
+}
+
+typedef struct {
+  const char *prefix;
+  GPtrArray *objects;
+  GHashTable *old_packs;
+  guint n_unpacked;
+  gboolean has_tombstones;
+} PackKind;
+
+static gboolean
+pack_objects_internal (OstreeRepo        *self,
+                       gboolean           repack,
+                       guint             *out_n_packed,
+                       GCancellable      *cancellable,
+                       GError           **error)
+{
+  gboolean ret = FALSE;
+  GHashTableIter hashiter;
+  gpointer key, value;
+  guint i, j;
+  guint n_packed = 0;
+  PackKind kinds[2];
+  gs_unref_hashtable GHashTable *objects = NULL;
+
+  kinds[0].prefix = OSTREE_PACK_META_PREFIX;
+  kinds[1].prefix = OSTREE_PACK_CONTENT_PREFIX;
+  for (i = 0; i < G_N_ELEMENTS (kinds); i++)
+    {
+      kinds[i].objects = g_ptr_array_new_with_free_func ((GDestroyNotify) g_variant_unref);
+      kinds[i].old_packs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+      kinds[i].n_unpacked = 0;
+      kinds[i].has_tombstones = FALSE;
+    }
+
+  /* Repacking replaces all the packs, including the ones whose
+   * entries are all tombstoned, and so aren't listed below.
+   */
+  if (repack)
+    {
+      g_mutex_lock (&self->cache_lock);
+      if (!ensure_pack_indexes_locked (self, cancellable, error))
+        {
+          g_mutex_unlock (&self->cache_lock);
+          goto out;
+        }
+      for (i = 0; i < G_N_ELEMENTS (kinds); i++)
+        {
+          GPtrArray *indexes = i == 0 ? self->cached_meta_indexes : self->cached_content_indexes;
+
+          for (j = 0; j < indexes->len; j++)
+            {
+              OstreeRepoPackIndex *index = indexes->pdata[j];
+
+              g_hash_table_add (kinds[i].old_packs, g_strdup (index->name));
+              if (ostree_object_set_get_size (index->deleted) > 0)
+                kinds[i].has_tombstones = TRUE;
+            }
+        }
+      g_mutex_unlock (&self->cache_lock);
+    }
+
+  if (!ostree_repo_list_objects (self, OSTREE_REPO_LIST_OBJECTS_ALL, &objects,
+                                 cancellable, error))
+    goto out;
+
+  g_hash_table_iter_init (&hashiter, objects);
+  while (g_hash_table_iter_next (&hashiter, &key, &value))
+    {
+      GVariant *serialized_key = key;
+      const char *checksum;
+      OstreeObjectType objtype;
+      gboolean is_loose;
+      gboolean is_packed;
+      gs_free const char **packs = NULL;
+      PackKind *kind;
+
+      ostree_object_name_deserialize (serialized_key, &checksum, &objtype);
+
+      if (!OSTREE_OBJECT_TYPE_IS_META (objtype) &&
+          self->mode != OSTREE_REPO_MODE_ARCHIVE_Z2)
+        continue;
+
+      kind = OSTREE_OBJECT_TYPE_IS_META (objtype) ? &kinds[0] : &kinds[1];
+
+      g_variant_get ((GVariant*) value, "(b^a&s)", &is_loose, &packs);
+      is_packed = packs != NULL && packs[0] != NULL;
+
+      if (is_packed)
+        {
+          if (!repack)
+            continue;
+        }
+      else
+        {
+          gboolean is_stored;
+          char loose_path[_OSTREE_LOOSE_PATH_MAX];
+
+          /* Objects from a parent repository are listed too */
+          if (!_ostree_repo_has_loose_object (self, checksum, objtype, &is_stored,
+                                              loose_path, cancellable, error))
+            goto out;
+          if (!is_stored)
+            continue;
+          kind->n_unpacked++;
+        }
+
+      g_ptr_array_add (kind->objects, g_variant_ref (serialized_key));
+    }
+
+  for (i = 0; i < G_N_ELEMENTS (kinds); i++)
+    {
+      PackKind *kind = &kinds[i];
+      gs_free char *new_name = NULL;
+
+      /* Nothing to gain */
+      if (kind->n_unpacked == 0 && g_hash_table_size (kind->old_packs) <= 1 &&
+          !kind->has_tombstones)
+        continue;
+
+      /* Everything packed was deleted */
+      if (kind->objects->len == 0)
+        {
+          g_hash_table_iter_init (&hashiter, kind->old_packs);
+          while (g_hash_table_iter_next (&hashiter, &key, NULL))
+            {
+              if (!remove_pack (self, key, cancellable, error))
+                goto out;
+            }
+          invalidate_pack_indexes (self);
+          if (!write_pack_list (self, cancellable, error))
+            goto out;
+          continue;
+        }
+
+      if (!write_one_pack (self, kind->prefix, kind->objects, &new_name,
+                           cancellable, error))
+        goto out;
+      n_packed += kind->objects->len;
+
+      /* The new pack holds all the objects of the ones it supersedes;
+       * it may also have the same name as one of them.
+       */
+      g_hash_table_remove (kind->old_packs, new_name);
+
+      invalidate_pack_indexes (self);
+
+      g_hash_table_iter_init (&hashiter, kind->old_packs);
+      while (g_hash_table_iter_next (&hashiter, &key, NULL))
+        {
+          if (!remove_pack (self, key, cancellable, error))
+            goto out;
+        }
+
+      if (!write_pack_list (self, cancellable, error))
+        goto out;
+
+      /* Now that the pack is in place, the loose copies are redundant */
+      for (j = 0; j < kind->objects->len; j++)
+        {
+          const char *checksum;
+          OstreeObjectType objtype;
+          char loose_path[_OSTREE_LOOSE_PATH_MAX];
+
+          ostree_object_name_deserialize (kind->objects->pdata[j], &checksum, &objtype);
+          _ostree_loose_path (loose_path, checksum, objtype, self->mode);
+
+          if (G_UNLIKELY (unlinkat (self->objects_dir_fd, loose_path, 0) == -1))
+            {
+              if (errno != ENOENT)
+                {
+                  ot_util_set_error_from_errno (error, errno);
+                  goto out;
+                }
+            }
+        }
+    }
+
+  ret = TRUE;
+  if (out_n_packed)
+    *out_n_packed = n_packed;
+ out:
+  for (i = 0; i < G_N_ELEMENTS (kinds); i++)
+    {
+      g_ptr_array_unref (kinds[i].objects);
+      g_hash_table_unref (kinds[i].old_packs);
+    }
+  return ret;
+}
+
+/**
+ * ostree_repo_pack_loose_objects:
+ * @self: Repo
+ * @out_n_packed: (out) (allow-none): Number of objects packed
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Fold all loose metadata objects, and for archive-z2 repositories
+ * all loose content objects, which are not yet packed into new pack
+ * files.  The loose copies are then deleted, reducing the number of
+ * files; pulls from an archive-z2 repository fetch packed objects as
+ * ranges of the pack data.
+ *
+ * Like ostree_repo_prune(), this should not be run concurrently with
+ * other processes using the repository.
+ */
+gboolean
+ostree_repo_pack_loose_objects (OstreeRepo        *self,
+                                guint             *out_n_packed,
+                                GCancellable      *cancellable,
+                                GError           **error)
+{
+  return pack_objects_internal (self, FALSE, out_n_packed, cancellable, error);
+}
+
+/**
+ * ostree_repo_repack_objects:
+ * @self: Repo
+ * @out_n_packed: (out) (allow-none): Number of objects in the new packs
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Like ostree_repo_pack_loose_objects(), but also merge all existing
+ * packs into a single metadata pack and a single content pack.
+ */
+gboolean
+ostree_repo_repack_objects (OstreeRepo        *self,
+                            guint             *out_n_packed,
+                            GCancellable      *cancellable,
+                            GError           **error)
+{
+  return pack_objects_internal (self, TRUE, out_n_packed, cancellable, error);
+}
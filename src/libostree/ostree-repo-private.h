@@ -24,6 +24,12 @@
 
 G_BEGIN_DECLS
 
+typedef struct OstreeRepoPackIndex OstreeRepoPackIndex;
+typedef struct OstreeRepoDevinoCache OstreeRepoDevinoCache;
+typedef struct OstreeRepoMetadataCache OstreeRepoMetadataCache;
+
+#define _OSTREE_METADATA_CACHE_MAX_ENTRIES 1024
+
 #define _OSTREE_OBJECT_SIZES_ENTRY_SIGNATURE "ay"
 
 /**
@@ -55,11 +61,17 @@ struct OstreeRepo {
   GMutex cache_lock;
   GPtrArray *cached_meta_indexes;
   GPtrArray *cached_content_indexes;
+  OstreeRepoMetadataCache *metadata_cache;
 
   gboolean inited;
   gboolean in_transaction;
   gboolean disable_fsync;
-  GHashTable *loose_object_devino_hash;
+  gboolean batch_fsync;
+  int txn_marker_fd;
+  char *txn_marker_name;
+  OstreeRepoDevinoCache *devino_cache;
+  gboolean devino_cache_checked;
+  gboolean use_devino_cache;
   GHashTable *updated_uncompressed_dirs;
   GHashTable *object_sizes;
 
@@ -98,12 +110,158 @@ _ostree_repo_has_loose_object (OstreeRepo           *self,
                                GCancellable         *cancellable,
                                GError             **error);
 
+gboolean
+_ostree_repo_parse_loose_object_name (OstreeRepo        *self,
+                                      const char        *prefix,
+                                      const char        *name,
+                                      char              *out_checksum,
+                                      OstreeObjectType  *out_objtype);
+
+gboolean
+_ostree_repo_list_loose_objects_fanout (OstreeRepo        *self,
+                                        guint              fanout,
+                                        OstreeObjectSet   *inout_objects,
+                                        GCancellable      *cancellable,
+                                        GError           **error);
+
 gboolean
 _ostree_repo_get_loose_object_dirs (OstreeRepo       *self,
                                     GPtrArray       **out_object_dirs,
                                     GCancellable     *cancellable,
                                     GError          **error);
 
+gboolean
+_ostree_repo_devino_cache_ensure (OstreeRepo     *self,
+                                  gboolean        create,
+                                  GCancellable   *cancellable,
+                                  GError        **error);
+
+gboolean
+_ostree_repo_devino_cache_insert (OstreeRepo     *self,
+                                  const char     *checksum,
+                                  guint64         dev,
+                                  guint64         ino,
+                                  GCancellable   *cancellable,
+                                  GError        **error);
+
+gboolean
+_ostree_repo_devino_cache_lookup (OstreeRepo     *self,
+                                  guint64         dev,
+                                  guint64         ino,
+                                  char           *out_checksum);
+
+void
+_ostree_repo_devino_cache_free (OstreeRepoDevinoCache *cache);
+
+gboolean
+_ostree_repo_metadata_cache_is_cacheable (OstreeObjectType objtype);
+
+OstreeRepoMetadataCache *
+_ostree_repo_metadata_cache_new (guint max_entries);
+
+GVariant *
+_ostree_repo_metadata_cache_lookup (OstreeRepoMetadataCache *cache,
+                                    OstreeObjectType         objtype,
+                                    const guchar            *csum);
+
+void
+_ostree_repo_metadata_cache_insert (OstreeRepoMetadataCache *cache,
+                                    OstreeObjectType         objtype,
+                                    const guchar            *csum,
+                                    GVariant                *variant);
+
+void
+_ostree_repo_metadata_cache_clear (OstreeRepoMetadataCache *cache);
+
+void
+_ostree_repo_metadata_cache_free (OstreeRepoMetadataCache *cache);
+
+gboolean
+_ostree_repo_load_variant_csum (OstreeRepo       *self,
+                                OstreeObjectType  objtype,
+                                const guchar     *csum,
+                                GVariant        **out_variant,
+                                GError          **error);
+
+void
+_ostree_repo_pack_index_free (OstreeRepoPackIndex *index);
+
+const char *
+_ostree_repo_pack_index_get_name (OstreeRepoPackIndex *index);
+
+gboolean
+_ostree_repo_validate_pack_name (const char  *name,
+                                 GError     **error);
+
+gboolean
+_ostree_repo_open_pack_index (GFile                 *index_path,
+                              const char            *name,
+                              gboolean               verify,
+                              OstreeRepoPackIndex  **out_index,
+                              GCancellable          *cancellable,
+                              GError               **error);
+
+gboolean
+_ostree_repo_pack_index_lookup (OstreeRepoPackIndex  *index,
+                                OstreeObjectType      objtype,
+                                const char           *checksum,
+                                guint64              *out_offset,
+                                guint64              *out_size);
+
+gboolean
+_ostree_repo_find_packed_object (OstreeRepo           *self,
+                                 OstreeObjectType      objtype,
+                                 const char           *checksum,
+                                 GBytes              **out_data,
+                                 GCancellable         *cancellable,
+                                 GError              **error);
+
+gboolean
+_ostree_repo_list_packed_objects (OstreeRepo     *self,
+                                  GHashTable     *inout_objects,
+                                  GCancellable   *cancellable,
+                                  GError        **error);
+
+gboolean
+_ostree_repo_list_packed_commits (OstreeRepo     *self,
+                                  GHashTable     *inout_commits,
+                                  GCancellable   *cancellable,
+                                  GError        **error);
+
+gboolean
+_ostree_repo_prune_packed_objects (OstreeRepo       *self,
+                                   OstreeObjectSet  *reachable,
+                                   gboolean          dry_run,
+                                   guint            *out_n_reachable,
+                                   guint            *out_n_unreachable,
+                                   guint64          *out_freed_bytes,
+                                   GCancellable     *cancellable,
+                                   GError          **error);
+
+gboolean
+_ostree_repo_delete_packed_object (OstreeRepo         *self,
+                                   OstreeObjectType    objtype,
+                                   const char         *checksum,
+                                   gboolean           *out_deleted,
+                                   GCancellable       *cancellable,
+                                   GError            **error);
+
+gboolean
+_ostree_repo_write_archived_content (OstreeRepo        *self,
+                                     const char        *expected_checksum,
+                                     GFile             *archived_path,
+                                     guchar           **out_csum,
+                                     GCancellable      *cancellable,
+                                     GError           **error);
+
+void
+_ostree_repo_write_archived_content_async (OstreeRepo               *self,
+                                           const char               *expected_checksum,
+                                           GFile                    *archived_path,
+                                           GCancellable             *cancellable,
+                                           GAsyncReadyCallback       callback,
+                                           gpointer                  user_data);
+
 GFile *
 _ostree_repo_get_object_path (OstreeRepo   *self,
                               const char   *checksum,
@@ -139,5 +297,14 @@ _ostree_repo_commit_modifier_apply (OstreeRepo               *self,
                                     GFileInfo                *file_info,
                                     GFileInfo               **out_modified_info);
 
+gboolean
+_ostree_repo_gpg_verify_data_with_metadata (OstreeRepo          *self,
+                                            GBytes              *data,
+                                            GVariant            *metadata,
+                                            GFile               *keyringdir,
+                                            GFile               *extra_keyring,
+                                            GCancellable        *cancellable,
+                                            GError             **error);
+
 G_END_DECLS
 
@@ -25,75 +25,230 @@
 #include "ostree-repo-private.h"
 #include "otutil.h"
 
+static const gchar hexchars[] = "0123456789abcdef";
+
+/*
+ * Objects are swept one fanout directory per job, using only
+ * readdir() and the *at() syscalls.  The set of reachable objects is
+ * fully built before any job starts, and only read by the workers.
+ */
 typedef struct {
   OstreeRepo *repo;
-  GHashTable *reachable;
+  OstreeRepoPruneFlags flags;
+  OstreeObjectSet *reachable;
+  GCancellable *cancellable;
+
+  GMutex lock;
   guint n_reachable_meta;
   guint n_reachable_content;
   guint n_unreachable_meta;
   guint n_unreachable_content;
+  guint n_reachable_packed;
+  guint n_unreachable_packed;
   guint64 freed_bytes;
+
+  volatile gint failed;
+  GError *error;
 } OtPruneData;
 
 static gboolean
-maybe_prune_loose_object (OtPruneData        *data,
-                          OstreeRepoPruneFlags    flags,
-                          const char         *checksum,
-                          OstreeObjectType    objtype,
-                          GCancellable       *cancellable,
-                          GError            **error)
+open_objdir (OstreeRepo        *repo,
+             guint              c,
+             char              *prefix,
+             DIR              **out_dir,
+             GError           **error)
+{
+  int dfd;
+
+  prefix[0] = hexchars[c >> 4];
+  prefix[1] = hexchars[c & 0xF];
+  prefix[2] = '\0';
+
+  *out_dir = NULL;
+  dfd = openat (repo->objects_dir_fd, prefix, O_RDONLY | O_NONBLOCK | O_DIRECTORY | O_CLOEXEC);
+  if (dfd == -1)
+    {
+      if (errno == ENOENT)
+        return TRUE;
+      ot_util_set_error_from_errno (error, errno);
+      return FALSE;
+    }
+
+  *out_dir = fdopendir (dfd);
+  if (!*out_dir)
+    {
+      (void) close (dfd);
+      ot_util_set_error_from_errno (error, errno);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+list_loose_commits (OstreeRepo        *repo,
+                    GHashTable        *inout_commits,
+                    GCancellable      *cancellable,
+                    GError           **error)
 {
   gboolean ret = FALSE;
-  gs_unref_variant GVariant *key = NULL;
-  gs_unref_object GFile *objf = NULL;
+  guint c;
+  DIR *d = NULL;
 
-  key = ostree_object_name_serialize (checksum, objtype);
+  for (c = 0; c < 256; c++)
+    {
+      char prefix[3];
+      struct dirent *dent;
 
-  objf = _ostree_repo_get_object_path (data->repo, checksum, objtype);
+      if (!open_objdir (repo, c, prefix, &d, error))
+        goto out;
+      if (!d)
+        continue;
 
-  if (!g_hash_table_lookup_extended (data->reachable, key, NULL, NULL))
+      while ((dent = readdir (d)) != NULL)
+        {
+          char checksum[65];
+          OstreeObjectType objtype;
+
+          if (!_ostree_repo_parse_loose_object_name (repo, prefix, dent->d_name, checksum, &objtype))
+            continue;
+          if (objtype == OSTREE_OBJECT_TYPE_COMMIT)
+            g_hash_table_add (inout_commits, g_strdup (checksum));
+        }
+
+      (void) closedir (d);
+      d = NULL;
+    }
+
+  ret = TRUE;
+ out:
+  if (d)
+    (void) closedir (d);
+  return ret;
+}
+
+static gboolean
+prune_loose_objects_at (OtPruneData       *data,
+                        guint              c,
+                        GCancellable      *cancellable,
+                        GError           **error)
+{
+  gboolean ret = FALSE;
+  char prefix[3];
+  DIR *d = NULL;
+  struct dirent *dent;
+  guint n_reachable_meta = 0;
+  guint n_reachable_content = 0;
+  guint n_unreachable_meta = 0;
+  guint n_unreachable_content = 0;
+  guint64 freed_bytes = 0;
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    goto out;
+
+  if (!open_objdir (data->repo, c, prefix, &d, error))
+    goto out;
+
+  while (d && (dent = readdir (d)) != NULL)
     {
-      if (!(flags & OSTREE_REPO_PRUNE_FLAGS_NO_PRUNE))
+      const char *name = dent->d_name;
+      char checksum[65];
+      guchar csum[32];
+      OstreeObjectType objtype;
+      gboolean is_meta;
+
+      if (!_ostree_repo_parse_loose_object_name (data->repo, prefix, name, checksum, &objtype))
+        continue;
+
+      ostree_checksum_inplace_to_bytes (checksum, csum);
+      is_meta = OSTREE_OBJECT_TYPE_IS_META (objtype);
+
+      if (ostree_object_set_contains (data->reachable, csum, objtype))
         {
-          gs_unref_object GFileInfo *info = NULL;
+          if (is_meta)
+            n_reachable_meta++;
+          else
+            n_reachable_content++;
+          continue;
+        }
 
-          if (!ot_gfile_query_info_allow_noent (objf, OSTREE_GIO_FAST_QUERYINFO,
-                                                G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
-                                                &info, cancellable, error))
-            goto out;
+      if (!(data->flags & OSTREE_REPO_PRUNE_FLAGS_NO_PRUNE))
+        {
+          struct stat stbuf;
 
-          if (info)
+          if (fstatat (dirfd (d), name, &stbuf, AT_SYMLINK_NOFOLLOW) != 0)
+            {
+              if (errno != ENOENT)
+                {
+                  ot_util_set_error_from_errno (error, errno);
+                  goto out;
+                }
+            }
+          else
             {
               if (objtype == OSTREE_OBJECT_TYPE_COMMIT)
                 {
-                  gs_unref_object GFile *detached_metadata =
-                    _ostree_repo_get_commit_metadata_loose_path (data->repo, checksum);
-                  if (!ot_gfile_ensure_unlinked (detached_metadata, cancellable, error))
-                    goto out;
+                  gs_free char *detached_metadata = g_strconcat (name, "meta", NULL);
+                  if (unlinkat (dirfd (d), detached_metadata, 0) != 0 && errno != ENOENT)
+                    {
+                      ot_util_set_error_from_errno (error, errno);
+                      goto out;
+                    }
+                }
+              if (unlinkat (dirfd (d), name, 0) != 0)
+                {
+                  ot_util_set_error_from_errno (error, errno);
+                  goto out;
                 }
-              if (!gs_file_unlink (objf, cancellable, error))
-                goto out;
-              data->freed_bytes += g_file_info_get_size (info);
+              freed_bytes += stbuf.st_size;
             }
         }
-      if (OSTREE_OBJECT_TYPE_IS_META (objtype))
-        data->n_unreachable_meta++;
-      else
-        data->n_unreachable_content++;
-    }
-  else
-    {
-      if (OSTREE_OBJECT_TYPE_IS_META (objtype))
-        data->n_reachable_meta++;
+
+      if (is_meta)
+        n_unreachable_meta++;
       else
-        data->n_reachable_content++;
+        n_unreachable_content++;
     }
 
+  g_mutex_lock (&data->lock);
+  data->n_reachable_meta += n_reachable_meta;
+  data->n_reachable_content += n_reachable_content;
+  data->n_unreachable_meta += n_unreachable_meta;
+  data->n_unreachable_content += n_unreachable_content;
+  data->freed_bytes += freed_bytes;
+  g_mutex_unlock (&data->lock);
+
   ret = TRUE;
  out:
+  if (d)
+    (void) closedir (d);
   return ret;
 }
 
+static void
+prune_objdir_thread (gpointer   job,
+                     gpointer   user_data)
+{
+  OtPruneData *data = user_data;
+  guint c = GPOINTER_TO_UINT (job) - 1;
+  GError *local_error = NULL;
+
+  /* Once one directory failed, don't bother with the rest */
+  if (g_atomic_int_get (&data->failed))
+    return;
+
+  if (!prune_loose_objects_at (data, c, data->cancellable, &local_error))
+    {
+      g_mutex_lock (&data->lock);
+      if (data->error == NULL)
+        data->error = local_error;
+      else
+        g_error_free (local_error);
+      g_atomic_int_set (&data->failed, 1);
+      g_mutex_unlock (&data->lock);
+    }
+}
+
 /**
  * ostree_repo_prune:
  * @self: Repo
@@ -132,13 +287,18 @@ ostree_repo_prune (OstreeRepo        *self,
   gboolean ret = FALSE;
   GHashTableIter hash_iter;
   gpointer key, value;
-  gs_unref_hashtable GHashTable *objects = NULL;
+  guint c;
+  GThreadPool *pool;
+  gs_unref_hashtable GHashTable *commits = NULL;
   gs_unref_hashtable GHashTable *all_refs = NULL;
   OtPruneData data = { 0, };
   gboolean refs_only = flags & OSTREE_REPO_PRUNE_FLAGS_REFS_ONLY;
 
   data.repo = self;
-  data.reachable = ostree_repo_traverse_new_reachable ();
+  data.flags = flags;
+  data.reachable = ostree_object_set_new ();
+  data.cancellable = cancellable;
+  g_mutex_init (&data.lock);
 
   if (refs_only)
     {
@@ -152,62 +312,71 @@ ostree_repo_prune (OstreeRepo        *self,
         {
           const char *checksum = value;
           
-          if (!ostree_repo_traverse_commit_union (self, checksum, depth, data.reachable,
-                                            cancellable, error))
+          if (!ostree_repo_traverse_commit_set (self, checksum, depth, data.reachable,
+                                                cancellable, error))
             goto out;
         }
     }
+  else
+    {
+      commits = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
 
-  if (!ostree_repo_list_objects (self, OSTREE_REPO_LIST_OBJECTS_ALL, &objects,
-                                 cancellable, error))
-    goto out;
+      if (!list_loose_commits (self, commits, cancellable, error))
+        goto out;
+      if (self->parent_repo)
+        {
+          if (!list_loose_commits (self->parent_repo, commits, cancellable, error))
+            goto out;
+        }
+      if (!_ostree_repo_list_packed_commits (self, commits, cancellable, error))
+        goto out;
 
-  if (!refs_only)
-    {
-      g_hash_table_iter_init (&hash_iter, objects);
+      g_hash_table_iter_init (&hash_iter, commits);
       while (g_hash_table_iter_next (&hash_iter, &key, &value))
         {
-          GVariant *serialized_key = key;
-          const char *checksum;
-          OstreeObjectType objtype;
-
-          ostree_object_name_deserialize (serialized_key, &checksum, &objtype);
+          const char *checksum = key;
 
-          if (objtype != OSTREE_OBJECT_TYPE_COMMIT)
-            continue;
-          
-          if (!ostree_repo_traverse_commit_union (self, checksum, depth, data.reachable,
-                                                  cancellable, error))
+          if (!ostree_repo_traverse_commit_set (self, checksum, depth, data.reachable,
+                                                cancellable, error))
             goto out;
         }
     }
 
-  g_hash_table_iter_init (&hash_iter, objects);
-  while (g_hash_table_iter_next (&hash_iter, &key, &value))
-    {
-      GVariant *serialized_key = key;
-      GVariant *objdata = value;
-      const char *checksum;
-      OstreeObjectType objtype;
-      gboolean is_loose;
-      
-      ostree_object_name_deserialize (serialized_key, &checksum, &objtype);
-      g_variant_get_child (objdata, 0, "b", &is_loose);
+  /* Packed objects go first; those also stored loose are then counted
+   * by the loose sweep.
+   */
+  if (!_ostree_repo_prune_packed_objects (self, data.reachable,
+                                          (flags & OSTREE_REPO_PRUNE_FLAGS_NO_PRUNE) != 0,
+                                          &data.n_reachable_packed,
+                                          &data.n_unreachable_packed,
+                                          &data.freed_bytes,
+                                          cancellable, error))
+    goto out;
 
-      if (!is_loose)
-        continue;
+  pool = ot_thread_pool_new_nproc (prune_objdir_thread, &data);
+  for (c = 0; c < 256; c++)
+    g_thread_pool_push (pool, GUINT_TO_POINTER (c + 1), NULL);
+  g_thread_pool_free (pool, FALSE, TRUE);
 
-      if (!maybe_prune_loose_object (&data, flags, checksum, objtype,
-                                     cancellable, error))
-        goto out;
+  /* Don't keep serving deleted objects from memory */
+  _ostree_repo_metadata_cache_clear (self->metadata_cache);
+
+  if (data.error)
+    {
+      g_propagate_error (error, data.error);
+      data.error = NULL;
+      goto out;
     }
+
   ret = TRUE;
   *out_objects_total = (data.n_reachable_meta + data.n_unreachable_meta +
-                        data.n_reachable_content + data.n_unreachable_content);
-  *out_objects_pruned = (data.n_unreachable_meta + data.n_unreachable_content);
+                        data.n_reachable_content + data.n_unreachable_content +
+                        data.n_reachable_packed + data.n_unreachable_packed);
+  *out_objects_pruned = (data.n_unreachable_meta + data.n_unreachable_content +
+                         data.n_unreachable_packed);
   *out_pruned_object_size_total = data.freed_bytes;
  out:
-  if (data.reachable)
-    g_hash_table_unref (data.reachable);
+  ostree_object_set_free (data.reachable);
+  g_mutex_clear (&data.lock);
   return ret;
 }
@@ -52,18 +52,27 @@ typedef struct {
   
   gboolean          gpg_verify;
 
+  GVariant         *summary;
+  GVariant         *summary_deltas; /* a{sat}, or %NULL if the summary doesn't list them */
+  GPtrArray        *remote_packs; /* OstreeRepoPackIndex, from objects/pack/packs */
+
   GPtrArray        *static_delta_metas;
   GHashTable       *scanned_metadata; /* Maps object name to itself */
   GHashTable       *requested_metadata; /* Maps object name to itself */
   GHashTable       *requested_content; /* Maps object name to itself */
+  OstreeObjectSet  *have_objects; /* Objects known to be stored locally */
+  guint8            fanout_lookups[256]; /* Lookups per objects/XX, or FANOUT_LISTED */
   guint             n_outstanding_metadata_fetches;
   guint             n_outstanding_metadata_write_requests;
   guint             n_outstanding_content_fetches;
   guint             n_outstanding_content_write_requests;
+  guint             n_outstanding_deltapart_fetches;
+  guint             n_outstanding_deltapart_write_requests;
   gint              n_requested_metadata;
   gint              n_requested_content;
   guint             n_fetched_metadata;
   guint             n_fetched_content;
+  guint             n_fetched_deltaparts;
 
   gboolean      have_previous_bytes;
   guint64       previous_bytes_sec;
@@ -80,6 +89,21 @@ typedef struct {
   gboolean     is_detached_meta;
 } FetchObjectData;
 
+typedef struct {
+  char        *from_revision;
+  char        *to_revision;
+  GVariant    *delta_meta;
+  GVariant    *detached_meta;
+} StaticDeltaMetaData;
+
+typedef struct {
+  OtPullData  *pull_data;
+  GVariant    *objects;
+  GVariant    *expected_checksum;
+  guint        i;
+  GFile       *temp_path;
+} FetchStaticDeltaData;
+
 static SoupURI *
 suburi_new (SoupURI   *base,
             const char *first,
@@ -137,9 +161,11 @@ update_progress (gpointer user_data)
 {
   OtPullData *pull_data = user_data;
   guint outstanding_writes = pull_data->n_outstanding_content_write_requests +
-    pull_data->n_outstanding_metadata_write_requests;
+    pull_data->n_outstanding_metadata_write_requests +
+    pull_data->n_outstanding_deltapart_write_requests;
   guint outstanding_fetches = pull_data->n_outstanding_content_fetches +
-    pull_data->n_outstanding_metadata_fetches;
+    pull_data->n_outstanding_metadata_fetches +
+    pull_data->n_outstanding_deltapart_fetches;
   guint64 bytes_transferred = ostree_fetcher_bytes_transferred (pull_data->fetcher);
   guint fetched = pull_data->n_fetched_metadata + pull_data->n_fetched_content;
   guint requested = pull_data->n_requested_metadata + pull_data->n_requested_content;
@@ -190,9 +216,11 @@ check_outstanding_requests_handle_error (OtPullData          *pull_data,
                                          GError              *error)
 {
   gboolean current_fetch_idle = (pull_data->n_outstanding_metadata_fetches == 0 &&
-                                 pull_data->n_outstanding_content_fetches == 0);
+                                 pull_data->n_outstanding_content_fetches == 0 &&
+                                 pull_data->n_outstanding_deltapart_fetches == 0);
   gboolean current_write_idle = (pull_data->n_outstanding_metadata_write_requests == 0 &&
-                                 pull_data->n_outstanding_content_write_requests == 0);
+                                 pull_data->n_outstanding_content_write_requests == 0 &&
+                                 pull_data->n_outstanding_deltapart_write_requests == 0);
   gboolean current_idle = current_fetch_idle && current_write_idle;
 
   throw_async_error (pull_data, error);
@@ -249,6 +277,7 @@ run_mainloop_monitor_fetcher (OtPullData   *pull_data)
 typedef struct {
   OtPullData     *pull_data;
   GInputStream   *result_stream;
+  GFile          *result_file;
 } OstreeFetchUriSyncData;
 
 static void
@@ -356,12 +385,117 @@ fetch_uri_contents_utf8_sync (OtPullData  *pull_data,
   return ret;
 }
 
+static void
+fetch_uri_file_sync_on_complete (GObject        *object,
+                                 GAsyncResult   *result,
+                                 gpointer        user_data)
+{
+  OstreeFetchUriSyncData *data = user_data;
+
+  data->result_file = ostree_fetcher_request_uri_with_partial_finish ((OstreeFetcher*)object,
+                                                                      result, data->pull_data->async_error);
+  data->pull_data->fetching_sync_uri = NULL;
+  g_main_loop_quit (data->pull_data->loop);
+}
+
+/* Like fetch_uri_contents_membuf_sync(), for files too large to keep
+ * in memory; the download is left in the fetcher's temporary
+ * directory.
+ */
+static gboolean
+fetch_uri_file_sync (OtPullData    *pull_data,
+                     SoupURI       *uri,
+                     GFile        **out_file,
+                     GCancellable  *cancellable,
+                     GError       **error)
+{
+  OstreeFetchUriSyncData fetch_data = { 0, };
+
+  g_assert (error != NULL);
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    return FALSE;
+
+  fetch_data.pull_data = pull_data;
+
+  pull_data->fetching_sync_uri = uri;
+  ostree_fetcher_request_uri_with_partial_async (pull_data->fetcher, uri, G_PRIORITY_HIGH,
+                                                 cancellable,
+                                                 fetch_uri_file_sync_on_complete, &fetch_data);
+
+  run_mainloop_monitor_fetcher (pull_data);
+  if (!fetch_data.result_file)
+    return FALSE;
+
+  *out_file = fetch_data.result_file;
+  return TRUE;
+}
+
 static void
 enqueue_one_object_request (OtPullData        *pull_data,
                             const char        *checksum,
                             OstreeObjectType   objtype,
                             gboolean           is_detached_meta);
 
+/* After this many lookups land in one objects/XX directory, list it
+ * with a single readdir() rather than stat()ing each object.
+ */
+#define FANOUT_LIST_THRESHOLD 8
+#define FANOUT_LISTED G_MAXUINT8
+
+/*
+ * Existence check used while scanning; objects found locally are
+ * remembered in pull_data->have_objects so that a tree sharing most
+ * of its content with what we already have resolves with in-memory
+ * lookups.  A miss falls back to ostree_repo_has_object(), which also
+ * covers packs and objects written since the directory was listed.
+ */
+static gboolean
+pull_has_object_c (OtPullData         *pull_data,
+                   const guchar       *csum,
+                   OstreeObjectType    objtype,
+                   gboolean           *out_is_stored,
+                   GCancellable       *cancellable,
+                   GError            **error)
+{
+  gboolean ret = FALSE;
+  guint8 *lookups = &pull_data->fanout_lookups[csum[0]];
+  char checksum[65];
+
+  if (*lookups != FANOUT_LISTED)
+    {
+      if (*lookups < FANOUT_LIST_THRESHOLD)
+        (*lookups)++;
+      else
+        {
+          if (!_ostree_repo_list_loose_objects_fanout (pull_data->repo, csum[0],
+                                                       pull_data->have_objects,
+                                                       cancellable, error))
+            goto out;
+          *lookups = FANOUT_LISTED;
+        }
+    }
+
+  if (ostree_object_set_contains (pull_data->have_objects, csum, objtype))
+    {
+      *out_is_stored = TRUE;
+      ret = TRUE;
+      goto out;
+    }
+
+  ostree_checksum_inplace_from_bytes (csum, checksum);
+  if (!ostree_repo_has_object (pull_data->repo, objtype, checksum, out_is_stored,
+                               cancellable, error))
+    goto out;
+
+  if (*out_is_stored)
+    (void) ostree_object_set_add (pull_data->have_objects, csum, objtype);
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
 static gboolean
 scan_dirtree_object (OtPullData   *pull_data,
                      const char   *checksum,
@@ -403,13 +537,16 @@ scan_dirtree_object (OtPullData   *pull_data,
       if (!ot_util_filename_validate (filename, error))
         goto out;
 
-      file_checksum = ostree_checksum_from_bytes_v (csum);
-
-      if (!ostree_repo_has_object (pull_data->repo, OSTREE_OBJECT_TYPE_FILE, file_checksum,
-                                   &file_is_stored, cancellable, error))
+      if (!pull_has_object_c (pull_data, ostree_checksum_bytes_peek (csum),
+                              OSTREE_OBJECT_TYPE_FILE, &file_is_stored,
+                              cancellable, error))
         goto out;
-      
-      if (!file_is_stored && !g_hash_table_lookup (pull_data->requested_content, file_checksum))
+
+      if (file_is_stored)
+        continue;
+
+      file_checksum = ostree_checksum_from_bytes_v (csum);
+      if (!g_hash_table_lookup (pull_data->requested_content, file_checksum))
         {
           g_hash_table_insert (pull_data->requested_content, file_checksum, file_checksum);
           enqueue_one_object_request (pull_data, file_checksum, OSTREE_OBJECT_TYPE_FILE, FALSE);
@@ -446,6 +583,53 @@ scan_dirtree_object (OtPullData   *pull_data,
   return ret;
 }
 
+/*
+ * Find @ref in the remote summary; @out_checksum is set to %NULL if
+ * the summary doesn't list it.  The refs are sorted by name.
+ */
+static gboolean
+lookup_ref_in_summary (GVariant      *summary,
+                       const char    *ref,
+                       char         **out_checksum,
+                       GError       **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_variant GVariant *refs = g_variant_get_child_value (summary, 0);
+  gsize imin = 0;
+  gsize imax = g_variant_n_children (refs);
+
+  *out_checksum = NULL;
+
+  while (imin < imax)
+    {
+      gsize imid = imin + (imax - imin) / 2;
+      gs_unref_variant GVariant *entry = g_variant_get_child_value (refs, imid);
+      const char *cur;
+      int c;
+
+      g_variant_get_child (entry, 0, "&s", &cur);
+      c = strcmp (cur, ref);
+      if (c < 0)
+        imin = imid + 1;
+      else if (c > 0)
+        imax = imid;
+      else
+        {
+          gs_unref_variant GVariant *csum_v = NULL;
+
+          g_variant_get_child (entry, 1, "(t@aya{sv})", NULL, &csum_v, NULL);
+          if (!ostree_validate_structureof_csum_v (csum_v, error))
+            goto out;
+          *out_checksum = ostree_checksum_from_bytes_v (csum_v);
+          break;
+        }
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
 static gboolean
 fetch_ref_contents (OtPullData    *pull_data,
                     const char    *ref,
@@ -457,6 +641,21 @@ fetch_ref_contents (OtPullData    *pull_data,
   gs_free char *ret_contents = NULL;
   SoupURI *target_uri = NULL;
 
+  /* The summary wins over refs/heads, even if it's stale; see
+   * ostree_repo_regenerate_summary().
+   */
+  if (pull_data->summary)
+    {
+      if (!lookup_ref_in_summary (pull_data->summary, ref, &ret_contents, error))
+        goto out;
+      if (ret_contents)
+        {
+          ret = TRUE;
+          ot_transfer_out_value (out_contents, &ret_contents);
+          goto out;
+        }
+    }
+
   target_uri = suburi_new (pull_data->base_uri, "refs", "heads", ref, NULL);
   
   if (!fetch_uri_contents_utf8_sync (pull_data, target_uri, &ret_contents, cancellable, error))
@@ -545,6 +744,20 @@ content_fetch_on_complete (GObject        *object,
 
   g_debug ("fetch of %s complete", ostree_object_to_string (checksum, objtype));
 
+  /* Remote content is in archive-z2 format already, so when pulling
+   * into an archive-z2 repository, avoid recompressing it; the
+   * download itself is moved into the object store.
+   */
+  if (ostree_repo_get_mode (pull_data->repo) == OSTREE_REPO_MODE_ARCHIVE_Z2)
+    {
+      pull_data->n_outstanding_content_write_requests++;
+      _ostree_repo_write_archived_content_async (pull_data->repo, checksum,
+                                                 fetch_data->temp_path,
+                                                 cancellable,
+                                                 content_fetch_on_write_complete, fetch_data);
+      goto out;
+    }
+
   if (!ostree_content_file_parse (TRUE, fetch_data->temp_path, FALSE,
                                   &file_in, &file_info, &xattrs,
                                   cancellable, error))
@@ -601,6 +814,8 @@ on_metadata_writed (GObject           *object,
       goto out;
     }
 
+  (void) ostree_object_set_add (pull_data->have_objects, csum, objtype);
+
   if (!scan_one_metadata_object_c (pull_data, csum, objtype, 0,
                                    pull_data->cancellable, error))
     goto out;
@@ -778,8 +993,8 @@ scan_one_metadata_object_c (OtPullData         *pull_data,
     return TRUE;
 
   is_requested = g_hash_table_lookup (pull_data->requested_metadata, tmp_checksum) != NULL;
-  if (!ostree_repo_has_object (pull_data->repo, objtype, tmp_checksum, &is_stored,
-                               cancellable, error))
+  if (!pull_has_object_c (pull_data, csum, objtype, &is_stored,
+                          cancellable, error))
     goto out;
 
   if (!is_stored && !is_requested)
@@ -832,6 +1047,9 @@ enqueue_one_object_request (OtPullData        *pull_data,
 {
   SoupURI *obj_uri = NULL;
   gboolean is_meta;
+  gboolean is_packed = FALSE;
+  guint64 pack_offset = 0;
+  guint64 pack_size = 0;
   FetchObjectData *fetch_data;
   gs_free char *objpath = NULL;
 
@@ -847,8 +1065,26 @@ enqueue_one_object_request (OtPullData        *pull_data,
     }
   else
     {
-      objpath = _ostree_get_relative_object_path (checksum, objtype, TRUE);
-      obj_uri = suburi_new (pull_data->base_uri, objpath, NULL);
+      guint i;
+
+      /* Packed objects are fetched as a range of the pack data */
+      for (i = 0; i < pull_data->remote_packs->len && !is_packed; i++)
+        {
+          OstreeRepoPackIndex *index = pull_data->remote_packs->pdata[i];
+
+          is_packed = _ostree_repo_pack_index_lookup (index, objtype, checksum,
+                                                      &pack_offset, &pack_size);
+          if (is_packed)
+            objpath = g_strconcat (_ostree_repo_pack_index_get_name (index), ".data", NULL);
+        }
+
+      if (is_packed)
+        obj_uri = suburi_new (pull_data->base_uri, "objects", "pack", objpath, NULL);
+      else
+        {
+          objpath = ostree_get_relative_object_path (checksum, objtype, TRUE);
+          obj_uri = suburi_new (pull_data->base_uri, objpath, NULL);
+        }
     }
 
   is_meta = OSTREE_OBJECT_TYPE_IS_META (objtype);
@@ -866,8 +1102,19 @@ enqueue_one_object_request (OtPullData        *pull_data,
   fetch_data->pull_data = pull_data;
   fetch_data->object = ostree_object_name_serialize (checksum, objtype);
   fetch_data->is_detached_meta = is_detached_meta;
-  ostree_fetcher_request_uri_with_partial_async (pull_data->fetcher, obj_uri, pull_data->cancellable,
-                                                 is_meta ? meta_fetch_on_complete : content_fetch_on_complete, fetch_data);
+  /* Metadata goes ahead of content, since it's what tells us about
+   * further objects to fetch.
+   */
+  if (is_packed && pack_size > 0)
+    ostree_fetcher_request_uri_range_async (pull_data->fetcher, obj_uri, pack_offset, pack_size,
+                                            is_meta ? G_PRIORITY_HIGH : G_PRIORITY_DEFAULT,
+                                            pull_data->cancellable,
+                                            is_meta ? meta_fetch_on_complete : content_fetch_on_complete, fetch_data);
+  else
+    ostree_fetcher_request_uri_with_partial_async (pull_data->fetcher, obj_uri,
+                                                   is_meta ? G_PRIORITY_HIGH : G_PRIORITY_DEFAULT,
+                                                   pull_data->cancellable,
+                                                   is_meta ? meta_fetch_on_complete : content_fetch_on_complete, fetch_data);
   soup_uri_free (obj_uri);
 }
 
@@ -940,59 +1187,643 @@ load_remote_repo_config (OtPullData    *pull_data,
   return ret;
 }
 
-#if 0
+/*
+ * Load the indexes of the packs listed in the remote's
+ * objects/pack/packs.  Pack names are the checksums of their
+ * indexes, so indexes are kept in remote-cache/$remote/packs and
+ * only fetched once; the ones of packs no longer listed are dropped.
+ */
+static gboolean
+load_remote_packs (OtPullData    *pull_data,
+                   GCancellable  *cancellable,
+                   GError       **error)
+{
+  gboolean ret = FALSE;
+  char **iter;
+  char **names = NULL;
+  SoupURI *list_uri = NULL;
+  gs_unref_bytes GBytes *list_bytes = NULL;
+  gs_unref_object GFile *remote_dir = NULL;
+  gs_unref_object GFile *cache_dir = NULL;
+  gs_unref_object GFileEnumerator *dir_enum = NULL;
+  gs_unref_hashtable GHashTable *listed = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+  pull_data->remote_packs = g_ptr_array_new_with_free_func ((GDestroyNotify) _ostree_repo_pack_index_free);
+
+  list_uri = suburi_new (pull_data->base_uri, "objects", "pack", "packs", NULL);
+  if (!fetch_uri_contents_membuf_sync (pull_data, list_uri, TRUE, TRUE,
+                                       &list_bytes, cancellable, error))
+    goto out;
+
+  remote_dir = g_file_get_child (pull_data->repo->remote_cache_dir, pull_data->remote_name);
+  cache_dir = g_file_get_child (remote_dir, "packs");
+  if (!gs_file_ensure_directory (cache_dir, TRUE, cancellable, error))
+    goto out;
+
+  if (list_bytes)
+    names = g_strsplit (g_bytes_get_data (list_bytes, NULL), "\n", -1);
+
+  for (iter = names; iter && *iter; iter++)
+    {
+      const char *name = *iter;
+      OstreeRepoPackIndex *index;
+      gboolean verify = FALSE;
+      gs_free char *index_name = NULL;
+      gs_unref_object GFile *cached_path = NULL;
+      gs_unref_object GFile *tmp_path = NULL;
+
+      if (*name == '\0')
+        continue;
+      if (!_ostree_repo_validate_pack_name (name, error))
+        goto out;
+
+      index_name = g_strconcat (name, ".index", NULL);
+      cached_path = g_file_get_child (cache_dir, index_name);
+      if (!g_file_query_exists (cached_path, cancellable))
+        {
+          SoupURI *index_uri = suburi_new (pull_data->base_uri, "objects", "pack", index_name, NULL);
+          gboolean fetched = fetch_uri_file_sync (pull_data, index_uri, &tmp_path,
+                                                  cancellable, error);
+          soup_uri_free (index_uri);
+          if (!fetched)
+            goto out;
+          verify = TRUE;
+        }
+
+      if (!_ostree_repo_open_pack_index (tmp_path ? tmp_path : cached_path, name, verify,
+                                         &index, cancellable, error))
+        {
+          if (tmp_path)
+            (void) gs_file_unlink (tmp_path, NULL, NULL);
+          goto out;
+        }
+      g_ptr_array_add (pull_data->remote_packs, index);
+      g_hash_table_add (listed, g_strdup (index_name));
+
+      if (tmp_path)
+        {
+          if (!gs_file_rename (tmp_path, cached_path, cancellable, error))
+            goto out;
+        }
+    }
+
+  dir_enum = g_file_enumerate_children (cache_dir, OSTREE_GIO_FAST_QUERYINFO,
+                                        G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                        cancellable, error);
+  if (!dir_enum)
+    goto out;
+  while (TRUE)
+    {
+      GFileInfo *file_info;
+      GFile *path;
+
+      if (!gs_file_enumerator_iterate (dir_enum, &file_info, &path,
+                                       cancellable, error))
+        goto out;
+      if (file_info == NULL)
+        break;
+
+      if (!g_hash_table_contains (listed, g_file_info_get_name (file_info)))
+        {
+          if (!gs_file_unlink (path, cancellable, error))
+            goto out;
+        }
+    }
+
+  ret = TRUE;
+ out:
+  g_strfreev (names);
+  if (list_uri)
+    soup_uri_free (list_uri);
+  return ret;
+}
+
+static void
+static_delta_meta_data_free (StaticDeltaMetaData *data)
+{
+  g_free (data->from_revision);
+  g_free (data->to_revision);
+  g_clear_pointer (&data->delta_meta, (GDestroyNotify) g_variant_unref);
+  g_clear_pointer (&data->detached_meta, (GDestroyNotify) g_variant_unref);
+  g_free (data);
+}
+
+static void
+fetch_static_delta_data_free (FetchStaticDeltaData *fetch_data)
+{
+  if (fetch_data->temp_path)
+    {
+      (void) gs_file_unlink (fetch_data->temp_path, NULL, NULL);
+      g_object_unref (fetch_data->temp_path);
+    }
+  g_variant_unref (fetch_data->objects);
+  g_variant_unref (fetch_data->expected_checksum);
+  g_free (fetch_data);
+}
+
+/* Mark the objects of a static delta part as requested, so that the
+ * scan of the target commit afterwards recurses into them rather than
+ * fetching them again.  This is only done once they are stored: once
+ * the part was applied, or if we already had them.  If @fetch_missing
+ * is set, because the part can't be fetched or applied, the objects
+ * we don't have are requested individually instead.
+ */
+static gboolean
+mark_static_delta_part_objects (OtPullData    *pull_data,
+                                GVariant      *objects,
+                                gboolean       fetch_missing,
+                                GCancellable  *cancellable,
+                                GError       **error)
+{
+  gboolean ret = FALSE;
+  guint8 *checksums_data;
+  guint i, n_checksums;
+
+  if (!_ostree_static_delta_parse_checksum_array (objects,
+                                                  &checksums_data,
+                                                  &n_checksums,
+                                                  error))
+    goto out;
+
+  for (i = 0; i < n_checksums; i++)
+    {
+      guint8 objtype = *checksums_data;
+      const guint8 *csum = checksums_data + 1;
+      GHashTable *requested;
+      char *checksum;
+      gboolean is_stored;
+
+      checksums_data += OSTREE_STATIC_DELTA_OBJTYPE_CSUM_LEN;
+
+      if (G_UNLIKELY(!ostree_validate_structureof_objtype (objtype, error)))
+        goto out;
+
+      requested = OSTREE_OBJECT_TYPE_IS_META (objtype) ?
+        pull_data->requested_metadata : pull_data->requested_content;
+      checksum = ostree_checksum_from_bytes (csum);
+
+      /* Already stored, or being fetched for another ref */
+      if (g_hash_table_lookup (requested, checksum))
+        {
+          g_free (checksum);
+          continue;
+        }
+
+      g_hash_table_insert (requested, checksum, checksum);
+
+      if (!fetch_missing)
+        continue;
+
+      if (!ostree_repo_has_object (pull_data->repo, objtype, checksum,
+                                   &is_stored, cancellable, error))
+        goto out;
+
+      if (!is_stored)
+        enqueue_one_object_request (pull_data, checksum, objtype,
+                                    objtype == OSTREE_OBJECT_TYPE_COMMIT);
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+static gboolean
+execute_static_delta_part (OstreeRepo            *repo,
+                           FetchStaticDeltaData  *fetch_data,
+                           GCancellable          *cancellable,
+                           GError               **error)
+{
+  gboolean ret = FALSE;
+  GMappedFile *mfile = NULL;
+  const guchar *expected_csum;
+  gs_unref_bytes GBytes *bytes = NULL;
+  gs_unref_variant GVariant *part = NULL;
+
+  expected_csum = ostree_checksum_bytes_peek_validate (fetch_data->expected_checksum, error);
+  if (!expected_csum)
+    goto out;
+
+  mfile = gs_file_map_noatime (fetch_data->temp_path, cancellable, error);
+  if (!mfile)
+    goto out;
+
+  bytes = g_mapped_file_get_bytes (mfile);
+  g_mapped_file_unref (mfile);
+
+  if (!_ostree_static_delta_part_open (repo, bytes, expected_csum, &part,
+                                       cancellable, error))
+    goto out;
+
+  if (!_ostree_static_delta_part_execute (repo, fetch_data->objects, part,
+                                          cancellable, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  if (!ret)
+    g_prefix_error (error, "delta part %u: ", fetch_data->i);
+  return ret;
+}
+
+static void
+execute_static_delta_part_thread (GSimpleAsyncResult  *res,
+                                  GObject             *object,
+                                  GCancellable        *cancellable)
+{
+  GError *error = NULL;
+  FetchStaticDeltaData *fetch_data;
+
+  fetch_data = g_simple_async_result_get_op_res_gpointer (res);
+  if (!execute_static_delta_part ((OstreeRepo*)object, fetch_data,
+                                  cancellable, &error))
+    g_simple_async_result_take_error (res, error);
+}
+
+static void
+on_static_delta_part_executed (GObject        *object,
+                               GAsyncResult   *result,
+                               gpointer        user_data)
+{
+  FetchStaticDeltaData *fetch_data = user_data;
+  OtPullData *pull_data = fetch_data->pull_data;
+  GError *local_error = NULL;
+  GError **error = &local_error;
+
+  if (g_simple_async_result_propagate_error ((GSimpleAsyncResult*) result, error))
+    {
+      if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        goto out;
+
+      g_debug ("%s; falling back to fetching objects", local_error->message);
+      g_clear_error (&local_error);
+
+      if (!mark_static_delta_part_objects (pull_data, fetch_data->objects, TRUE,
+                                           pull_data->cancellable, error))
+        goto out;
+    }
+  else
+    {
+      pull_data->n_fetched_deltaparts++;
+      if (!mark_static_delta_part_objects (pull_data, fetch_data->objects, FALSE,
+                                           pull_data->cancellable, error))
+        goto out;
+    }
+
+ out:
+  g_assert (pull_data->n_outstanding_deltapart_write_requests > 0);
+  pull_data->n_outstanding_deltapart_write_requests--;
+  fetch_static_delta_data_free (fetch_data);
+  check_outstanding_requests_handle_error (pull_data, local_error);
+}
+
+static void
+static_deltapart_fetch_on_complete (GObject           *object,
+                                    GAsyncResult      *result,
+                                    gpointer           user_data)
+{
+  FetchStaticDeltaData *fetch_data = user_data;
+  OtPullData *pull_data = fetch_data->pull_data;
+  GSimpleAsyncResult *execute_result;
+  GError *local_error = NULL;
+  GError **error = &local_error;
+
+  g_debug ("fetch of delta part %u complete", fetch_data->i);
+
+  fetch_data->temp_path = ostree_fetcher_request_uri_with_partial_finish ((OstreeFetcher*)object, result, error);
+  if (!fetch_data->temp_path)
+    {
+      if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        goto out;
+
+      g_debug ("fetch of delta part %u failed: %s; falling back to fetching objects",
+               fetch_data->i, local_error->message);
+      g_clear_error (&local_error);
+
+      /* Any error here is thrown below */
+      (void) mark_static_delta_part_objects (pull_data, fetch_data->objects, TRUE,
+                                             pull_data->cancellable, error);
+      goto out;
+    }
+
+  /* Decompressing and writing out the objects of a part is CPU and
+   * disk bound; do it in a worker so the fetcher keeps running.
+   */
+  execute_result = g_simple_async_result_new ((GObject*) pull_data->repo,
+                                              on_static_delta_part_executed, fetch_data,
+                                              static_deltapart_fetch_on_complete);
+  g_simple_async_result_set_op_res_gpointer (execute_result, fetch_data, NULL);
+  pull_data->n_outstanding_deltapart_write_requests++;
+  g_simple_async_result_run_in_thread (execute_result, execute_static_delta_part_thread,
+                                       G_PRIORITY_DEFAULT, pull_data->cancellable);
+  g_object_unref (execute_result);
+  fetch_data = NULL;
+
+ out:
+  g_assert (pull_data->n_outstanding_deltapart_fetches > 0);
+  pull_data->n_outstanding_deltapart_fetches--;
+  if (fetch_data)
+    fetch_static_delta_data_free (fetch_data);
+  check_outstanding_requests_handle_error (pull_data, local_error);
+}
+
 static gboolean
 request_static_delta_meta_sync (OtPullData  *pull_data,
-                                const char  *ref,
-                                const char  *checksum,
+                                const char  *from_revision,
+                                const char  *to_revision,
                                 GVariant   **out_delta_meta,
                                 GCancellable *cancellable,
                                 GError     **error)
 {
   gboolean ret = FALSE;
-  gs_free char *from_revision = NULL;
+  gs_free char *delta_name = NULL;
   SoupURI *target_uri = NULL;
+  gs_unref_bytes GBytes *delta_meta_data = NULL;
   gs_unref_variant GVariant *ret_delta_meta = NULL;
 
-  if (!ostree_repo_resolve_rev (pull_data->repo, ref, TRUE, &from_revision, error))
+  delta_name = _ostree_get_relative_static_delta_path (from_revision, to_revision);
+  target_uri = suburi_new (pull_data->base_uri, delta_name, NULL);
+
+  if (!fetch_uri_contents_membuf_sync (pull_data, target_uri, FALSE, TRUE,
+                                       &delta_meta_data,
+                                       cancellable, error))
     goto out;
 
-  if (from_revision == NULL)
+  if (delta_meta_data)
     {
-      initiate_commit_scan (pull_data, checksum);
+      ret_delta_meta = ot_variant_new_from_bytes ((GVariantType*)OSTREE_STATIC_DELTA_META_FORMAT,
+                                                  delta_meta_data, FALSE);
+      g_variant_ref_sink (ret_delta_meta);
     }
-  else
+  
+  ret = TRUE;
+  gs_transfer_out_value (out_delta_meta, &ret_delta_meta);
+ out:
+  if (target_uri)
+    soup_uri_free (target_uri);
+  return ret;
+}
+
+static gboolean
+request_detached_metadata_sync (OtPullData  *pull_data,
+                                const char  *checksum,
+                                GVariant   **out_detached_meta,
+                                GCancellable *cancellable,
+                                GError     **error)
+{
+  gboolean ret = FALSE;
+  char buf[_OSTREE_LOOSE_PATH_MAX];
+  SoupURI *target_uri = NULL;
+  gs_unref_bytes GBytes *detached_meta_data = NULL;
+  gs_unref_variant GVariant *ret_detached_meta = NULL;
+
+  _ostree_loose_path_with_suffix (buf, checksum, OSTREE_OBJECT_TYPE_COMMIT,
+                                  pull_data->remote_mode, "meta");
+  target_uri = suburi_new (pull_data->base_uri, "objects", buf, NULL);
+
+  if (!fetch_uri_contents_membuf_sync (pull_data, target_uri, FALSE, TRUE,
+                                       &detached_meta_data,
+                                       cancellable, error))
+    goto out;
+
+  if (detached_meta_data)
     {
-      gs_free char *delta_name = _ostree_get_relative_static_delta_path (from_revision, checksum);
-      gs_unref_bytes GBytes *delta_meta_data = NULL;
-      gs_unref_variant GVariant *delta_meta = NULL;
+      ret_detached_meta = ot_variant_new_from_bytes (G_VARIANT_TYPE ("a{sv}"),
+                                                     detached_meta_data, FALSE);
+      g_variant_ref_sink (ret_detached_meta);
+    }
+
+  ret = TRUE;
+  gs_transfer_out_value (out_detached_meta, &ret_detached_meta);
+ out:
+  if (target_uri)
+    soup_uri_free (target_uri);
+  return ret;
+}
+
+/*
+ * Fetch the remote's "summary" file, if it has one; if
+ * @gpg_verify_summary is set, it must have one with a valid signature.
+ */
+static gboolean
+request_summary_sync (OtPullData    *pull_data,
+                      gboolean       gpg_verify_summary,
+                      GVariant     **out_summary,
+                      GCancellable  *cancellable,
+                      GError       **error)
+{
+  gboolean ret = FALSE;
+  SoupURI *summary_uri = NULL;
+  SoupURI *summary_sig_uri = NULL;
+  gs_unref_bytes GBytes *summary_data = NULL;
+  gs_unref_bytes GBytes *summary_sig_data = NULL;
+  gs_unref_variant GVariant *summary_sig = NULL;
+  gs_unref_variant GVariant *ret_summary = NULL;
+
+  summary_uri = suburi_new (pull_data->base_uri, "summary", NULL);
+  if (!fetch_uri_contents_membuf_sync (pull_data, summary_uri, FALSE, TRUE,
+                                       &summary_data,
+                                       cancellable, error))
+    goto out;
 
-      target_uri = suburi_new (pull_data->base_uri, delta_name, NULL);
+  if (gpg_verify_summary)
+    {
+      if (!summary_data)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                       "GPG verification of the summary enabled, but remote %s has no summary",
+                       pull_data->remote_name);
+          goto out;
+        }
 
-      if (!fetch_uri_contents_membuf_sync (pull_data, target_uri, FALSE, TRUE,
-                                           &delta_meta_data,
-                                           pull_data->cancellable, error))
+      summary_sig_uri = suburi_new (pull_data->base_uri, "summary.sig", NULL);
+      if (!fetch_uri_contents_membuf_sync (pull_data, summary_sig_uri, FALSE, TRUE,
+                                           &summary_sig_data,
+                                           cancellable, error))
         goto out;
 
-      if (delta_meta_data)
+      if (summary_sig_data)
         {
-          g_print ("Using static delta\n"); 
-          ret_delta_meta = ot_variant_new_from_bytes ((GVariantType*)OSTREE_STATIC_DELTA_META_FORMAT,
-                                                      delta_meta_data, FALSE);
+          summary_sig = ot_variant_new_from_bytes (OSTREE_SUMMARY_SIG_GVARIANT_FORMAT,
+                                                   summary_sig_data, FALSE);
+          g_variant_ref_sink (summary_sig);
         }
+
+      if (!_ostree_repo_gpg_verify_data_with_metadata (pull_data->repo,
+                                                       summary_data, summary_sig,
+                                                       NULL, NULL,
+                                                       cancellable, error))
+        goto out;
     }
-  
+
+  if (summary_data)
+    {
+      ret_summary = ot_variant_new_from_bytes (OSTREE_SUMMARY_GVARIANT_FORMAT,
+                                               summary_data, FALSE);
+      g_variant_ref_sink (ret_summary);
+    }
+
   ret = TRUE;
-  gs_transfer_out_value (out_delta_meta, &ret_delta_meta);
+  gs_transfer_out_value (out_summary, &ret_summary);
  out:
+  if (summary_uri)
+    soup_uri_free (summary_uri);
+  if (summary_sig_uri)
+    soup_uri_free (summary_sig_uri);
   return ret;
 }
-#endif
 
-static void
-process_one_static_delta_meta (OtPullData   *pull_data,
-                               GVariant     *delta_meta)
+static gboolean
+lookup_summary_delta_size (GVariant    *summary_deltas,
+                           const char  *delta_name,
+                           guint64     *out_size)
+{
+  gs_unref_variant GVariant *part_sizes = NULL;
+  const guint64 *sizes;
+  gsize i, n;
+
+  part_sizes = g_variant_lookup_value (summary_deltas, delta_name, G_VARIANT_TYPE ("at"));
+  if (!part_sizes)
+    return FALSE;
+
+  sizes = g_variant_get_fixed_array (part_sizes, &n, sizeof (guint64));
+  *out_size = 0;
+  for (i = 0; i < n; i++)
+    *out_size += sizes[i];
+
+  return TRUE;
+}
+
+/*
+ * Using the static deltas listed in the summary, pick the smallest
+ * one leading to @to_revision: either from *@inout_from_revision, or
+ * from scratch, in which case *@inout_from_revision is cleared.
+ * Returns %FALSE if the remote has neither.
+ */
+static gboolean
+choose_static_delta_from_summary (OtPullData   *pull_data,
+                                  char        **inout_from_revision,
+                                  const char   *to_revision)
+{
+  guint64 from_size = 0;
+  guint64 scratch_size = 0;
+  gboolean have_from = FALSE;
+  gboolean have_scratch;
+
+  have_scratch = lookup_summary_delta_size (pull_data->summary_deltas, to_revision,
+                                            &scratch_size);
+  if (*inout_from_revision)
+    {
+      gs_free char *delta_name = g_strconcat (*inout_from_revision, "-", to_revision, NULL);
+      have_from = lookup_summary_delta_size (pull_data->summary_deltas, delta_name,
+                                             &from_size);
+    }
+
+  if (have_from && (!have_scratch || from_size <= scratch_size))
+    return TRUE;
+  if (have_scratch)
+    {
+      g_clear_pointer (inout_from_revision, g_free);
+      return TRUE;
+    }
+  return FALSE;
+}
+
+/* Queue fetches for the parts whose objects we don't already have.
+ * Their objects are only marked as requested once stored, see
+ * mark_static_delta_part_objects(); until then, the scan of another
+ * ref may still fetch them individually.
+ */
+static gboolean
+process_one_static_delta_meta (OtPullData           *pull_data,
+                               StaticDeltaMetaData  *meta_data,
+                               GCancellable         *cancellable,
+                               GError              **error)
+{
+  gboolean ret = FALSE;
+  guint i, n;
+  gs_unref_variant GVariant *headers = NULL;
+
+  if (meta_data->detached_meta)
+    {
+      if (!ostree_repo_write_commit_detached_metadata (pull_data->repo, meta_data->to_revision,
+                                                       meta_data->detached_meta,
+                                                       cancellable, error))
+        goto out;
+    }
+
+  headers = g_variant_get_child_value (meta_data->delta_meta, 3);
+  n = g_variant_n_children (headers);
+  for (i = 0; i < n; i++)
+    {
+      guint64 size;
+      guint64 usize;
+      gboolean have_all;
+      gs_unref_variant GVariant *header = NULL;
+      gs_unref_variant GVariant *csum_v = NULL;
+      gs_unref_variant GVariant *objects = NULL;
+      gs_free char *deltapart_path = NULL;
+      SoupURI *target_uri = NULL;
+      FetchStaticDeltaData *fetch_data;
+
+      header = g_variant_get_child_value (headers, i);
+      g_variant_get (header, "(@aytt@ay)", &csum_v, &size, &usize, &objects);
+
+      if (!_ostree_static_delta_part_have_all_objects (pull_data->repo, objects, &have_all,
+                                                       cancellable, error))
+        goto out;
+
+      if (have_all)
+        {
+          g_debug ("Have all objects from static delta %s-%s part %u",
+                   meta_data->from_revision ? meta_data->from_revision : "empty",
+                   meta_data->to_revision, i);
+          if (!mark_static_delta_part_objects (pull_data, objects, FALSE,
+                                               cancellable, error))
+            goto out;
+          continue;
+        }
+
+      if (!ostree_checksum_bytes_peek_validate (csum_v, error))
+        goto out;
+
+      fetch_data = g_new0 (FetchStaticDeltaData, 1);
+      fetch_data->pull_data = pull_data;
+      fetch_data->objects = g_variant_ref (objects);
+      fetch_data->expected_checksum = g_variant_ref (csum_v);
+      fetch_data->i = i;
+
+      deltapart_path = _ostree_get_relative_static_delta_part_path (meta_data->from_revision,
+                                                                    meta_data->to_revision,
+                                                                    i);
+      target_uri = suburi_new (pull_data->base_uri, deltapart_path, NULL);
+      pull_data->n_outstanding_deltapart_fetches++;
+      ostree_fetcher_request_uri_with_partial_async (pull_data->fetcher, target_uri,
+                                                     G_PRIORITY_DEFAULT,
+                                                     pull_data->cancellable,
+                                                     static_deltapart_fetch_on_complete,
+                                                     fetch_data);
+      soup_uri_free (target_uri);
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+static gboolean
+is_static_delta_target (OtPullData  *pull_data,
+                        const char  *checksum)
 {
+  guint i;
+
+  for (i = 0; i < pull_data->static_delta_metas->len; i++)
+    {
+      StaticDeltaMetaData *meta_data = pull_data->static_delta_metas->pdata[i];
+      if (strcmp (meta_data->to_revision, checksum) == 0)
+        return TRUE;
+    }
+  return FALSE;
 }
 
 gboolean
@@ -1008,6 +1839,11 @@ ostree_repo_pull (OstreeRepo               *self,
   GHashTableIter hash_iter;
   gpointer key, value;
   gboolean tls_permissive = FALSE;
+  gboolean gpg_verify_summary = FALSE;
+  gboolean adaptive_concurrency = TRUE;
+  gint max_connections = 0;
+  gint max_concurrent_requests = 0;
+  gint timeout_secs = 0;
   OstreeFetcherConfigFlags fetcher_flags = 0;
   guint i;
   gs_free char *remote_key = NULL;
@@ -1022,6 +1858,8 @@ ostree_repo_pull (OstreeRepo               *self,
   GKeyFile *config = NULL;
   GKeyFile *remote_config = NULL;
   char **configured_branches = NULL;
+  char **mirrorlist = NULL;
+  gs_unref_ptrarray GPtrArray *mirror_uris = NULL;
   guint64 bytes_transferred;
   guint64 start_time;
   guint64 end_time;
@@ -1040,6 +1878,7 @@ ostree_repo_pull (OstreeRepo               *self,
                                                         (GDestroyNotify)g_free, NULL);
   pull_data->requested_metadata = g_hash_table_new_full (g_str_hash, g_str_equal,
                                                          (GDestroyNotify)g_free, NULL);
+  pull_data->have_objects = ostree_object_set_new ();
 
   start_time = g_get_monotonic_time ();
 
@@ -1059,6 +1898,14 @@ ostree_repo_pull (OstreeRepo               *self,
   pull_data->gpg_verify = FALSE;
 #endif
 
+#ifdef HAVE_GPGME
+  if (!ot_keyfile_get_boolean_with_default (config, remote_key, "gpg-verify-summary",
+                                            FALSE, &gpg_verify_summary, error))
+    goto out;
+#else
+  gpg_verify_summary = FALSE;
+#endif
+
   pull_data->phase = OSTREE_PULL_PHASE_FETCHING_REFS;
 
   if (!ot_keyfile_get_boolean_with_default (config, remote_key, "tls-permissive",
@@ -1070,6 +1917,30 @@ ostree_repo_pull (OstreeRepo               *self,
   pull_data->fetcher = ostree_fetcher_new (pull_data->repo->tmp_dir,
                                            fetcher_flags);
 
+  if (!ot_keyfile_get_integer_with_default (config, remote_key, "max-connections",
+                                            0, &max_connections, error))
+    goto out;
+  if (!ot_keyfile_get_integer_with_default (config, remote_key, "max-concurrent-requests",
+                                            0, &max_concurrent_requests, error))
+    goto out;
+  if (!ot_keyfile_get_boolean_with_default (config, remote_key, "adaptive-concurrency",
+                                            TRUE, &adaptive_concurrency, error))
+    goto out;
+  if (!ot_keyfile_get_integer_with_default (config, remote_key, "timeout",
+                                            60, &timeout_secs, error))
+    goto out;
+  if (max_connections < 0 || max_concurrent_requests < 0 || timeout_secs < 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Invalid fetcher limits for remote %s", pull_data->remote_name);
+      goto out;
+    }
+  if (max_connections > 0)
+    ostree_fetcher_set_max_connections (pull_data->fetcher, max_connections);
+  ostree_fetcher_set_concurrency (pull_data->fetcher, max_concurrent_requests,
+                                  adaptive_concurrency);
+  ostree_fetcher_set_timeout (pull_data->fetcher, timeout_secs);
+
   if (!pull_data->base_uri)
     {
       g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
@@ -1077,6 +1948,35 @@ ostree_repo_pull (OstreeRepo               *self,
       goto out;
     }
 
+  /* Objects may come from any of the mirrors; refs and the repository
+   * config are always read from the primary url.
+   */
+  mirrorlist = g_key_file_get_string_list (config, remote_key, "mirrorlist", NULL, NULL);
+  if (mirrorlist && *mirrorlist)
+    {
+      char **strviter;
+
+      mirror_uris = g_ptr_array_new_with_free_func ((GDestroyNotify) soup_uri_free);
+      for (strviter = mirrorlist; *strviter; strviter++)
+        {
+          SoupURI *mirror_uri = soup_uri_new (*strviter);
+          if (!mirror_uri)
+            {
+              g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                           "Failed to parse mirror url '%s'", *strviter);
+              goto out;
+            }
+          g_ptr_array_add (mirror_uris, mirror_uri);
+        }
+      if (mirror_uris->len >= 32)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Too many mirrors for remote %s", pull_data->remote_name);
+          goto out;
+        }
+      ostree_fetcher_set_mirrors (pull_data->fetcher, pull_data->base_uri, mirror_uris);
+    }
+
   if (!load_remote_repo_config (pull_data, &remote_config, cancellable, error))
     goto out;
 
@@ -1095,7 +1995,23 @@ ostree_repo_pull (OstreeRepo               *self,
       goto out;
     }
 
-  pull_data->static_delta_metas = g_ptr_array_new_with_free_func ((GDestroyNotify)g_variant_unref);
+  if (!load_remote_packs (pull_data, cancellable, error))
+    goto out;
+
+  /* If the remote has a summary, refs and static deltas are looked
+   * up there rather than probed for one by one.
+   */
+  if (!request_summary_sync (pull_data, gpg_verify_summary, &pull_data->summary,
+                             cancellable, error))
+    goto out;
+  if (pull_data->summary)
+    {
+      gs_unref_variant GVariant *summary_metadata = g_variant_get_child_value (pull_data->summary, 1);
+      pull_data->summary_deltas = g_variant_lookup_value (summary_metadata, "ostree.static-deltas",
+                                                          G_VARIANT_TYPE ("a{sat}"));
+    }
+
+  pull_data->static_delta_metas = g_ptr_array_new_with_free_func ((GDestroyNotify)static_delta_meta_data_free);
 
   requested_refs_to_fetch = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
   commits_to_fetch = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
@@ -1149,6 +2065,65 @@ ostree_repo_pull (OstreeRepo               *self,
         }
     }
 
+  /* Look for a static delta from what we have now to each new ref
+   * target, or one from scratch if we have no revision of the ref;
+   * this has to happen while we're still fetching synchronously.
+   */
+  g_hash_table_iter_init (&hash_iter, requested_refs_to_fetch);
+  while (g_hash_table_iter_next (&hash_iter, &key, &value))
+    {
+      const char *ref = key;
+      const char *to_revision = value;
+      gs_free char *remote_ref = NULL;
+      gs_free char *from_revision = NULL;
+      gs_unref_variant GVariant *delta_meta = NULL;
+      StaticDeltaMetaData *meta_data;
+
+      remote_ref = g_strdup_printf ("%s/%s", pull_data->remote_name, ref);
+      if (!ostree_repo_resolve_rev (pull_data->repo, remote_ref, TRUE, &from_revision, error))
+        goto out;
+
+      if (from_revision == NULL)
+        {
+          gboolean have_commit;
+
+          /* Probably pulled through another ref already */
+          if (!ostree_repo_has_object (pull_data->repo, OSTREE_OBJECT_TYPE_COMMIT, to_revision,
+                                       &have_commit, cancellable, error))
+            goto out;
+          if (have_commit)
+            continue;
+        }
+      else if (strcmp (from_revision, to_revision) == 0)
+        continue;
+
+      if (pull_data->summary_deltas
+          && !choose_static_delta_from_summary (pull_data, &from_revision, to_revision))
+        continue;
+
+      if (!request_static_delta_meta_sync (pull_data, from_revision, to_revision,
+                                           &delta_meta, cancellable, error))
+        goto out;
+
+      if (!delta_meta)
+        continue;
+
+      g_debug ("Using static delta %s-%s", from_revision ? from_revision : "empty", to_revision);
+
+      meta_data = g_new0 (StaticDeltaMetaData, 1);
+      meta_data->from_revision = from_revision;
+      from_revision = NULL;
+      meta_data->to_revision = g_strdup (to_revision);
+      meta_data->delta_meta = delta_meta;
+      delta_meta = NULL;
+      g_ptr_array_add (pull_data->static_delta_metas, meta_data);
+
+      if (!request_detached_metadata_sync (pull_data, to_revision,
+                                           &meta_data->detached_meta,
+                                           cancellable, error))
+        goto out;
+    }
+
   pull_data->phase = OSTREE_PULL_PHASE_FETCHING_OBJECTS;
 
   if (!ostree_repo_prepare_transaction (pull_data->repo, &pull_data->transaction_resuming,
@@ -1157,6 +2132,13 @@ ostree_repo_pull (OstreeRepo               *self,
 
   g_debug ("resuming transaction: %s", pull_data->transaction_resuming ? "true" : " false");
 
+  for (i = 0; i < pull_data->static_delta_metas->len; i++)
+    {
+      if (!process_one_static_delta_meta (pull_data, pull_data->static_delta_metas->pdata[i],
+                                          pull_data->cancellable, error))
+        goto out;
+    }
+
   g_hash_table_iter_init (&hash_iter, commits_to_fetch);
   while (g_hash_table_iter_next (&hash_iter, &key, &value))
     {
@@ -1170,24 +2152,42 @@ ostree_repo_pull (OstreeRepo               *self,
   while (g_hash_table_iter_next (&hash_iter, &key, &value))
     {
       const char *checksum = value;
+      if (is_static_delta_target (pull_data, checksum))
+        continue;
       if (!scan_one_metadata_object (pull_data, checksum, OSTREE_OBJECT_TYPE_COMMIT,
                                      0, pull_data->cancellable, error))
         goto out;
     }
 
-  for (i = 0; i < pull_data->static_delta_metas->len; i++)
-    {
-      process_one_static_delta_meta (pull_data, pull_data->static_delta_metas->pdata[i]);
-    }
-
   /* Now await work completion */
   if (!run_mainloop_monitor_fetcher (pull_data))
     goto out;
+
+  /* Commits reached through a static delta are scanned only once all
+   * parts have been applied; this verifies their signatures and fills
+   * in anything the deltas didn't provide.
+   */
+  if (pull_data->static_delta_metas->len > 0)
+    {
+      for (i = 0; i < pull_data->static_delta_metas->len; i++)
+        {
+          StaticDeltaMetaData *meta_data = pull_data->static_delta_metas->pdata[i];
+          if (!scan_one_metadata_object (pull_data, meta_data->to_revision,
+                                         OSTREE_OBJECT_TYPE_COMMIT,
+                                         0, pull_data->cancellable, error))
+            goto out;
+        }
+
+      if (!run_mainloop_monitor_fetcher (pull_data))
+        goto out;
+    }
   
   g_assert_cmpint (pull_data->n_outstanding_metadata_fetches, ==, 0);
   g_assert_cmpint (pull_data->n_outstanding_metadata_write_requests, ==, 0);
   g_assert_cmpint (pull_data->n_outstanding_content_fetches, ==, 0);
   g_assert_cmpint (pull_data->n_outstanding_content_write_requests, ==, 0);
+  g_assert_cmpint (pull_data->n_outstanding_deltapart_fetches, ==, 0);
+  g_assert_cmpint (pull_data->n_outstanding_deltapart_write_requests, ==, 0);
 
   g_hash_table_iter_init (&hash_iter, requested_refs_to_fetch);
   while (g_hash_table_iter_next (&hash_iter, &key, &value))
@@ -1227,6 +2227,8 @@ ostree_repo_pull (OstreeRepo               *self,
         shift = 1;
       else
         shift = 1024;
+      if (pull_data->n_fetched_deltaparts > 0)
+        g_print ("%u delta parts, ", pull_data->n_fetched_deltaparts);
       g_print ("%u metadata, %u content objects fetched; %" G_GUINT64_FORMAT " %s transferred in %u seconds\n", 
                pull_data->n_fetched_metadata, pull_data->n_fetched_content,
                (guint64)(bytes_transferred / shift),
@@ -1241,6 +2243,7 @@ ostree_repo_pull (OstreeRepo               *self,
   if (pull_data->loop)
     g_main_loop_unref (pull_data->loop);
   g_strfreev (configured_branches);
+  g_strfreev (mirrorlist);
   g_clear_object (&pull_data->fetcher);
   g_free (pull_data->remote_name);
   if (pull_data->base_uri)
@@ -1248,9 +2251,13 @@ ostree_repo_pull (OstreeRepo               *self,
   if (queue_src)
     g_source_destroy (queue_src);
   g_clear_pointer (&pull_data->static_delta_metas, (GDestroyNotify) g_ptr_array_unref);
+  g_clear_pointer (&pull_data->summary, (GDestroyNotify) g_variant_unref);
+  g_clear_pointer (&pull_data->summary_deltas, (GDestroyNotify) g_variant_unref);
+  g_clear_pointer (&pull_data->remote_packs, (GDestroyNotify) g_ptr_array_unref);
   g_clear_pointer (&pull_data->scanned_metadata, (GDestroyNotify) g_hash_table_unref);
   g_clear_pointer (&pull_data->requested_content, (GDestroyNotify) g_hash_table_unref);
   g_clear_pointer (&pull_data->requested_metadata, (GDestroyNotify) g_hash_table_unref);
+  g_clear_pointer (&pull_data->have_objects, (GDestroyNotify) ostree_object_set_free);
   g_clear_pointer (&remote_config, (GDestroyNotify) g_key_file_unref);
   return ret;
 }
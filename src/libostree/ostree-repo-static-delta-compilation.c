@@ -21,75 +21,465 @@
 #include "config.h"
 
 #include <string.h>
+#include <unistd.h>
 
 #include "ostree-core-private.h"
 #include "ostree-repo-private.h"
 #include "ostree-repo-static-delta-private.h"
 #include "ostree-diff.h"
+#include "ostree-repo-file.h"
 #include "otutil.h"
 #include "ostree-varint.h"
+#include "bupsplit.h"
+
+/* Don't bother trying to find matching chunks in objects smaller than this */
+#define ROLLSUM_MIN_OBJECT_SIZE (64*1024)
+/* Same cap on chunk size as bup uses */
+#define ROLLSUM_BLOB_MAX (8192*4)
+
+/* Size of the buffer compressed part data is written out from */
+#define COMPRESS_BUFSIZE (64*1024)
 
 typedef struct {
+  guint8            csum[32];
+  OstreeObjectType  objtype;
+  guint64           size;
+  const char       *path;          /* Only for content; owned by the builder */
+  const char       *rollsum_from;  /* Only for content; owned by the builder */
+} OstreeStaticDeltaObject;
+
+typedef struct {
+  /* Range of the builder's sorted objects contained in this part */
+  guint start;
+  guint n_objects;
   guint64 uncompressed_size;
-  GPtrArray *objects;
-  GString *payload;
-  GString *operations;
+
+  /* Filled in by compile_part() */
+  GFile *tempfile;
+  guint8 checksum[32];
+  guint64 compressed_size;
 } OstreeStaticDeltaPartBuilder;
 
 typedef struct {
+  OstreeRepo *repo;
+  guint64 max_part_size;
+  OstreeStaticDeltaCompressionType compression;
+  int compression_level;
+  GArray *objects;
   GPtrArray *parts;
+  GHashTable *content_paths;
+  GHashTable *rollsum_sources;
+
+  GCancellable *cancellable;
+  volatile gint failed;
+  GMutex lock;
+  GError *error;
 } OstreeStaticDeltaBuilder;
 
 static void
 ostree_static_delta_part_builder_unref (OstreeStaticDeltaPartBuilder *part_builder)
 {
-  if (part_builder->objects)
-    g_ptr_array_unref (part_builder->objects);
-  if (part_builder->payload)
-    g_string_free (part_builder->payload, TRUE);
-  if (part_builder->operations)
-    g_string_free (part_builder->operations, TRUE);
+  g_clear_object (&part_builder->tempfile);
   g_free (part_builder);
 }
 
 static OstreeStaticDeltaPartBuilder *
-allocate_part (OstreeStaticDeltaBuilder *builder)
+allocate_part (OstreeStaticDeltaBuilder *builder,
+               guint                     start)
 {
   OstreeStaticDeltaPartBuilder *part = g_new0 (OstreeStaticDeltaPartBuilder, 1);
-  part->objects = g_ptr_array_new_with_free_func ((GDestroyNotify)g_variant_unref);
-  part->payload = g_string_new (NULL);
-  part->operations = g_string_new (NULL);
-  part->uncompressed_size = 0;
+  part->start = start;
   g_ptr_array_add (builder->parts, part);
   return part;
 }
 
 static GBytes *
-objtype_checksum_array_new (GPtrArray *objects)
+objtype_checksum_array_new (OstreeStaticDeltaBuilder     *builder,
+                            OstreeStaticDeltaPartBuilder *part)
 {
   guint i;
   GByteArray *ret = g_byte_array_new ();
 
-  g_assert (objects->len > 0);
-  for (i = 0; i < objects->len; i++)
+  g_assert (part->n_objects > 0);
+  for (i = part->start; i < part->start + part->n_objects; i++)
     {
-      GVariant *serialized_key = objects->pdata[i];
-      OstreeObjectType objtype;
-      const char *checksum;
-      guint8 csum[32];
-      guint8 objtype_v;
-        
-      ostree_object_name_deserialize (serialized_key, &checksum, &objtype);
-      objtype_v = (guint8) objtype;
-
-      ostree_checksum_inplace_to_bytes (checksum, csum);
+      OstreeStaticDeltaObject *obj = &g_array_index (builder->objects, OstreeStaticDeltaObject, i);
+      guint8 objtype_v = (guint8) obj->objtype;
 
       g_byte_array_append (ret, &objtype_v, 1);
-      g_byte_array_append (ret, csum, sizeof (csum));
+      g_byte_array_append (ret, obj->csum, sizeof (obj->csum));
     }
   return g_byte_array_free_to_bytes (ret);
 }
 
+static gboolean
+load_object_stream_bytes (OstreeRepo     *repo,
+                          const char     *checksum,
+                          GBytes        **out_bytes,
+                          GCancellable   *cancellable,
+                          GError        **error)
+{
+  gboolean ret = FALSE;
+  guint64 size;
+  gs_unref_object GInputStream *in = NULL;
+  gs_unref_object GMemoryOutputStream *out = NULL;
+
+  if (!ostree_repo_load_object_stream (repo, OSTREE_OBJECT_TYPE_FILE, checksum,
+                                       &in, &size, cancellable, error))
+    goto out;
+
+  out = (GMemoryOutputStream*)g_memory_output_stream_new (NULL, 0, g_realloc, g_free);
+  if (0 > g_output_stream_splice ((GOutputStream*)out, in,
+                                  G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE |
+                                  G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET,
+                                  cancellable, error))
+    goto out;
+
+  ret = TRUE;
+  *out_bytes = g_memory_output_stream_steal_as_bytes (out);
+ out:
+  return ret;
+}
+
+/* Split @bytes at content-defined boundaries; the returned chunks
+ * reference @bytes.
+ */
+static GPtrArray *
+rollsum_split (GBytes *bytes)
+{
+  GPtrArray *ret = g_ptr_array_new_with_free_func ((GDestroyNotify)g_bytes_unref);
+  gsize len;
+  gsize start = 0;
+  const guint8 *buf = g_bytes_get_data (bytes, &len);
+
+  while (start < len)
+    {
+      int offset, bits;
+      gsize remaining = len - start;
+
+      offset = bupsplit_find_ofs (buf + start, MIN (remaining, ROLLSUM_BLOB_MAX), &bits);
+      if (offset == 0)
+        offset = MIN (remaining, ROLLSUM_BLOB_MAX);
+
+      g_ptr_array_add (ret, g_bytes_new_from_bytes (bytes, start, offset));
+      start += offset;
+    }
+
+  return ret;
+}
+
+typedef struct {
+  gboolean from_source;
+  guint64  offset;
+  guint64  len;
+} RollsumSegment;
+
+/* Express @target as a sequence of ranges copied from @source and
+ * ranges of new data, in order.  Returns %NULL if too little of
+ * @target can be found in @source to make this worthwhile.
+ */
+static GArray *
+rollsum_compute_segments (GBytes   *source,
+                          GBytes   *target)
+{
+  GArray *ret = NULL;
+  guint i;
+  guint64 matched = 0;
+  guint64 target_offset = 0;
+  const guint8 *source_data = g_bytes_get_data (source, NULL);
+  gs_unref_ptrarray GPtrArray *source_chunks = rollsum_split (source);
+  gs_unref_ptrarray GPtrArray *target_chunks = rollsum_split (target);
+  gs_unref_hashtable GHashTable *source_chunk_set =
+    g_hash_table_new (g_bytes_hash, g_bytes_equal);
+
+  for (i = 0; i < source_chunks->len; i++)
+    g_hash_table_insert (source_chunk_set, source_chunks->pdata[i], source_chunks->pdata[i]);
+
+  ret = g_array_new (FALSE, FALSE, sizeof (RollsumSegment));
+
+  for (i = 0; i < target_chunks->len; i++)
+    {
+      GBytes *chunk = target_chunks->pdata[i];
+      GBytes *source_chunk = g_hash_table_lookup (source_chunk_set, chunk);
+      gsize chunk_len = g_bytes_get_size (chunk);
+      RollsumSegment *prev = ret->len > 0 ? &g_array_index (ret, RollsumSegment, ret->len - 1) : NULL;
+      RollsumSegment seg;
+
+      if (source_chunk)
+        {
+          seg.from_source = TRUE;
+          seg.offset = (const guint8*)g_bytes_get_data (source_chunk, NULL) - source_data;
+          matched += chunk_len;
+        }
+      else
+        {
+          seg.from_source = FALSE;
+          seg.offset = target_offset;
+        }
+      seg.len = chunk_len;
+      target_offset += chunk_len;
+
+      /* Coalesce with the previous segment if contiguous */
+      if (prev && prev->from_source == seg.from_source &&
+          prev->offset + prev->len == seg.offset)
+        prev->len += seg.len;
+      else
+        g_array_append_val (ret, seg);
+    }
+
+  /* Only worth it if at least half of the object is reused */
+  if (matched < g_bytes_get_size (target) / 2)
+    {
+      g_array_unref (ret);
+      ret = NULL;
+    }
+
+  return ret;
+}
+
+static gboolean
+process_one_rollsum (OstreeRepo                       *repo,
+                     GString                          *payload,
+                     GString                          *operations,
+                     const char                       *from_checksum,
+                     const char                       *to_checksum,
+                     gboolean                         *out_handled,
+                     GCancellable                     *cancellable,
+                     GError                          **error)
+{
+  gboolean ret = FALSE;
+  guint i;
+  guint64 new_data_size = 0;
+  gboolean reading_source = FALSE;
+  guint8 source_csum[32];
+  const guint8 *target_data;
+  gs_unref_bytes GBytes *source = NULL;
+  gs_unref_bytes GBytes *target = NULL;
+  GArray *segments = NULL;
+
+  if (!load_object_stream_bytes (repo, from_checksum, &source, cancellable, error))
+    goto out;
+  if (!load_object_stream_bytes (repo, to_checksum, &target, cancellable, error))
+    goto out;
+
+  segments = rollsum_compute_segments (source, target);
+  if (!segments)
+    {
+      ret = TRUE;
+      *out_handled = FALSE;
+      goto out;
+    }
+
+  for (i = 0; i < segments->len; i++)
+    {
+      RollsumSegment *seg = &g_array_index (segments, RollsumSegment, i);
+      if (!seg->from_source)
+        new_data_size += seg->len;
+    }
+
+  ostree_checksum_inplace_to_bytes (from_checksum, source_csum);
+  target_data = g_bytes_get_data (target, NULL);
+
+  for (i = 0; i < segments->len; i++)
+    {
+      RollsumSegment *seg = &g_array_index (segments, RollsumSegment, i);
+
+      if (seg->from_source)
+        {
+          if (!reading_source)
+            {
+              g_string_append_c (operations, (gchar)OSTREE_STATIC_DELTA_OP_READOBJECT);
+              g_string_append_len (operations, (char*)source_csum, sizeof (source_csum));
+              reading_source = TRUE;
+            }
+          g_string_append_c (operations, (gchar)OSTREE_STATIC_DELTA_OP_WRITE);
+          _ostree_write_varuint64 (operations, seg->offset);
+          _ostree_write_varuint64 (operations, seg->len);
+        }
+      else
+        {
+          gsize payload_start = payload->len;
+
+          if (reading_source)
+            {
+              g_string_append_c (operations, (gchar)OSTREE_STATIC_DELTA_OP_READPAYLOAD);
+              reading_source = FALSE;
+            }
+          g_string_append_len (payload, (char*)target_data + seg->offset, seg->len);
+          g_string_append_c (operations, (gchar)OSTREE_STATIC_DELTA_OP_WRITE);
+          _ostree_write_varuint64 (operations, payload_start);
+          _ostree_write_varuint64 (operations, seg->len);
+        }
+    }
+
+  if (reading_source)
+    g_string_append_c (operations, (gchar)OSTREE_STATIC_DELTA_OP_READPAYLOAD);
+  g_string_append_c (operations, (gchar)OSTREE_STATIC_DELTA_OP_CLOSE);
+
+  g_debug ("rollsum for %s-%s: %" G_GUINT64_FORMAT " of %" G_GSIZE_FORMAT " bytes new",
+           from_checksum, to_checksum, new_data_size, g_bytes_get_size (target));
+
+  ret = TRUE;
+  *out_handled = TRUE;
+ out:
+  if (segments)
+    g_array_unref (segments);
+  return ret;
+}
+
+/* Record a path for each new content object reachable from the tree
+ * @dirtree_checksum, so objects can be ordered by where they live;
+ * files next to each other tend to be similar and compress better
+ * together.
+ */
+static gboolean
+collect_content_paths (OstreeRepo                       *repo,
+                       const char                       *dirtree_checksum,
+                       const char                       *path,
+                       OstreeObjectSet                  *new_objects,
+                       GHashTable                       *seen_dirtrees,
+                       GHashTable                       *content_paths,
+                       GCancellable                     *cancellable,
+                       GError                          **error)
+{
+  gboolean ret = FALSE;
+  guint i, n;
+  gs_unref_variant GVariant *dirtree = NULL;
+  gs_unref_variant GVariant *files = NULL;
+  gs_unref_variant GVariant *dirs = NULL;
+
+  if (g_hash_table_contains (seen_dirtrees, dirtree_checksum))
+    {
+      ret = TRUE;
+      goto out;
+    }
+  g_hash_table_add (seen_dirtrees, g_strdup (dirtree_checksum));
+
+  if (!ostree_repo_load_variant (repo, OSTREE_OBJECT_TYPE_DIR_TREE, dirtree_checksum,
+                                 &dirtree, error))
+    goto out;
+
+  files = g_variant_get_child_value (dirtree, 0);
+  n = g_variant_n_children (files);
+  for (i = 0; i < n; i++)
+    {
+      const char *name;
+      const guchar *csum;
+      char checksum[65];
+      gs_unref_variant GVariant *csum_v = NULL;
+
+      g_variant_get_child (files, i, "(&s@ay)", &name, &csum_v);
+      csum = ostree_checksum_bytes_peek (csum_v);
+      if (!ostree_object_set_contains (new_objects, csum, OSTREE_OBJECT_TYPE_FILE))
+        continue;
+
+      ostree_checksum_inplace_from_bytes (csum, checksum);
+      if (g_hash_table_contains (content_paths, checksum))
+        continue;
+      g_hash_table_insert (content_paths, g_strdup (checksum),
+                           g_build_filename (path, name, NULL));
+    }
+
+  dirs = g_variant_get_child_value (dirtree, 1);
+  n = g_variant_n_children (dirs);
+  for (i = 0; i < n; i++)
+    {
+      const char *name;
+      char tree_checksum[65];
+      gs_free char *subpath = NULL;
+      gs_unref_variant GVariant *tree_csum_v = NULL;
+      gs_unref_variant GVariant *meta_csum_v = NULL;
+
+      g_variant_get_child (dirs, i, "(&s@ay@ay)", &name, &tree_csum_v, &meta_csum_v);
+      ostree_checksum_inplace_from_bytes (ostree_checksum_bytes_peek (tree_csum_v), tree_checksum);
+      subpath = g_build_filename (path, name, NULL);
+
+      if (!collect_content_paths (repo, tree_checksum, subpath, new_objects,
+                                  seen_dirtrees, content_paths,
+                                  cancellable, error))
+        goto out;
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+static int
+compare_delta_objects (gconstpointer  ap,
+                       gconstpointer  bp)
+{
+  const OstreeStaticDeltaObject *a = ap;
+  const OstreeStaticDeltaObject *b = bp;
+  gboolean a_is_meta = OSTREE_OBJECT_TYPE_IS_META (a->objtype);
+  gboolean b_is_meta = OSTREE_OBJECT_TYPE_IS_META (b->objtype);
+
+  /* Metadata first, grouped by type */
+  if (a_is_meta != b_is_meta)
+    return a_is_meta ? -1 : 1;
+  if (a->objtype != b->objtype)
+    return (int)a->objtype - (int)b->objtype;
+
+  /* Then content by path */
+  if (a->path && b->path)
+    {
+      int c = strcmp (a->path, b->path);
+      if (c != 0)
+        return c;
+    }
+  else if (a->path != b->path)
+    return a->path ? -1 : 1;
+
+  if (a->size != b->size)
+    return a->size < b->size ? -1 : 1;
+
+  return memcmp (a->csum, b->csum, sizeof (a->csum));
+}
+
+/* Large regular files which changed in place are candidates for
+ * shipping just their changed parts.
+ */
+static gboolean
+collect_rollsum_source (OstreeDiffChange   change,
+                        const char        *path,
+                        gboolean           is_dir_a,
+                        const char        *checksum_a,
+                        gboolean           is_dir_b,
+                        const char        *checksum_b,
+                        gpointer           user_data,
+                        GError           **error)
+{
+  gboolean ret = FALSE;
+  OstreeStaticDeltaBuilder *builder = user_data;
+  gs_unref_object GFileInfo *info_a = NULL;
+  gs_unref_object GFileInfo *info_b = NULL;
+
+  if (change != OSTREE_DIFF_CHANGE_MODIFIED || is_dir_a || is_dir_b)
+    return TRUE;
+
+  if (!ostree_repo_load_file (builder->repo, checksum_a, NULL, &info_a, NULL,
+                              builder->cancellable, error))
+    goto out;
+  if (!ostree_repo_load_file (builder->repo, checksum_b, NULL, &info_b, NULL,
+                              builder->cancellable, error))
+    goto out;
+
+  if (g_file_info_get_file_type (info_a) == G_FILE_TYPE_REGULAR &&
+      g_file_info_get_file_type (info_b) == G_FILE_TYPE_REGULAR &&
+      g_file_info_get_size (info_a) >= ROLLSUM_MIN_OBJECT_SIZE &&
+      g_file_info_get_size (info_b) >= ROLLSUM_MIN_OBJECT_SIZE)
+    g_hash_table_replace (builder->rollsum_sources,
+                          g_strdup (checksum_b),
+                          g_strdup (checksum_a));
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/* Find the objects new in @to, sort them, and split them into parts
+ * of at most max_part_size bytes; the parts are compiled later.
+ */
 static gboolean 
 generate_delta_lowlatency (OstreeRepo                       *repo,
                            const char                       *from,
@@ -99,136 +489,362 @@ generate_delta_lowlatency (OstreeRepo                       *repo,
                            GError                          **error)
 {
   gboolean ret = FALSE;
-  GHashTableIter hashiter;
-  gpointer key, value;
   OstreeStaticDeltaPartBuilder *current_part = NULL;
   gs_unref_object GFile *root_from = NULL;
   gs_unref_object GFile *root_to = NULL;
-  gs_unref_ptrarray GPtrArray *modified = NULL;
-  gs_unref_ptrarray GPtrArray *removed = NULL;
-  gs_unref_ptrarray GPtrArray *added = NULL;
-  gs_unref_hashtable GHashTable *to_reachable_objects = NULL;
-  gs_unref_hashtable GHashTable *from_reachable_objects = NULL;
-  gs_unref_hashtable GHashTable *new_reachable_objects = NULL;
-
-  if (!ostree_repo_read_commit (repo, from, &root_from, NULL,
-                                cancellable, error))
-    goto out;
+  OstreeObjectSet *to_reachable_objects = ostree_object_set_new ();
+  OstreeObjectSet *from_reachable_objects = ostree_object_set_new ();
+  OstreeObjectSet *new_objects = ostree_object_set_new ();
+  gs_unref_hashtable GHashTable *seen_dirtrees = NULL;
+  guint i, n;
+
   if (!ostree_repo_read_commit (repo, to, &root_to, NULL,
                                 cancellable, error))
     goto out;
-
-  /* Gather a filesystem level diff; when we do heuristics to ship
-   * just parts of changed files, we can make use of this data.
-   */
-  modified = g_ptr_array_new_with_free_func ((GDestroyNotify) ostree_diff_item_unref);
-  removed = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
-  added = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
-  if (!ostree_diff_dirs (OSTREE_DIFF_FLAGS_NONE, root_from, root_to, modified, removed, added,
-                         cancellable, error))
+  if (!ostree_repo_file_ensure_resolved ((OstreeRepoFile*)root_to, error))
     goto out;
 
-  if (!ostree_repo_traverse_commit (repo, from, -1, &from_reachable_objects,
+  /* A delta from scratch contains every object of @to */
+  if (from != NULL)
+    {
+      if (!ostree_repo_read_commit (repo, from, &root_from, NULL,
                                     cancellable, error))
+        goto out;
+      if (!ostree_repo_file_ensure_resolved ((OstreeRepoFile*)root_from, error))
+        goto out;
+
+      if (!ostree_diff_trees (repo,
+                              ostree_repo_file_tree_get_contents_checksum ((OstreeRepoFile*)root_from),
+                              ostree_repo_file_tree_get_contents_checksum ((OstreeRepoFile*)root_to),
+                              collect_rollsum_source, builder,
+                              cancellable, error))
+        goto out;
+
+      if (!ostree_repo_traverse_commit_set (repo, from, -1, from_reachable_objects,
+                                            cancellable, error))
+        goto out;
+    }
+
+  if (!ostree_repo_traverse_commit_set (repo, to, -1, to_reachable_objects,
+                                        cancellable, error))
     goto out;
 
-  if (!ostree_repo_traverse_commit (repo, to, -1, &to_reachable_objects,
-                                    cancellable, error))
+  n = ostree_object_set_get_size (to_reachable_objects);
+  for (i = 0; i < n; i++)
+    {
+      const guchar *csum;
+      OstreeObjectType objtype;
+
+      ostree_object_set_get (to_reachable_objects, i, &csum, &objtype);
+      if (!ostree_object_set_contains (from_reachable_objects, csum, objtype))
+        ostree_object_set_add (new_objects, csum, objtype);
+    }
+
+  seen_dirtrees = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  if (!collect_content_paths (repo, ostree_repo_file_tree_get_contents_checksum ((OstreeRepoFile*)root_to),
+                              "/", new_objects, seen_dirtrees, builder->content_paths,
+                              cancellable, error))
     goto out;
 
-  new_reachable_objects = ostree_repo_traverse_new_reachable ();
+  n = ostree_object_set_get_size (new_objects);
+  for (i = 0; i < n; i++)
+    {
+      const guchar *csum;
+      char checksum[65];
+      OstreeStaticDeltaObject obj = { { 0, }, };
+      gs_unref_object GInputStream *content_stream = NULL;
+
+      ostree_object_set_get (new_objects, i, &csum, &obj.objtype);
+      memcpy (obj.csum, csum, sizeof (obj.csum));
+      ostree_checksum_inplace_from_bytes (csum, checksum);
+
+      /* Only the header is read here */
+      if (!ostree_repo_load_object_stream (repo, obj.objtype, checksum,
+                                           &content_stream, &obj.size,
+                                           cancellable, error))
+        goto out;
 
-  g_hash_table_iter_init (&hashiter, to_reachable_objects);
-  while (g_hash_table_iter_next (&hashiter, &key, &value))
+      if (obj.objtype == OSTREE_OBJECT_TYPE_FILE)
+        {
+          obj.path = g_hash_table_lookup (builder->content_paths, checksum);
+          obj.rollsum_from = g_hash_table_lookup (builder->rollsum_sources, checksum);
+        }
+
+      g_array_append_val (builder->objects, obj);
+    }
+
+  g_array_sort (builder->objects, compare_delta_objects);
+
+  for (i = 0; i < builder->objects->len; i++)
     {
-      GVariant *serialized_key = key;
+      OstreeStaticDeltaObject *obj = &g_array_index (builder->objects, OstreeStaticDeltaObject, i);
 
-      if (g_hash_table_contains (from_reachable_objects, serialized_key))
-        continue;
+      /* Ensure we have at least one object per delta, even if a given
+       * object is larger.  Rollsum objects are accounted at their full
+       * size, which is an upper bound of what they contribute.
+       */
+      if (current_part == NULL ||
+          (current_part->n_objects > 0 &&
+           current_part->uncompressed_size + obj->size > builder->max_part_size))
+        current_part = allocate_part (builder, i);
 
-      g_hash_table_insert (new_reachable_objects, g_variant_ref (serialized_key), serialized_key);
+      current_part->n_objects++;
+      current_part->uncompressed_size += obj->size;
     }
 
-  current_part = allocate_part (builder);
+  ret = TRUE;
+ out:
+  ostree_object_set_free (to_reachable_objects);
+  ostree_object_set_free (from_reachable_objects);
+  ostree_object_set_free (new_objects);
+  return ret;
+}
 
-  g_hash_table_iter_init (&hashiter, new_reachable_objects);
-  while (g_hash_table_iter_next (&hashiter, &key, &value))
+/* Write @data, compressed with @compression at @level, to a new
+ * temporary file for @part, preceded by the compression type; this is
+ * the serialized form of the "(yay)" part variant.  The checksum is computed as we
+ * go, so the compressed part is never held in memory.
+ */
+static gboolean
+write_compressed_part (OstreeRepo                       *repo,
+                       OstreeStaticDeltaCompressionType  compression,
+                       int                               level,
+                       const guint8                     *data,
+                       gsize                             len,
+                       OstreeStaticDeltaPartBuilder     *part,
+                       GCancellable                     *cancellable,
+                       GError                          **error)
+{
+  gboolean ret = FALSE;
+  const guint8 compression_type = compression;
+  gsize bytes_written;
+  gsize digest_len = sizeof (part->checksum);
+  gs_free guint8 *buf = NULL;
+  gs_free_checksum GChecksum *checksum = NULL;
+  gs_unref_object GConverter *compressor = NULL;
+  gs_unref_object GOutputStream *part_temp_outstream = NULL;
+  GError *temp_error = NULL;
+
+  compressor = _ostree_static_delta_compressor_new (compression, level, &temp_error);
+  if (temp_error)
     {
-      GVariant *serialized_key = key;
-      const char *checksum;
-      OstreeObjectType objtype;
+      g_propagate_error (error, temp_error);
+      goto out;
+    }
+
+  if (!gs_file_open_in_tmpdir (repo->tmp_dir, 0644,
+                               &part->tempfile, &part_temp_outstream,
+                               cancellable, error))
+    goto out;
+
+  checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  buf = g_malloc (COMPRESS_BUFSIZE);
+
+  g_checksum_update (checksum, &compression_type, 1);
+  if (!g_output_stream_write_all (part_temp_outstream, &compression_type, 1, &bytes_written,
+                                  cancellable, error))
+    goto out;
+  part->compressed_size = 1;
+
+  while (len > 0 && compressor == NULL)
+    {
+      gsize n = MIN (len, COMPRESS_BUFSIZE);
+
+      g_checksum_update (checksum, data, n);
+      if (!g_output_stream_write_all (part_temp_outstream, data, n, &bytes_written,
+                                      cancellable, error))
+        goto out;
+      part->compressed_size += n;
+      data += n;
+      len -= n;
+    }
+
+  while (compressor != NULL)
+    {
+      GConverterResult res;
+      gsize bytes_read;
+      gsize bytes_converted;
+
+      res = g_converter_convert (compressor, data, len, buf, COMPRESS_BUFSIZE,
+                                 G_CONVERTER_INPUT_AT_END, &bytes_read, &bytes_converted,
+                                 error);
+      if (res == G_CONVERTER_ERROR)
+        goto out;
+      data += bytes_read;
+      len -= bytes_read;
+
+      g_checksum_update (checksum, buf, bytes_converted);
+      if (!g_output_stream_write_all (part_temp_outstream, buf, bytes_converted, &bytes_written,
+                                      cancellable, error))
+        goto out;
+      part->compressed_size += bytes_converted;
+
+      if (res == G_CONVERTER_FINISHED)
+        break;
+    }
+
+  if (!g_output_stream_close (part_temp_outstream, cancellable, error))
+    goto out;
+
+  g_checksum_get_digest (checksum, part->checksum, &digest_len);
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/* Build the payload and operations of @part, and write it out.  Only
+ * this part's objects are held in memory.
+ */
+static gboolean
+compile_part (OstreeStaticDeltaBuilder         *builder,
+              OstreeStaticDeltaPartBuilder     *part,
+              GCancellable                     *cancellable,
+              GError                          **error)
+{
+  gboolean ret = FALSE;
+  guint i;
+  GString *payload = g_string_sized_new (part->uncompressed_size);
+  GString *operations = g_string_new (NULL);
+  gs_unref_bytes GBytes *payload_b = NULL;
+  gs_unref_bytes GBytes *operations_b = NULL;
+  gs_unref_variant GVariant *delta_part_content = NULL;
+
+  for (i = part->start; i < part->start + part->n_objects; i++)
+    {
+      OstreeStaticDeltaObject *obj = &g_array_index (builder->objects, OstreeStaticDeltaObject, i);
+      char checksum[65];
+      gboolean handled = FALSE;
       guint64 content_size;
       gsize object_payload_start;
-      gs_unref_object GInputStream *content_stream = NULL;
       gsize bytes_read;
-      const guint readlen = 4096;
+      gs_unref_object GInputStream *content_stream = NULL;
+
+      ostree_checksum_inplace_from_bytes (obj->csum, checksum);
+
+      if (obj->rollsum_from &&
+          !process_one_rollsum (builder->repo, payload, operations,
+                                obj->rollsum_from, checksum, &handled,
+                                cancellable, error))
+        goto out;
 
-      ostree_object_name_deserialize (serialized_key, &checksum, &objtype);
+      if (handled)
+        continue;
 
-      if (!ostree_repo_load_object_stream (repo, objtype, checksum,
+      if (!ostree_repo_load_object_stream (builder->repo, obj->objtype, checksum,
                                            &content_stream, &content_size,
                                            cancellable, error))
         goto out;
 
-      current_part->uncompressed_size += content_size;
-
-      /* Ensure we have at least one object per delta, even if a given
-       * object is larger.
-       */
-      if (current_part->objects->len > 0 &&
-          current_part->payload->len + content_size > OSTREE_STATIC_DELTA_PART_MAX_SIZE_BYTES)
+      /* Read the object straight into its place in the payload */
+      object_payload_start = payload->len;
+      g_string_set_size (payload, object_payload_start + content_size);
+      if (!g_input_stream_read_all (content_stream, payload->str + object_payload_start,
+                                    content_size, &bytes_read,
+                                    cancellable, error))
+        goto out;
+      if (bytes_read != content_size)
         {
-          current_part = allocate_part (builder);
-        } 
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Unexpected end of object %s.%s", checksum,
+                       ostree_object_type_to_string (obj->objtype));
+          goto out;
+        }
 
-      g_ptr_array_add (current_part->objects, g_variant_ref (serialized_key));
+      g_string_append_c (operations, (gchar)OSTREE_STATIC_DELTA_OP_WRITE);
+      _ostree_write_varuint64 (operations, object_payload_start);
+      _ostree_write_varuint64 (operations, content_size);
+      g_string_append_c (operations, (gchar)OSTREE_STATIC_DELTA_OP_CLOSE);
+    }
 
-      object_payload_start = current_part->payload->len;
+  payload_b = g_string_free_to_bytes (payload);
+  payload = NULL;
+  operations_b = g_string_free_to_bytes (operations);
+  operations = NULL;
 
-      while (TRUE)
-        {
-          gsize empty_space;
+  delta_part_content = g_variant_new ("(@ay@ay)",
+                                      ot_gvariant_new_ay_bytes (payload_b),
+                                      ot_gvariant_new_ay_bytes (operations_b));
+  g_variant_ref_sink (delta_part_content);
 
-          empty_space = current_part->payload->allocated_len - current_part->payload->len;
-          if (empty_space < readlen)
-            {
-              gsize origlen;
-              origlen = current_part->payload->len;
-              g_string_set_size (current_part->payload, current_part->payload->allocated_len + (readlen - empty_space));
-              current_part->payload->len = origlen;
-            }
+  /* Serializing releases the children, leaving a single copy */
+  g_variant_get_data (delta_part_content);
+  g_clear_pointer (&payload_b, g_bytes_unref);
+  g_clear_pointer (&operations_b, g_bytes_unref);
 
-          if (!g_input_stream_read_all (content_stream,
-                                        current_part->payload->str + current_part->payload->len,
-                                        readlen,
-                                        &bytes_read,
-                                        cancellable, error))
-            goto out;
-          if (bytes_read == 0)
-            break;
-          
-          current_part->payload->len += bytes_read;
-        }
-      
-      g_string_append_c (current_part->operations, (gchar)OSTREE_STATIC_DELTA_OP_WRITE);
-      _ostree_write_varuint64 (current_part->operations, object_payload_start);
-      _ostree_write_varuint64 (current_part->operations, content_size);
-      g_printerr ("write %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT "\n", (guint64) object_payload_start, (guint64)(content_size));
-      g_string_append_c (current_part->operations, (gchar)OSTREE_STATIC_DELTA_OP_CLOSE);
-    }
+  if (!write_compressed_part (builder->repo, builder->compression,
+                              builder->compression_level,
+                              g_variant_get_data (delta_part_content),
+                              g_variant_get_size (delta_part_content),
+                              part, cancellable, error))
+    goto out;
 
   ret = TRUE;
  out:
+  if (payload)
+    g_string_free (payload, TRUE);
+  if (operations)
+    g_string_free (operations, TRUE);
   return ret;
 }
 
+static void
+compile_part_thread (gpointer   job,
+                     gpointer   user_data)
+{
+  OstreeStaticDeltaBuilder *builder = user_data;
+  OstreeStaticDeltaPartBuilder *part = builder->parts->pdata[GPOINTER_TO_UINT (job) - 1];
+  GError *local_error = NULL;
+
+  /* Once one part failed, don't bother with the rest */
+  if (g_atomic_int_get (&builder->failed))
+    return;
+
+  if (!compile_part (builder, part, builder->cancellable, &local_error))
+    {
+      g_mutex_lock (&builder->lock);
+      if (builder->error == NULL)
+        builder->error = local_error;
+      else
+        g_error_free (local_error);
+      g_atomic_int_set (&builder->failed, 1);
+      g_mutex_unlock (&builder->lock);
+    }
+}
+
+/* Each compile thread holds one part, serialized once more while
+ * compressing, plus its own compressor; at the higher xz levels the
+ * latter dominates.  Don't run more threads than fit in a quarter of
+ * physical memory.
+ */
+static guint
+get_max_compile_threads (OstreeStaticDeltaBuilder *builder)
+{
+  long phys_pages = sysconf (_SC_PHYS_PAGES);
+  long page_size = sysconf (_SC_PAGESIZE);
+  guint64 budget;
+  guint64 per_thread;
+
+  if (phys_pages > 0 && page_size > 0)
+    budget = ((guint64)phys_pages) * page_size / 4;
+  else
+    budget = 1024 * 1024 * 1024;
+
+  per_thread = 2 * builder->max_part_size +
+    _ostree_static_delta_compressor_get_memusage (builder->compression,
+                                                  builder->compression_level);
+
+  return MAX (budget / per_thread, 1);
+}
+
 /**
  * ostree_repo_static_delta_generate:
  * @self: Repo
  * @opt: High level optimization choice
- * @from: ASCII SHA256 checksum of origin
+ * @from: (allow-none): ASCII SHA256 checksum of origin, or %NULL
  * @to: ASCII SHA256 checksum of target
  * @metadata: (allow-none): Optional metadata
+ * @params: (allow-none): Parameters, of type a{sv}
  * @cancellable: Cancellable
  * @error: Error
  *
@@ -236,6 +852,23 @@ generate_delta_lowlatency (OstreeRepo                       *repo,
  * the objects in @to.  This delta is an optimization over fetching
  * individual objects, and can be conveniently stored and applied
  * offline.
+ *
+ * If @from is %NULL, the delta is generated "from scratch"; it
+ * contains all objects of @to, and can be used for an initial pull
+ * of @to into an empty repository.
+ *
+ * The @params argument should be an a{sv}.  The following attributes
+ * are known:
+ *   - max-chunk-size: u: Maximum uncompressed size of a part in
+ *     megabytes, unless a single object is larger
+ *   - compression: y: Compression type of the parts; 'g' for gzip
+ *     (the default), 'x' for xz if built with liblzma, or 0 for none
+ *   - compression-level: u: Compression level between 0 and 9; the
+ *     default is 9 for gzip and 6 for xz
+ *
+ * Parts are compiled in parallel; each one is only held in memory
+ * while it is being compiled.  Fewer threads are used when the parts
+ * and their compressors would not otherwise fit in memory.
  */
 gboolean
 ostree_repo_static_delta_generate (OstreeRepo                   *self,
@@ -243,96 +876,113 @@ ostree_repo_static_delta_generate (OstreeRepo                   *self,
                                    const char                   *from,
                                    const char                   *to,
                                    GVariant                     *metadata,
+                                   GVariant                     *params,
                                    GCancellable                 *cancellable,
                                    GError                      **error)
 {
   gboolean ret = FALSE;
   OstreeStaticDeltaBuilder builder = { 0, };
   guint i;
+  guint32 max_chunk_size;
+  guint8 compression;
+  guint32 compression_level;
+  guint max_threads;
+  GError *temp_error = NULL;
   GVariant *metadata_source;
+  GThreadPool *pool;
   gs_unref_variant_builder GVariantBuilder *part_headers = NULL;
-  gs_unref_ptrarray GPtrArray *part_tempfiles = NULL;
   gs_unref_variant GVariant *delta_descriptor = NULL;
   gs_free char *descriptor_relpath = NULL;
   gs_unref_object GFile *descriptor_path = NULL;
   gs_unref_object GFile *descriptor_dir = NULL;
   gs_unref_variant GVariant *tmp_metadata = NULL;
 
+  builder.repo = self;
+  builder.max_part_size = OSTREE_STATIC_DELTA_PART_MAX_SIZE_BYTES;
+  builder.compression = OSTREE_STATIC_DELTA_COMPRESSION_TYPE_GZIP;
+  builder.compression_level = -1;
+  builder.objects = g_array_new (FALSE, FALSE, sizeof (OstreeStaticDeltaObject));
   builder.parts = g_ptr_array_new_with_free_func ((GDestroyNotify)ostree_static_delta_part_builder_unref);
+  builder.content_paths = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  builder.rollsum_sources = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  builder.cancellable = cancellable;
+  g_mutex_init (&builder.lock);
+
+  if (params && g_variant_lookup (params, "max-chunk-size", "u", &max_chunk_size))
+    {
+      if (max_chunk_size == 0)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                       "Invalid max-chunk-size 0");
+          goto out;
+        }
+      builder.max_part_size = ((guint64)max_chunk_size) * 1024 * 1024;
+    }
+
+  if (params && g_variant_lookup (params, "compression", "y", &compression))
+    builder.compression = compression;
+
+  if (params && g_variant_lookup (params, "compression-level", "u", &compression_level))
+    {
+      if (compression_level > 9)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                       "Invalid compression-level %u", compression_level);
+          goto out;
+        }
+      builder.compression_level = compression_level;
+    }
+
+  /* Check it's supported before doing any work */
+  {
+    gs_unref_object GConverter *compressor = NULL;
+
+    compressor = _ostree_static_delta_compressor_new (builder.compression,
+                                                      builder.compression_level,
+                                                      &temp_error);
+    if (temp_error)
+      {
+        g_propagate_error (error, temp_error);
+        goto out;
+      }
+  }
 
   /* Ignore optimization flags */
   if (!generate_delta_lowlatency (self, from, to, &builder,
                                   cancellable, error))
     goto out;
 
+  pool = ot_thread_pool_new_nproc (compile_part_thread, &builder);
+  max_threads = get_max_compile_threads (&builder);
+  if (max_threads < (guint) g_thread_pool_get_max_threads (pool))
+    g_thread_pool_set_max_threads (pool, max_threads, NULL);
+  for (i = 0; i < builder.parts->len; i++)
+    g_thread_pool_push (pool, GUINT_TO_POINTER (i + 1), NULL);
+  g_thread_pool_free (pool, FALSE, TRUE);
+
+  if (builder.error)
+    {
+      g_propagate_error (error, builder.error);
+      builder.error = NULL;
+      goto out;
+    }
+
   part_headers = g_variant_builder_new (G_VARIANT_TYPE ("a" OSTREE_STATIC_DELTA_META_ENTRY_FORMAT));
-  part_tempfiles = g_ptr_array_new_with_free_func (g_object_unref);
   for (i = 0; i < builder.parts->len; i++)
     {
       OstreeStaticDeltaPartBuilder *part_builder = builder.parts->pdata[i];
-      GBytes *payload_b;
-      GBytes *operations_b;
-      gs_free guchar *part_checksum = NULL;
-      gs_free_checksum GChecksum *checksum = NULL;
       gs_unref_bytes GBytes *objtype_checksum_array = NULL;
       gs_unref_bytes GBytes *checksum_bytes = NULL;
-      gs_unref_object GFile *part_tempfile = NULL;
-      gs_unref_object GOutputStream *part_temp_outstream = NULL;
-      gs_unref_object GInputStream *part_in = NULL;
-      gs_unref_object GInputStream *part_payload_in = NULL;
-      gs_unref_object GMemoryOutputStream *part_payload_out = NULL;
-      gs_unref_object GConverterOutputStream *part_payload_compressor = NULL;
-      gs_unref_object GConverter *zlib_compressor = NULL;
-      gs_unref_variant GVariant *delta_part_content = NULL;
-      gs_unref_variant GVariant *delta_part = NULL;
       gs_unref_variant GVariant *delta_part_header = NULL;
 
-      payload_b = g_string_free_to_bytes (part_builder->payload);
-      part_builder->payload = NULL;
-      
-      operations_b = g_string_free_to_bytes (part_builder->operations);
-      part_builder->operations = NULL;
-      /* FIXME - avoid duplicating memory here */
-      delta_part_content = g_variant_new ("(@ay@ay)",
-                                          ot_gvariant_new_ay_bytes (payload_b),
-                                          ot_gvariant_new_ay_bytes (operations_b));
-      g_variant_ref_sink (delta_part_content);
-
-      /* Hardcode gzip for now */
-      zlib_compressor = (GConverter*)g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_RAW, 9);
-      part_payload_in = ot_variant_read (delta_part_content);
-      part_payload_out = (GMemoryOutputStream*)g_memory_output_stream_new (NULL, 0, g_realloc, g_free);
-      part_payload_compressor = (GConverterOutputStream*)g_converter_output_stream_new ((GOutputStream*)part_payload_out, zlib_compressor);
-
-      if (0 > g_output_stream_splice ((GOutputStream*)part_payload_compressor, part_payload_in,
-                                      G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET | G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE,
-                                      cancellable, error))
-        goto out;
-
-      /* FIXME - avoid duplicating memory here */
-      delta_part = g_variant_new ("(y@ay)",
-                                  (guint8)'g',
-                                  ot_gvariant_new_ay_bytes (g_memory_output_stream_steal_as_bytes (part_payload_out)));
-
-      if (!gs_file_open_in_tmpdir (self->tmp_dir, 0644,
-                                   &part_tempfile, &part_temp_outstream,
-                                   cancellable, error))
-        goto out;
-      part_in = ot_variant_read (delta_part);
-      if (!ot_gio_splice_get_checksum (part_temp_outstream, part_in,
-                                       &part_checksum,
-                                       cancellable, error))
-        goto out;
-
-      checksum_bytes = g_bytes_new (part_checksum, 32);
-      objtype_checksum_array = objtype_checksum_array_new (part_builder->objects);
+      checksum_bytes = g_bytes_new (part_builder->checksum, sizeof (part_builder->checksum));
+      objtype_checksum_array = objtype_checksum_array_new (&builder, part_builder);
       delta_part_header = g_variant_new ("(@aytt@ay)",
                                          ot_gvariant_new_ay_bytes (checksum_bytes),
-                                         g_variant_get_size (delta_part),
+                                         part_builder->compressed_size,
                                          part_builder->uncompressed_size,
                                          ot_gvariant_new_ay_bytes (objtype_checksum_array));
       g_variant_builder_add_value (part_headers, g_variant_ref (delta_part_header));
-      g_ptr_array_add (part_tempfiles, g_object_ref (part_tempfile));
     }
 
   descriptor_relpath = _ostree_get_relative_static_delta_path (from, to);
@@ -344,12 +994,13 @@ ostree_repo_static_delta_generate (OstreeRepo                   *self,
 
   for (i = 0; i < builder.parts->len; i++)
     {
-      GFile *tempfile = part_tempfiles->pdata[i];
+      OstreeStaticDeltaPartBuilder *part_builder = builder.parts->pdata[i];
       gs_free char *part_relpath = _ostree_get_relative_static_delta_part_path (from, to, i);
       gs_unref_object GFile *part_path = g_file_resolve_relative_path (self->repodir, part_relpath);
 
-      if (!gs_file_rename (tempfile, part_path, cancellable, error))
+      if (!gs_file_rename (part_builder->tempfile, part_path, cancellable, error))
         goto out;
+      g_clear_object (&part_builder->tempfile);
     }
 
   if (metadata != NULL)
@@ -380,6 +1031,16 @@ ostree_repo_static_delta_generate (OstreeRepo                   *self,
 
   ret = TRUE;
  out:
+  for (i = 0; i < builder.parts->len; i++)
+    {
+      OstreeStaticDeltaPartBuilder *part_builder = builder.parts->pdata[i];
+      if (part_builder->tempfile)
+        (void) gs_file_unlink (part_builder->tempfile, NULL, NULL);
+    }
   g_clear_pointer (&builder.parts, g_ptr_array_unref);
+  g_clear_pointer (&builder.objects, g_array_unref);
+  g_clear_pointer (&builder.content_paths, g_hash_table_unref);
+  g_clear_pointer (&builder.rollsum_sources, g_hash_table_unref);
+  g_mutex_clear (&builder.lock);
   return ret;
 }
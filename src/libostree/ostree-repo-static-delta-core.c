@@ -22,6 +22,10 @@
 
 #include "ostree-repo-private.h"
 #include "ostree-repo-static-delta-private.h"
+#ifdef HAVE_LIBLZMA
+#include "ostree-lzma-compressor.h"
+#include "ostree-lzma-decompressor.h"
+#endif
 #include "otutil.h"
 
 gboolean
@@ -115,12 +119,12 @@ ostree_repo_list_static_delta_names (OstreeRepo                  *self,
   return ret;
 }
 
-static gboolean
-have_all_objects (OstreeRepo             *repo,
-                  GVariant               *checksum_array,
-                  gboolean               *out_have_all,
-                  GCancellable           *cancellable,
-                  GError                **error)
+gboolean
+_ostree_static_delta_part_have_all_objects (OstreeRepo             *repo,
+                                            GVariant               *checksum_array,
+                                            gboolean               *out_have_all,
+                                            GCancellable           *cancellable,
+                                            GError                **error)
 {
   gboolean ret = FALSE;
   guint8 *checksums_data;
@@ -160,31 +164,330 @@ have_all_objects (OstreeRepo             *repo,
   return ret;
 }
 
+/*
+ * _ostree_static_delta_compressor_new:
+ * @compression: Compression type
+ * @level: Compression level between 0 and 9, or -1 for the default
+ * (9 for gzip, 6 for xz); ignored for uncompressed parts
+ *
+ * Returns: (transfer full): A compressor for delta parts of type
+ * @compression, or %NULL for uncompressed parts.  Sets @error if
+ * @compression is unknown or not supported by this build, or if
+ * @level is out of range.
+ */
+GConverter *
+_ostree_static_delta_compressor_new (OstreeStaticDeltaCompressionType   compression,
+                                     int                                level,
+                                     GError                           **error)
+{
+  if (level < -1 || level > 9)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                   "Invalid static delta compression level %d", level);
+      return NULL;
+    }
+
+  switch (compression)
+    {
+    case OSTREE_STATIC_DELTA_COMPRESSION_TYPE_NONE:
+      return NULL;
+    case OSTREE_STATIC_DELTA_COMPRESSION_TYPE_GZIP:
+      return (GConverter*)g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_RAW,
+                                                 level == -1 ? 9 : level);
+#ifdef HAVE_LIBLZMA
+    case OSTREE_STATIC_DELTA_COMPRESSION_TYPE_LZMA:
+      return (GConverter*)_ostree_lzma_compressor_new (level == -1 ? 6 : level);
+#endif
+    default:
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                   "Unsupported static delta part compression type '%u'",
+                   (guint) compression);
+      return NULL;
+    }
+}
+
+/*
+ * _ostree_static_delta_compressor_get_memusage:
+ *
+ * Returns: Approximate memory in bytes used by one compressor from
+ * _ostree_static_delta_compressor_new() with the same arguments.
+ */
+guint64
+_ostree_static_delta_compressor_get_memusage (OstreeStaticDeltaCompressionType   compression,
+                                              int                                level)
+{
+  switch (compression)
+    {
+    case OSTREE_STATIC_DELTA_COMPRESSION_TYPE_GZIP:
+      /* deflate's window and hash chains at the zlib defaults */
+      return 256 * 1024;
+#ifdef HAVE_LIBLZMA
+    case OSTREE_STATIC_DELTA_COMPRESSION_TYPE_LZMA:
+      return _ostree_lzma_compressor_get_memusage (level == -1 ? 6 : level);
+#endif
+    default:
+      return 0;
+    }
+}
+
+/*
+ * _ostree_static_delta_decompressor_new:
+ *
+ * Like _ostree_static_delta_compressor_new(), but for reading parts.
+ */
+GConverter *
+_ostree_static_delta_decompressor_new (OstreeStaticDeltaCompressionType   compression,
+                                       GError                           **error)
+{
+  switch (compression)
+    {
+    case OSTREE_STATIC_DELTA_COMPRESSION_TYPE_NONE:
+      return NULL;
+    case OSTREE_STATIC_DELTA_COMPRESSION_TYPE_GZIP:
+      return (GConverter*)g_zlib_decompressor_new (G_ZLIB_COMPRESSOR_FORMAT_RAW);
+#ifdef HAVE_LIBLZMA
+    case OSTREE_STATIC_DELTA_COMPRESSION_TYPE_LZMA:
+      return (GConverter*)_ostree_lzma_decompressor_new ();
+#endif
+    default:
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                   "Invalid compression type '%u' in static delta part",
+                   (guint) compression);
+      return NULL;
+    }
+}
+
+/* Decompress @data straight into a temporary file and map it, rather
+ * than growing a heap buffer for the whole payload; the payload is
+ * then backed by the page cache.
+ */
 static gboolean
-zlib_uncompress_data (GBytes       *data,
-                      GBytes      **out_uncompressed,
-                      GCancellable *cancellable,
-                      GError      **error)
+uncompress_data (OstreeRepo   *repo,
+                 GConverter   *decompressor,
+                 GBytes       *data,
+                 GBytes      **out_uncompressed,
+                 GCancellable *cancellable,
+                 GError      **error)
 {
   gboolean ret = FALSE;
-  gs_unref_object GMemoryInputStream *memin = (GMemoryInputStream*)g_memory_input_stream_new_from_bytes (data);
-  gs_unref_object GMemoryOutputStream *memout = (GMemoryOutputStream*)g_memory_output_stream_new (NULL, 0, g_realloc, g_free);
-  gs_unref_object GConverter *zlib_decomp =
-    (GConverter*) g_zlib_decompressor_new (G_ZLIB_COMPRESSOR_FORMAT_RAW);
-  gs_unref_object GInputStream *convin = g_converter_input_stream_new ((GInputStream*)memin, zlib_decomp);
+  GMappedFile *mfile = NULL;
+  gs_unref_object GInputStream *memin = g_memory_input_stream_new_from_bytes (data);
+  gs_unref_object GInputStream *convin = g_converter_input_stream_new (memin, decompressor);
+  gs_unref_object GFile *tmp_path = NULL;
+  gs_unref_object GOutputStream *tmp_out = NULL;
+
+  if (!gs_file_open_in_tmpdir (repo->tmp_dir, 0644,
+                               &tmp_path, &tmp_out,
+                               cancellable, error))
+    goto out;
 
-  if (0 > g_output_stream_splice ((GOutputStream*)memout, convin,
+  if (0 > g_output_stream_splice (tmp_out, convin,
                                   G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE |
                                   G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET,
                                   cancellable, error))
     goto out;
 
+  mfile = gs_file_map_noatime (tmp_path, cancellable, error);
+  if (!mfile)
+    goto out;
+
   ret = TRUE;
-  *out_uncompressed = g_memory_output_stream_steal_as_bytes (memout);
+  *out_uncompressed = g_mapped_file_get_bytes (mfile);
+  g_mapped_file_unref (mfile);
  out:
+  /* The mapping stays valid after the unlink */
+  if (tmp_path)
+    (void) gs_file_unlink (tmp_path, NULL, NULL);
   return ret;
 }
 
+/**
+ * _ostree_static_delta_part_open:
+ * @repo: Repo, whose temporary directory is used for decompression
+ * @part_bytes: Raw contents of a delta part, including the compression byte
+ * @expected_checksum: (allow-none): If non-%NULL, binary SHA256 the part must match
+ * @out_part: (out): Payload variant of type %OSTREE_STATIC_DELTA_PART_PAYLOAD_FORMAT
+ *
+ * Optionally validate the checksum of @part_bytes, then decompress it
+ * according to its leading compression byte.
+ */
+gboolean
+_ostree_static_delta_part_open (OstreeRepo     *repo,
+                                GBytes         *part_bytes,
+                                const guchar   *expected_checksum,
+                                GVariant      **out_part,
+                                GCancellable   *cancellable,
+                                GError        **error)
+{
+  gboolean ret = FALSE;
+  gsize partlen;
+  const guint8 *partdata;
+  gs_unref_bytes GBytes *payload = NULL;
+  gs_unref_bytes GBytes *subbytes = NULL;
+  gs_unref_object GConverter *decompressor = NULL;
+  gs_unref_variant GVariant *ret_part = NULL;
+  GError *temp_error = NULL;
+
+  partdata = g_bytes_get_data (part_bytes, &partlen);
+
+  if (expected_checksum)
+    {
+      GChecksum *checksum = g_checksum_new (G_CHECKSUM_SHA256);
+      gs_free guchar *actual_checksum = NULL;
+
+      g_checksum_update (checksum, partdata, partlen);
+      actual_checksum = ot_csum_from_gchecksum (checksum);
+      g_checksum_free (checksum);
+
+      if (ostree_cmp_checksum_bytes (expected_checksum, actual_checksum) != 0)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Checksum mismatch in static delta part");
+          goto out;
+        }
+    }
+
+  if (partlen < 1)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Corrupted 0 length byte part");
+      goto out;
+    }
+
+  subbytes = g_bytes_new_from_bytes (part_bytes, 1, partlen - 1);
+
+  decompressor = _ostree_static_delta_decompressor_new (partdata[0], &temp_error);
+  if (temp_error)
+    {
+      g_propagate_error (error, temp_error);
+      goto out;
+    }
+
+  if (decompressor == NULL)
+    payload = g_bytes_ref (subbytes);
+  else if (!uncompress_data (repo, decompressor, subbytes, &payload,
+                             cancellable, error))
+    goto out;
+
+  ret_part = ot_variant_new_from_bytes (G_VARIANT_TYPE (OSTREE_STATIC_DELTA_PART_PAYLOAD_FORMAT),
+                                        payload, FALSE);
+  g_variant_ref_sink (ret_part);
+
+  ret = TRUE;
+  gs_transfer_out_value (out_part, &ret_part);
+ out:
+  return ret;
+}
+
+typedef struct {
+  OstreeRepo    *repo;
+  GFile         *dir;
+  GVariant      *headers;
+  gboolean       skip_validation;
+  GCancellable  *cancellable;
+
+  volatile gint  failed;
+  GMutex         lock;
+  GError        *error;
+} StaticDeltaExecuteData;
+
+static gboolean
+execute_one_part (StaticDeltaExecuteData  *data,
+                  guint                    i,
+                  GCancellable            *cancellable,
+                  GError                 **error)
+{
+  gboolean ret = FALSE;
+  guint64 size;
+  guint64 usize;
+  const guchar *csum = NULL;
+  gboolean have_all;
+  GMappedFile *mfile = NULL;
+  gs_unref_variant GVariant *header = NULL;
+  gs_unref_variant GVariant *csum_v = NULL;
+  gs_unref_variant GVariant *objects = NULL;
+  gs_unref_object GFile *part_path = NULL;
+  gs_unref_variant GVariant *part = NULL;
+  gs_unref_bytes GBytes *bytes = NULL;
+
+  header = g_variant_get_child_value (data->headers, i);
+  g_variant_get (header, "(@aytt@ay)", &csum_v, &size, &usize, &objects);
+
+  if (!_ostree_static_delta_part_have_all_objects (data->repo, objects, &have_all,
+                                                   cancellable, error))
+    goto out;
+
+  /* If we already have these objects, don't bother executing the
+   * static delta.
+   */
+  if (have_all)
+    {
+      ret = TRUE;
+      goto out;
+    }
+
+  if (!data->skip_validation)
+    {
+      csum = ostree_checksum_bytes_peek_validate (csum_v, error);
+      if (!csum)
+        goto out;
+    }
+
+  part_path = ot_gfile_resolve_path_printf (data->dir, "%u", i);
+
+  mfile = gs_file_map_noatime (part_path, cancellable, error);
+  if (!mfile)
+    goto out;
+
+  bytes = g_mapped_file_get_bytes (mfile);
+  g_mapped_file_unref (mfile);
+
+  /* The checksum is computed over the same mapping the part is then
+   * decompressed from, so each part is only read once.
+   */
+  if (!_ostree_static_delta_part_open (data->repo, bytes, csum, &part,
+                                       cancellable, error))
+    {
+      g_prefix_error (error, "opening static delta %s part %u: ",
+                      gs_file_get_path_cached (data->dir), i);
+      goto out;
+    }
+
+  if (!_ostree_static_delta_part_execute (data->repo, objects, part, cancellable, error))
+    {
+      g_prefix_error (error, "executing delta part %u: ", i);
+      goto out;
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+static void
+execute_part_thread (gpointer   job,
+                     gpointer   user_data)
+{
+  StaticDeltaExecuteData *data = user_data;
+  GError *local_error = NULL;
+
+  /* Once one part failed, don't bother with the rest */
+  if (g_atomic_int_get (&data->failed))
+    return;
+
+  if (!execute_one_part (data, GPOINTER_TO_UINT (job) - 1,
+                         data->cancellable, &local_error))
+    {
+      g_mutex_lock (&data->lock);
+      if (data->error == NULL)
+        data->error = local_error;
+      else
+        g_error_free (local_error);
+      g_atomic_int_set (&data->failed, 1);
+      g_mutex_unlock (&data->lock);
+    }
+}
+
 /**
  * ostree_repo_static_delta_execute_offline:
  * @self: Repo
@@ -197,6 +500,9 @@ zlib_uncompress_data (GBytes       *data,
  * on disk, apply it, generating a new commit.  The directory must be
  * named with the form "FROM-TO", where both are checksums, and it
  * must contain a file named "meta", along with at least one part.
+ *
+ * Parts are independent of each other, and are validated and
+ * executed in parallel.
  */
 gboolean
 ostree_repo_static_delta_execute_offline (OstreeRepo                    *self,
@@ -207,127 +513,41 @@ ostree_repo_static_delta_execute_offline (OstreeRepo                    *self,
 {
   gboolean ret = FALSE;
   guint i, n;
+  StaticDeltaExecuteData data = { 0, };
+  GThreadPool *pool;
   gs_unref_object GFile *meta_file = g_file_get_child (dir, "meta");
   gs_unref_variant GVariant *meta = NULL;
   gs_unref_variant GVariant *headers = NULL;
 
+  g_mutex_init (&data.lock);
+
   if (!ot_util_variant_map (meta_file, G_VARIANT_TYPE (OSTREE_STATIC_DELTA_META_FORMAT),
                             FALSE, &meta, error))
     goto out;
 
   headers = g_variant_get_child_value (meta, 3);
   n = g_variant_n_children (headers);
-  for (i = 0; i < n; i++)
-    {
-      guint64 size;
-      guint64 usize;
-      const guchar *csum;
-      gboolean have_all;
-      gs_unref_variant GVariant *header = NULL;
-      gs_unref_variant GVariant *csum_v = NULL;
-      gs_unref_variant GVariant *objects = NULL;
-      gs_unref_object GFile *part_path = NULL;
-      gs_unref_variant GVariant *part = NULL;
-      gs_unref_object GInputStream *raw_in = NULL;
-      gs_unref_object GInputStream *in = NULL;
-
-      header = g_variant_get_child_value (headers, i);
-      g_variant_get (header, "(@aytt@ay)", &csum_v, &size, &usize, &objects);
-
-      if (!have_all_objects (self, objects, &have_all, cancellable, error))
-        goto out;
-
-      /* If we already have these objects, don't bother executing the
-       * static delta.
-       */
-      if (have_all)
-        continue;
-
-      csum = ostree_checksum_bytes_peek_validate (csum_v, error);
-      if (!csum)
-        goto out;
-
-      part_path = ot_gfile_resolve_path_printf (dir, "%u", i);
-
-      in = (GInputStream*)g_file_read (part_path, cancellable, error);
-      if (!in)
-        goto out;
-
-      if (!skip_validation)
-        {
-          gs_unref_object GInputStream *tmp_in = NULL;
-          gs_free guchar *actual_checksum = NULL;
-
-          tmp_in = (GInputStream*)g_file_read (part_path, cancellable, error);
-          if (!tmp_in)
-            goto out;
-
-          if (!ot_gio_checksum_stream (tmp_in, &actual_checksum,
-                                       cancellable, error))
-            goto out;
-
-          if (ostree_cmp_checksum_bytes (csum, actual_checksum) != 0)
-            {
-              g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
-                           "Checksum mismatch in static delta %s part %u",
-                           gs_file_get_path_cached (dir), i);
-              goto out;
-            }
-        }
-
-      {
-        GMappedFile *mfile = gs_file_map_noatime (part_path, cancellable, error);
-        gs_unref_bytes GBytes *bytes = NULL;
-        gs_unref_bytes GBytes *payload = NULL;
-        gsize partlen;
-        const guint8*partdata;
 
-        if (!mfile)
-          goto out;
+  data.repo = self;
+  data.dir = dir;
+  data.headers = headers;
+  data.skip_validation = skip_validation;
+  data.cancellable = cancellable;
 
-        bytes = g_mapped_file_get_bytes (mfile);
-        g_mapped_file_unref (mfile);
-
-        partdata = g_bytes_get_data (bytes, &partlen);
+  pool = ot_thread_pool_new_nproc (execute_part_thread, &data);
+  for (i = 0; i < n; i++)
+    g_thread_pool_push (pool, GUINT_TO_POINTER (i + 1), NULL);
+  g_thread_pool_free (pool, FALSE, TRUE);
 
-        if (partlen < 1)
-          {
-            g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
-                         "Corrupted 0 length byte part %s/%i",
-                         gs_file_get_basename_cached (dir),
-                         i);
-            goto out;
-          }
-        
-        switch (partdata[0])
-          {
-          case 0:
-            payload = g_bytes_new_from_bytes (bytes, 1, partlen - 1);
-            break;
-          case 'g':
-            {
-              gs_unref_bytes GBytes *subbytes = g_bytes_new_from_bytes (bytes, 1, partlen - 1);
-              if (!zlib_uncompress_data (subbytes, &payload,
-                                         cancellable, error))
-                goto out;
-            }
-            break;
-          }
-        
-        part = ot_variant_new_from_bytes (G_VARIANT_TYPE (OSTREE_STATIC_DELTA_PART_PAYLOAD_FORMAT),
-                                          payload, FALSE);
-        
-        
-        if (!_ostree_static_delta_part_execute (self, objects, part, cancellable, error))
-          {
-            g_prefix_error (error, "executing delta part %i: ", i);
-            goto out;
-          }
-      }
+  if (data.error)
+    {
+      g_propagate_error (error, data.error);
+      data.error = NULL;
+      goto out;
     }
 
   ret = TRUE;
  out:
+  g_mutex_clear (&data.lock);
   return ret;
 }
-
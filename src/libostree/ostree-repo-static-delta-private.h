@@ -29,6 +29,20 @@ G_BEGIN_DECLS
 /* 1 byte for object type, 32 bytes for checksum */
 #define OSTREE_STATIC_DELTA_OBJTYPE_CSUM_LEN 33
 
+/**
+ * OstreeStaticDeltaCompressionType:
+ *
+ * The first byte of a delta part; the rest of the part is the
+ * serialized %OSTREE_STATIC_DELTA_PART_PAYLOAD_FORMAT variant
+ * compressed with this type.  'x' (xz) is only available when built
+ * with liblzma.
+ */
+typedef enum {
+  OSTREE_STATIC_DELTA_COMPRESSION_TYPE_NONE = 0,
+  OSTREE_STATIC_DELTA_COMPRESSION_TYPE_GZIP = 'g',
+  OSTREE_STATIC_DELTA_COMPRESSION_TYPE_LZMA = 'x'
+} OstreeStaticDeltaCompressionType;
+
 /**
  * OSTREE_STATIC_DELTA_PART_PAYLOAD_FORMAT:
  *
@@ -93,5 +107,33 @@ _ostree_static_delta_parse_checksum_array (GVariant      *array,
                                            guint8       **out_checksums_array,
                                            guint         *out_n_checksums,
                                            GError       **error);
+
+gboolean
+_ostree_static_delta_part_have_all_objects (OstreeRepo             *repo,
+                                            GVariant               *checksum_array,
+                                            gboolean               *out_have_all,
+                                            GCancellable           *cancellable,
+                                            GError                **error);
+
+GConverter *
+_ostree_static_delta_compressor_new (OstreeStaticDeltaCompressionType   compression,
+                                     int                                level,
+                                     GError                           **error);
+
+guint64
+_ostree_static_delta_compressor_get_memusage (OstreeStaticDeltaCompressionType   compression,
+                                              int                                level);
+
+GConverter *
+_ostree_static_delta_decompressor_new (OstreeStaticDeltaCompressionType   compression,
+                                       GError                           **error);
+
+gboolean
+_ostree_static_delta_part_open (OstreeRepo     *repo,
+                                GBytes         *part_bytes,
+                                const guchar   *expected_checksum,
+                                GVariant      **out_part,
+                                GCancellable   *cancellable,
+                                GError        **error);
 G_END_DECLS
 
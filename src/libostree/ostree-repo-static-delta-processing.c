@@ -43,6 +43,10 @@ typedef struct {
   GFile          *output_tmp_path;
   GOutputStream  *output_tmp_stream;
   const guint8   *input_target_csum;
+  GBytes         *input_target_bytes;
+
+  const guint8   *input_data;
+  guint64         input_size;
 
   const guint8   *payload_data;
   guint64         payload_size; 
@@ -68,6 +72,8 @@ OPPROTO(fetch)
 OPPROTO(write)
 OPPROTO(gunzip)
 OPPROTO(close)
+OPPROTO(readobject)
+OPPROTO(readpayload)
 #undef OPPROTO
 
 static OstreeStaticDeltaOperation op_dispatch_table[] = {
@@ -75,7 +81,8 @@ static OstreeStaticDeltaOperation op_dispatch_table[] = {
   { "write", dispatch_write },
   { "gunzip", dispatch_gunzip },
   { "close", dispatch_close },
-  { NULL }
+  { "readobject", dispatch_readobject },
+  { "readpayload", dispatch_readpayload }
 };
 
 static gboolean
@@ -142,6 +149,8 @@ _ostree_static_delta_part_execute (OstreeRepo      *repo,
 
   state->payload_data = g_variant_get_data (payload);
   state->payload_size = g_variant_get_size (payload);
+  state->input_data = state->payload_data;
+  state->input_size = state->payload_size;
 
   state->oplen = g_variant_n_children (ops);
   state->opdata = g_variant_get_data (ops);
@@ -150,14 +159,14 @@ _ostree_static_delta_part_execute (OstreeRepo      *repo,
       guint8 opcode = state->opdata[0];
       OstreeStaticDeltaOperation *op;
 
-      if (G_UNLIKELY (opcode == 0 || opcode >= G_N_ELEMENTS (op_dispatch_table)))
+      if (G_UNLIKELY (opcode == 0 || opcode > G_N_ELEMENTS (op_dispatch_table)))
         {
           g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
                        "Out of range opcode %u at offset %u", opcode, n_executed);
           goto out;
         }
       op = &op_dispatch_table[opcode-1];
-      g_printerr ("dispatch %u\n", opcode-1);
+      g_debug ("dispatch %u", opcode-1);
       state->oplen--;
       state->opdata++;
       if (!op->func (repo, state, cancellable, error))
@@ -168,6 +177,11 @@ _ostree_static_delta_part_execute (OstreeRepo      *repo,
 
   ret = TRUE;
  out:
+  g_clear_pointer (&state->input_target_bytes, g_bytes_unref);
+  if (state->output_tmp_path)
+    (void) gs_file_unlink (state->output_tmp_path, NULL, NULL);
+  g_clear_object (&state->output_tmp_stream);
+  g_clear_object (&state->output_tmp_path);
   return ret;
 }
 
@@ -206,7 +220,7 @@ validate_ofs (StaticDeltaExecutionState  *state,
               GError                    **error)
 {
   if (G_UNLIKELY (offset + length < offset ||
-                  offset + length > state->payload_size))
+                  offset + length > state->input_size))
     {
       g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
                    "Invalid offset/length %" G_GUINT64_FORMAT "/%" G_GUINT64_FORMAT,
@@ -242,7 +256,7 @@ dispatch_write (OstreeRepo                 *repo,
     goto out;
 
   if (!g_output_stream_write_all (state->output_tmp_stream,
-                                  state->payload_data + offset,
+                                  state->input_data + offset,
                                   length,
                                   &bytes_written,
                                   cancellable, error))
@@ -282,7 +296,7 @@ dispatch_gunzip (OstreeRepo                 *repo,
   if (!validate_ofs (state, offset, length, error))
     goto out;
 
-  payload_in = g_memory_input_stream_new_from_data (state->payload_data + offset, length, NULL);
+  payload_in = g_memory_input_stream_new_from_data (state->input_data + offset, length, NULL);
   zlib_decomp = (GConverter*)g_zlib_decompressor_new (G_ZLIB_COMPRESSOR_FORMAT_RAW);
   zlib_in = g_converter_input_stream_new (payload_in, zlib_decomp);
 
@@ -306,6 +320,7 @@ dispatch_close (OstreeRepo                 *repo,
 {
   gboolean ret = FALSE;
   char tmp_checksum[65];
+  gs_free guchar *actual_csum = NULL;
 
   if (state->checksum_index == state->n_checksums)
     {
@@ -324,6 +339,10 @@ dispatch_close (OstreeRepo                 *repo,
 
   ostree_checksum_inplace_from_bytes (state->output_target, tmp_checksum);
 
+  /* Always ask for the computed checksum, so that the content is
+   * verified against the expected checksum rather than trusted; delta
+   * parts may be fetched from an untrusted source.
+   */
   if (OSTREE_OBJECT_TYPE_IS_META (state->output_objtype))
     {
       gs_unref_variant GVariant *metadata = NULL;
@@ -334,11 +353,10 @@ dispatch_close (OstreeRepo                 *repo,
         goto out;
 
       if (!ostree_repo_write_metadata (repo, state->output_objtype, tmp_checksum,
-                                       metadata, NULL, cancellable, error))
+                                       metadata, &actual_csum, cancellable, error))
         goto out;
 
-      g_print ("Wrote metadata object '%s'\n",
-               tmp_checksum);
+      g_debug ("Wrote metadata object '%s'", tmp_checksum);
     }
   else
     {
@@ -355,15 +373,15 @@ dispatch_close (OstreeRepo                 *repo,
         goto out;
       
       if (!ostree_repo_write_content (repo, tmp_checksum, in,
-                                      g_file_info_get_size (info), NULL,
+                                      g_file_info_get_size (info), &actual_csum,
                                       cancellable, error))
         goto out;
 
-      g_print ("Wrote content object '%s'\n",
-               tmp_checksum);
+      g_debug ("Wrote content object '%s'", tmp_checksum);
     }
 
   state->output_target = NULL;
+  (void) gs_file_unlink (state->output_tmp_path, NULL, NULL);
   g_clear_object (&state->output_tmp_path);
 
   state->checksum_index++;
@@ -379,3 +397,93 @@ dispatch_close (OstreeRepo                 *repo,
     g_prefix_error (error, "opcode close: ");
   return ret;
 }
+
+static gboolean
+dispatch_readobject (OstreeRepo                 *repo,
+                     StaticDeltaExecutionState  *state,
+                     GCancellable               *cancellable,  
+                     GError                    **error)
+{
+  gboolean ret = FALSE;
+  const guint8 *csum;
+  char tmp_checksum[65];
+  guint64 size;
+  GMappedFile *mfile = NULL;
+  gs_unref_object GInputStream *in = NULL;
+  gs_unref_object GFile *tmp_path = NULL;
+  gs_unref_object GOutputStream *tmp_out = NULL;
+
+  if (G_UNLIKELY(state->oplen < 32))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                   "Expected 32 bytes for readobject op");
+      goto out;
+    }
+  csum = state->opdata;
+  state->opdata += 32;
+  state->oplen -= 32;
+
+  /* The compiler switches back and forth between a source object and
+   * the payload; only load the object when it changes.
+   */
+  if (state->input_target_bytes != NULL &&
+      ostree_cmp_checksum_bytes (state->input_target_csum, csum) == 0)
+    {
+      state->input_data = g_bytes_get_data (state->input_target_bytes, NULL);
+      state->input_size = g_bytes_get_size (state->input_target_bytes);
+      ret = TRUE;
+      goto out;
+    }
+
+  g_clear_pointer (&state->input_target_bytes, g_bytes_unref);
+  state->input_target_csum = NULL;
+
+  ostree_checksum_inplace_from_bytes (csum, tmp_checksum);
+
+  /* Unpack the content object stream into a temporary file so we can
+   * copy arbitrary ranges out of it.
+   */
+  if (!ostree_repo_load_object_stream (repo, OSTREE_OBJECT_TYPE_FILE, tmp_checksum,
+                                       &in, &size, cancellable, error))
+    goto out;
+
+  if (!gs_file_open_in_tmpdir (repo->tmp_dir, 0644,
+                               &tmp_path, &tmp_out,
+                               cancellable, error))
+    goto out;
+
+  if (0 > g_output_stream_splice (tmp_out, in,
+                                  G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE |
+                                  G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET,
+                                  cancellable, error))
+    goto out;
+
+  mfile = gs_file_map_noatime (tmp_path, cancellable, error);
+  if (!mfile)
+    goto out;
+
+  state->input_target_bytes = g_mapped_file_get_bytes (mfile);
+  g_mapped_file_unref (mfile);
+  state->input_target_csum = csum;
+  state->input_data = g_bytes_get_data (state->input_target_bytes, NULL);
+  state->input_size = g_bytes_get_size (state->input_target_bytes);
+
+  ret = TRUE;
+ out:
+  if (tmp_path)
+    (void) gs_file_unlink (tmp_path, NULL, NULL);
+  if (!ret)
+    g_prefix_error (error, "opcode readobject: ");
+  return ret;
+}
+
+static gboolean
+dispatch_readpayload (OstreeRepo                 *repo,
+                      StaticDeltaExecutionState  *state,
+                      GCancellable               *cancellable,  
+                      GError                    **error)
+{
+  state->input_data = state->payload_data;
+  state->input_size = state->payload_size;
+  return TRUE;
+}
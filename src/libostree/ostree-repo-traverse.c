@@ -42,12 +42,202 @@ ostree_repo_traverse_new_reachable (void)
 }
 
 static gboolean
-traverse_dirtree_internal (OstreeRepo      *repo,
-                           const char      *dirtree_checksum,
-                           int              recursion_depth,
-                           GHashTable      *inout_reachable,
-                           GCancellable    *cancellable,
-                           GError         **error)
+traverse_dirtree_internal (OstreeRepo       *repo,
+                           const guchar     *dirtree_csum,
+                           int               recursion_depth,
+                           OstreeObjectSet  *inout_reachable,
+                           GCancellable     *cancellable,
+                           GError          **error)
+{
+  gboolean ret = FALSE;
+  int n, i;
+  char dirtree_checksum[65];
+  gs_unref_variant GVariant *tree = NULL;
+  gs_unref_variant GVariant *files_variant = NULL;
+  gs_unref_variant GVariant *dirs_variant = NULL;
+
+  if (recursion_depth > OSTREE_MAX_RECURSION)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Maximum recursion limit reached during traversal");
+      goto out;
+    }
+
+  if (ostree_object_set_contains (inout_reachable, dirtree_csum,
+                                  OSTREE_OBJECT_TYPE_DIR_TREE))
+    return TRUE;
+
+  ostree_checksum_inplace_from_bytes (dirtree_csum, dirtree_checksum);
+  if (!ostree_repo_load_variant_if_exists (repo, OSTREE_OBJECT_TYPE_DIR_TREE, dirtree_checksum, &tree, error))
+    goto out;
+
+  if (!tree)
+    return TRUE;
+
+  (void) ostree_object_set_add (inout_reachable, dirtree_csum,
+                                OSTREE_OBJECT_TYPE_DIR_TREE);
+
+  /* PARSE OSTREE_SERIALIZED_TREE_VARIANT */
+  files_variant = g_variant_get_child_value (tree, 0);
+  n = g_variant_n_children (files_variant);
+  for (i = 0; i < n; i++)
+    {
+      const char *filename;
+      const guchar *csum;
+      gs_unref_variant GVariant *csum_v = NULL;
+
+      g_variant_get_child (files_variant, i, "(&s@ay)", &filename, &csum_v);
+      csum = ostree_checksum_bytes_peek_validate (csum_v, error);
+      if (!csum)
+        goto out;
+      (void) ostree_object_set_add (inout_reachable, csum, OSTREE_OBJECT_TYPE_FILE);
+    }
+
+  dirs_variant = g_variant_get_child_value (tree, 1);
+  n = g_variant_n_children (dirs_variant);
+  for (i = 0; i < n; i++)
+    {
+      const char *dirname;
+      const guchar *content_csum;
+      const guchar *metadata_csum;
+      gs_unref_variant GVariant *content_csum_v = NULL;
+      gs_unref_variant GVariant *metadata_csum_v = NULL;
+
+      g_variant_get_child (dirs_variant, i, "(&s@ay@ay)",
+                           &dirname, &content_csum_v, &metadata_csum_v);
+
+      content_csum = ostree_checksum_bytes_peek_validate (content_csum_v, error);
+      if (!content_csum)
+        goto out;
+      if (!traverse_dirtree_internal (repo, content_csum, recursion_depth + 1,
+                                      inout_reachable, cancellable, error))
+        goto out;
+
+      metadata_csum = ostree_checksum_bytes_peek_validate (metadata_csum_v, error);
+      if (!metadata_csum)
+        goto out;
+      (void) ostree_object_set_add (inout_reachable, metadata_csum,
+                                    OSTREE_OBJECT_TYPE_DIR_META);
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/**
+ * ostree_repo_traverse_commit_set: (skip)
+ * @repo: Repo
+ * @commit_checksum: ASCII SHA256 checksum
+ * @maxdepth: Traverse this many parent commits, -1 for unlimited
+ * @inout_reachable: Set of reachable objects
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Update the set @inout_reachable containing all objects reachable
+ * from @commit_checksum, traversing @maxdepth parent commits.  Commits
+ * already in @inout_reachable are not traversed again.
+ *
+ * Objects are stored by binary checksum, so unlike
+ * ostree_repo_traverse_commit_union(), no hexadecimal string or
+ * #GVariant is created per object; this is the preferred API when
+ * traversing large repositories.
+ */
+gboolean
+ostree_repo_traverse_commit_set (OstreeRepo       *repo,
+                                 const char       *commit_checksum,
+                                 int               maxdepth,
+                                 OstreeObjectSet  *inout_reachable,
+                                 GCancellable     *cancellable,
+                                 GError          **error)
+{
+  gboolean ret = FALSE;
+  gs_free char *tmp_checksum = NULL;
+
+  while (TRUE)
+    {
+      gboolean recurse = FALSE;
+      guchar commit_csum[32];
+      const guchar *meta_csum;
+      const guchar *content_csum;
+      gs_unref_variant GVariant *meta_csum_bytes = NULL;
+      gs_unref_variant GVariant *content_csum_bytes = NULL;
+      gs_unref_variant GVariant *commit = NULL;
+
+      if (!ostree_validate_checksum_string (commit_checksum, error))
+        goto out;
+      ostree_checksum_inplace_to_bytes (commit_checksum, commit_csum);
+
+      if (ostree_object_set_contains (inout_reachable, commit_csum,
+                                      OSTREE_OBJECT_TYPE_COMMIT))
+        break;
+
+      /* PARSE OSTREE_SERIALIZED_COMMIT_VARIANT */
+      if (!ostree_repo_load_variant_if_exists (repo, OSTREE_OBJECT_TYPE_COMMIT, commit_checksum, &commit, error))
+        goto out;
+
+      /* Just return if the parent isn't found; we do expect most
+       * people to have partial repositories.
+       */
+      if (!commit)
+        break;
+
+      (void) ostree_object_set_add (inout_reachable, commit_csum,
+                                    OSTREE_OBJECT_TYPE_COMMIT);
+
+      g_variant_get_child (commit, 7, "@ay", &meta_csum_bytes);
+      if (G_UNLIKELY (g_variant_n_children (meta_csum_bytes) != 32))
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Corrupted commit '%s'; invalid tree metadata",
+                       commit_checksum);
+          goto out;
+        }
+      meta_csum = ostree_checksum_bytes_peek (meta_csum_bytes);
+      (void) ostree_object_set_add (inout_reachable, meta_csum,
+                                    OSTREE_OBJECT_TYPE_DIR_META);
+
+      g_variant_get_child (commit, 6, "@ay", &content_csum_bytes);
+      if (G_UNLIKELY (g_variant_n_children (content_csum_bytes) != 32))
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Corrupted commit '%s'; invalid tree content",
+                       commit_checksum);
+          goto out;
+        }
+      content_csum = ostree_checksum_bytes_peek (content_csum_bytes);
+      if (!traverse_dirtree_internal (repo, content_csum, 0, inout_reachable,
+                                      cancellable, error))
+        goto out;
+
+      if (maxdepth == -1 || maxdepth > 0)
+        {
+          g_free (tmp_checksum);
+          tmp_checksum = ostree_commit_get_parent (commit);
+          if (tmp_checksum)
+            {
+              commit_checksum = tmp_checksum;
+              if (maxdepth > 0)
+                maxdepth -= 1;
+              recurse = TRUE;
+            }
+        }
+      if (!recurse)
+        break;
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+static gboolean
+traverse_dirtree_union_internal (OstreeRepo      *repo,
+                                 const char      *dirtree_checksum,
+                                 int              recursion_depth,
+                                 GHashTable      *inout_reachable,
+                                 GCancellable    *cancellable,
+                                 GError         **error)
 {
   gboolean ret = FALSE;
   int n, i;
@@ -108,8 +298,8 @@ traverse_dirtree_internal (OstreeRepo      *repo,
       
           g_free (tmp_checksum);
           tmp_checksum = ostree_checksum_from_bytes_v (content_csum_v);
-          if (!traverse_dirtree_internal (repo, tmp_checksum, recursion_depth + 1,
-                                          inout_reachable, cancellable, error))
+          if (!traverse_dirtree_union_internal (repo, tmp_checksum, recursion_depth + 1,
+                                                inout_reachable, cancellable, error))
             goto out;
 
           g_free (tmp_checksum);
@@ -136,6 +326,10 @@ traverse_dirtree_internal (OstreeRepo      *repo,
  *
  * Update the set @inout_reachable containing all objects reachable
  * from @commit_checksum, traversing @maxdepth parent commits.
+ *
+ * Objects are only ever added to @inout_reachable, so it can be
+ * reused across calls.  ostree_repo_traverse_commit_set() is cheaper
+ * for large repositories.
  */
 gboolean
 ostree_repo_traverse_commit_union (OstreeRepo      *repo,
@@ -200,7 +394,7 @@ ostree_repo_traverse_commit_union (OstreeRepo      *repo,
         }
 
       tmp_checksum = ostree_checksum_from_bytes_v (content_csum_bytes);
-      if (!traverse_dirtree_internal (repo, tmp_checksum, 0, inout_reachable, cancellable, error))
+      if (!traverse_dirtree_union_internal (repo, tmp_checksum, 0, inout_reachable, cancellable, error))
         goto out;
 
       if (maxdepth == -1 || maxdepth > 0)
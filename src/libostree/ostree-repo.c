@@ -33,6 +33,7 @@
 #include "ostree-repo-file.h"
 #include "ostree-repo-file-enumerator.h"
 #include "ostree-gpg-verifier.h"
+#include "ostree-repo-static-delta-private.h"
 
 #ifdef HAVE_GPGME
 #include <locale.h>
@@ -107,9 +108,11 @@ ostree_repo_finalize (GObject *object)
   g_clear_object (&self->config_file);
 
   g_clear_object (&self->transaction_lock_path);
+  if (self->txn_marker_fd != -1)
+    (void) close (self->txn_marker_fd);
+  g_free (self->txn_marker_name);
 
-  if (self->loose_object_devino_hash)
-    g_hash_table_destroy (self->loose_object_devino_hash);
+  g_clear_pointer (&self->devino_cache, (GDestroyNotify) _ostree_repo_devino_cache_free);
   if (self->updated_uncompressed_dirs)
     g_hash_table_destroy (self->updated_uncompressed_dirs);
   if (self->config)
@@ -117,6 +120,7 @@ ostree_repo_finalize (GObject *object)
   g_clear_pointer (&self->txn_refs, g_hash_table_destroy);
   g_clear_pointer (&self->cached_meta_indexes, (GDestroyNotify) g_ptr_array_unref);
   g_clear_pointer (&self->cached_content_indexes, (GDestroyNotify) g_ptr_array_unref);
+  g_clear_pointer (&self->metadata_cache, (GDestroyNotify) _ostree_repo_metadata_cache_free);
   g_clear_pointer (&self->object_sizes, (GDestroyNotify) g_hash_table_unref);
   g_mutex_clear (&self->cache_lock);
   g_mutex_clear (&self->txn_stats_lock);
@@ -208,8 +212,10 @@ ostree_repo_init (OstreeRepo *self)
 {
   g_mutex_init (&self->cache_lock);
   g_mutex_init (&self->txn_stats_lock);
+  self->metadata_cache = _ostree_repo_metadata_cache_new (_OSTREE_METADATA_CACHE_MAX_ENTRIES);
   self->objects_dir_fd = -1;
   self->uncompressed_objects_dir_fd = -1;
+  self->txn_marker_fd = -1;
 }
 
 /**
@@ -532,6 +538,10 @@ ostree_repo_open (OstreeRepo    *self,
                                             TRUE, &self->enable_uncompressed_cache, error))
     goto out;
 
+  if (!ot_keyfile_get_boolean_with_default (self->config, "core", "batch-fsync",
+                                            FALSE, &self->batch_fsync, error))
+    goto out;
+
   if (!gs_file_open_dir_fd (self->objects_dir, &self->objects_dir_fd, cancellable, error))
     goto out;
 
@@ -572,6 +582,32 @@ ostree_repo_set_disable_fsync (OstreeRepo    *self,
   self->disable_fsync = disable_fsync;
 }
 
+/**
+ * ostree_repo_set_batch_fsync:
+ * @self: An #OstreeRepo
+ * @batch_fsync: If %TRUE, sync objects once per transaction
+ *
+ * By default, every object is synced to stable storage individually
+ * before being put in place.  With batch fsync, objects are instead
+ * synced all at once by ostree_repo_commit_transaction(), before any
+ * refs are updated; this avoids the cost of many fsync() calls when
+ * writing a large number of objects, such as during a pull.
+ *
+ * If the system crashes during such a transaction, the objects it
+ * wrote are verified by the next ostree_repo_prepare_transaction(),
+ * and any that are incomplete are deleted.
+ *
+ * This can also be enabled with the "batch-fsync" key in the "core"
+ * section of the repository configuration.  It has no effect if
+ * ostree_repo_set_disable_fsync() is in use.
+ */
+void
+ostree_repo_set_batch_fsync (OstreeRepo    *self,
+                             gboolean       batch_fsync)
+{
+  self->batch_fsync = batch_fsync;
+}
+
 
 /**
  * ostree_repo_get_path:
@@ -725,7 +761,8 @@ list_loose_objects_at (OstreeRepo             *self,
       if (!dot)
         continue;
 
-      if (strcmp (dot, ".file") == 0)
+      if ((self->mode == OSTREE_REPO_MODE_ARCHIVE_Z2 && strcmp (dot, ".filez") == 0) ||
+          (self->mode == OSTREE_REPO_MODE_BARE && strcmp (dot, ".file") == 0))
         objtype = OSTREE_OBJECT_TYPE_FILE;
       else if (strcmp (dot, ".dirtree") == 0)
         objtype = OSTREE_OBJECT_TYPE_DIR_TREE;
@@ -771,7 +808,7 @@ list_loose_objects (OstreeRepo                     *self,
   int dfd = -1;
   static const gchar hexchars[] = "0123456789abcdef";
 
-  for (c = 0; c < 255; c++)
+  for (c = 0; c < 256; c++)
     {
       char buf[3];
       buf[0] = hexchars[c >> 4];
@@ -799,6 +836,125 @@ list_loose_objects (OstreeRepo                     *self,
   return ret;
 }
 
+/*
+ * _ostree_repo_parse_loose_object_name:
+ * @prefix: Two character fanout directory name
+ * @name: Name of a file in that directory
+ * @out_checksum: (out): Buffer of at least 65 bytes
+ * @out_objtype: (out): Object type
+ *
+ * Returns: %TRUE if @name is a loose object of @self
+ */
+gboolean
+_ostree_repo_parse_loose_object_name (OstreeRepo        *self,
+                                      const char        *prefix,
+                                      const char        *name,
+                                      char              *out_checksum,
+                                      OstreeObjectType  *out_objtype)
+{
+  const char *dot;
+
+  dot = strrchr (name, '.');
+  if (!dot || (dot - name) != 62)
+    return FALSE;
+
+  if ((self->mode == OSTREE_REPO_MODE_ARCHIVE_Z2 && strcmp (dot, ".filez") == 0) ||
+      (self->mode == OSTREE_REPO_MODE_BARE && strcmp (dot, ".file") == 0))
+    *out_objtype = OSTREE_OBJECT_TYPE_FILE;
+  else if (strcmp (dot, ".dirtree") == 0)
+    *out_objtype = OSTREE_OBJECT_TYPE_DIR_TREE;
+  else if (strcmp (dot, ".dirmeta") == 0)
+    *out_objtype = OSTREE_OBJECT_TYPE_DIR_META;
+  else if (strcmp (dot, ".commit") == 0)
+    *out_objtype = OSTREE_OBJECT_TYPE_COMMIT;
+  else
+    return FALSE;
+
+  memcpy (out_checksum, prefix, 2);
+  memcpy (out_checksum + 2, name, 62);
+  out_checksum[64] = '\0';
+
+  return ostree_validate_checksum_string (out_checksum, NULL);
+}
+
+/*
+ * _ostree_repo_list_loose_objects_fanout:
+ * @fanout: First byte of the checksums to list
+ * @inout_objects: Set to add objects to
+ *
+ * Add every loose object in the objects/XX directory for @fanout of
+ * @self and its parent repositories to @inout_objects.  This costs a
+ * single readdir() per repository, rather than a stat() per object.
+ */
+gboolean
+_ostree_repo_list_loose_objects_fanout (OstreeRepo        *self,
+                                        guint              fanout,
+                                        OstreeObjectSet   *inout_objects,
+                                        GCancellable      *cancellable,
+                                        GError           **error)
+{
+  gboolean ret = FALSE;
+  static const gchar hexchars[] = "0123456789abcdef";
+  OstreeRepo *repo;
+  DIR *d = NULL;
+  struct dirent *dent;
+  char prefix[3];
+
+  g_return_val_if_fail (fanout < 256, FALSE);
+
+  prefix[0] = hexchars[fanout >> 4];
+  prefix[1] = hexchars[fanout & 0xF];
+  prefix[2] = '\0';
+
+  for (repo = self; repo != NULL; repo = repo->parent_repo)
+    {
+      int dfd;
+
+      if (g_cancellable_set_error_if_cancelled (cancellable, error))
+        goto out;
+
+      dfd = openat (repo->objects_dir_fd, prefix, O_RDONLY | O_NONBLOCK | O_DIRECTORY | O_CLOEXEC);
+      if (dfd == -1)
+        {
+          if (errno == ENOENT)
+            continue;
+          ot_util_set_error_from_errno (error, errno);
+          goto out;
+        }
+
+      d = fdopendir (dfd);
+      if (!d)
+        {
+          (void) close (dfd);
+          ot_util_set_error_from_errno (error, errno);
+          goto out;
+        }
+
+      while ((dent = readdir (d)) != NULL)
+        {
+          char checksum[65];
+          guchar csum[32];
+          OstreeObjectType objtype;
+
+          if (!_ostree_repo_parse_loose_object_name (repo, prefix, dent->d_name,
+                                                     checksum, &objtype))
+            continue;
+
+          ostree_checksum_inplace_to_bytes (checksum, csum);
+          (void) ostree_object_set_add (inout_objects, csum, objtype);
+        }
+
+      (void) closedir (d);
+      d = NULL;
+    }
+
+  ret = TRUE;
+ out:
+  if (d)
+    (void) closedir (d);
+  return ret;
+}
+
 static gboolean
 openat_allow_noent (int                 dfd,
                     const char         *path,
@@ -839,17 +995,45 @@ load_metadata_internal (OstreeRepo       *self,
   gboolean ret = FALSE;
   char loose_path_buf[_OSTREE_LOOSE_PATH_MAX];
   int fd = -1;
+  gs_unref_bytes GBytes *packed_data = NULL;
   gs_unref_object GInputStream *ret_stream = NULL;
   gs_unref_variant GVariant *ret_variant = NULL;
+  gboolean cacheable;
+  guchar csum[32];
 
   g_return_val_if_fail (OSTREE_OBJECT_TYPE_IS_META (objtype), FALSE);
 
-  _ostree_loose_path (loose_path_buf, sha256, objtype, self->mode);
+  cacheable = out_variant != NULL
+    && _ostree_repo_metadata_cache_is_cacheable (objtype)
+    && ostree_validate_checksum_string (sha256, NULL);
+  if (cacheable)
+    {
+      ostree_checksum_inplace_to_bytes (sha256, csum);
+      ret_variant = _ostree_repo_metadata_cache_lookup (self->metadata_cache, objtype, csum);
+      if (ret_variant)
+        {
+          if (out_size)
+            *out_size = g_variant_get_size (ret_variant);
+          ret = TRUE;
+          ot_transfer_out_value (out_variant, &ret_variant);
+          goto out;
+        }
+    }
 
-  if (!openat_allow_noent (self->objects_dir_fd, loose_path_buf, &fd,
-                           cancellable, error))
+  /* Packs first; once a repository is packed, most objects are there */
+  if (!_ostree_repo_find_packed_object (self, objtype, sha256, &packed_data,
+                                        cancellable, error))
     goto out;
 
+  if (!packed_data)
+    {
+      _ostree_loose_path (loose_path_buf, sha256, objtype, self->mode);
+
+      if (!openat_allow_noent (self->objects_dir_fd, loose_path_buf, &fd,
+                               cancellable, error))
+        goto out;
+    }
+
   if (fd != -1)
     {
       if (out_variant)
@@ -888,6 +1072,20 @@ load_metadata_internal (OstreeRepo       *self,
             }
         }
     }
+  else if (packed_data)
+    {
+      if (out_variant)
+        {
+          ret_variant = g_variant_new_from_bytes (ostree_metadata_variant_type (objtype),
+                                                  packed_data, TRUE);
+          g_variant_ref_sink (ret_variant);
+        }
+      else if (out_stream)
+        ret_stream = g_memory_input_stream_new_from_bytes (packed_data);
+
+      if (out_size)
+        *out_size = g_bytes_get_size (packed_data);
+    }
   else if (self->parent_repo)
     {
       if (!ostree_repo_load_variant (self->parent_repo, objtype, sha256, &ret_variant, error))
@@ -901,6 +1099,9 @@ load_metadata_internal (OstreeRepo       *self,
       goto out;
     }
 
+  if (cacheable && ret_variant)
+    _ostree_repo_metadata_cache_insert (self->metadata_cache, objtype, csum, ret_variant);
+
   ret = TRUE;
   ot_transfer_out_value (out_variant, &ret_variant);
   ot_transfer_out_value (out_stream, &ret_stream);
@@ -1017,23 +1218,17 @@ ostree_repo_load_file (OstreeRepo         *self,
       int fd = -1;
       struct stat stbuf;
       gs_unref_object GInputStream *tmp_stream = NULL;
+      gs_unref_bytes GBytes *packed_data = NULL;
 
-      _ostree_loose_path (loose_path_buf, checksum, OSTREE_OBJECT_TYPE_FILE, self->mode);
-
-      if (!openat_allow_noent (self->objects_dir_fd, loose_path_buf, &fd,
-                               cancellable, error))
+      if (!_ostree_repo_find_packed_object (self, OSTREE_OBJECT_TYPE_FILE, checksum,
+                                            &packed_data, cancellable, error))
         goto out;
 
-      if (fd != -1)
+      if (packed_data)
         {
-          tmp_stream = g_unix_input_stream_new (fd, TRUE);
-          fd = -1; /* Transfer ownership */
-          
-          if (!gs_stream_fstat ((GFileDescriptorBased*) tmp_stream, &stbuf,
-                                cancellable, error))
-            goto out;
-          
-          if (!ostree_content_stream_parse (TRUE, tmp_stream, stbuf.st_size, TRUE,
+          tmp_stream = g_memory_input_stream_new_from_bytes (packed_data);
+
+          if (!ostree_content_stream_parse (TRUE, tmp_stream, g_bytes_get_size (packed_data), TRUE,
                                             out_input ? &ret_input : NULL,
                                             &ret_file_info, &ret_xattrs,
                                             cancellable, error))
@@ -1041,6 +1236,32 @@ ostree_repo_load_file (OstreeRepo         *self,
 
           found = TRUE;
         }
+      else
+        {
+          _ostree_loose_path (loose_path_buf, checksum, OSTREE_OBJECT_TYPE_FILE, self->mode);
+
+          if (!openat_allow_noent (self->objects_dir_fd, loose_path_buf, &fd,
+                                   cancellable, error))
+            goto out;
+
+          if (fd != -1)
+            {
+              tmp_stream = g_unix_input_stream_new (fd, TRUE);
+              fd = -1; /* Transfer ownership */
+
+              if (!gs_stream_fstat ((GFileDescriptorBased*) tmp_stream, &stbuf,
+                                    cancellable, error))
+                goto out;
+
+              if (!ostree_content_stream_parse (TRUE, tmp_stream, stbuf.st_size, TRUE,
+                                                out_input ? &ret_input : NULL,
+                                                &ret_file_info, &ret_xattrs,
+                                                cancellable, error))
+                goto out;
+
+              found = TRUE;
+            }
+        }
     }
   else
     {
@@ -1247,13 +1468,23 @@ ostree_repo_has_object (OstreeRepo           *self,
 {
   gboolean ret = FALSE;
   gboolean ret_have_object;
-  gs_unref_object GFile *loose_path = NULL;
+  gs_unref_bytes GBytes *packed_data = NULL;
 
-  if (!_ostree_repo_find_object (self, objtype, checksum, &loose_path,
-                                 cancellable, error))
+  if (!_ostree_repo_find_packed_object (self, objtype, checksum, &packed_data,
+                                        cancellable, error))
     goto out;
 
-  ret_have_object = (loose_path != NULL);
+  ret_have_object = (packed_data != NULL);
+
+  if (!ret_have_object)
+    {
+      gs_unref_object GFile *loose_path = NULL;
+
+      if (!_ostree_repo_find_object (self, objtype, checksum, &loose_path,
+                                     cancellable, error))
+        goto out;
+      ret_have_object = (loose_path != NULL);
+    }
 
   if (!ret_have_object && self->parent_repo)
     {
@@ -1278,8 +1509,8 @@ ostree_repo_has_object (OstreeRepo           *self,
  * @error: Error
  *
  * Remove the object of type @objtype with checksum @sha256
- * from the repository.  An error of type %G_IO_ERROR_NOT_FOUND
- * is thrown if the object does not exist.
+ * from the repository, both loose and packed.  An error of type
+ * %G_IO_ERROR_NOT_FOUND is thrown if the object does not exist.
  */
 gboolean
 ostree_repo_delete_object (OstreeRepo           *self,
@@ -1288,8 +1519,30 @@ ostree_repo_delete_object (OstreeRepo           *self,
                            GCancellable         *cancellable,
                            GError              **error)
 {
+  gboolean ret = FALSE;
+  gboolean deleted_packed = FALSE;
   gs_unref_object GFile *objpath = _ostree_repo_get_object_path (self, sha256, objtype);
-  return gs_file_unlink (objpath, cancellable, error);
+
+  _ostree_repo_metadata_cache_clear (self->metadata_cache);
+
+  if (!_ostree_repo_delete_packed_object (self, objtype, sha256, &deleted_packed,
+                                          cancellable, error))
+    goto out;
+
+  if (deleted_packed)
+    {
+      if (!ot_gfile_ensure_unlinked (objpath, cancellable, error))
+        goto out;
+    }
+  else
+    {
+      if (!gs_file_unlink (objpath, cancellable, error))
+        goto out;
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
 }
 
 /**
@@ -1314,13 +1567,31 @@ ostree_repo_query_object_storage_size (OstreeRepo           *self,
 {
   gboolean ret = FALSE;
   gs_unref_object GFile *objpath = _ostree_repo_get_object_path (self, sha256, objtype);
-  gs_unref_object GFileInfo *finfo = g_file_query_info (objpath, OSTREE_GIO_FAST_QUERYINFO,
-                                                        G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
-                                                        cancellable, error);
-  if (!finfo)
+  gs_unref_object GFileInfo *finfo = NULL;
+  gs_unref_bytes GBytes *packed_data = NULL;
+
+  if (!_ostree_repo_find_packed_object (self, objtype, sha256, &packed_data,
+                                        cancellable, error))
     goto out;
 
-  *out_size = g_file_info_get_size (finfo);
+  if (packed_data)
+    *out_size = g_bytes_get_size (packed_data);
+  else
+    {
+      if (!ot_gfile_query_info_allow_noent (objpath, OSTREE_GIO_FAST_QUERYINFO,
+                                            G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                            &finfo, cancellable, error))
+        goto out;
+      if (!finfo)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                       "No such object %s.%s", sha256,
+                       ostree_object_type_to_string (objtype));
+          goto out;
+        }
+      *out_size = g_file_info_get_size (finfo);
+    }
+
   ret = TRUE;
  out:
   return ret;
@@ -1371,6 +1642,26 @@ ostree_repo_load_variant (OstreeRepo       *self,
                                  out_variant, NULL, NULL, NULL, error);
 }
 
+/*
+ * _ostree_repo_load_variant_csum:
+ *
+ * Like ostree_repo_load_variant(), but for a binary checksum, which
+ * is converted on the stack rather than allocating a string.
+ */
+gboolean
+_ostree_repo_load_variant_csum (OstreeRepo       *self,
+                                OstreeObjectType  objtype,
+                                const guchar     *csum,
+                                GVariant        **out_variant,
+                                GError          **error)
+{
+  char checksum[65];
+
+  ostree_checksum_inplace_from_bytes (csum, checksum);
+  return load_metadata_internal (self, objtype, checksum, TRUE,
+                                 out_variant, NULL, NULL, NULL, error);
+}
+
 /**
  * ostree_repo_list_objects:
  * @self: Repo
@@ -1419,7 +1710,8 @@ ostree_repo_list_objects (OstreeRepo                  *self,
 
   if (flags & OSTREE_REPO_LIST_OBJECTS_PACKED)
     {
-      /* Nothing for now... */
+      if (!_ostree_repo_list_packed_objects (self, ret_objects, cancellable, error))
+        goto out;
     }
 
   ret = TRUE;
@@ -1499,60 +1791,32 @@ ostree_repo_pull (OstreeRepo               *self,
 }
 #endif
 
-/**
- * ostree_repo_sign_commit:
- * @self: Self
- * @commit_checksum: SHA256 of given commit to sign
- * @key_id: Use this GPG key id
- * @homedir: (allow-none): GPG home directory, or %NULL
- * @cancellable: A #GCancellable
- * @error: a #GError
- *
- * Add a GPG signature to a commit.
+#ifdef HAVE_GPGME
+/*
+ * Create a detached GPG signature of @data with the secret key
+ * @key_id, returning its contents in @out_signature.
  */
-gboolean
-ostree_repo_sign_commit (OstreeRepo     *self,
-                         const gchar    *commit_checksum,
-                         const gchar    *key_id,
-                         const gchar    *homedir,
-                         GCancellable   *cancellable,
-                         GError        **error)
+static gboolean
+sign_data (OstreeRepo     *self,
+           GBytes         *data,
+           const gchar    *key_id,
+           const gchar    *homedir,
+           GBytes        **out_signature,
+           GCancellable   *cancellable,
+           GError        **error)
 {
-#ifdef HAVE_GPGME
   gboolean ret = FALSE;
-  gs_unref_object GFile *commit_path = NULL;
-  gs_unref_variant GVariant *metadata = NULL;
-  gs_free gchar *commit_filename = NULL;
   gs_unref_object GFile *tmp_signature_file = NULL;
   gs_unref_object GOutputStream *tmp_signature_output = NULL;
-  gs_unref_variant_builder GVariantBuilder *builder = NULL;
-  gs_unref_variant_builder GVariantBuilder *signature_builder = NULL;
-  gs_unref_variant GVariant *commit_variant = NULL;
-  gs_unref_variant GVariant *signaturedata = NULL;
-  gs_unref_bytes GBytes *signature_bytes = NULL;
-  gpgme_ctx_t context;
+  gs_unref_bytes GBytes *ret_signature = NULL;
+  gpgme_ctx_t context = NULL;
   gpgme_engine_info_t info;
   gpgme_error_t err;
   gpgme_key_t key = NULL;
-  gpgme_data_t commit_buffer = NULL;
+  gpgme_data_t data_buffer = NULL;
   gpgme_data_t signature_buffer = NULL;
   int signature_fd = -1;
   GMappedFile *signature_file = NULL;
-  
-  if (!ostree_repo_load_variant (self, OSTREE_OBJECT_TYPE_COMMIT,
-                                 commit_checksum, &commit_variant, error))
-    goto out;
-  
-  if (!ostree_repo_read_commit_detached_metadata (self,
-                                                  commit_checksum,
-                                                  &metadata,
-                                                  cancellable,
-                                                  error))
-    {
-      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
-                   "Unable to read existing detached metadata");
-      goto out;
-    }
 
   if (!gs_file_open_in_tmpdir (self->tmp_dir, 0644,
                                &tmp_signature_file, &tmp_signature_output,
@@ -1604,15 +1868,15 @@ ostree_repo_sign_commit (OstreeRepo     *self,
   if ((err = gpgme_signers_add (context, key)) != GPG_ERR_NO_ERROR)
     {
       g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
-                   "Error signing commit");
+                   "Error signing data");
       goto out;
     }
   
-  if ((err = gpgme_data_new_from_mem (&commit_buffer, g_variant_get_data (commit_variant),
-                                      g_variant_get_size (commit_variant), FALSE)) != GPG_ERR_NO_ERROR)
+  if ((err = gpgme_data_new_from_mem (&data_buffer, g_bytes_get_data (data, NULL),
+                                      g_bytes_get_size (data), FALSE)) != GPG_ERR_NO_ERROR)
     {
       g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
-                   "Failed to create buffer from commit file");
+                   "Failed to create buffer from data");
       goto out;
     }
   
@@ -1631,11 +1895,11 @@ ostree_repo_sign_commit (OstreeRepo     *self,
       goto out;
     }
   
-  if ((err = gpgme_op_sign (context, commit_buffer, signature_buffer, GPGME_SIG_MODE_DETACH))
+  if ((err = gpgme_op_sign (context, data_buffer, signature_buffer, GPGME_SIG_MODE_DETACH))
       != GPG_ERR_NO_ERROR)
     {
       g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
-                   "Failure signing commit file");
+                   "Failure signing data");
       goto out;
     }
   
@@ -1645,30 +1909,130 @@ ostree_repo_sign_commit (OstreeRepo     *self,
   signature_file = gs_file_map_noatime (tmp_signature_file, cancellable, error);
   if (!signature_file)
     goto out;
-  signature_bytes = g_mapped_file_get_bytes (signature_file);
-  
-  // Now read the file and put its contents into the result GVariant
+  ret_signature = g_mapped_file_get_bytes (signature_file);
+
+  ret = TRUE;
+  gs_transfer_out_value (out_signature, &ret_signature);
+out:
+  if (data_buffer)
+    gpgme_data_release (data_buffer);
+  if (signature_buffer)
+    gpgme_data_release (signature_buffer);
+  if (key)
+    gpgme_key_release (key);
+  if (context)
+    gpgme_release (context);
+  if (signature_file)
+    g_mapped_file_unref (signature_file);
+  if (tmp_signature_file)
+    (void) gs_file_unlink (tmp_signature_file, NULL, NULL);
+  return ret;
+}
+
+/*
+ * Return a new a{sv} with the contents of @metadata (which may be
+ * %NULL), and @signature_bytes appended to its "ostree.gpgsigs".
+ */
+static GVariant *
+metadata_append_gpg_signature (GVariant  *metadata,
+                               GBytes    *signature_bytes)
+{
+  GVariantBuilder builder;
+  GVariantBuilder signature_builder;
+  gs_unref_variant GVariant *signaturedata = NULL;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sv}"));
+  g_variant_builder_init (&signature_builder, G_VARIANT_TYPE ("aay"));
+
   if (metadata)
     {
-      builder = ot_util_variant_builder_from_variant (metadata, G_VARIANT_TYPE ("a{sv}"));
+      GVariantIter viter;
+      const char *key;
+      GVariant *value;
+
+      g_variant_iter_init (&viter, metadata);
+      while (g_variant_iter_loop (&viter, "{&s@v}", &key, &value))
+        {
+          if (strcmp (key, "ostree.gpgsigs") == 0)
+            continue;
+          g_variant_builder_add (&builder, "{s@v}", key, value);
+        }
+
       signaturedata = g_variant_lookup_value (metadata, "ostree.gpgsigs", G_VARIANT_TYPE ("aay"));
       if (signaturedata)
-        signature_builder = ot_util_variant_builder_from_variant (signaturedata, G_VARIANT_TYPE ("aay"));
+        {
+          GVariantIter sigiter;
+          GVariant *sig;
+
+          g_variant_iter_init (&sigiter, signaturedata);
+          while (g_variant_iter_loop (&sigiter, "@ay", &sig))
+            g_variant_builder_add_value (&signature_builder, sig);
+        }
     }
-  if (!builder)
-    builder = g_variant_builder_new (G_VARIANT_TYPE ("a{sv}"));
-  if (!signature_builder)
-    signature_builder = g_variant_builder_new (G_VARIANT_TYPE ("aay"));
 
-  g_variant_builder_add (signature_builder, "@ay", ot_gvariant_new_ay_bytes (signature_bytes));
+  g_variant_builder_add (&signature_builder, "@ay", ot_gvariant_new_ay_bytes (signature_bytes));
+  g_variant_builder_add (&builder, "{sv}", "ostree.gpgsigs", g_variant_builder_end (&signature_builder));
 
-  g_variant_builder_add (builder, "{sv}", "ostree.gpgsigs", g_variant_builder_end (signature_builder));
+  return g_variant_builder_end (&builder);
+}
+#endif
+
+/**
+ * ostree_repo_sign_commit:
+ * @self: Self
+ * @commit_checksum: SHA256 of given commit to sign
+ * @key_id: Use this GPG key id
+ * @homedir: (allow-none): GPG home directory, or %NULL
+ * @cancellable: A #GCancellable
+ * @error: a #GError
+ *
+ * Add a GPG signature to a commit.
+ */
+gboolean
+ostree_repo_sign_commit (OstreeRepo     *self,
+                         const gchar    *commit_checksum,
+                         const gchar    *key_id,
+                         const gchar    *homedir,
+                         GCancellable   *cancellable,
+                         GError        **error)
+{
+#ifdef HAVE_GPGME
+  gboolean ret = FALSE;
+  gs_unref_variant GVariant *metadata = NULL;
+  gs_unref_variant GVariant *new_metadata = NULL;
+  gs_unref_variant GVariant *commit_variant = NULL;
+  gs_unref_bytes GBytes *commit_bytes = NULL;
+  gs_unref_bytes GBytes *signature_bytes = NULL;
   
-  metadata = g_variant_builder_end (builder);
+  if (!ostree_repo_load_variant (self, OSTREE_OBJECT_TYPE_COMMIT,
+                                 commit_checksum, &commit_variant, error))
+    goto out;
+  
+  if (!ostree_repo_read_commit_detached_metadata (self,
+                                                  commit_checksum,
+                                                  &metadata,
+                                                  cancellable,
+                                                  error))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Unable to read existing detached metadata");
+      goto out;
+    }
+
+  commit_bytes = g_bytes_new_with_free_func (g_variant_get_data (commit_variant),
+                                             g_variant_get_size (commit_variant),
+                                             (GDestroyNotify)g_variant_unref,
+                                             g_variant_ref (commit_variant));
+
+  if (!sign_data (self, commit_bytes, key_id, homedir,
+                  &signature_bytes, cancellable, error))
+    goto out;
+
+  new_metadata = g_variant_ref_sink (metadata_append_gpg_signature (metadata, signature_bytes));
 
   if (!ostree_repo_write_commit_detached_metadata (self,
                                                    commit_checksum,
-                                                   metadata,
+                                                   new_metadata,
                                                    cancellable,
                                                    error))
     {
@@ -1679,16 +2043,6 @@ ostree_repo_sign_commit (OstreeRepo     *self,
 
   ret = TRUE;
 out:
-  if (commit_buffer)
-    gpgme_data_release (commit_buffer);
-  if (signature_buffer)
-    gpgme_data_release (signature_buffer);
-  if (key)
-    gpgme_key_release (key);
-  if (context)
-    gpgme_release (context);
-  if (signature_file)
-    g_mapped_file_unref (signature_file);
   return ret;
 #else
   g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
@@ -1788,6 +2142,48 @@ _ostree_repo_gpg_verify_file_with_metadata (OstreeRepo          *self,
 #endif
 }
 
+/*
+ * _ostree_repo_gpg_verify_data_with_metadata:
+ *
+ * Like _ostree_repo_gpg_verify_file_with_metadata(), but for the
+ * in-memory @data.
+ */
+gboolean
+_ostree_repo_gpg_verify_data_with_metadata (OstreeRepo          *self,
+                                            GBytes              *data,
+                                            GVariant            *metadata,
+                                            GFile               *keyringdir,
+                                            GFile               *extra_keyring,
+                                            GCancellable        *cancellable,
+                                            GError             **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_object GFile *data_tmp_path = NULL;
+
+  if (!gs_file_open_in_tmpdir (self->tmp_dir, 0644,
+                               &data_tmp_path, NULL,
+                               cancellable, error))
+    goto out;
+  if (!g_file_replace_contents (data_tmp_path,
+                                g_bytes_get_data (data, NULL),
+                                g_bytes_get_size (data),
+                                NULL, FALSE, 0, NULL,
+                                cancellable, error))
+    goto out;
+
+  if (!_ostree_repo_gpg_verify_file_with_metadata (self,
+                                                   data_tmp_path, metadata,
+                                                   keyringdir, extra_keyring,
+                                                   cancellable, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  if (data_tmp_path)
+    (void) gs_file_unlink (data_tmp_path, NULL, NULL);
+  return ret;
+}
+
 /**
  * ostree_repo_verify_commit:
  * @self: Repository
@@ -1810,26 +2206,13 @@ ostree_repo_verify_commit (OstreeRepo   *self,
 {
   gboolean ret = FALSE;
   gs_unref_variant GVariant *commit_variant = NULL;
-  gs_unref_object GFile *commit_tmp_path = NULL;
-  gs_unref_object GFile *keyringdir_ref = NULL;
   gs_unref_variant GVariant *metadata = NULL;
-  gs_free gchar *commit_filename = NULL;
+  gs_unref_bytes GBytes *commit_bytes = NULL;
 
-  /* Create a temporary file for the commit */
   if (!ostree_repo_load_variant (self, OSTREE_OBJECT_TYPE_COMMIT,
                                  commit_checksum, &commit_variant,
                                  error))
     goto out;
-  if (!gs_file_open_in_tmpdir (self->tmp_dir, 0644,
-                               &commit_tmp_path, NULL,
-                               cancellable, error))
-    goto out;
-  if (!g_file_replace_contents (commit_tmp_path,
-                                (char*)g_variant_get_data (commit_variant),
-                                g_variant_get_size (commit_variant),
-                                NULL, FALSE, 0, NULL,
-                                cancellable, error))
-    goto out;
 
   /* Load the metadata */
   if (!ostree_repo_read_commit_detached_metadata (self,
@@ -1841,16 +2224,273 @@ ostree_repo_verify_commit (OstreeRepo   *self,
       g_prefix_error (error, "Failed to read detached metadata: ");
       goto out;
     }
+
+  commit_bytes = g_bytes_new_with_free_func (g_variant_get_data (commit_variant),
+                                             g_variant_get_size (commit_variant),
+                                             (GDestroyNotify)g_variant_unref,
+                                             g_variant_ref (commit_variant));
   
-  if (!_ostree_repo_gpg_verify_file_with_metadata (self,
-                                                   commit_tmp_path, metadata,
+  if (!_ostree_repo_gpg_verify_data_with_metadata (self,
+                                                   commit_bytes, metadata,
                                                    keyringdir, extra_keyring,
                                                    cancellable, error))
     goto out;
   
   ret = TRUE;
 out:
-  if (commit_tmp_path)
-    (void) gs_file_unlink (commit_tmp_path, NULL, NULL);
   return ret;
 }
+
+static int
+compare_strings_for_sorting (gconstpointer  a_pp,
+                             gconstpointer  b_pp)
+{
+  const char *a = *((const char**)a_pp);
+  const char *b = *((const char**)b_pp);
+
+  return strcmp (a, b);
+}
+
+/*
+ * Collect the compressed size of each part of the static delta
+ * @delta_name into an "at" array.
+ */
+static gboolean
+get_static_delta_part_sizes (OstreeRepo     *self,
+                             const char     *delta_name,
+                             GVariant      **out_part_sizes,
+                             GError        **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_object GFile *meta_path = NULL;
+  gs_unref_variant GVariant *delta_meta = NULL;
+  gs_unref_variant GVariant *headers = NULL;
+  gs_unref_variant GVariant *ret_part_sizes = NULL;
+  GVariantBuilder builder;
+  guint i, n;
+
+  meta_path = ot_gfile_resolve_path_printf (self->deltas_dir, "%s/meta", delta_name);
+  if (!ot_util_variant_map (meta_path, G_VARIANT_TYPE (OSTREE_STATIC_DELTA_META_FORMAT),
+                            FALSE, &delta_meta, error))
+    goto out;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("at"));
+  headers = g_variant_get_child_value (delta_meta, 3);
+  n = g_variant_n_children (headers);
+  for (i = 0; i < n; i++)
+    {
+      guint64 size;
+
+      g_variant_get_child (headers, i, "(@ayt@ay)", NULL, &size, NULL, NULL);
+      g_variant_builder_add (&builder, "t", size);
+    }
+  ret_part_sizes = g_variant_ref_sink (g_variant_builder_end (&builder));
+
+  ret = TRUE;
+  gs_transfer_out_value (out_part_sizes, &ret_part_sizes);
+ out:
+  return ret;
+}
+
+/**
+ * ostree_repo_regenerate_summary:
+ * @self: Repo
+ * @additional_metadata: (allow-none): A GVariant of type a{sv}, or %NULL
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Write a "summary" file at the toplevel of @self, in the format
+ * %OSTREE_SUMMARY_GVARIANT_FORMAT; it lists all local refs with their
+ * commits, and all static deltas along with the sizes of their parts.
+ * Clients pulling over HTTP fetch it once rather than probing for
+ * each ref and delta.  Any keys in @additional_metadata are added to
+ * its metadata dictionary.
+ *
+ * Pulls resolve the refs it lists from the summary alone, ignoring
+ * refs/heads, so it must be regenerated whenever a ref is updated;
+ * a stale summary keeps clients on the commits it lists.
+ *
+ * This removes any existing "summary.sig", since it would no longer
+ * match; use ostree_repo_add_gpg_signature_summary() to sign the new
+ * summary.
+ */
+gboolean
+ostree_repo_regenerate_summary (OstreeRepo     *self,
+                                GVariant       *additional_metadata,
+                                GCancellable   *cancellable,
+                                GError        **error)
+{
+  gboolean ret = FALSE;
+  guint i;
+  gs_unref_hashtable GHashTable *refs = NULL;
+  gs_unref_ptrarray GPtrArray *ordered_refs = NULL;
+  gs_unref_ptrarray GPtrArray *delta_names = NULL;
+  gs_unref_variant GVariant *summary = NULL;
+  gs_unref_object GFile *summary_path = NULL;
+  gs_unref_object GFile *summary_sig_path = NULL;
+  GHashTableIter hashiter;
+  gpointer key, value;
+  GVariantBuilder refs_builder;
+  GVariantBuilder deltas_builder;
+  GVariantBuilder metadata_builder;
+
+  if (!ostree_repo_list_refs (self, NULL, &refs, cancellable, error))
+    goto out;
+
+  ordered_refs = g_ptr_array_new ();
+  g_hash_table_iter_init (&hashiter, refs);
+  while (g_hash_table_iter_next (&hashiter, &key, &value))
+    {
+      const char *ref = key;
+
+      /* Only our own branches are served from refs/heads */
+      if (strchr (ref, ':') != NULL)
+        continue;
+      g_ptr_array_add (ordered_refs, key);
+    }
+  g_ptr_array_sort (ordered_refs, compare_strings_for_sorting);
+
+  g_variant_builder_init (&refs_builder, G_VARIANT_TYPE ("a(s(taya{sv}))"));
+  for (i = 0; i < ordered_refs->len; i++)
+    {
+      const char *ref = ordered_refs->pdata[i];
+      const char *commit = g_hash_table_lookup (refs, ref);
+      gs_unref_variant GVariant *commit_obj = NULL;
+
+      if (!ostree_repo_load_variant (self, OSTREE_OBJECT_TYPE_COMMIT, commit,
+                                     &commit_obj, error))
+        goto out;
+
+      g_variant_builder_add_value (&refs_builder,
+                                   g_variant_new ("(s(t@ay@a{sv}))", ref,
+                                                  (guint64) g_variant_get_size (commit_obj),
+                                                  ostree_checksum_to_bytes_v (commit),
+                                                  g_variant_new_array (G_VARIANT_TYPE ("{sv}"), NULL, 0)));
+    }
+
+  if (!ostree_repo_list_static_delta_names (self, &delta_names, cancellable, error))
+    goto out;
+  g_ptr_array_sort (delta_names, compare_strings_for_sorting);
+
+  g_variant_builder_init (&deltas_builder, G_VARIANT_TYPE ("a{sat}"));
+  for (i = 0; i < delta_names->len; i++)
+    {
+      const char *delta_name = delta_names->pdata[i];
+      gs_unref_variant GVariant *part_sizes = NULL;
+
+      if (!get_static_delta_part_sizes (self, delta_name, &part_sizes, error))
+        goto out;
+
+      g_variant_builder_add (&deltas_builder, "{s@at}", delta_name, part_sizes);
+    }
+
+  g_variant_builder_init (&metadata_builder, G_VARIANT_TYPE ("a{sv}"));
+  if (additional_metadata)
+    {
+      GVariantIter viter;
+      const char *metadata_key;
+      GVariant *metadata_value;
+
+      g_variant_iter_init (&viter, additional_metadata);
+      while (g_variant_iter_loop (&viter, "{&s@v}", &metadata_key, &metadata_value))
+        {
+          if (strcmp (metadata_key, "ostree.static-deltas") == 0)
+            continue;
+          g_variant_builder_add (&metadata_builder, "{s@v}", metadata_key, metadata_value);
+        }
+    }
+  g_variant_builder_add (&metadata_builder, "{sv}", "ostree.static-deltas",
+                         g_variant_builder_end (&deltas_builder));
+
+  summary = g_variant_new ("(@a(s(taya{sv}))@a{sv})",
+                           g_variant_builder_end (&refs_builder),
+                           g_variant_builder_end (&metadata_builder));
+  g_variant_ref_sink (summary);
+
+  summary_path = g_file_get_child (self->repodir, "summary");
+  summary_sig_path = g_file_get_child (self->repodir, "summary.sig");
+
+  if (!ot_util_variant_save (summary_path, summary, cancellable, error))
+    goto out;
+  if (!ot_gfile_ensure_unlinked (summary_sig_path, cancellable, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/**
+ * ostree_repo_add_gpg_signature_summary:
+ * @self: Self
+ * @key_id: (array zero-terminated=1) (element-type utf8): NULL-terminated array of GPG keys.
+ * @homedir: (allow-none): GPG home directory, or %NULL
+ * @cancellable: A #GCancellable
+ * @error: a #GError
+ *
+ * Add a GPG signature to the "summary" file of @self, stored in
+ * "summary.sig" in the format %OSTREE_SUMMARY_SIG_GVARIANT_FORMAT.
+ */
+gboolean
+ostree_repo_add_gpg_signature_summary (OstreeRepo     *self,
+                                       const gchar   **key_id,
+                                       const gchar    *homedir,
+                                       GCancellable   *cancellable,
+                                       GError        **error)
+{
+#ifdef HAVE_GPGME
+  gboolean ret = FALSE;
+  const gchar **iter;
+  gs_unref_object GFile *summary_path = NULL;
+  gs_unref_object GFile *summary_sig_path = NULL;
+  gs_unref_variant GVariant *metadata = NULL;
+  gs_unref_bytes GBytes *summary_bytes = NULL;
+  GMappedFile *summary_file = NULL;
+
+  summary_path = g_file_get_child (self->repodir, "summary");
+  summary_sig_path = g_file_get_child (self->repodir, "summary.sig");
+
+  summary_file = gs_file_map_noatime (summary_path, cancellable, error);
+  if (!summary_file)
+    goto out;
+  summary_bytes = g_mapped_file_get_bytes (summary_file);
+
+  if (g_file_query_exists (summary_sig_path, NULL))
+    {
+      if (!ot_util_variant_map (summary_sig_path, OSTREE_SUMMARY_SIG_GVARIANT_FORMAT,
+                                FALSE, &metadata, error))
+        goto out;
+    }
+
+  for (iter = key_id; iter && *iter; iter++)
+    {
+      gs_unref_bytes GBytes *signature_bytes = NULL;
+      GVariant *new_metadata;
+
+      if (!sign_data (self, summary_bytes, *iter, homedir,
+                      &signature_bytes, cancellable, error))
+        goto out;
+
+      new_metadata = g_variant_ref_sink (metadata_append_gpg_signature (metadata, signature_bytes));
+      if (metadata)
+        g_variant_unref (metadata);
+      metadata = new_metadata;
+    }
+
+  if (metadata)
+    {
+      if (!ot_util_variant_save (summary_sig_path, metadata, cancellable, error))
+        goto out;
+    }
+
+  ret = TRUE;
+ out:
+  if (summary_file)
+    g_mapped_file_unref (summary_file);
+  return ret;
+#else
+  g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+               "This version of ostree was compiled without GPG support");
+  return FALSE;
+#endif
+}
@@ -24,6 +24,7 @@
 
 #include "ostree-core.h"
 #include "ostree-types.h"
+#include "ostree-object-set.h"
 #include "ostree-async-progress.h"
 #include "ostree-sepolicy.h"
 
@@ -52,6 +53,9 @@ gboolean      ostree_repo_open   (OstreeRepo     *self,
 void          ostree_repo_set_disable_fsync (OstreeRepo    *self,
                                              gboolean       disable_fsync);
 
+void          ostree_repo_set_batch_fsync (OstreeRepo    *self,
+                                           gboolean       batch_fsync);
+
 gboolean      ostree_repo_create (OstreeRepo     *self,
                                   OstreeRepoMode  mode,
                                   GCancellable   *cancellable,
@@ -226,6 +230,10 @@ gboolean      ostree_repo_load_variant_if_exists (OstreeRepo  *self,
                                                   GVariant     **out_variant,
                                                   GError       **error);
 
+void          ostree_repo_get_metadata_cache_stats (OstreeRepo  *self,
+                                                    guint64     *out_hits,
+                                                    guint64     *out_misses);
+
 gboolean ostree_repo_load_file (OstreeRepo         *self,
                                 const char         *checksum,
                                 GInputStream      **out_input,
@@ -317,6 +325,9 @@ void ostree_repo_commit_modifier_set_xattr_callback (OstreeRepoCommitModifier
 void ostree_repo_commit_modifier_set_sepolicy (OstreeRepoCommitModifier              *modifier,
                                                OstreeSePolicy                        *sepolicy);
 
+void ostree_repo_commit_modifier_set_n_jobs (OstreeRepoCommitModifier              *modifier,
+                                             guint                                  n_jobs);
+
 OstreeRepoCommitModifier *ostree_repo_commit_modifier_ref (OstreeRepoCommitModifier *modifier);
 void ostree_repo_commit_modifier_unref (OstreeRepoCommitModifier *modifier);
 
@@ -393,6 +404,17 @@ ostree_repo_checkout_tree (OstreeRepo               *self,
                            GCancellable             *cancellable,
                            GError                  **error);
 
+gboolean
+ostree_repo_checkout_tree_parallel (OstreeRepo               *self,
+                                    OstreeRepoCheckoutMode    mode,
+                                    OstreeRepoCheckoutOverwriteMode    overwrite_mode,
+                                    guint                     n_jobs,
+                                    GFile                    *destination,
+                                    OstreeRepoFile           *source,
+                                    GFileInfo                *source_info,
+                                    GCancellable             *cancellable,
+                                    GError                  **error);
+
 gboolean       ostree_repo_checkout_gc (OstreeRepo        *self,
                                         GCancellable      *cancellable,
                                         GError           **error);
@@ -452,6 +474,7 @@ gboolean ostree_repo_static_delta_generate (OstreeRepo                   *self,
                                             const char                   *from,
                                             const char                   *to,
                                             GVariant                     *metadata,
+                                            GVariant                     *params,
                                             GCancellable                 *cancellable,
                                             GError                      **error);
 
@@ -477,6 +500,13 @@ gboolean ostree_repo_traverse_commit_union (OstreeRepo         *repo,
                                             GCancellable       *cancellable,
                                             GError            **error);
 
+gboolean ostree_repo_traverse_commit_set (OstreeRepo         *repo,
+                                          const char         *commit_checksum,
+                                          int                 maxdepth,
+                                          OstreeObjectSet    *inout_reachable,
+                                          GCancellable       *cancellable,
+                                          GError            **error);
+
 /**
  * OstreeRepoPruneFlags:
  * @OSTREE_REPO_PRUNE_FLAGS_NONE: No special options for pruning
@@ -498,6 +528,16 @@ gboolean ostree_repo_prune (OstreeRepo        *self,
                             GCancellable      *cancellable,
                             GError           **error);
 
+gboolean ostree_repo_pack_loose_objects (OstreeRepo        *self,
+                                         guint             *out_n_packed,
+                                         GCancellable      *cancellable,
+                                         GError           **error);
+
+gboolean ostree_repo_repack_objects (OstreeRepo        *self,
+                                     guint             *out_n_packed,
+                                     GCancellable      *cancellable,
+                                     GError           **error);
+
 /**
  * OstreeRepoPullFlags:
  * @OSTREE_REPO_PULL_FLAGS_NONE: No special options for pull
@@ -528,5 +568,16 @@ gboolean ostree_repo_verify_commit (OstreeRepo   *self,
                                     GCancellable *cancellable,
                                     GError      **error);
 
+gboolean ostree_repo_regenerate_summary (OstreeRepo     *self,
+                                         GVariant       *additional_metadata,
+                                         GCancellable   *cancellable,
+                                         GError        **error);
+
+gboolean ostree_repo_add_gpg_signature_summary (OstreeRepo     *self,
+                                                const gchar   **key_id,
+                                                const gchar    *homedir,
+                                                GCancellable   *cancellable,
+                                                GError        **error);
+
 G_END_DECLS
 
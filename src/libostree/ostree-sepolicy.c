@@ -49,6 +49,9 @@ struct OstreeSePolicy {
   GFile *selinux_policy_root;
   struct selabel_handle *selinux_hnd;
   char *selinux_policy_name;
+  /* libselinux compiles the file contexts lazily, so lookups on one
+   * handle must not race */
+  GMutex selinux_hnd_lock;
 #endif
 };
 
@@ -81,6 +84,7 @@ ostree_sepolicy_finalize (GObject *object)
       selabel_close (self->selinux_hnd);
       self->selinux_hnd = NULL;
     }
+  g_mutex_clear (&self->selinux_hnd_lock);
 #endif
 
   G_OBJECT_CLASS (ostree_sepolicy_parent_class)->finalize (object);
@@ -269,6 +273,9 @@ initable_init (GInitable     *initable,
 static void
 ostree_sepolicy_init (OstreeSePolicy *self)
 {
+#ifdef HAVE_SELINUX
+  g_mutex_init (&self->selinux_hnd_lock);
+#endif
 }
 
 static void
@@ -325,6 +332,8 @@ ostree_sepolicy_get_name (OstreeSePolicy *self)
  * Store in @out_label the security context for the given @relpath and
  * mode @unix_mode.  If the policy does not specify a label, %NULL
  * will be returned.
+ *
+ * This function may be called from multiple threads at once.
  */
 gboolean
 ostree_sepolicy_get_label (OstreeSePolicy    *self,
@@ -341,10 +350,14 @@ ostree_sepolicy_get_label (OstreeSePolicy    *self,
 
   if (self->selinux_hnd)
     {
+      int errsv;
+
+      g_mutex_lock (&self->selinux_hnd_lock);
       res = selabel_lookup_raw (self->selinux_hnd, &con, relpath, unix_mode);
+      errsv = errno;
+      g_mutex_unlock (&self->selinux_hnd_lock);
       if (res != 0)
         {
-          int errsv = errno;
           if (errsv != ENOENT)
             {
               ot_util_set_error_from_errno (error, errsv);
@@ -437,11 +450,26 @@ ostree_sepolicy_restorecon (OstreeSePolicy    *self,
         }
       else
         {
-          int res = lsetfilecon (gs_file_get_path_cached (target), label);
-          if (res != 0)
+          char *existing_con = NULL;
+          gboolean unchanged;
+
+          /* Avoid rewriting the xattr (and dirtying the inode) when
+           * the file is already labeled correctly */
+          unchanged = lgetfilecon_raw (gs_file_get_path_cached (target), &existing_con) > 0
+            && existing_con && strcmp (existing_con, label) == 0;
+          if (existing_con)
+            freecon (existing_con);
+
+          if (unchanged)
+            g_clear_pointer (&label, g_free);
+          else
             {
-              ot_util_set_error_from_errno (error, errno);
-              goto out;
+              int res = lsetfilecon (gs_file_get_path_cached (target), label);
+              if (res != 0)
+                {
+                  ot_util_set_error_from_errno (error, errno);
+                  goto out;
+                }
             }
         }
     }
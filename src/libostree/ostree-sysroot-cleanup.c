@@ -326,6 +326,7 @@ cleanup_old_deployments (OstreeSysroot       *self,
       OstreeDeployment *deployment = all_deployment_dirs->pdata[i];
       gs_unref_object GFile *deployment_path = ostree_sysroot_get_deployment_directory (self, deployment);
       gs_unref_object GFile *origin_path = ostree_sysroot_get_deployment_origin_path (deployment_path);
+      gs_unref_object GFile *etc_checksums_path = _ostree_sysroot_get_deployment_etc_checksums_path (deployment_path);
       if (!g_hash_table_lookup (active_deployment_dirs, deployment_path))
         {
           guint32 device;
@@ -345,6 +346,8 @@ cleanup_old_deployments (OstreeSysroot       *self,
             goto out;
           if (!gs_shutil_rm_rf (origin_path, cancellable, error))
             goto out;
+          if (!gs_shutil_rm_rf (etc_checksums_path, cancellable, error))
+            goto out;
         }
     }
 
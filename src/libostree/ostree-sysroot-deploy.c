@@ -20,13 +20,21 @@
 
 #include "config.h"
 
+#include <errno.h>
+
 #include "ostree-sysroot-private.h"
 #include "ostree-core-private.h"
+#include "ostree-diff-private.h"
 #include "otutil.h"
 #include "libgsystem.h"
 
 #define OSTREE_DEPLOYMENT_COMPLETE_ID "dd440e3e549083b63d0efc7dc15255f1"
 
+/* Stat data key (see _ostree_diff_checksum_cache_key()) to the
+ * checksum of a file in /etc or /usr/etc, ignoring xattrs.
+ */
+#define OSTREE_ETC_CHECKSUMS_GVARIANT_FORMAT "a(say)"
+
 /**
  * copy_modified_config_file:
  *
@@ -103,11 +111,17 @@ copy_modified_config_file (GFile              *orig_etc,
  * approximately equivalent to "diff -unR orig_etc modified_etc",
  * except that rather than attempting a 3-way merge if a file is also
  * changed in @new_etc, the modified version always wins.
+ *
+ * Files whose stat data is in @checksum_cache are not read.  The
+ * paths (relative to @modified_etc) copied into @new_etc are added
+ * to @out_merged_paths.
  */
 static gboolean
 merge_etc_changes (GFile          *orig_etc,
                    GFile          *modified_etc,
                    GFile          *new_etc,
+                   GHashTable     *checksum_cache,
+                   GHashTable     *out_merged_paths,
                    GCancellable   *cancellable,
                    GError        **error)
 {
@@ -129,9 +143,9 @@ merge_etc_changes (GFile          *orig_etc,
    * file, to have that change persist across upgrades, you must also
    * modify the content of the file.
    */
-  if (!ostree_diff_dirs (OSTREE_DIFF_FLAGS_IGNORE_XATTRS,
-                         orig_etc, modified_etc, modified, removed, added,
-                         cancellable, error))
+  if (!_ostree_diff_dirs_with_cache (OSTREE_DIFF_FLAGS_IGNORE_XATTRS,
+                                     orig_etc, modified_etc, modified, removed, added,
+                                     checksum_cache, cancellable, error))
     {
       g_prefix_error (error, "While computing configuration diff: ");
       goto out;
@@ -166,6 +180,7 @@ merge_etc_changes (GFile          *orig_etc,
       if (!copy_modified_config_file (orig_etc, modified_etc, new_etc, diff->target,
                                       cancellable, error))
         goto out;
+      g_hash_table_add (out_merged_paths, g_file_get_relative_path (modified_etc, diff->target));
     }
   for (i = 0; i < added->len; i++)
     {
@@ -174,8 +189,274 @@ merge_etc_changes (GFile          *orig_etc,
       if (!copy_modified_config_file (orig_etc, modified_etc, new_etc, file,
                                       cancellable, error))
         goto out;
+      g_hash_table_add (out_merged_paths, g_file_get_relative_path (modified_etc, file));
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/*
+ * load_etc_checksums:
+ *
+ * Add the checksums recorded by save_etc_checksums() for
+ * @deployment_path, if any, to @checksum_cache.
+ */
+static gboolean
+load_etc_checksums (GFile          *deployment_path,
+                    GHashTable     *checksum_cache,
+                    GCancellable   *cancellable,
+                    GError        **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_object GFile *path = _ostree_sysroot_get_deployment_etc_checksums_path (deployment_path);
+  gs_unref_variant GVariant *checksums = NULL;
+  guint i, n;
+
+  if (!g_file_query_exists (path, cancellable))
+    {
+      ret = TRUE;
+      goto out;
+    }
+
+  if (!ot_util_variant_map (path, G_VARIANT_TYPE (OSTREE_ETC_CHECKSUMS_GVARIANT_FORMAT),
+                            FALSE, &checksums, error))
+    goto out;
+
+  n = g_variant_n_children (checksums);
+  for (i = 0; i < n; i++)
+    {
+      const char *key;
+      gs_unref_variant GVariant *csum_v = NULL;
+
+      g_variant_get_child (checksums, i, "(&s@ay)", &key, &csum_v);
+      /* It is only a cache; skip anything which can't be a checksum */
+      if (g_variant_n_children (csum_v) != 32)
+        continue;
+      g_hash_table_replace (checksum_cache, g_strdup (key),
+                            ostree_checksum_from_bytes_v (csum_v));
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+static gboolean
+save_etc_checksums (GFile          *deployment_path,
+                    GHashTable     *checksums,
+                    GCancellable   *cancellable,
+                    GError        **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_object GFile *path = _ostree_sysroot_get_deployment_etc_checksums_path (deployment_path);
+  gs_unref_variant_builder GVariantBuilder *builder = NULL;
+  GHashTableIter hashiter;
+  gpointer hkey, hvalue;
+
+  builder = g_variant_builder_new (G_VARIANT_TYPE (OSTREE_ETC_CHECKSUMS_GVARIANT_FORMAT));
+  g_hash_table_iter_init (&hashiter, checksums);
+  while (g_hash_table_iter_next (&hashiter, &hkey, &hvalue))
+    g_variant_builder_add (builder, "(s@ay)", (const char*)hkey,
+                           ostree_checksum_to_bytes_v ((const char*)hvalue));
+
+  if (!ot_util_variant_save (path, g_variant_builder_end (builder),
+                             cancellable, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+typedef struct {
+  GFile      *new_etc;
+  GFile      *modified_etc;
+  GHashTable *merged_paths;
+  GHashTable *checksum_cache;
+  GHashTable *new_checksums;
+} RecordEtcChecksumsData;
+
+/*
+ * record_copied_file_checksum:
+ *
+ * @dest was copied from @src by merge_configuration(), preserving
+ * everything which is part of its checksum (xattrs are ignored).  So
+ * rather than reading @dest, use the checksum of @src, which usually
+ * is a hardlink to a repository object already in the cache.
+ */
+static gboolean
+record_copied_file_checksum (RecordEtcChecksumsData *data,
+                             GFile                  *dest,
+                             GFile                  *src,
+                             GCancellable           *cancellable,
+                             GError                **error)
+{
+  gboolean ret = FALSE;
+  struct stat dest_stbuf;
+  struct stat src_stbuf;
+  gs_unref_object GFileInfo *src_info = NULL;
+  gs_free char *checksum = NULL;
+
+  if (lstat (gs_file_get_path_cached (dest), &dest_stbuf) != 0)
+    {
+      ot_util_set_error_from_errno (error, errno);
+      goto out;
+    }
+  if (lstat (gs_file_get_path_cached (src), &src_stbuf) != 0)
+    {
+      if (errno != ENOENT)
+        {
+          ot_util_set_error_from_errno (error, errno);
+          goto out;
+        }
+      ret = TRUE;
+      goto out;
+    }
+
+  if (!S_ISREG (src_stbuf.st_mode)
+      || src_stbuf.st_mode != dest_stbuf.st_mode
+      || src_stbuf.st_uid != dest_stbuf.st_uid
+      || src_stbuf.st_gid != dest_stbuf.st_gid
+      || src_stbuf.st_size != dest_stbuf.st_size)
+    {
+      /* Not a plain copy; leave it to the next merge to checksum */
+      ret = TRUE;
+      goto out;
     }
 
+  src_info = g_file_query_info (src, OSTREE_GIO_FAST_QUERYINFO,
+                                G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                cancellable, error);
+  if (!src_info)
+    goto out;
+
+  if (!_ostree_diff_get_file_checksum (OSTREE_DIFF_FLAGS_IGNORE_XATTRS, src, src_info,
+                                       data->checksum_cache, &checksum,
+                                       cancellable, error))
+    goto out;
+
+  g_hash_table_replace (data->new_checksums, _ostree_diff_checksum_cache_key (&src_stbuf),
+                        g_strdup (checksum));
+  g_hash_table_replace (data->new_checksums, _ostree_diff_checksum_cache_key (&dest_stbuf),
+                        g_strdup (checksum));
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+static gboolean
+record_etc_checksums_recurse (RecordEtcChecksumsData *data,
+                              GFile                  *dir,
+                              GFile                  *src_dir,
+                              gboolean                src_is_merged,
+                              GCancellable           *cancellable,
+                              GError                **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_object GFileEnumerator *dir_enum = NULL;
+  GError *temp_error = NULL;
+  GFileInfo *file_info = NULL;
+
+  dir_enum = g_file_enumerate_children (dir, OSTREE_GIO_FAST_QUERYINFO,
+                                        G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                        cancellable, error);
+  if (!dir_enum)
+    goto out;
+
+  while ((file_info = g_file_enumerator_next_file (dir_enum, cancellable, &temp_error)) != NULL)
+    {
+      const char *name = g_file_info_get_name (file_info);
+      GFileType type = g_file_info_get_file_type (file_info);
+      gs_unref_object GFile *child = g_file_get_child (dir, name);
+      gs_unref_object GFile *src_child = NULL;
+      gboolean child_is_merged = src_is_merged;
+
+      if (!src_is_merged && g_hash_table_size (data->merged_paths) > 0)
+        {
+          gs_free char *relpath = g_file_get_relative_path (data->new_etc, child);
+          if (g_hash_table_contains (data->merged_paths, relpath))
+            {
+              src_child = g_file_resolve_relative_path (data->modified_etc, relpath);
+              child_is_merged = TRUE;
+            }
+        }
+      if (!src_child)
+        src_child = g_file_get_child (src_dir, name);
+
+      if (type == G_FILE_TYPE_REGULAR)
+        {
+          if (!record_copied_file_checksum (data, child, src_child,
+                                            cancellable, error))
+            goto out;
+        }
+      else
+        {
+          gs_free char *checksum = NULL;
+
+          /* Cheap; no content to read */
+          if (!_ostree_diff_get_file_checksum (OSTREE_DIFF_FLAGS_IGNORE_XATTRS, child, file_info,
+                                               data->new_checksums, &checksum,
+                                               cancellable, error))
+            goto out;
+
+          if (type == G_FILE_TYPE_DIRECTORY)
+            {
+              if (!record_etc_checksums_recurse (data, child, src_child, child_is_merged,
+                                                 cancellable, error))
+                goto out;
+            }
+        }
+
+      g_clear_object (&file_info);
+    }
+  if (temp_error != NULL)
+    {
+      g_propagate_error (error, temp_error);
+      goto out;
+    }
+
+  ret = TRUE;
+ out:
+  g_clear_object (&file_info);
+  return ret;
+}
+
+/*
+ * record_etc_checksums:
+ *
+ * Save the checksums of the new /etc and /usr/etc of the deployment
+ * at @deployment_path, so the merge_etc_changes() for the next
+ * upgrade only needs to read files that have been changed since.
+ * @checksum_cache holds the checksums of the previous deployment,
+ * including any computed during the merge.
+ */
+static gboolean
+record_etc_checksums (GFile          *deployment_path,
+                      GFile          *modified_etc,
+                      GHashTable     *merged_paths,
+                      GHashTable     *checksum_cache,
+                      GCancellable   *cancellable,
+                      GError        **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_object GFile *new_etc = g_file_get_child (deployment_path, "etc");
+  gs_unref_object GFile *new_usretc = g_file_resolve_relative_path (deployment_path, "usr/etc");
+  gs_unref_hashtable GHashTable *new_checksums =
+    g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  RecordEtcChecksumsData data = { new_etc, modified_etc, merged_paths,
+                                  checksum_cache, new_checksums };
+
+  if (!record_etc_checksums_recurse (&data, new_etc, new_usretc, FALSE,
+                                     cancellable, error))
+    goto out;
+
+  if (!save_etc_checksums (deployment_path, new_checksums,
+                           cancellable, error))
+    goto out;
+
   ret = TRUE;
  out:
   return ret;
@@ -226,8 +507,8 @@ checkout_deployment_tree (OstreeSysroot     *sysroot,
   g_print ("ostadmin: Creating deployment %s\n",
            gs_file_get_path_cached (deploy_target_path));
 
-  if (!ostree_repo_checkout_tree (repo, 0, 0, deploy_target_path, OSTREE_REPO_FILE (root),
-                                  file_info, cancellable, error))
+  if (!ostree_repo_checkout_tree_parallel (repo, 0, 0, 0, deploy_target_path, OSTREE_REPO_FILE (root),
+                                           file_info, cancellable, error))
     goto out;
 
   ret = TRUE;
@@ -236,43 +517,16 @@ checkout_deployment_tree (OstreeSysroot     *sysroot,
   return ret;
 }
 
-static char *
-ptrarray_path_join (GPtrArray  *path)
-{
-  GString *path_buf;
-
-  path_buf = g_string_new ("");
-
-  if (path->len == 0)
-    g_string_append_c (path_buf, '/');
-  else
-    {
-      guint i;
-      for (i = 0; i < path->len; i++)
-        {
-          const char *elt = path->pdata[i];
-
-          g_string_append_c (path_buf, '/');
-          g_string_append (path_buf, elt);
-        }
-    }
-
-  return g_string_free (path_buf, FALSE);
-}
-
 static gboolean
-relabel_one_path (OstreeSysroot  *sysroot,
-                  OstreeSePolicy *sepolicy,
-                  GFile         *path,
-                  GFileInfo     *info,
-                  GPtrArray     *path_parts,
+relabel_one_path (OstreeSePolicy *sepolicy,
+                  GFile          *path,
+                  GFileInfo      *info,
+                  const char     *relpath,
                   GCancellable   *cancellable,
                   GError        **error)
 {
   gboolean ret = FALSE;
-  gs_free char *relpath = NULL;
 
-  relpath = ptrarray_path_join (path_parts);
   if (!ostree_sepolicy_restorecon (sepolicy, relpath,
                                    info, path,
                                    OSTREE_SEPOLICY_RESTORECON_FLAGS_ALLOW_NOLABEL,
@@ -285,25 +539,56 @@ relabel_one_path (OstreeSysroot  *sysroot,
   return ret;
 }
 
+/*
+ * A directory tree is relabeled by a pool of worker threads, with one
+ * job per directory which labels its entries and queues a job for
+ * each subdirectory.  Policy lookups are serialized inside
+ * #OstreeSePolicy, but reading the directories and writing the
+ * labels proceed in parallel, which is what dominates for a large
+ * /var on a cold cache.
+ */
+typedef struct {
+  OstreeSePolicy *sepolicy;
+  GThreadPool *pool;
+  GCancellable *cancellable;
+
+  volatile gint pending;
+  volatile gint failed;
+  GMutex lock;
+  GCond cond;
+  gboolean done;
+  GError *error;
+} RelabelData;
+
+typedef struct {
+  GFile *dir;
+  char *relpath;
+} RelabelJob;
+
+static void
+relabel_push_job (RelabelData   *data,
+                  GFile         *dir,
+                  char          *relpath)
+{
+  RelabelJob *job = g_new0 (RelabelJob, 1);
+
+  job->dir = g_object_ref (dir);
+  job->relpath = relpath;  /* Transfer ownership */
+  g_atomic_int_inc (&data->pending);
+  g_thread_pool_push (data->pool, job, NULL);
+}
+
 static gboolean
-relabel_recursively (OstreeSysroot  *sysroot,
-                     OstreeSePolicy *sepolicy,
-                     GFile          *dir,
-                     GFileInfo      *dir_info,
-                     GPtrArray      *path_parts,
-                     GCancellable   *cancellable,
-                     GError        **error)
+relabel_dir_contents (RelabelData   *data,
+                      RelabelJob    *job,
+                      GError       **error)
 {
   gboolean ret = FALSE;
   gs_unref_object GFileEnumerator *direnum = NULL;
 
-  if (!relabel_one_path (sysroot, sepolicy, dir, dir_info, path_parts,
-                         cancellable, error))
-    goto out;
-
-  direnum = g_file_enumerate_children (dir, OSTREE_GIO_FAST_QUERYINFO,
+  direnum = g_file_enumerate_children (job->dir, OSTREE_GIO_FAST_QUERYINFO,
                                        G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
-                                       cancellable, error);
+                                       data->cancellable, error);
   if (!direnum)
     goto out;
   
@@ -311,31 +596,29 @@ relabel_recursively (OstreeSysroot  *sysroot,
     {
       GFileInfo *file_info;
       GFile *child;
-      GFileType ftype;
+      gs_free char *child_relpath = NULL;
+
+      if (g_atomic_int_get (&data->failed))
+        break;
 
       if (!gs_file_enumerator_iterate (direnum, &file_info, &child,
-                                       cancellable, error))
+                                       data->cancellable, error))
         goto out;
       if (file_info == NULL)
         break;
 
-      g_ptr_array_add (path_parts, (char*)gs_file_get_basename_cached (child));
+      child_relpath = g_strconcat (job->relpath, "/",
+                                   gs_file_get_basename_cached (child), NULL);
 
-      ftype = g_file_info_get_file_type (file_info);
-      if (ftype == G_FILE_TYPE_DIRECTORY)
-        {
-          if (!relabel_recursively (sysroot, sepolicy, child, file_info, path_parts,
-                                    cancellable, error))
-            goto out;
-        }
-      else
+      if (!relabel_one_path (data->sepolicy, child, file_info, child_relpath,
+                             data->cancellable, error))
+        goto out;
+
+      if (g_file_info_get_file_type (file_info) == G_FILE_TYPE_DIRECTORY)
         {
-          if (!relabel_one_path (sysroot, sepolicy, child, file_info, path_parts,
-                                 cancellable, error))
-            goto out;
+          relabel_push_job (data, child, child_relpath);
+          child_relpath = NULL;
         }
-
-      g_ptr_array_remove_index (path_parts, path_parts->len - 1);
     }
 
   ret = TRUE;
@@ -343,6 +626,43 @@ relabel_recursively (OstreeSysroot  *sysroot,
   return ret;
 }
 
+static void
+relabel_job_thread (gpointer   job_data,
+                    gpointer   user_data)
+{
+  RelabelJob *job = job_data;
+  RelabelData *data = user_data;
+  GError *local_error = NULL;
+
+  /* Once one job failed, don't bother with the rest */
+  if (!g_atomic_int_get (&data->failed))
+    {
+      if (!relabel_dir_contents (data, job, &local_error))
+        {
+          g_prefix_error (&local_error, "Relabeling %s: ", job->relpath);
+          g_mutex_lock (&data->lock);
+          if (data->error == NULL)
+            data->error = local_error;
+          else
+            g_error_free (local_error);
+          g_atomic_int_set (&data->failed, 1);
+          g_mutex_unlock (&data->lock);
+        }
+    }
+
+  g_object_unref (job->dir);
+  g_free (job->relpath);
+  g_free (job);
+
+  if (g_atomic_int_dec_and_test (&data->pending))
+    {
+      g_mutex_lock (&data->lock);
+      data->done = TRUE;
+      g_cond_signal (&data->cond);
+      g_mutex_unlock (&data->lock);
+    }
+}
+
 static gboolean
 selinux_relabel_dir (OstreeSysroot                 *sysroot,
                      OstreeSePolicy                *sepolicy,
@@ -352,25 +672,51 @@ selinux_relabel_dir (OstreeSysroot                 *sysroot,
                      GError                       **error)
 {
   gboolean ret = FALSE;
-  gs_unref_ptrarray GPtrArray *path_parts = g_ptr_array_new ();
+  RelabelData data = { 0, };
   gs_unref_object GFileInfo *root_info = NULL;
+  char *relpath = g_strconcat ("/", prefix, NULL);
 
   root_info = g_file_query_info (dir, OSTREE_GIO_FAST_QUERYINFO,
                                  G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
                                  cancellable, error);
   if (!root_info)
     goto out;
-  
-  g_ptr_array_add (path_parts, (char*)prefix);
-  if (!relabel_recursively (sysroot, sepolicy, dir, root_info, path_parts,
-                            cancellable, error))
+
+  if (!relabel_one_path (sepolicy, dir, root_info, relpath,
+                         cancellable, error))
     {
       g_prefix_error (error, "Relabeling /%s: ", prefix);
       goto out;
     }
 
+  data.sepolicy = sepolicy;
+  data.cancellable = cancellable;
+  g_mutex_init (&data.lock);
+  g_cond_init (&data.cond);
+  data.pool = ot_thread_pool_new_nproc (relabel_job_thread, &data);
+
+  relabel_push_job (&data, dir, relpath);
+  relpath = NULL;
+
+  g_mutex_lock (&data.lock);
+  while (!data.done)
+    g_cond_wait (&data.cond, &data.lock);
+  g_mutex_unlock (&data.lock);
+
+  /* Wait for the workers to return */
+  g_thread_pool_free (data.pool, FALSE, TRUE);
+  g_mutex_clear (&data.lock);
+  g_cond_clear (&data.cond);
+
+  if (data.error)
+    {
+      g_propagate_error (error, data.error);
+      goto out;
+    }
+
   ret = TRUE;
  out:
+  g_free (relpath);
   return ret;
 }
 
@@ -383,20 +729,18 @@ selinux_relabel_file (OstreeSysroot                 *sysroot,
                       GError                       **error)
 {
   gboolean ret = FALSE;
-  gs_unref_ptrarray GPtrArray *path_parts = g_ptr_array_new ();
+  gs_free char *relpath = NULL;
   gs_unref_object GFileInfo *file_info = g_file_query_info (path, OSTREE_GIO_FAST_QUERYINFO,
                                                             G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
                                                             cancellable, error);
   if (!file_info)
     goto out;
 
-  g_ptr_array_add (path_parts, (char*)prefix);
-  g_ptr_array_add (path_parts, (char*)gs_file_get_basename_cached (path));
-  if (!relabel_one_path (sysroot, sepolicy, path, file_info, path_parts,
+  relpath = g_strconcat ("/", prefix, "/", gs_file_get_basename_cached (path), NULL);
+  if (!relabel_one_path (sepolicy, path, file_info, relpath,
                          cancellable, error))
     {
-      g_prefix_error (error, "Relabeling /%s/%s: ", prefix,
-                      gs_file_get_basename_cached (path));
+      g_prefix_error (error, "Relabeling %s: ", relpath);
       goto out;
     }
 
@@ -455,6 +799,90 @@ selinux_relabel_var_if_needed (OstreeSysroot                 *sysroot,
   return ret;
 }
 
+/*
+ * Like gs_shutil_cp_a(), but label each entry according to @sepolicy
+ * as it is created, rather than walking the copy again afterwards.
+ */
+static gboolean
+copy_dir_labeled (OstreeSePolicy   *sepolicy,
+                  GFile            *src,
+                  GFile            *dest,
+                  const char       *relpath,
+                  GCancellable     *cancellable,
+                  GError          **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_object GFileInfo *src_info = NULL;
+  gs_unref_object GFileEnumerator *direnum = NULL;
+
+  src_info = g_file_query_info (src, OSTREE_GIO_FAST_QUERYINFO,
+                                G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                cancellable, error);
+  if (!src_info)
+    goto out;
+
+  if (!g_file_make_directory (dest, cancellable, error))
+    goto out;
+
+  direnum = g_file_enumerate_children (src, OSTREE_GIO_FAST_QUERYINFO,
+                                       G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                       cancellable, error);
+  if (!direnum)
+    goto out;
+
+  while (TRUE)
+    {
+      GFileInfo *file_info;
+      GFile *child;
+      const char *name;
+      gs_unref_object GFile *dest_child = NULL;
+      gs_free char *child_relpath = NULL;
+
+      if (!gs_file_enumerator_iterate (direnum, &file_info, &child,
+                                       cancellable, error))
+        goto out;
+      if (file_info == NULL)
+        break;
+
+      name = gs_file_get_basename_cached (child);
+      dest_child = g_file_get_child (dest, name);
+      child_relpath = g_strconcat (relpath, "/", name, NULL);
+
+      if (g_file_info_get_file_type (file_info) == G_FILE_TYPE_DIRECTORY)
+        {
+          if (!copy_dir_labeled (sepolicy, child, dest_child, child_relpath,
+                                 cancellable, error))
+            goto out;
+        }
+      else
+        {
+          /* Copying the metadata also copies the source label, so
+           * this has to come first.
+           */
+          if (!g_file_copy (child, dest_child,
+                            G_FILE_COPY_NOFOLLOW_SYMLINKS | G_FILE_COPY_ALL_METADATA,
+                            cancellable, NULL, NULL, error))
+            goto out;
+          if (!relabel_one_path (sepolicy, dest_child, file_info, child_relpath,
+                                 cancellable, error))
+            goto out;
+        }
+    }
+
+  /* Last, so that creating the entries doesn't touch the timestamps */
+  if (!g_file_copy_attributes (src, dest,
+                               G_FILE_COPY_NOFOLLOW_SYMLINKS | G_FILE_COPY_ALL_METADATA,
+                               cancellable, error))
+    goto out;
+  if (!relabel_one_path (sepolicy, dest, src_info, relpath,
+                         cancellable, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
 static gboolean
 merge_configuration (OstreeSysroot         *sysroot,
                      OstreeDeployment      *previous_deployment,
@@ -470,6 +898,10 @@ merge_configuration (OstreeSysroot         *sysroot,
   gs_unref_object GFile *deployment_usretc_path = NULL;
   gs_unref_object GFile *deployment_etc_path = NULL;
   gs_unref_object OstreeSePolicy *sepolicy = NULL;
+  gs_unref_hashtable GHashTable *etc_checksums =
+    g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  gs_unref_hashtable GHashTable *merged_paths =
+    g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
   gboolean etc_exists;
   gboolean usretc_exists;
 
@@ -482,6 +914,10 @@ merge_configuration (OstreeSysroot         *sysroot,
       source_etc_path = g_file_resolve_relative_path (previous_path, "etc");
       source_etc_pristine_path = g_file_resolve_relative_path (previous_path, "usr/etc");
 
+      if (!load_etc_checksums (previous_path, etc_checksums,
+                               cancellable, error))
+        goto out;
+
       previous_bootconfig = ostree_deployment_get_bootconfig (previous_deployment);
       if (previous_bootconfig)
         {
@@ -518,11 +954,7 @@ merge_configuration (OstreeSysroot         *sysroot,
   
   if (usretc_exists)
     {
-      /* TODO - set out labels as we copy files */
       g_assert (!etc_exists);
-      if (!gs_shutil_cp_a (deployment_usretc_path, deployment_etc_path,
-                           cancellable, error))
-        goto out;
 
       /* Here, we initialize SELinux policy from the /usr/etc inside
        * the root - this is before we've finalized the configuration
@@ -534,8 +966,17 @@ merge_configuration (OstreeSysroot         *sysroot,
       if (ostree_sepolicy_get_name (sepolicy) != NULL)
         {
           g_print ("ostadmin: Using SELinux policy '%s'\n", ostree_sepolicy_get_name (sepolicy));
-          if (!selinux_relabel_dir (sysroot, sepolicy, deployment_etc_path, "etc",
-                                    cancellable, error))
+          if (!copy_dir_labeled (sepolicy, deployment_usretc_path, deployment_etc_path, "/etc",
+                                 cancellable, error))
+            {
+              g_prefix_error (error, "Copying /usr/etc: ");
+              goto out;
+            }
+        }
+      else
+        {
+          if (!gs_shutil_cp_a (deployment_usretc_path, deployment_etc_path,
+                               cancellable, error))
             goto out;
         }
       g_print ("ostadmin: Created %s\n", gs_file_get_path_cached (deployment_etc_path));
@@ -543,7 +984,8 @@ merge_configuration (OstreeSysroot         *sysroot,
 
   if (source_etc_path)
     {
-      if (!merge_etc_changes (source_etc_pristine_path, source_etc_path, deployment_etc_path, 
+      if (!merge_etc_changes (source_etc_pristine_path, source_etc_path, deployment_etc_path,
+                              etc_checksums, merged_paths,
                               cancellable, error))
         goto out;
     }
@@ -552,6 +994,13 @@ merge_configuration (OstreeSysroot         *sysroot,
       g_print ("ostadmin: No previous configuration changes to merge\n");
     }
 
+  if (usretc_exists)
+    {
+      if (!record_etc_checksums (deployment_path, source_etc_path, merged_paths,
+                                 etc_checksums, cancellable, error))
+        goto out;
+    }
+
   ret = TRUE;
   gs_transfer_out_value (out_sepolicy, &sepolicy);
  out:
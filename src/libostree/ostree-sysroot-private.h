@@ -73,6 +73,8 @@ _ostree_sysroot_get_devino (GFile         *path,
                             GCancellable  *cancellable,
                             GError       **error);
 
+GFile *_ostree_sysroot_get_deployment_etc_checksums_path (GFile   *deployment_path);
+
 char *_ostree_sysroot_join_lines (GPtrArray  *lines);
 
 OstreeBootloader *_ostree_sysroot_query_bootloader (OstreeSysroot         *sysroot);
@@ -807,6 +807,22 @@ ostree_sysroot_get_deployment_origin_path (GFile   *deployment_path)
                                        gs_file_get_path_cached (deployment_path));
 }
 
+/*
+ * _ostree_sysroot_get_deployment_etc_checksums_path:
+ * @deployment_path: A deployment path
+ *
+ * Returns: (transfer full): Path to the checksums of the deployment's
+ * /etc and /usr/etc, as recorded when it was deployed
+ */
+GFile *
+_ostree_sysroot_get_deployment_etc_checksums_path (GFile   *deployment_path)
+{
+  gs_unref_object GFile *deployment_parent = g_file_get_parent (deployment_path);
+  return ot_gfile_resolve_path_printf (deployment_parent,
+                                       "%s.etc-checksums",
+                                       gs_file_get_path_cached (deployment_path));
+}
+
 /**
  * ostree_sysroot_get_repo:
  * @self: Sysroot
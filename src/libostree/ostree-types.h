@@ -31,6 +31,7 @@ typedef struct OstreeSePolicy OstreeSePolicy;
 typedef struct OstreeSysroot OstreeSysroot;
 typedef struct OstreeMutableTree OstreeMutableTree;
 typedef struct OstreeRepoFile OstreeRepoFile;
+typedef struct OstreeObjectSet OstreeObjectSet;
 
 G_END_DECLS
 
@@ -59,6 +59,39 @@ ot_keyfile_get_boolean_with_default (GKeyFile      *keyfile,
   return ret;
 }
 
+gboolean
+ot_keyfile_get_integer_with_default (GKeyFile      *keyfile,
+                                     const char    *section,
+                                     const char    *value,
+                                     gint           default_value,
+                                     gint          *out_int,
+                                     GError       **error)
+{
+  gboolean ret = FALSE;
+  GError *temp_error = NULL;
+  gint ret_int;
+
+  ret_int = g_key_file_get_integer (keyfile, section, value, &temp_error);
+  if (temp_error)
+    {
+      if (g_error_matches (temp_error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_KEY_NOT_FOUND))
+        {
+          g_clear_error (&temp_error);
+          ret_int = default_value;
+        }
+      else
+        {
+          g_propagate_error (error, temp_error);
+          goto out;
+        }
+    }
+
+  ret = TRUE;
+  *out_int = ret_int;
+ out:
+  return ret;
+}
+
 gboolean
 ot_keyfile_get_value_with_default (GKeyFile      *keyfile,
                                    const char    *section,
@@ -34,6 +34,13 @@ ot_keyfile_get_boolean_with_default (GKeyFile      *keyfile,
                                      gboolean      *out_bool,
                                      GError       **error);
 
+gboolean
+ot_keyfile_get_integer_with_default (GKeyFile      *keyfile,
+                                     const char    *section,
+                                     const char    *value,
+                                     gint           default_value,
+                                     gint          *out_int,
+                                     GError       **error);
 
 gboolean
 ot_keyfile_get_value_with_default (GKeyFile      *keyfile,
@@ -46,6 +46,7 @@ static OstreeCommand commands[] = {
   { "ls", ostree_builtin_ls, 0 },
   { "refs", ostree_builtin_refs, 0 },
   { "reset", ostree_builtin_reset, 0 },
+  { "pack", ostree_builtin_pack, 0 },
   { "prune", ostree_builtin_prune, 0 },
 #ifdef HAVE_LIBSOUP 
   { "pull", ostree_builtin_pull, 0 },
@@ -55,6 +56,7 @@ static OstreeCommand commands[] = {
   { "rev-parse", ostree_builtin_rev_parse, 0 },
   { "show", ostree_builtin_show, 0 },
   { "static-delta", ostree_builtin_static_delta, 0 },
+  { "summary", ostree_builtin_summary, 0 },
 #ifdef HAVE_LIBSOUP 
   { "trivial-httpd", ostree_builtin_trivial_httpd, OSTREE_BUILTIN_FLAG_NO_REPO },
 #endif
@@ -35,6 +35,7 @@ static char *opt_subpath;
 static gboolean opt_union;
 static gboolean opt_from_stdin;
 static char *opt_from_file;
+static gint opt_jobs = 1;
 
 static GOptionEntry options[] = {
   { "user-mode", 'U', 0, G_OPTION_ARG_NONE, &opt_user_mode, "Do not change file ownership or initialize extended attributes", NULL },
@@ -43,6 +44,7 @@ static GOptionEntry options[] = {
   { "allow-noent", 0, 0, G_OPTION_ARG_NONE, &opt_allow_noent, "Do nothing if specified path does not exist", NULL },
   { "from-stdin", 0, 0, G_OPTION_ARG_NONE, &opt_from_stdin, "Process many checkouts from standard input", NULL },
   { "from-file", 0, 0, G_OPTION_ARG_STRING, &opt_from_file, "Process many checkouts from input file", NULL },
+  { "jobs", 'j', 0, G_OPTION_ARG_INT, &opt_jobs, "Check out using N threads (0 for one per CPU)", "N" },
   { NULL }
 };
 
@@ -86,9 +88,10 @@ process_one_checkout (OstreeRepo           *repo,
       goto out;
     }
 
-  if (!ostree_repo_checkout_tree (repo, opt_user_mode ? OSTREE_REPO_CHECKOUT_MODE_USER : 0,
-                                  opt_union ? OSTREE_REPO_CHECKOUT_OVERWRITE_UNION_FILES : 0,
-                                  target, OSTREE_REPO_FILE (subtree), file_info, cancellable, error))
+  if (!ostree_repo_checkout_tree_parallel (repo, opt_user_mode ? OSTREE_REPO_CHECKOUT_MODE_USER : 0,
+                                           opt_union ? OSTREE_REPO_CHECKOUT_OVERWRITE_UNION_FILES : 0,
+                                           (guint)opt_jobs,
+                                           target, OSTREE_REPO_FILE (subtree), file_info, cancellable, error))
     goto out;
                       
   ret = TRUE;
@@ -196,6 +199,13 @@ ostree_builtin_checkout (int argc, char **argv, OstreeRepo *repo, GCancellable *
       goto out;
     }
 
+  if (opt_jobs < 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Invalid number of jobs: %d", opt_jobs);
+      goto out;
+    }
+
   if (opt_from_stdin || opt_from_file)
     {
       destination = argv[1];
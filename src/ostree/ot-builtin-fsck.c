@@ -22,24 +22,88 @@
 
 #include "config.h"
 
+#include <gio/gfiledescriptorbased.h>
+
 #include "ot-builtins.h"
 #include "ostree.h"
 #include "otutil.h"
 
 static gboolean opt_quiet;
 static gboolean opt_delete;
+static gboolean opt_journal;
+static gint opt_jobs = 1;
 
 static GOptionEntry options[] = {
   { "quiet", 'q', 0, G_OPTION_ARG_NONE, &opt_quiet, "Only print error messages", NULL },
   { "delete", 0, 0, G_OPTION_ARG_NONE, &opt_delete, "Remove corrupted objects", NULL },
+  { "journal", 0, 0, G_OPTION_ARG_NONE, &opt_journal, "Skip objects unchanged since a previous --journal run, and record verified objects", NULL },
+  { "jobs", 'j', 0, G_OPTION_ARG_INT, &opt_jobs, "Verify objects using N threads (0 for one per CPU)", "N" },
   { NULL }
 };
 
+/*
+ * The journal records loose objects which were verified, along with
+ * their inode, size and ctime at that point.  Bare content objects all
+ * have an mtime of 0, but any change to an object's data or metadata
+ * updates its ctime; if all three match on a later run, the object is
+ * assumed not to have changed.
+ *
+ * The file is an array of entries sorted by checksum and object type,
+ * in host byte order, after a small header.
+ */
+#define FSCK_JOURNAL_NAME "fsck-journal"
+#define FSCK_JOURNAL_MAGIC "OSTFSCKJ"
+#define FSCK_JOURNAL_VERSION 1
+
+/* Read size for checksumming file descriptors */
+#define FSCK_READ_BUFSIZE (256 * 1024)
+
+typedef struct {
+  char magic[8];
+  guint32 version;
+  guint32 n_entries;
+} FsckJournalHeader;
+
+typedef struct {
+  guint8 csum[32];
+  guint8 objtype;
+  guint8 reserved[7];
+  guint64 ino;
+  guint64 size;
+  gint64 ctime_sec;
+  gint64 ctime_nsec;
+} FsckJournalEntry;
+
+typedef struct {
+  OstreeRepo *repo;
+  GCancellable *cancellable;
+  OstreeObjectSet *objects;
+  int repo_dfd;
+
+  /* Journal from the previous run, and entries for this one */
+  GMappedFile *journal;
+  const FsckJournalEntry *journal_entries;
+  guint journal_n_entries;
+  GArray *new_journal;
+
+  guint n_objects;
+  guint mod;
+  volatile gint n_done;
+  volatile gint n_unchanged;
+  volatile gint found_corruption;
+
+  GMutex lock;
+  guint64 n_bytes;
+  volatile gint failed;
+  GError *error;
+} FsckData;
+
 static gboolean
 load_and_fsck_one_object (OstreeRepo            *repo,
                           const char            *checksum,
                           OstreeObjectType       objtype,
                           gboolean              *out_found_corruption,
+                          guint64               *out_size,
                           GCancellable          *cancellable,
                           GError               **error)
 {
@@ -99,6 +163,7 @@ load_and_fsck_one_object (OstreeRepo            *repo,
           input = g_memory_input_stream_new_from_data (g_variant_get_data (metadata),
                                                        g_variant_get_size (metadata),
                                                        NULL);
+          *out_size = g_variant_get_size (metadata);
 
         }
     }
@@ -130,6 +195,7 @@ load_and_fsck_one_object (OstreeRepo            *repo,
               g_prefix_error (error, "While validating file '%s': ", checksum);
               goto out;
             }
+          *out_size = g_file_info_get_size (file_info);
         }
     }
 
@@ -142,6 +208,20 @@ load_and_fsck_one_object (OstreeRepo            *repo,
       gs_free guchar *computed_csum = NULL;
       gs_free char *tmp_checksum = NULL;
 
+      /* Bare content comes straight from a file; read it sequentially
+       * in large chunks, rather than 4k at a time.
+       */
+      if (input && G_IS_FILE_DESCRIPTOR_BASED (input))
+        {
+          GInputStream *buffered;
+
+          (void) posix_fadvise (g_file_descriptor_based_get_fd ((GFileDescriptorBased*)input),
+                                0, 0, POSIX_FADV_SEQUENTIAL);
+          buffered = g_buffered_input_stream_new_sized (input, FSCK_READ_BUFSIZE);
+          g_object_unref (input);
+          input = buffered;
+        }
+
       if (!ostree_checksum_file_from_input (file_info, xattrs, input,
                                             objtype, &computed_csum,
                                             cancellable, error))
@@ -172,6 +252,225 @@ load_and_fsck_one_object (OstreeRepo            *repo,
   return ret;
 }
 
+static int
+compare_journal_entries (gconstpointer  a,
+                         gconstpointer  b)
+{
+  const FsckJournalEntry *entry_a = a;
+  const FsckJournalEntry *entry_b = b;
+  int c;
+
+  c = memcmp (entry_a->csum, entry_b->csum, 32);
+  if (c != 0)
+    return c;
+  return (int)entry_a->objtype - (int)entry_b->objtype;
+}
+
+static gboolean
+load_journal (FsckData              *data,
+              GCancellable          *cancellable,
+              GError               **error)
+{
+  gboolean ret = FALSE;
+  GError *temp_error = NULL;
+  const FsckJournalHeader *header;
+  gsize len;
+  gs_unref_object GFile *path =
+    g_file_get_child (ostree_repo_get_path (data->repo), FSCK_JOURNAL_NAME);
+
+  data->journal = gs_file_map_noatime (path, cancellable, &temp_error);
+  if (!data->journal)
+    {
+      if (g_error_matches (temp_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        {
+          g_clear_error (&temp_error);
+          ret = TRUE;
+          goto out;
+        }
+      g_propagate_error (error, temp_error);
+      goto out;
+    }
+
+  header = (const FsckJournalHeader*)g_mapped_file_get_contents (data->journal);
+  len = g_mapped_file_get_length (data->journal);
+  if (len < sizeof (FsckJournalHeader) ||
+      memcmp (header->magic, FSCK_JOURNAL_MAGIC, sizeof (header->magic)) != 0 ||
+      header->version != FSCK_JOURNAL_VERSION ||
+      (len - sizeof (FsckJournalHeader)) / sizeof (FsckJournalEntry) < header->n_entries)
+    {
+      /* Not worth failing over; everything is just verified again */
+      g_printerr ("Ignoring invalid fsck journal\n");
+      ret = TRUE;
+      goto out;
+    }
+
+  data->journal_entries = (const FsckJournalEntry*)(header + 1);
+  data->journal_n_entries = header->n_entries;
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+static gboolean
+write_journal (FsckData              *data,
+               GCancellable          *cancellable,
+               GError               **error)
+{
+  gboolean ret = FALSE;
+  FsckJournalHeader header = { FSCK_JOURNAL_MAGIC, FSCK_JOURNAL_VERSION, 0 };
+  gs_unref_object GFile *path =
+    g_file_get_child (ostree_repo_get_path (data->repo), FSCK_JOURNAL_NAME);
+  gs_unref_object GOutputStream *out = NULL;
+  gsize bytes_written;
+
+  g_array_sort (data->new_journal, compare_journal_entries);
+  header.n_entries = data->new_journal->len;
+
+  out = (GOutputStream*)g_file_replace (path, NULL, FALSE, G_FILE_CREATE_REPLACE_DESTINATION,
+                                        cancellable, error);
+  if (!out)
+    goto out;
+
+  if (!g_output_stream_write_all (out, &header, sizeof (header), &bytes_written,
+                                  cancellable, error))
+    goto out;
+  if (!g_output_stream_write_all (out, data->new_journal->data,
+                                  data->new_journal->len * sizeof (FsckJournalEntry),
+                                  &bytes_written, cancellable, error))
+    goto out;
+  if (!g_output_stream_close (out, cancellable, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/* Fill in @entry for the loose object; returns FALSE if it isn't loose */
+static gboolean
+stat_journal_entry (FsckData              *data,
+                    const char            *checksum,
+                    OstreeObjectType       objtype,
+                    FsckJournalEntry      *entry)
+{
+  gboolean compressed = ostree_repo_get_mode (data->repo) == OSTREE_REPO_MODE_ARCHIVE_Z2;
+  gs_free char *relpath = NULL;
+  struct stat stbuf;
+
+  relpath = ostree_get_relative_object_path (checksum, objtype, compressed);
+
+  if (fstatat (data->repo_dfd, relpath, &stbuf, AT_SYMLINK_NOFOLLOW) != 0)
+    return FALSE;
+
+  entry->ino = stbuf.st_ino;
+  entry->size = stbuf.st_size;
+  entry->ctime_sec = stbuf.st_ctim.tv_sec;
+  entry->ctime_nsec = stbuf.st_ctim.tv_nsec;
+  return TRUE;
+}
+
+static gboolean
+journal_has_entry (FsckData                *data,
+                   const FsckJournalEntry  *entry)
+{
+  const FsckJournalEntry *found;
+
+  if (!data->journal_entries)
+    return FALSE;
+
+  found = bsearch (entry, data->journal_entries, data->journal_n_entries,
+                   sizeof (FsckJournalEntry), compare_journal_entries);
+
+  return found != NULL &&
+    found->ino == entry->ino &&
+    found->size == entry->size &&
+    found->ctime_sec == entry->ctime_sec &&
+    found->ctime_nsec == entry->ctime_nsec;
+}
+
+static gboolean
+fsck_one_object (FsckData              *data,
+                 guint                  i,
+                 GCancellable          *cancellable,
+                 GError               **error)
+{
+  gboolean ret = FALSE;
+  const guchar *csum;
+  char checksum[65];
+  OstreeObjectType objtype;
+  gboolean found_corruption = FALSE;
+  gboolean journaled = FALSE;
+  guint64 size = 0;
+  guint n_done;
+  FsckJournalEntry entry = { { 0, }, };
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    goto out;
+
+  ostree_object_set_get (data->objects, i, &csum, &objtype);
+  ostree_checksum_inplace_from_bytes (csum, checksum);
+
+  if (data->new_journal)
+    {
+      memcpy (entry.csum, csum, 32);
+      entry.objtype = objtype;
+      journaled = stat_journal_entry (data, checksum, objtype, &entry);
+    }
+
+  if (journaled && journal_has_entry (data, &entry))
+    {
+      g_atomic_int_inc (&data->n_unchanged);
+    }
+  else
+    {
+      if (!load_and_fsck_one_object (data->repo, checksum, objtype, &found_corruption,
+                                     &size, cancellable, error))
+        goto out;
+    }
+
+  if (found_corruption)
+    g_atomic_int_set (&data->found_corruption, 1);
+
+  g_mutex_lock (&data->lock);
+  data->n_bytes += size;
+  if (journaled && !found_corruption)
+    g_array_append_val (data->new_journal, entry);
+  g_mutex_unlock (&data->lock);
+
+  n_done = g_atomic_int_add (&data->n_done, 1);
+  if (data->mod == 0 || (n_done % data->mod == 0))
+    g_print ("%u/%u objects\n", n_done, data->n_objects);
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+static void
+fsck_object_thread (gpointer   job,
+                    gpointer   user_data)
+{
+  FsckData *data = user_data;
+  guint i = GPOINTER_TO_UINT (job) - 1;
+  GError *local_error = NULL;
+
+  /* Once one object failed, don't bother with the rest */
+  if (g_atomic_int_get (&data->failed))
+    return;
+
+  if (!fsck_one_object (data, i, data->cancellable, &local_error))
+    {
+      g_mutex_lock (&data->lock);
+      if (data->error == NULL)
+        data->error = local_error;
+      else
+        g_error_free (local_error);
+      g_atomic_int_set (&data->failed, 1);
+      g_mutex_unlock (&data->lock);
+    }
+}
+
 static gboolean
 fsck_reachable_objects_from_commits (OstreeRepo            *repo,
                                      GHashTable            *commits,
@@ -182,12 +481,16 @@ fsck_reachable_objects_from_commits (OstreeRepo            *repo,
   gboolean ret = FALSE;
   GHashTableIter hash_iter;
   gpointer key, value;
-  gs_unref_hashtable GHashTable *reachable_objects = NULL;
   guint i;
-  guint mod;
-  guint count;
+  GThreadPool *pool = NULL;
+  gint64 start_time, elapsed;
+  FsckData data = { 0, };
 
-  reachable_objects = ostree_repo_traverse_new_reachable ();
+  data.repo = repo;
+  data.cancellable = cancellable;
+  data.objects = ostree_object_set_new ();
+  data.repo_dfd = -1;
+  g_mutex_init (&data.lock);
 
   g_hash_table_iter_init (&hash_iter, commits);
   while (g_hash_table_iter_next (&hash_iter, &key, &value))
@@ -200,34 +503,78 @@ fsck_reachable_objects_from_commits (OstreeRepo            *repo,
 
       g_assert (objtype == OSTREE_OBJECT_TYPE_COMMIT);
 
-      if (!ostree_repo_traverse_commit_union (repo, checksum, 0, reachable_objects,
-                                              cancellable, error))
+      if (!ostree_repo_traverse_commit_set (repo, checksum, 0, data.objects,
+                                            cancellable, error))
         goto out;
     }
 
-  count = g_hash_table_size (reachable_objects);
-  mod = count / 10;
-  i = 0;
-  g_hash_table_iter_init (&hash_iter, reachable_objects);
-  while (g_hash_table_iter_next (&hash_iter, &key, &value))
+  if (opt_journal)
     {
-      GVariant *serialized_key = key;
-      const char *checksum;
-      OstreeObjectType objtype;
+      if (!gs_file_open_dir_fd (ostree_repo_get_path (repo), &data.repo_dfd, cancellable, error))
+        goto out;
+      if (!load_journal (&data, cancellable, error))
+        goto out;
+      data.new_journal = g_array_new (FALSE, FALSE, sizeof (FsckJournalEntry));
+    }
 
-      ostree_object_name_deserialize (serialized_key, &checksum, &objtype);
+  data.n_objects = ostree_object_set_get_size (data.objects);
+  data.mod = data.n_objects / 10;
 
-      if (!load_and_fsck_one_object (repo, checksum, objtype, out_found_corruption,
-                                     cancellable, error))
+  if (opt_jobs == 0)
+    pool = ot_thread_pool_new_nproc (fsck_object_thread, &data);
+  else
+    {
+      pool = g_thread_pool_new (fsck_object_thread, &data, opt_jobs, FALSE, error);
+      if (!pool)
         goto out;
+    }
+
+  start_time = g_get_monotonic_time ();
+  for (i = 0; i < data.n_objects; i++)
+    g_thread_pool_push (pool, GUINT_TO_POINTER (i + 1), NULL);
+  g_thread_pool_free (pool, FALSE, TRUE);
+  elapsed = g_get_monotonic_time () - start_time;
 
-      if (mod == 0 || (i % mod == 0))
-        g_print ("%u/%u objects\n", i, count);
-      i++;
+  if (data.error)
+    {
+      g_propagate_error (error, data.error);
+      data.error = NULL;
+      goto out;
+    }
+
+  if (!opt_quiet)
+    {
+      double secs = MAX (elapsed, 1) / (double) G_USEC_PER_SEC;
+      gs_free char *formatted_size = g_format_size_full (data.n_bytes, 0);
+      gs_free char *formatted_rate = g_format_size_full ((guint64)(data.n_bytes / secs), 0);
+
+      g_print ("Verified %u objects (%s) in %.1f seconds, %s/s\n",
+               data.n_objects - (guint)data.n_unchanged,
+               formatted_size, secs, formatted_rate);
+      if (opt_journal)
+        g_print ("%u objects unchanged since last verified\n",
+                 (guint)data.n_unchanged);
     }
 
+  if (data.new_journal)
+    {
+      if (!write_journal (&data, cancellable, error))
+        goto out;
+    }
+
+  if (data.found_corruption)
+    *out_found_corruption = TRUE;
+
   ret = TRUE;
  out:
+  ostree_object_set_free (data.objects);
+  if (data.repo_dfd != -1)
+    (void) close (data.repo_dfd);
+  if (data.journal)
+    g_mapped_file_unref (data.journal);
+  if (data.new_journal)
+    g_array_unref (data.new_journal);
+  g_mutex_clear (&data.lock);
   return ret;
 }
 
@@ -248,6 +595,13 @@ ostree_builtin_fsck (int argc, char **argv, OstreeRepo *repo, GCancellable *canc
   if (!g_option_context_parse (context, &argc, &argv, error))
     goto out;
 
+  if (opt_jobs < 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Invalid number of jobs: %d", opt_jobs);
+      goto out;
+    }
+
   if (!opt_quiet)
     g_print ("Enumerating objects...\n");
 
@@ -0,0 +1,68 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2014 Colin Walters <walters@verbum.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "config.h"
+
+#include "ot-builtins.h"
+#include "ostree.h"
+#include "libgsystem.h"
+
+static gboolean opt_repack;
+
+static GOptionEntry options[] = {
+  { "repack", 0, 0, G_OPTION_ARG_NONE, &opt_repack, "Also merge existing packs", NULL },
+  { NULL }
+};
+
+gboolean
+ostree_builtin_pack (int argc, char **argv, OstreeRepo *repo, GCancellable *cancellable, GError **error)
+{
+  gboolean ret = FALSE;
+  GOptionContext *context;
+  guint n_packed = 0;
+
+  context = g_option_context_new ("- Fold loose objects into pack files");
+  g_option_context_add_main_entries (context, options, NULL);
+
+  if (!g_option_context_parse (context, &argc, &argv, error))
+    goto out;
+
+  if (opt_repack)
+    {
+      if (!ostree_repo_repack_objects (repo, &n_packed, cancellable, error))
+        goto out;
+    }
+  else
+    {
+      if (!ostree_repo_pack_loose_objects (repo, &n_packed, cancellable, error))
+        goto out;
+    }
+
+  if (n_packed == 0)
+    g_print ("No objects to pack\n");
+  else
+    g_print ("Packed %u objects\n", n_packed);
+
+  ret = TRUE;
+ out:
+  if (context)
+    g_option_context_free (context);
+  return ret;
+}
@@ -179,7 +179,7 @@ ostree_builtin_pull_local (int argc, char **argv, OstreeRepo *repo, GCancellable
   gs_unref_object GFile *dest_repo_dir = NULL;
   gs_unref_hashtable GHashTable *refs_to_clone = NULL;
   gs_unref_hashtable GHashTable *commits_to_clone = NULL;
-  gs_unref_hashtable GHashTable *source_objects = NULL;
+  OstreeObjectSet *source_objects = NULL;
   OtLocalCloneData datav = { 0, };
   OtLocalCloneData *data = &datav;
 
@@ -252,7 +252,7 @@ ostree_builtin_pull_local (int argc, char **argv, OstreeRepo *repo, GCancellable
 
   g_print ("Enumerating objects...\n");
 
-  source_objects = ostree_repo_traverse_new_reachable ();
+  source_objects = ostree_object_set_new ();
 
   if (refs_to_clone)
     {
@@ -261,8 +261,8 @@ ostree_builtin_pull_local (int argc, char **argv, OstreeRepo *repo, GCancellable
         {
           const char *checksum = value;
           
-          if (!ostree_repo_traverse_commit_union (data->src_repo, checksum, 0, source_objects,
-                                                  cancellable, error))
+          if (!ostree_repo_traverse_commit_set (data->src_repo, checksum, 0, source_objects,
+                                                cancellable, error))
             goto out;
         }
     }
@@ -273,20 +273,25 @@ ostree_builtin_pull_local (int argc, char **argv, OstreeRepo *repo, GCancellable
       while (g_hash_table_iter_next (&hash_iter, &key, &value))
         {
           const char *checksum = key;
-          gs_unref_hashtable GHashTable *tmp_source_objects = NULL;
 
-          if (!ostree_repo_traverse_commit_union (data->src_repo, checksum, 0, source_objects,
-                                                  cancellable, error))
+          if (!ostree_repo_traverse_commit_set (data->src_repo, checksum, 0, source_objects,
+                                                cancellable, error))
             goto out;
         }
     }
 
-  data->n_objects_to_check = g_hash_table_size (source_objects);
-  g_hash_table_iter_init (&hash_iter, source_objects);
-  while (g_hash_table_iter_next (&hash_iter, &key, &value))
+  data->n_objects_to_check = ostree_object_set_get_size (source_objects);
+  for (i = 0; i < data->n_objects_to_check; i++)
     {
-      GVariant *serialized_key = key;
-      g_thread_pool_push (data->threadpool, g_variant_ref (serialized_key), NULL);
+      const guchar *csum;
+      char checksum[65];
+      OstreeObjectType objtype;
+      GVariant *serialized_key;
+
+      ostree_object_set_get (source_objects, i, &csum, &objtype);
+      ostree_checksum_inplace_from_bytes (csum, checksum);
+      serialized_key = g_variant_ref_sink (ostree_object_name_serialize (checksum, objtype));
+      g_thread_pool_push (data->threadpool, serialized_key, NULL);
     }
 
   if (data->n_objects_to_check > 0)
@@ -324,6 +329,7 @@ ostree_builtin_pull_local (int argc, char **argv, OstreeRepo *repo, GCancellable
   ret = TRUE;
  out:
   g_clear_pointer (&data->threadpool, (GDestroyNotify) g_thread_pool_free);
+  ostree_object_set_free (source_objects);
   if (data->src_repo)
     g_object_unref (data->src_repo);
   if (data->dest_repo)
@@ -27,11 +27,19 @@
 static char *opt_from_rev;
 static char *opt_to_rev;
 static char *opt_apply;
+static gboolean opt_empty;
+static gint opt_max_chunk_size;
+static char *opt_compression;
+static gint opt_compression_level = -1;
 
 static GOptionEntry options[] = {
   { "from", 0, 0, G_OPTION_ARG_STRING, &opt_from_rev, "Create delta from revision REV", "REV" },
   { "to", 0, 0, G_OPTION_ARG_STRING, &opt_to_rev, "Create delta to revision REV", "REV" },
+  { "empty", 0, 0, G_OPTION_ARG_NONE, &opt_empty, "Create delta from scratch, for initial pulls", NULL },
   { "apply", 0, 0, G_OPTION_ARG_FILENAME, &opt_apply, "Apply delta from PATH", "PATH" },
+  { "max-chunk-size", 0, 0, G_OPTION_ARG_INT, &opt_max_chunk_size, "Maximum size of delta parts in megabytes", "SIZE" },
+  { "compression", 0, 0, G_OPTION_ARG_STRING, &opt_compression, "Compression of delta parts: gzip (the default), xz or none", "TYPE" },
+  { "compression-level", 0, 0, G_OPTION_ARG_INT, &opt_compression_level, "Compression level of delta parts, between 0 and 9", "LEVEL" },
   { NULL }
 };
 
@@ -86,12 +94,64 @@ ostree_builtin_static_delta (int argc, char **argv, OstreeRepo *repo, GCancellab
         }
       else if (opt_to_rev != NULL)
         {
-          const char *from_source;
+          const char *from_source = NULL;
           gs_free char *from_resolved = NULL;
           gs_free char *to_resolved = NULL;
           gs_free char *from_parent_str = NULL;
+          gs_unref_variant GVariant *params = NULL;
+          GVariantBuilder parambuilder;
 
-          if (opt_from_rev == NULL)
+          if (opt_max_chunk_size < 0)
+            {
+              g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                           "Invalid max chunk size: %d", opt_max_chunk_size);
+              goto out;
+            }
+
+          if (opt_compression_level < -1 || opt_compression_level > 9)
+            {
+              g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                           "Invalid compression level: %d", opt_compression_level);
+              goto out;
+            }
+
+          g_variant_builder_init (&parambuilder, G_VARIANT_TYPE ("a{sv}"));
+          if (opt_max_chunk_size > 0)
+            g_variant_builder_add (&parambuilder, "{sv}",
+                                   "max-chunk-size", g_variant_new_uint32 (opt_max_chunk_size));
+          if (opt_compression)
+            {
+              guint8 compression;
+
+              if (strcmp (opt_compression, "gzip") == 0)
+                compression = 'g';
+              else if (strcmp (opt_compression, "xz") == 0)
+                compression = 'x';
+              else if (strcmp (opt_compression, "none") == 0)
+                compression = 0;
+              else
+                {
+                  g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                               "Invalid compression: %s", opt_compression);
+                  goto out;
+                }
+              g_variant_builder_add (&parambuilder, "{sv}",
+                                     "compression", g_variant_new_byte (compression));
+            }
+          if (opt_compression_level >= 0)
+            g_variant_builder_add (&parambuilder, "{sv}",
+                                   "compression-level", g_variant_new_uint32 (opt_compression_level));
+          params = g_variant_ref_sink (g_variant_builder_end (&parambuilder));
+
+          if (opt_empty)
+            {
+              if (opt_from_rev != NULL)
+                {
+                  ot_util_usage_error (context, "Cannot specify both --empty and --from=REV", error);
+                  goto out;
+                }
+            }
+          else if (opt_from_rev == NULL)
             {
               from_parent_str = g_strconcat (opt_to_rev, "^", NULL);
               from_source = from_parent_str;
@@ -101,17 +161,18 @@ ostree_builtin_static_delta (int argc, char **argv, OstreeRepo *repo, GCancellab
               from_source = opt_from_rev;
             }
 
-          if (!ostree_repo_resolve_rev (repo, from_source, FALSE, &from_resolved, error))
+          if (from_source &&
+              !ostree_repo_resolve_rev (repo, from_source, FALSE, &from_resolved, error))
             goto out;
           if (!ostree_repo_resolve_rev (repo, opt_to_rev, FALSE, &to_resolved, error))
             goto out;
 
           g_print ("Generating static delta:\n");
-          g_print ("  From: %s\n", from_resolved);
+          g_print ("  From: %s\n", from_resolved ? from_resolved : "empty");
           g_print ("  To:   %s\n", to_resolved);
           if (!ostree_repo_static_delta_generate (repo, OSTREE_STATIC_DELTA_GENERATE_OPT_MAJOR,
                                                   from_resolved, to_resolved, NULL,
-                                                  cancellable, error))
+                                                  params, cancellable, error))
             goto out;
         }
       else
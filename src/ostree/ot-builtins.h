@@ -40,12 +40,14 @@ BUILTINPROTO(log);
 BUILTINPROTO(pull);
 BUILTINPROTO(pull_local);
 BUILTINPROTO(ls);
+BUILTINPROTO(pack);
 BUILTINPROTO(prune);
 BUILTINPROTO(refs);
 BUILTINPROTO(reset);
 BUILTINPROTO(fsck);
 BUILTINPROTO(show);
 BUILTINPROTO(static_delta);
+BUILTINPROTO(summary);
 BUILTINPROTO(rev_parse);
 BUILTINPROTO(remote);
 BUILTINPROTO(write_refs);
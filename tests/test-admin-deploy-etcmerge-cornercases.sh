@@ -46,6 +46,10 @@ chmod 770 ${etc}/a/long
 chmod 777 ${etc}/a/long/dir
 chmod 707 ${etc}/a/long/dir/chain
 chmod 700 ${etc}/a/long/dir/forking
+# A change which keeps the size must still be found via the recorded
+# checksums
+assert_has_file sysroot/ostree/deploy/testos/deploy/${rev}.0.etc-checksums
+echo "A config file" > ${etc}/aconfigfile
 
 # Now deploy a new commit
 os_repository_new_commit
@@ -69,5 +73,7 @@ assert_file_has_mode ${newetc}/a/long/dir 777
 assert_file_has_mode ${newetc}/a/long/dir/chain 707
 assert_file_has_mode ${newetc}/a/long/dir/forking 700
 assert_file_has_mode ${newetc}/a/long/dir 777
+assert_file_has_content ${newetc}/aconfigfile "A config file"
+assert_has_file sysroot/ostree/deploy/testos/deploy/${newrev}.0.etc-checksums
 
 echo "ok"
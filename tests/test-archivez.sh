@@ -21,7 +21,7 @@ set -e
 
 . $(dirname $0)/libtest.sh
 
-echo '1..11'
+echo '1..13'
 
 setup_test_repository "archive-z2"
 echo "ok setup"
@@ -36,3 +36,33 @@ ostree --repo=repo2 pull aremote
 ostree --repo=repo2 rev-parse aremote/test2
 ostree --repo=repo2 fsck
 echo "ok pull with from file:/// uri"
+
+cd ${test_tmpdir}
+$OSTREE pack > pack-output.txt
+assert_file_has_content pack-output.txt "Packed [0-9]* objects"
+assert_not_has_file repo/objects/$(${CMD_PREFIX} ostree --repo=repo rev-parse test2 | cut -c 1-2)/$(${CMD_PREFIX} ostree --repo=repo rev-parse test2 | cut -c 3-).commit
+assert_file_has_content repo/objects/pack/packs "^ostmeta-"
+$OSTREE pack > pack-output.txt
+assert_file_has_content pack-output.txt "No objects to pack"
+$OSTREE fsck
+rm checkout-test2 -rf
+$OSTREE checkout test2 checkout-test2
+assert_file_has_content checkout-test2/baz/cow moo
+echo "ok pack"
+
+cd ${test_tmpdir}
+$OSTREE commit -b test2 -s "Commit after pack" --tree=dir=checkout-test2
+$OSTREE pack
+$OSTREE pack --repack > pack-output.txt
+assert_file_has_content pack-output.txt "Packed [0-9]* objects"
+ls repo/objects/pack/ostmeta-*.index | wc -l > pack-count.txt
+assert_file_has_content pack-count.txt "^1$"
+ostree --repo=repo2 pull aremote
+ostree --repo=repo2 fsck
+rm repo3 -rf
+mkdir repo3
+${CMD_PREFIX} ostree --repo=repo3 init
+${CMD_PREFIX} ostree --repo=repo3 remote add --set=gpg-verify=false aremote file://$(pwd)/repo test2
+ostree --repo=repo3 pull aremote
+ostree --repo=repo3 fsck
+echo "ok pull from packed repository"
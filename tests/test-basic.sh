@@ -19,7 +19,7 @@
 
 set -e
 
-echo "1..41"
+echo "1..48"
 
 . $(dirname $0)/libtest.sh
 
@@ -123,6 +123,15 @@ cd ${test_tmpdir}
 assert_file_has_content diff-test2-2 'M */four$'
 echo "ok diff file changing type"
 
+cd ${test_tmpdir}/checkout-test2-4
+$OSTREE commit -b test2-typechange -s 'four is a directory'
+cd ${test_tmpdir}
+$OSTREE diff test2 test2-typechange > diff-test2-3
+assert_file_has_content diff-test2-3 'M */four$'
+assert_not_file_has_content diff-test2-3 'four/other'
+$OSTREE refs --delete test2-typechange
+echo "ok diff revisions file changing type"
+
 cd ${test_tmpdir}
 mkdir repo2
 ${CMD_PREFIX} ostree --repo=repo2 init
@@ -216,6 +225,7 @@ echo "ok pull-local with --remote arg"
 
 cd ${test_tmpdir}
 ostree --repo=repo3 prune
+ostree --repo=repo3 fsck -q
 find repo3/objects -name '*.commit' > objlist-before-prune
 rm repo3/refs/heads/* repo3/refs/remotes/* -rf
 ostree --repo=repo3 prune --refs-only
@@ -223,9 +233,31 @@ find repo3/objects -name '*.commit' > objlist-after-prune
 if cmp -s objlist-before-prune objlist-after-prune; then
     echo "Prune didn't delete anything!"; exit 1
 fi
+find repo3/objects -name '*.file' > objlist-after-prune
+if test -s objlist-after-prune; then
+    echo "Prune left unreachable content objects"; exit 1
+fi
 rm repo3 objlist-before-prune objlist-after-prune -rf
 echo "ok prune"
 
+cd ${test_tmpdir}
+mkdir repo3
+${CMD_PREFIX} ostree --repo=repo3 init
+${CMD_PREFIX} ostree --repo=repo3 pull-local repo test2
+rev=$(ostree --repo=repo3 rev-parse test2)
+ostree --repo=repo3 pack
+assert_not_has_file repo3/objects/$(echo ${rev} | cut -c 1-2)/$(echo ${rev} | cut -c 3-).commit
+ostree --repo=repo3 fsck -q
+ostree --repo=repo3 pack --repack
+ostree --repo=repo3 show ${rev}
+rm repo3/refs/heads/* repo3/refs/remotes/* -rf
+ostree --repo=repo3 prune --refs-only
+if ostree --repo=repo3 show ${rev} 2>/dev/null; then
+    echo "Prune didn't delete packed commit"; exit 1
+fi
+rm repo3 -rf
+echo "ok prune packed objects"
+
 cd ${test_tmpdir}
 $OSTREE commit -b test3 -s "Another commit" --tree=ref=test2
 ostree --repo=repo refs > reflist
@@ -241,6 +273,62 @@ $OSTREE checkout test2 test2-checkout
 (cd test2-checkout && $OSTREE commit --link-checkout-speedup -b test2 -s "tmp")
 echo "ok commit with link speedup"
 
+cd ${test_tmpdir}
+assert_has_file repo/devino-cache
+echo "linkspeedup" > test2-checkout/linkspeedup-file
+(cd test2-checkout && $OSTREE commit --link-checkout-speedup -b test2 -s "tmp2")
+rm -rf test2-checkout
+$OSTREE checkout test2 test2-checkout
+old_rev=$($OSTREE rev-parse test2)
+(cd test2-checkout && $OSTREE commit --link-checkout-speedup --skip-if-unchanged -b test2 -s "tmp3")
+new_rev=$($OSTREE rev-parse test2)
+assert_streq "${old_rev}" "${new_rev}"
+rm test2-checkout/linkspeedup-file
+(cd test2-checkout && $OSTREE commit --link-checkout-speedup -b test2 -s "tmp4")
+echo "ok commit with persistent link speedup cache"
+
+cd ${test_tmpdir}
+old_rev=$($OSTREE rev-parse test2)
+(cd test2-checkout && $OSTREE commit --jobs=4 --skip-if-unchanged -b test2 -s "parallel")
+new_rev=$($OSTREE rev-parse test2)
+assert_streq "${old_rev}" "${new_rev}"
+echo "ok commit --jobs matches serial tree"
+
+cd ${test_tmpdir}
+rm -rf test2-checkout-jobs
+$OSTREE checkout --jobs=4 test2 test2-checkout-jobs
+diff -r test2-checkout test2-checkout-jobs
+(cd test2-checkout-jobs && $OSTREE commit --skip-if-unchanged -b test2 -s "parallel checkout")
+new_rev=$($OSTREE rev-parse test2)
+assert_streq "${old_rev}" "${new_rev}"
+rm -rf test2-checkout-jobs
+echo "ok checkout --jobs"
+
+cd ${test_tmpdir}
+${CMD_PREFIX} ostree --repo=repo config set core.batch-fsync true
+echo "batch fsync" > test2-checkout/batch-fsync
+(cd test2-checkout && $OSTREE commit -b test2 -s "batch fsync")
+assert_streq "$(ls repo | grep transaction-unsynced || true)" ""
+touch repo/transaction-unsynced-dead
+corrupt=repo/objects/00/00000000000000000000000000000000000000000000000000000000000000.dirtree
+mkdir -p repo/objects/00
+echo corrupt > ${corrupt}
+(cd test2-checkout && $OSTREE commit --skip-if-unchanged -b test2 -s "batch fsync recovery")
+assert_streq "$(ls repo | grep transaction-unsynced || true)" ""
+assert_not_has_file ${corrupt}
+$OSTREE fsck -q
+rm test2-checkout/batch-fsync
+${CMD_PREFIX} ostree --repo=repo config set core.batch-fsync false
+echo "ok commit with batch fsync"
+
+cd ${test_tmpdir}
+$OSTREE fsck --jobs=4 --journal > fsck.txt
+assert_file_has_content fsck.txt '^Verified [1-9]'
+$OSTREE fsck --journal > fsck.txt
+assert_file_has_content fsck.txt '^Verified 0 objects'
+rm -f fsck.txt repo/fsck-journal
+echo "ok fsck --jobs --journal"
+
 cd ${test_tmpdir}
 $OSTREE ls test2
 echo "ok ls with no argument"
@@ -100,3 +100,36 @@ ${CMD_PREFIX} ostree --repo=repo init
 ${CMD_PREFIX} ostree --repo=repo remote add --set=gpg-verify=false origin $(cat httpd-address)/ostree/gnomerepo
 ${CMD_PREFIX} ostree --repo=repo pull origin main
 rm repo -rf
+
+# A signed summary
+cd ${test_tmpdir}
+${CMD_PREFIX} ostree --repo=${repopath} summary -u --gpg-sign=$keyid --gpg-homedir=${SRCDIR}/gpghome
+mkdir repo
+${CMD_PREFIX} ostree --repo=repo init
+${CMD_PREFIX} ostree --repo=repo remote add --set=gpg-verify=false --set=gpg-verify-summary=true origin $(cat httpd-address)/ostree/gnomerepo
+${CMD_PREFIX} ostree --repo=repo pull origin main
+rm repo -rf
+
+# The summary is required to be signed
+cd ${test_tmpdir}
+mv ${repopath}/summary.sig ${test_tmpdir}/summary.sig
+mkdir repo
+${CMD_PREFIX} ostree --repo=repo init
+${CMD_PREFIX} ostree --repo=repo remote add --set=gpg-verify=false --set=gpg-verify-summary=true origin $(cat httpd-address)/ostree/gnomerepo
+if ${CMD_PREFIX} ostree --repo=repo pull origin main; then
+    assert_not_reached "pull without summary signature unexpectedly succeeded!"
+fi
+rm repo -rf
+
+# And the signature must match it
+cd ${test_tmpdir}
+${CMD_PREFIX} ostree --repo=${repopath} commit -b other -s "Another branch" --tree=ref=main
+${CMD_PREFIX} ostree --repo=${repopath} summary -u
+mv ${test_tmpdir}/summary.sig ${repopath}/summary.sig
+mkdir repo
+${CMD_PREFIX} ostree --repo=repo init
+${CMD_PREFIX} ostree --repo=repo remote add --set=gpg-verify=false --set=gpg-verify-summary=true origin $(cat httpd-address)/ostree/gnomerepo
+if ${CMD_PREFIX} ostree --repo=repo pull origin main; then
+    assert_not_reached "pull with tampered summary unexpectedly succeeded!"
+fi
+rm repo -rf
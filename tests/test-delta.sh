@@ -24,7 +24,7 @@ set -e
 bindatafiles="bash true ostree"
 morebindatafiles="false ls"
 
-echo '1..2'
+echo '1..8'
 
 mkdir repo
 ostree --repo=repo init --mode=archive-z2
@@ -65,6 +65,8 @@ ostree static-delta --repo=repo --from=${origrev} --to=${newrev}
 
 assert_has_dir repo/deltas/${origrev}-${newrev}
 
+echo 'ok generate'
+
 mkdir repo2
 ostree --repo=repo2 init --mode=archive-z2
 ostree --repo=repo2 pull-local repo ${origrev}
@@ -72,3 +74,120 @@ ostree --repo=repo2 pull-local repo ${origrev}
 ostree --repo=repo2 static-delta --apply=repo/deltas/${origrev}-${newrev}
 ostree --repo=repo2 fsck
 ostree --repo=repo2 show ${newrev}
+
+echo 'ok apply offline'
+
+mkdir httpd
+cd httpd
+ln -s ${test_tmpdir} ostree
+ostree trivial-httpd --daemonize -p ${test_tmpdir}/httpd-port
+port=$(cat ${test_tmpdir}/httpd-port)
+cd ${test_tmpdir}
+
+mkdir repo3
+ostree --repo=repo3 init
+ostree --repo=repo3 remote add --set=gpg-verify=false origin http://127.0.0.1:${port}/ostree/repo
+ostree --repo=repo3 pull origin ${origrev}
+mkdir -p repo3/refs/remotes/origin
+echo ${origrev} > repo3/refs/remotes/origin/test
+ostree --repo=repo3 pull origin test > pull-output.txt
+assert_file_has_content pull-output.txt 'delta parts'
+ostree --repo=repo3 fsck
+assert_streq $(ostree --repo=repo3 rev-parse origin/test) ${newrev}
+
+echo 'ok pull delta'
+
+mkdir rollsum-files
+dd if=/dev/urandom of=rollsum-files/bigfile bs=1024 count=1024 2>/dev/null
+ostree --repo=repo commit -b rollsum -s rollsum --tree=dir=rollsum-files
+echo 'a one line change' >> rollsum-files/bigfile
+ostree --repo=repo commit -b rollsum -s rollsum --tree=dir=rollsum-files
+rollsum_origrev=$(ostree --repo=repo rev-parse rollsum^)
+rollsum_newrev=$(ostree --repo=repo rev-parse rollsum)
+ostree static-delta --repo=repo --from=${rollsum_origrev} --to=${rollsum_newrev}
+partsize=$(du -ks repo/deltas/${rollsum_origrev}-${rollsum_newrev}/0 | cut -f 1)
+test ${partsize} -lt 256
+
+mkdir repo4
+ostree --repo=repo4 init --mode=archive-z2
+ostree --repo=repo4 pull-local repo ${rollsum_origrev}
+ostree --repo=repo4 static-delta --apply=repo/deltas/${rollsum_origrev}-${rollsum_newrev}
+ostree --repo=repo4 fsck
+ostree --repo=repo4 checkout ${rollsum_newrev} rollsum-checkout
+cmp rollsum-checkout/bigfile rollsum-files/bigfile
+
+echo 'ok rollsum delta'
+
+mkdir chunk-files
+echo base > chunk-files/base
+ostree --repo=repo commit -b chunks -s chunks --tree=dir=chunk-files
+dd if=/dev/urandom of=chunk-files/a bs=1024 count=700 2>/dev/null
+dd if=/dev/urandom of=chunk-files/b bs=1024 count=700 2>/dev/null
+ostree --repo=repo commit -b chunks -s chunks --tree=dir=chunk-files
+chunks_origrev=$(ostree --repo=repo rev-parse chunks^)
+chunks_newrev=$(ostree --repo=repo rev-parse chunks)
+ostree static-delta --repo=repo --max-chunk-size=1 --from=${chunks_origrev} --to=${chunks_newrev}
+assert_has_file repo/deltas/${chunks_origrev}-${chunks_newrev}/1
+
+mkdir repo5
+ostree --repo=repo5 init --mode=archive-z2
+ostree --repo=repo5 pull-local repo ${chunks_origrev}
+ostree --repo=repo5 static-delta --apply=repo/deltas/${chunks_origrev}-${chunks_newrev}
+ostree --repo=repo5 fsck
+ostree --repo=repo5 checkout ${chunks_newrev} chunks-checkout
+cmp chunks-checkout/a chunk-files/a
+cmp chunks-checkout/b chunk-files/b
+
+echo 'ok delta with small parts'
+
+if ostree --version | grep -q -e '\+lzma'; then
+    rm -rf repo/deltas/${origrev}-${newrev}
+    if ostree static-delta --repo=repo --compression=xz --compression-level=10 --from=${origrev} --to=${newrev}; then
+        assert_not_reached "static-delta with compression level 10 succeeded"
+    fi
+    ostree static-delta --repo=repo --compression=xz --compression-level=9 --from=${origrev} --to=${newrev}
+    head -c 1 repo/deltas/${origrev}-${newrev}/0 > part-compression
+    assert_file_has_content part-compression '^x$'
+
+    rm -rf repo6
+    mkdir repo6
+    ostree --repo=repo6 init --mode=archive-z2
+    ostree --repo=repo6 pull-local repo ${origrev}
+    ostree --repo=repo6 static-delta --apply=repo/deltas/${origrev}-${newrev}
+    ostree --repo=repo6 fsck
+    ostree --repo=repo6 show ${newrev}
+
+    echo 'ok xz delta'
+else
+    echo 'ok xz delta # SKIP not built with liblzma'
+fi
+
+ostree static-delta --repo=repo --empty --to=${newrev}
+assert_has_file repo/deltas/${newrev}/meta
+
+mkdir repo7
+ostree --repo=repo7 init
+ostree --repo=repo7 remote add --set=gpg-verify=false origin http://127.0.0.1:${port}/ostree/repo
+ostree --repo=repo7 pull origin test > pull-output.txt
+assert_file_has_content pull-output.txt 'delta parts'
+ostree --repo=repo7 fsck
+assert_streq $(ostree --repo=repo7 rev-parse origin/test) ${newrev}
+
+echo 'ok pull delta from scratch'
+
+ostree --repo=repo summary -u
+assert_has_file repo/summary
+
+# Hide the ref file; the pull must resolve the ref and find the delta
+# via the summary alone
+mv repo/refs/heads/test test-ref-saved
+mkdir repo8
+ostree --repo=repo8 init
+ostree --repo=repo8 remote add --set=gpg-verify=false origin http://127.0.0.1:${port}/ostree/repo
+ostree --repo=repo8 pull origin test > pull-output.txt
+mv test-ref-saved repo/refs/heads/test
+assert_file_has_content pull-output.txt 'delta parts'
+ostree --repo=repo8 fsck
+assert_streq $(ostree --repo=repo8 rev-parse origin/test) ${newrev}
+
+echo 'ok pull using summary'
@@ -0,0 +1,85 @@
+#!/usr/bin/env gjs
+//
+// Copyright (C) 2013 Colin Walters <walters@verbum.org>
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the
+// Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+// Boston, MA 02111-1307, USA.
+
+const Gio = imports.gi.Gio;
+const OSTree = imports.gi.OSTree;
+
+function assertEquals(a, b) {
+    if (a != b)
+	throw new Error("assertion failed " + JSON.stringify(a) + " == " + JSON.stringify(b));
+}
+
+let testDataDir = Gio.File.new_for_path('test-data');
+testDataDir.make_directory(null);
+testDataDir.get_child('some-file').replace_contents("hello world!", null, false, 0, null);
+
+let repoPath = Gio.File.new_for_path('repo');
+let repo = OSTree.Repo.new(repoPath);
+repo.create(OSTree.RepoMode.ARCHIVE_Z2, null);
+
+repo.open(null);
+
+repo.prepare_transaction(null);
+
+let mtree = OSTree.MutableTree.new();
+repo.write_directory_to_mtree(testDataDir, mtree, null, null);
+let [,dirTree] = repo.write_mtree(mtree, null);
+let [,commit] = repo.write_commit(null, 'Some subject', 'Some body', null, dirTree, null);
+
+repo.commit_transaction(null, null);
+
+let [,root,checksum] = repo.read_commit(commit, null);
+let treeChecksum = root.tree_get_contents_checksum();
+
+// The second load of the same dirtree is served from memory
+let [hitsBefore, missesBefore] = repo.get_metadata_cache_stats();
+repo.load_variant(OSTree.ObjectType.DIR_TREE, treeChecksum);
+repo.load_variant(OSTree.ObjectType.DIR_TREE, treeChecksum);
+let [hitsAfter, missesAfter] = repo.get_metadata_cache_stats();
+assertEquals(hitsAfter + missesAfter, hitsBefore + missesBefore + 2);
+if (hitsAfter <= hitsBefore)
+    throw new Error("assertion failed: no metadata cache hit");
+
+// Deleting an object drops it from the cache
+let metaChecksum = root.tree_get_metadata_checksum();
+repo.load_variant(OSTree.ObjectType.DIR_META, metaChecksum);
+repo.delete_object(OSTree.ObjectType.DIR_META, metaChecksum, null);
+let loadFailed = false;
+try {
+    repo.load_variant(OSTree.ObjectType.DIR_META, metaChecksum);
+} catch (e) {
+    loadFailed = true;
+}
+assertEquals(loadFailed, true);
+
+// No ref points to the commit, so pruning by refs deletes everything;
+// the cached dirtree must not outlive its object
+let [,nObjects,nPruned] = repo.prune(OSTree.RepoPruneFlags.REFS_ONLY, -1, null);
+if (nPruned == 0)
+    throw new Error("assertion failed: nothing pruned");
+
+loadFailed = false;
+try {
+    repo.load_variant(OSTree.ObjectType.DIR_TREE, treeChecksum);
+} catch (e) {
+    loadFailed = true;
+}
+assertEquals(loadFailed, true);
+
+print("test-metadata-cache complete");
@@ -23,6 +23,39 @@ set -e
 
 setup_fake_remote_repo1 "archive-z2"
 
-echo '1..2'
+echo '1..6'
 
 . ${SRCDIR}/pull-test.sh
+
+cd ${test_tmpdir}
+mkdir mirror
+${CMD_PREFIX} ostree --repo=mirror init --mode=archive-z2
+${CMD_PREFIX} ostree --repo=mirror remote add --set=gpg-verify=false origin $(cat httpd-address)/ostree/gnomerepo
+${CMD_PREFIX} ostree --repo=mirror pull origin main
+${CMD_PREFIX} ostree --repo=mirror fsck
+for obj in $(cd mirror/objects && find . -name '*.filez'); do
+    cmp mirror/objects/${obj} ostree-srv/gnomerepo/objects/${obj}
+done
+echo "ok pull into archive-z2 stores content verbatim"
+
+cd ${test_tmpdir}
+mkdir serialrepo
+${CMD_PREFIX} ostree --repo=serialrepo init
+${CMD_PREFIX} ostree --repo=serialrepo remote add --set=gpg-verify=false \
+    --set=max-connections=1 --set=max-concurrent-requests=1 \
+    --set=adaptive-concurrency=false --set=timeout=30 \
+    origin $(cat httpd-address)/ostree/gnomerepo
+${CMD_PREFIX} ostree --repo=serialrepo pull origin main
+${CMD_PREFIX} ostree --repo=serialrepo fsck
+echo "ok pull with configured fetcher limits"
+
+cd ${test_tmpdir}
+cp -a ostree-srv/gnomerepo ostree-srv/gnomerepo-mirror
+mkdir mirroredrepo
+${CMD_PREFIX} ostree --repo=mirroredrepo init
+${CMD_PREFIX} ostree --repo=mirroredrepo remote add --set=gpg-verify=false \
+    "--set=mirrorlist=$(cat httpd-address)/ostree/nosuchmirror;$(cat httpd-address)/ostree/gnomerepo-mirror;" \
+    origin $(cat httpd-address)/ostree/gnomerepo
+${CMD_PREFIX} ostree --repo=mirroredrepo pull origin main
+${CMD_PREFIX} ostree --repo=mirroredrepo fsck
+echo "ok pull with a failing mirror"
@@ -0,0 +1,48 @@
+#!/usr/bin/env gjs
+//
+// Copyright (C) 2013 Colin Walters <walters@verbum.org>
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the
+// Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+// Boston, MA 02111-1307, USA.
+
+const Gio = imports.gi.Gio;
+const OSTree = imports.gi.OSTree;
+
+function assertEquals(a, b) {
+    if (a != b)
+	throw new Error("assertion failed " + JSON.stringify(a) + " == " + JSON.stringify(b));
+}
+
+// Labeling needs a policy on the host, and a filesystem with xattrs
+let sepolicy = OSTree.SePolicy.new(Gio.File.new_for_path('/'), null);
+if (sepolicy.get_name() == null) {
+    print("test-sepolicy skipped: no SELinux policy");
+} else {
+    let target = Gio.File.new_for_path('some-file');
+    target.replace_contents("hello world!", null, false, 0, null);
+
+    let [,expectedLabel] = sepolicy.get_label('/etc/some-file', parseInt('100644', 8), null);
+    let [,newLabel] = sepolicy.restorecon('/etc/some-file', null, target,
+					  OSTree.SePolicyRestoreconFlags.ALLOW_NOLABEL, null);
+    if (newLabel != null)
+	assertEquals(newLabel, expectedLabel);
+
+    // Now that it's labeled, the label should not be written again
+    [,newLabel] = sepolicy.restorecon('/etc/some-file', null, target,
+				      OSTree.SePolicyRestoreconFlags.ALLOW_NOLABEL, null);
+    assertEquals(newLabel, null);
+
+    print("test-sepolicy complete");
+}